@@ -0,0 +1,183 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Reports the compression time and ratio of profiles for the supported
+// compression settings.
+//
+// Usage: compression_bench [--iterations=N] [profile.pb.gz ...]
+//
+// The profiles may be gzip-compressed, as saved by the agent with
+// -cprof_profile_filename, or uncompressed. Without profile arguments, a
+// synthetic profile with --synthetic_samples samples is used.
+
+#include <stdio.h>
+#include <time.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "perftools/profiles/proto/builder.h"
+#include "src/clock.h"
+#include "src/compression.h"
+#include "src/globals.h"
+
+DEFINE_int32(iterations, 5, "number of compressions per setting");
+DEFINE_int32(synthetic_samples, 20000,
+             "number of samples of the synthetic profile");
+
+namespace cloud {
+namespace profiler {
+namespace {
+
+using perftools::profiles::Profile;
+
+int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * kNanosPerSecond + ts.tv_nsec;
+}
+
+bool ReadProfile(const std::string &path, Profile *profile) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    fprintf(stderr, "Failed to open %s\n", path.c_str());
+    return false;
+  }
+  std::stringstream data;
+  data << file.rdbuf();
+  std::string bytes = data.str();
+
+  google::protobuf::io::ArrayInputStream stream(bytes.data(), bytes.size());
+  if (bytes.size() >= 2 && bytes[0] == '\x1f' && bytes[1] == '\x8b') {
+    google::protobuf::io::GzipInputStream gzip_stream(&stream);
+    return profile->ParseFromZeroCopyStream(&gzip_stream);
+  }
+  return profile->ParseFromZeroCopyStream(&stream);
+}
+
+// Builds a profile shaped like a CPU profile of a server: deep stacks
+// sharing most of their frames, over a few thousand Java methods.
+void SyntheticProfile(int num_samples, Profile *profile) {
+  perftools::profiles::Builder builder;
+  Profile *p = builder.mutable_profile();
+  perftools::profiles::ValueType *sample_type = p->add_sample_type();
+  sample_type->set_type(builder.StringId("sample"));
+  sample_type->set_unit(builder.StringId("count"));
+  sample_type = p->add_sample_type();
+  sample_type->set_type(builder.StringId("cpu"));
+  sample_type->set_unit(builder.StringId("nanoseconds"));
+  p->set_default_sample_type(builder.StringId("cpu"));
+
+  const int kNumMethods = 4000;
+  const int kMaxDepth = 64;
+  for (int i = 0; i < kNumMethods; ++i) {
+    std::string cls = "com.example.service.module" + std::to_string(i % 97) +
+                      ".Handler" + std::to_string(i / 97);
+    std::string name = cls + ".process" + std::to_string(i % 13);
+    uint64_t function_id = builder.FunctionId(
+        name.c_str(), (name + "(java.lang.String, int)").c_str(),
+        ("Handler" + std::to_string(i / 97) + ".java").c_str(), 0);
+    perftools::profiles::Location *location = p->add_location();
+    location->set_id(i + 1);
+    perftools::profiles::Line *line = location->add_line();
+    line->set_function_id(function_id);
+    line->set_line(10 + i % 500);
+  }
+
+  uint32_t seed = 1;
+  auto next = [&seed]() {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+  };
+  for (int i = 0; i < num_samples; ++i) {
+    perftools::profiles::Sample *sample = p->add_sample();
+    int depth = 8 + next() % (kMaxDepth - 8);
+    for (int d = 0; d < depth; ++d) {
+      // Frames near the root are shared by most samples.
+      int spread = 1 + d * d;
+      sample->add_location_id(1 + (d * 61 + next() % spread) % kNumMethods);
+    }
+    int64_t count = 1 + next() % 10;
+    sample->add_value(count);
+    sample->add_value(count * 10000000);
+  }
+  profile->Swap(p);
+}
+
+void Benchmark(const std::string &name, const Profile &profile) {
+  std::vector<CompressionOptions> settings;
+  for (int level : {1, 6, 9}) {
+    CompressionOptions options;
+    options.level = level;
+    settings.push_back(options);
+  }
+#ifdef CLOUD_PROFILER_HAVE_ZSTD
+  for (int level : {1, 3, 9, 19}) {
+    CompressionOptions options;
+    options.format = CompressionFormat::kZstd;
+    options.level = level;
+    settings.push_back(options);
+  }
+#endif
+
+  size_t raw_size = profile.ByteSizeLong();
+  printf("%s: %zu bytes serialized, %d samples, %d locations\n", name.c_str(),
+         raw_size, profile.sample_size(), profile.location_size());
+  printf("  %-8s %12s %8s %10s %10s\n", "setting", "bytes", "ratio",
+         "ms", "MB/s");
+  for (const CompressionOptions &options : settings) {
+    std::string out;
+    int64_t start = NowNanos();
+    for (int i = 0; i < FLAGS_iterations; ++i) {
+      if (!CompressProfile(profile, options, &out)) {
+        fprintf(stderr, "Compression with %s failed\n",
+                CompressionName(options).c_str());
+        return;
+      }
+    }
+    double ms = (NowNanos() - start) / 1e6 / FLAGS_iterations;
+    printf("  %-8s %12zu %8.2f %10.2f %10.1f\n",
+           CompressionName(options).c_str(), out.size(),
+           static_cast<double>(raw_size) / out.size(), ms,
+           raw_size / 1e3 / ms);
+  }
+}
+
+}  // namespace
+}  // namespace profiler
+}  // namespace cloud
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+
+  if (argc == 1) {
+    perftools::profiles::Profile profile;
+    cloud::profiler::SyntheticProfile(FLAGS_synthetic_samples, &profile);
+    cloud::profiler::Benchmark("synthetic", profile);
+    return 0;
+  }
+  for (int i = 1; i < argc; ++i) {
+    perftools::profiles::Profile profile;
+    if (!cloud::profiler::ReadProfile(argv[i], &profile)) {
+      fprintf(stderr, "Failed to parse %s\n", argv[i]);
+      return 1;
+    }
+    cloud::profiler::Benchmark(argv[i], profile);
+  }
+  return 0;
+}
@@ -0,0 +1,222 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// JVMTI agent comparing the stack capture paths of the heap sampler on the
+// allocations of a Java workload: AsyncGetCallTrace, used with
+// -cprof_heap_fast_stacks, and JVMTI GetStackTrace. Each sampled
+// allocation is captured with one path, alternating between the two, and
+// the capture times are reported when the JVM exits.
+//
+// Usage: java -agentpath:heap_stack_bench.so[=sampling_interval] ...
+//
+// The sampling interval defaults to 64k bytes.
+
+#include <jni.h>
+#include <jvmti.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <vector>
+
+#include "src/clock.h"
+#include "src/globals.h"
+#include "third_party/javaprofiler/accessors.h"
+#include "third_party/javaprofiler/stacktraces.h"
+
+namespace cloud {
+namespace profiler {
+namespace {
+
+using google::javaprofiler::JVMPI_CallFrame;
+using google::javaprofiler::kMaxFramesToCapture;
+
+const int kDefaultSamplingInterval = 64 * 1024;
+
+int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * kNanosPerSecond + ts.tv_nsec;
+}
+
+// Capture statistics of one path.
+struct PathStats {
+  std::atomic<int64_t> samples{0};
+  std::atomic<int64_t> failures{0};
+  std::atomic<int64_t> frames{0};
+  std::atomic<int64_t> total_ns{0};
+  std::atomic<int64_t> max_ns{0};
+
+  void Add(int num_frames, int64_t ns) {
+    if (num_frames <= 0) {
+      failures++;
+      return;
+    }
+    samples++;
+    frames += num_frames;
+    total_ns += ns;
+    int64_t max = max_ns.load();
+    while (ns > max && !max_ns.compare_exchange_weak(max, ns)) {
+    }
+  }
+
+  void Print(const char *name) const {
+    int64_t n = samples.load();
+    printf("  %-16s %10lld %10lld %10.1f %10.1f %10lld\n", name,
+           static_cast<long long>(n), static_cast<long long>(failures.load()),
+           n > 0 ? static_cast<double>(frames.load()) / n : 0.0,
+           n > 0 ? static_cast<double>(total_ns.load()) / n : 0.0,
+           static_cast<long long>(max_ns.load()));
+  }
+};
+
+std::atomic<int64_t> next_sample(0);
+PathStats asgct_stats;
+PathStats jvmti_stats;
+
+// Both paths end with a copy into a vector, as in the heap sampler.
+int CaptureWithAsgct(JNIEnv *jni) {
+  JVMPI_CallFrame frames[kMaxFramesToCapture];
+  int num_frames = google::javaprofiler::Asgct::GetCurrentThreadTrace(
+      jni, kMaxFramesToCapture, frames);
+  if (num_frames <= 0) {
+    return num_frames;
+  }
+  std::vector<JVMPI_CallFrame> trace(frames, frames + num_frames);
+  return trace.size();
+}
+
+int CaptureWithJvmti(jvmtiEnv *jvmti, jthread thread) {
+  jvmtiFrameInfo stack_frames[kMaxFramesToCapture];
+  jint count = 0;
+  if (jvmti->GetStackTrace(thread, 0, kMaxFramesToCapture, stack_frames,
+                           &count) != JVMTI_ERROR_NONE ||
+      count <= 0) {
+    return 0;
+  }
+  std::vector<JVMPI_CallFrame> trace(count);
+  for (int i = 0; i < count; i++) {
+    trace[i].lineno = stack_frames[i].location;
+    trace[i].method_id = stack_frames[i].method;
+  }
+  return trace.size();
+}
+
+// AsyncGetCallTrace only reports methods whose jmethodIDs exist.
+void CreateJMethodIDsForClass(jvmtiEnv *jvmti, jclass klass) {
+  jint method_count;
+  google::javaprofiler::JvmtiScopedPtr<jmethodID> methods(jvmti);
+  jvmti->GetClassMethods(klass, &method_count, methods.GetRef());
+}
+
+void JNICALL OnClassLoad(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread,
+                         jclass klass) {}
+
+void JNICALL OnClassPrepare(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread,
+                            jclass klass) {
+  CreateJMethodIDsForClass(jvmti, klass);
+}
+
+void JNICALL OnVMInit(jvmtiEnv *jvmti, JNIEnv *jni, jthread thread) {
+  jint class_count;
+  google::javaprofiler::JvmtiScopedPtr<jclass> classes(jvmti);
+  if (jvmti->GetLoadedClasses(&class_count, classes.GetRef()) ==
+      JVMTI_ERROR_NONE) {
+    for (int i = 0; i < class_count; ++i) {
+      CreateJMethodIDsForClass(jvmti, classes.Get()[i]);
+    }
+  }
+  jvmti->SetEventNotificationMode(JVMTI_ENABLE,
+                                  JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, nullptr);
+}
+
+void JNICALL OnSampledObjectAlloc(jvmtiEnv *jvmti, JNIEnv *jni,
+                                  jthread thread, jobject object,
+                                  jclass klass, jlong size) {
+  bool use_asgct = next_sample.fetch_add(1) % 2 == 0;
+  int64_t start = NowNanos();
+  int num_frames = use_asgct ? CaptureWithAsgct(jni)
+                             : CaptureWithJvmti(jvmti, thread);
+  int64_t ns = NowNanos() - start;
+  (use_asgct ? asgct_stats : jvmti_stats).Add(num_frames, ns);
+}
+
+void JNICALL OnVMDeath(jvmtiEnv *jvmti, JNIEnv *jni) {
+  jvmti->SetEventNotificationMode(JVMTI_DISABLE,
+                                  JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, nullptr);
+  printf("Heap sample stack capture:\n");
+  printf("  %-16s %10s %10s %10s %10s %10s\n", "path", "samples", "failures",
+         "frames", "mean ns", "max ns");
+  asgct_stats.Print("AsyncGetCallTrace");
+  jvmti_stats.Print("GetStackTrace");
+  fflush(stdout);
+}
+
+}  // namespace
+}  // namespace profiler
+}  // namespace cloud
+
+AGENTEXPORT jint JNICALL Agent_OnLoad(JavaVM *vm, char *options,
+                                      void *reserved) {
+  jvmtiEnv *jvmti = nullptr;
+  jint err = vm->GetEnv(reinterpret_cast<void **>(&jvmti), JVMTI_VERSION);
+  if (err != JNI_OK) {
+    fprintf(stderr, "Failed to get the JVMTI environment\n");
+    return 1;
+  }
+
+  jvmtiCapabilities caps;
+  memset(&caps, 0, sizeof(caps));
+  caps.can_generate_sampled_object_alloc_events = 1;
+  if (jvmti->AddCapabilities(&caps) != JVMTI_ERROR_NONE) {
+    fprintf(stderr, "Failed to add the heap sampling capability\n");
+    return 1;
+  }
+
+  int interval = cloud::profiler::kDefaultSamplingInterval;
+  if (options != nullptr && *options != '\0') {
+    interval = atoi(options);
+  }
+  if (jvmti->SetHeapSamplingInterval(interval) != JVMTI_ERROR_NONE) {
+    fprintf(stderr, "Invalid sampling interval %d\n", interval);
+    return 1;
+  }
+
+  jvmtiEventCallbacks callbacks;
+  memset(&callbacks, 0, sizeof(callbacks));
+  callbacks.ClassLoad = &cloud::profiler::OnClassLoad;
+  callbacks.ClassPrepare = &cloud::profiler::OnClassPrepare;
+  callbacks.VMInit = &cloud::profiler::OnVMInit;
+  callbacks.VMDeath = &cloud::profiler::OnVMDeath;
+  callbacks.SampledObjectAlloc = &cloud::profiler::OnSampledObjectAlloc;
+  jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
+
+  // AsyncGetCallTrace requires the class load events to be enabled.
+  jvmtiEvent events[] = {JVMTI_EVENT_CLASS_LOAD, JVMTI_EVENT_CLASS_PREPARE,
+                         JVMTI_EVENT_VM_INIT, JVMTI_EVENT_VM_DEATH};
+  for (jvmtiEvent event : events) {
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, event, nullptr);
+  }
+
+  google::javaprofiler::Asgct::SetAsgct(
+      google::javaprofiler::Accessors::GetJvmFunction<
+          google::javaprofiler::ASGCTType>("AsyncGetCallTrace"));
+  if (google::javaprofiler::Asgct::GetAsgct() == nullptr) {
+    fprintf(stderr, "AsyncGetCallTrace is not available\n");
+    return 1;
+  }
+  return 0;
+}
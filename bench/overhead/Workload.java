@@ -0,0 +1,237 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+import java.io.BufferedReader;
+import java.io.FileReader;
+import java.io.IOException;
+import java.util.ArrayList;
+import java.util.List;
+import java.util.concurrent.CountDownLatch;
+import java.util.concurrent.ThreadLocalRandom;
+import java.util.concurrent.locks.LockSupport;
+
+/**
+ * Reference workload of the agent overhead benchmark, run by
+ * overhead_bench.sh with and without the agent.
+ *
+ * <p>Usage: java Workload cpu|alloc|parked|contended [seconds] [threads]
+ *
+ * <p>Each thread repeats one operation of the workload and times it. The
+ * first quarter of the run warms up the JIT and is not measured. The result
+ * is printed as a single line: the operations per second, the p50 and p99
+ * latencies of an operation in microseconds, and the peak RSS of the JVM.
+ */
+public final class Workload {
+  private static volatile long sink;
+
+  /** Histogram of latencies, with 8 sub-buckets per power of two. */
+  static final class Histogram {
+    private static final int SUB_BUCKETS = 8;
+    private final long[] counts = new long[64 * SUB_BUCKETS];
+    private long total;
+
+    void record(long nanos) {
+      counts[bucket(Math.max(nanos, 1))]++;
+      total++;
+    }
+
+    void merge(Histogram other) {
+      for (int i = 0; i < counts.length; i++) {
+        counts[i] += other.counts[i];
+      }
+      total += other.total;
+    }
+
+    long total() {
+      return total;
+    }
+
+    /** Returns the upper bound of the bucket holding the given quantile. */
+    long percentile(double quantile) {
+      long rank = (long) (quantile * total);
+      long seen = 0;
+      for (int i = 0; i < counts.length; i++) {
+        seen += counts[i];
+        if (seen > rank) {
+          return upperBound(i);
+        }
+      }
+      return 0;
+    }
+
+    private static int bucket(long nanos) {
+      int log = 63 - Long.numberOfLeadingZeros(nanos);
+      if (log < 3) {
+        return (int) nanos;
+      }
+      int sub = (int) (nanos >> (log - 3)) & (SUB_BUCKETS - 1);
+      return log * SUB_BUCKETS + sub;
+    }
+
+    private static long upperBound(int bucket) {
+      int log = bucket / SUB_BUCKETS;
+      if (log < 3) {
+        return bucket;
+      }
+      int sub = bucket % SUB_BUCKETS;
+      return ((long) (SUB_BUCKETS + sub + 1) << (log - 3)) - 1;
+    }
+  }
+
+  /** One operation of a workload, run repeatedly by each thread. */
+  interface Operation {
+    void run(ThreadState state);
+  }
+
+  /** Per-thread data of the operations. */
+  static final class ThreadState {
+    final ThreadLocalRandom random = ThreadLocalRandom.current();
+    final Object[] live = new Object[4096];
+    long value;
+  }
+
+  private static final Object[] LOCKS = new Object[4];
+
+  static {
+    for (int i = 0; i < LOCKS.length; i++) {
+      LOCKS[i] = new Object();
+    }
+  }
+
+  // Recurses so that the CPU samples have stacks of a few distinct depths.
+  private static long compute(long seed, int depth) {
+    if (depth > 0) {
+      return compute(seed * 31 + depth, depth - 1) ^ seed;
+    }
+    long x = seed;
+    for (int i = 0; i < 2000; i++) {
+      x ^= x << 13;
+      x ^= x >>> 7;
+      x ^= x << 17;
+    }
+    return x;
+  }
+
+  private static Operation operation(String workload) {
+    switch (workload) {
+      case "cpu":
+        return state -> state.value += compute(state.random.nextLong(),
+            state.random.nextInt(16));
+      case "alloc":
+        // Keeps a window of objects alive so that some survive young
+        // collections.
+        return state -> {
+          for (int i = 0; i < 16; i++) {
+            int size = 16 << state.random.nextInt(10);
+            state.live[state.random.nextInt(state.live.length)] =
+                new byte[size];
+          }
+          state.value += state.live.length;
+        };
+      case "parked":
+        // Threads which mostly wait, as in a server with a large pool.
+        return state -> {
+          LockSupport.parkNanos(1000000);
+          state.value += compute(state.value, 2);
+        };
+      case "contended":
+        return state -> {
+          synchronized (LOCKS[state.random.nextInt(LOCKS.length)]) {
+            state.value += compute(state.value, 1);
+          }
+        };
+      default:
+        throw new IllegalArgumentException("Unknown workload " + workload);
+    }
+  }
+
+  private static int defaultThreads(String workload) {
+    int cpus = Runtime.getRuntime().availableProcessors();
+    switch (workload) {
+      case "parked":
+        return 1000;
+      case "contended":
+        return 4 * cpus;
+      default:
+        return cpus;
+    }
+  }
+
+  // Returns a field of /proc/self/status in kilobytes, or -1.
+  private static long statusKb(String field) {
+    try (BufferedReader reader =
+        new BufferedReader(new FileReader("/proc/self/status"))) {
+      String line;
+      while ((line = reader.readLine()) != null) {
+        if (line.startsWith(field + ":")) {
+          String[] parts = line.substring(field.length() + 1).trim().split(" ");
+          return Long.parseLong(parts[0]);
+        }
+      }
+    } catch (IOException | NumberFormatException e) {
+      // Not on Linux.
+    }
+    return -1;
+  }
+
+  public static void main(String[] args) throws InterruptedException {
+    if (args.length < 1) {
+      System.err.println("Usage: java Workload cpu|alloc|parked|contended "
+          + "[seconds] [threads]");
+      System.exit(2);
+    }
+    String workload = args[0];
+    final Operation operation = operation(workload);
+    double seconds = args.length > 1 ? Double.parseDouble(args[1]) : 60;
+    int threadCount = args.length > 2
+        ? Integer.parseInt(args[2]) : defaultThreads(workload);
+
+    final long start = System.nanoTime();
+    final long measureStart = start + (long) (seconds * 0.25e9);
+    final long end = start + (long) (seconds * 1e9);
+    final CountDownLatch done = new CountDownLatch(threadCount);
+    final List<Histogram> histograms = new ArrayList<>();
+    for (int i = 0; i < threadCount; i++) {
+      final Histogram histogram = new Histogram();
+      histograms.add(histogram);
+      Thread thread = new Thread(() -> {
+        ThreadState state = new ThreadState();
+        long now = System.nanoTime();
+        while (now < end) {
+          operation.run(state);
+          long after = System.nanoTime();
+          if (now >= measureStart) {
+            histogram.record(after - now);
+          }
+          now = after;
+        }
+        sink += state.value;
+        done.countDown();
+      }, "workload-" + i);
+      thread.setDaemon(true);
+      thread.start();
+    }
+    done.await();
+
+    Histogram total = new Histogram();
+    for (Histogram histogram : histograms) {
+      total.merge(histogram);
+    }
+    double measuredSeconds = (end - measureStart) / 1e9;
+    System.out.printf("workload=%s threads=%d ops_per_sec=%.1f p50_us=%.2f "
+        + "p99_us=%.2f rss_kb=%d%n", workload, threadCount,
+        total.total() / measuredSeconds, total.percentile(0.5) / 1e3,
+        total.percentile(0.99) / 1e3, statusKb("VmHWM"));
+  }
+}
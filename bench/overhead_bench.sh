@@ -0,0 +1,174 @@
+#!/bin/bash
+#
+# Copyright 2018 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+# The script measures the overhead of the agent on a reference Java
+# workload. Each workload of bench/overhead/Workload.java runs without the
+# agent, then with the agent saving profiles to local files for each
+# forced profile type, and the throughput, p99 latency and peak RSS are
+# reported relative to the run without the agent.
+
+set -o errexit
+set -o nounset
+#
+# Command line arguments: [-a agent] [-d seconds] [-r runs] [-w workloads]
+#                         [-c configs] [-o dir]
+#   -a: the agent to measure. Omitting -a builds it with make.
+#   -d: the duration of each run, 60 seconds by default.
+#   -r: the number of runs of each configuration, 3 by default. The median
+#       run is reported.
+#   -w: the comma-separated workloads, among cpu, alloc, parked and
+#       contended. All of them by default.
+#   -c: the comma-separated agent configurations, among cpu, wall, heap
+#       and all (CPU and wall, as when nothing is forced). All of them by
+#       default.
+#   -o: the directory of the profiles, logs and results.
+
+AGENT=""
+DURATION="60"
+RUNS="3"
+WORKLOADS="cpu,alloc,parked,contended"
+CONFIGS="cpu,wall,heap,all"
+OUT_DIR=""
+while getopts ":a:d:r:w:c:o:" opt; do
+  case $opt in
+  a)
+      AGENT=$OPTARG
+      ;;
+  d)
+      DURATION=$OPTARG
+      ;;
+  r)
+      RUNS=$OPTARG
+      ;;
+  w)
+      WORKLOADS=$OPTARG
+      ;;
+  c)
+      CONFIGS=$OPTARG
+      ;;
+  o)
+      OUT_DIR=$OPTARG
+      ;;
+  :)
+      echo "Missing option argument for -$OPTARG" >&2;
+      exit 1
+      ;;
+  *)
+      echo "Unknown option: -$OPTARG" >&2;
+      exit 1
+      ;;
+  esac
+done
+
+cd "$(dirname "$0")/.."
+
+if [[ -z "${OUT_DIR}" ]]; then
+  OUT_DIR="$(mktemp -d /tmp/overhead_bench.XXXXXX)"
+fi
+mkdir -p "${OUT_DIR}/classes"
+echo "Results in: ${OUT_DIR}"
+
+if [[ -z "${AGENT}" ]]; then
+  echo "Building the agent..."
+  make -j"$(nproc)" all > "${OUT_DIR}/build.log" 2>&1 || {
+    echo "FAILED: see ${OUT_DIR}/build.log"; exit 1; }
+  AGENT="$(pwd)/.out/profiler_java_agent.so"
+fi
+AGENT="$(cd "$(dirname "${AGENT}")" && pwd)/$(basename "${AGENT}")"
+
+javac -d "${OUT_DIR}/classes" bench/overhead/Workload.java
+
+# Prints the agent options of a configuration, profiling continuously to
+# local files so that the overhead is not diluted by the waits between
+# profiles.
+function AgentOptions() {
+  local config="$1"
+  local profiles="$2"
+  local options="-cprof_profile_filename=${profiles}/"
+  options+=",-cprof_service=overhead-bench,-cprof_interval_sec=10"
+  options+=",-cprof_duration_sec=10,-cprof_max_count=100000"
+  options+=",-logtostderr"
+  case "${config}" in
+  cpu|wall)
+      options+=",-cprof_force=${config}"
+      ;;
+  heap)
+      options+=",-cprof_force=heap,-cprof_enable_heap_sampling"
+      ;;
+  all)
+      ;;
+  *)
+      echo "Unknown configuration: ${config}" >&2;
+      exit 1
+      ;;
+  esac
+  echo "${options}"
+}
+
+# Prints the value of a field of the result line of a run.
+function Field() {
+  sed -n "s/.*$2=\([^ ]*\).*/\1/p" "$1"
+}
+
+# Runs a workload RUNS times and prints the result line of the median run,
+# by throughput.
+function Measure() {
+  local workload="$1"
+  local config="$2"
+  local results="${OUT_DIR}/${workload}.${config}.results"
+  : > "${results}"
+  for run in $(seq "${RUNS}"); do
+    local log="${OUT_DIR}/${workload}.${config}.${run}.log"
+    local java_args=()
+    if [[ "${config}" != "none" ]]; then
+      local profiles="${OUT_DIR}/profiles/${workload}.${config}.${run}"
+      mkdir -p "${profiles}"
+      java_args+=("-agentpath:${AGENT}=$(AgentOptions "${config}" \
+          "${profiles}")")
+    fi
+    java "${java_args[@]+"${java_args[@]}"}" -cp "${OUT_DIR}/classes" \
+        Workload "${workload}" "${DURATION}" > "${log}" 2> "${log}.stderr"
+    grep "^workload=" "${log}" >> "${results}"
+  done
+  sort -t= -k4 -g "${results}" | sed -n "$(( (RUNS + 1) / 2 ))p"
+}
+
+# Prints the relative change of a measure, in percent.
+function Delta() {
+  awk -v base="$1" -v value="$2" \
+      'BEGIN { if (base > 0) printf "%+.1f%%", 100 * (value - base) / base;
+               else printf "n/a" }'
+}
+
+printf "%-10s %-6s %12s %8s %10s %8s %10s %8s\n" workload config ops/s \
+    delta p99_us delta rss_mb delta
+for workload in ${WORKLOADS//,/ }; do
+  base="${OUT_DIR}/${workload}.none.median"
+  Measure "${workload}" none > "${base}"
+  for config in none ${CONFIGS//,/ }; do
+    median="${OUT_DIR}/${workload}.${config}.median"
+    if [[ "${config}" != "none" ]]; then
+      Measure "${workload}" "${config}" > "${median}"
+    fi
+    ops="$(Field "${median}" ops_per_sec)"
+    p99="$(Field "${median}" p99_us)"
+    rss="$(Field "${median}" rss_kb)"
+    printf "%-10s %-6s %12s %8s %10s %8s %10s %8s\n" "${workload}" \
+        "${config}" "${ops}" "$(Delta "$(Field "${base}" ops_per_sec)" \
+        "${ops}")" "${p99}" "$(Delta "$(Field "${base}" p99_us)" "${p99}")" \
+        "$(( rss / 1024 ))" "$(Delta "$(Field "${base}" rss_kb)" "${rss}")"
+  done
+done
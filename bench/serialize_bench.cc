@@ -0,0 +1,426 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the serialization of profiles from synthetic traces, without a
+// JVM: a fake JVMTI environment, along the lines of the one of
+// profile_test_lib.cc, names the methods of the traces.
+//
+// Usage: serialize_bench [--stacks=N] [--depth=N] [--shared_frames=N]
+//                        [--methods=N] [--attributes=N] [--profiles=N]
+//
+// The same traces go through the agent's path, ProfileProtoBuilder's
+// Populate() and Emit() as SerializeAndClearJavaCpuTraces() runs them,
+// and through the CPU and heap builders of third_party/javaprofiler, up
+// to CreateSampledProto() or CreateUnsampledProto() and the compressed
+// serialization of Builder::Marshal(). The agent's builder is reused
+// across profiles, as the profiler does, so that the later profiles show
+// the cost with warm dictionaries.
+//
+// Each stage reports its time, the peak of the memory it allocated on top
+// of what was allocated when it started, and the memory it left
+// allocated. Memory is tracked by replacing the global operator new.
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "src/clock.h"
+#include "src/compression.h"
+#include "src/globals.h"
+#include "src/method_cache.h"
+#include "src/proto.h"
+#include "src/throttler.h"
+#include "third_party/javaprofiler/native.h"
+#include "third_party/javaprofiler/profile_proto_builder.h"
+#include "third_party/javaprofiler/profile_test_lib.h"
+#include "third_party/javaprofiler/stacktraces.h"
+
+DEFINE_int32(stacks, 20000, "number of distinct stacks");
+DEFINE_int32(depth, 48, "number of frames of each stack");
+DEFINE_int32(shared_frames, 16,
+             "number of frames near the root shared by all the stacks");
+DEFINE_int32(methods, 8000, "number of distinct methods in the stacks");
+DEFINE_int32(methods_per_class, 8, "number of methods of each class");
+DEFINE_int32(attributes, 16,
+             "number of distinct attributes of the traces, 0 for none");
+DEFINE_int32(profiles, 3, "number of profiles serialized by each path");
+
+namespace {
+
+std::atomic<int64_t> allocated_bytes(0);
+std::atomic<int64_t> peak_bytes(0);
+
+void TrackAllocation(void *p) {
+  int64_t size = malloc_usable_size(p);
+  int64_t now = allocated_bytes.fetch_add(size, std::memory_order_relaxed) +
+                size;
+  int64_t peak = peak_bytes.load(std::memory_order_relaxed);
+  while (now > peak &&
+         !peak_bytes.compare_exchange_weak(peak, now,
+                                           std::memory_order_relaxed)) {
+  }
+}
+
+}  // namespace
+
+void *operator new(size_t size) {
+  void *p = malloc(size > 0 ? size : 1);
+  if (p == nullptr) {
+    throw std::bad_alloc();
+  }
+  TrackAllocation(p);
+  return p;
+}
+
+void *operator new[](size_t size) { return operator new(size); }
+
+void operator delete(void *p) noexcept {
+  if (p != nullptr) {
+    allocated_bytes.fetch_sub(malloc_usable_size(p),
+                              std::memory_order_relaxed);
+    free(p);
+  }
+}
+
+void operator delete[](void *p) noexcept { operator delete(p); }
+
+namespace cloud {
+namespace profiler {
+namespace {
+
+using google::javaprofiler::JVMPI_CallFrame;
+using google::javaprofiler::JVMPI_CallTrace;
+
+int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * kNanosPerSecond + ts.tv_nsec;
+}
+
+uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// Fake JVMTI environment: method id m, counting from 1, is the method
+// "method<m>" of class (m - 1) / --methods_per_class + 1, whose id is also
+// its jclass.
+
+int64_t ClassOf(jmethodID method) {
+  return (reinterpret_cast<int64_t>(method) - 1) /
+             std::max(FLAGS_methods_per_class, 1) +
+         1;
+}
+
+char *JvmtiString(jvmtiEnv *jvmti, const std::string &str) {
+  unsigned char *mem;
+  jvmti->Allocate(str.size() + 1, &mem);
+  memcpy(mem, str.c_str(), str.size() + 1);
+  return reinterpret_cast<char *>(mem);
+}
+
+jvmtiError JNICALL Allocate(jvmtiEnv *jvmti, jlong size,
+                            unsigned char **mem_ptr) {
+  *mem_ptr = static_cast<unsigned char *>(malloc(size));
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL Deallocate(jvmtiEnv *jvmti, unsigned char *mem) {
+  free(mem);
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetMethodName(jvmtiEnv *jvmti, jmethodID method,
+                                 char **name_ptr, char **signature_ptr,
+                                 char **generic_ptr) {
+  int64_t id = reinterpret_cast<int64_t>(method);
+  if (name_ptr != nullptr) {
+    *name_ptr = JvmtiString(jvmti, "method" + std::to_string(id));
+  }
+  if (signature_ptr != nullptr) {
+    *signature_ptr = JvmtiString(
+        jvmti, id % 2 == 0 ? "(Ljava/lang/String;I)V" : "()Ljava/util/List;");
+  }
+  if (generic_ptr != nullptr) {
+    *generic_ptr = nullptr;
+  }
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetMethodDeclaringClass(jvmtiEnv *jvmti, jmethodID method,
+                                           jclass *declaring_class_ptr) {
+  *declaring_class_ptr = reinterpret_cast<jclass>(ClassOf(method));
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetClassSignature(jvmtiEnv *jvmti, jclass klass,
+                                     char **signature_ptr,
+                                     char **generic_ptr) {
+  int64_t id = reinterpret_cast<int64_t>(klass);
+  if (signature_ptr != nullptr) {
+    *signature_ptr = JvmtiString(
+        jvmti, "Lcom/example/service/module" + std::to_string(id % 97) +
+                   "/Handler" + std::to_string(id) + ";");
+  }
+  if (generic_ptr != nullptr) {
+    *generic_ptr = nullptr;
+  }
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetSourceFileName(jvmtiEnv *jvmti, jclass klass,
+                                     char **source_name_ptr) {
+  *source_name_ptr = JvmtiString(
+      jvmti, "Handler" + std::to_string(reinterpret_cast<int64_t>(klass)) +
+                 ".java");
+  return JVMTI_ERROR_NONE;
+}
+
+jvmtiError JNICALL GetLineNumberTable(jvmtiEnv *jvmti, jmethodID method,
+                                      jint *entry_count_ptr,
+                                      jvmtiLineNumberEntry **table_ptr) {
+  const int kEntries = 8;
+  jvmti->Allocate(kEntries * sizeof(jvmtiLineNumberEntry),
+                  reinterpret_cast<unsigned char **>(table_ptr));
+  int64_t first_line = 10 + reinterpret_cast<int64_t>(method) % 500;
+  for (int i = 0; i < kEntries; i++) {
+    (*table_ptr)[i].start_location = i * 8;
+    (*table_ptr)[i].line_number = first_line + i;
+  }
+  *entry_count_ptr = kEntries;
+  return JVMTI_ERROR_NONE;
+}
+
+// Fake JNI environment, where the weak references to the classes are the
+// classes themselves, and the references need no release.
+
+jweak JNICALL NewWeakGlobalRef(JNIEnv *jni, jobject obj) { return obj; }
+
+void JNICALL DeleteWeakGlobalRef(JNIEnv *jni, jweak ref) {}
+
+void JNICALL DeleteLocalRef(JNIEnv *jni, jobject obj) {}
+
+jboolean JNICALL IsSameObject(JNIEnv *jni, jobject obj1, jobject obj2) {
+  return obj1 == obj2;
+}
+
+struct FakeJvm {
+  FakeJvm() {
+    memset(&jvmti_functions, 0, sizeof(jvmti_functions));
+    jvmti_functions.Allocate = &Allocate;
+    jvmti_functions.Deallocate = &Deallocate;
+    jvmti_functions.GetMethodName = &GetMethodName;
+    jvmti_functions.GetMethodDeclaringClass = &GetMethodDeclaringClass;
+    jvmti_functions.GetClassSignature = &GetClassSignature;
+    jvmti_functions.GetSourceFileName = &GetSourceFileName;
+    jvmti_functions.GetLineNumberTable = &GetLineNumberTable;
+    jvmti.functions = &jvmti_functions;
+
+    memset(&jni_functions, 0, sizeof(jni_functions));
+    jni_functions.NewWeakGlobalRef = &NewWeakGlobalRef;
+    jni_functions.DeleteWeakGlobalRef = &DeleteWeakGlobalRef;
+    jni_functions.DeleteLocalRef = &DeleteLocalRef;
+    jni_functions.IsSameObject = &IsSameObject;
+    jni.functions = &jni_functions;
+  }
+
+  struct jvmtiInterface_1_ jvmti_functions;
+  jvmtiEnv jvmti;
+  struct JNINativeInterface_ jni_functions;
+  JNIEnv jni;
+};
+
+// The synthetic traces, with their sample counts and attributes.
+struct Traces {
+  std::vector<std::vector<JVMPI_CallFrame>> stacks;
+  std::vector<int32_t> counts;
+  std::vector<int> attrs;
+  std::vector<int> attribute_ids;
+};
+
+// The frames near the root are shared by all the stacks, like the dispatch
+// loops of a server, and the other ones are drawn from --methods methods.
+void GenerateTraces(Traces *traces) {
+  int shared = std::min(FLAGS_shared_frames, FLAGS_depth);
+  int methods = std::max(FLAGS_methods - shared, 1);
+  for (int i = 0; i < FLAGS_attributes; i++) {
+    std::string attribute = "request-type-" + std::to_string(i);
+    traces->attribute_ids.push_back(
+        google::javaprofiler::AttributeTable::RegisterString(
+            attribute.c_str()));
+  }
+  for (int i = 0; i < FLAGS_stacks; i++) {
+    std::vector<JVMPI_CallFrame> frames(FLAGS_depth);
+    for (int d = 0; d < FLAGS_depth; d++) {
+      int from_root = FLAGS_depth - 1 - d;
+      uint64_t random = Mix(static_cast<uint64_t>(i) * FLAGS_depth + d);
+      int64_t method =
+          from_root < shared ? from_root + 1 : shared + 1 + random % methods;
+      frames[d].lineno = static_cast<jint>(random % 64);
+      frames[d].method_id =
+          reinterpret_cast<jmethodID>(static_cast<uintptr_t>(method));
+    }
+    traces->stacks.push_back(std::move(frames));
+    traces->counts.push_back(1 + Mix(i) % 100);
+    traces->attrs.push_back(traces->attribute_ids.empty()
+                                ? 0
+                                : traces->attribute_ids[i % FLAGS_attributes]);
+  }
+}
+
+// Times a stage and tracks the memory it allocates.
+class Stage {
+ public:
+  Stage(const char *path, const char *name, int profile)
+      : path_(path),
+        name_(name),
+        profile_(profile),
+        start_bytes_(allocated_bytes.load()),
+        start_nanos_(NowNanos()) {
+    peak_bytes.store(start_bytes_);
+  }
+
+  // Prints the stage, which produced output_bytes unless negative.
+  void Done(int64_t output_bytes = -1) {
+    int64_t nanos = NowNanos() - start_nanos_;
+    printf("%-10s %-14s %7d %10.2f %10.2f %11.2f", path_, name_, profile_,
+           nanos / 1e6, (peak_bytes.load() - start_bytes_) / 1048576.0,
+           (allocated_bytes.load() - start_bytes_) / 1048576.0);
+    if (output_bytes >= 0) {
+      printf(" %11lld", static_cast<long long>(output_bytes));  // NOLINT
+    }
+    printf("\n");
+    fflush(stdout);
+  }
+
+ private:
+  const char *path_;
+  const char *name_;
+  int profile_;
+  int64_t start_bytes_;
+  int64_t start_nanos_;
+};
+
+void RunAgentPath(FakeJvm *jvm, const Traces &traces) {
+  google::javaprofiler::NativeProcessInfo native_info("/proc/self/maps");
+  MethodCache methods(&jvm->jvmti, 0);
+  ProfileProtoBuilder builder(&native_info, nullptr, &methods, 0);
+  CompressionOptions compression;
+  google::javaprofiler::TraceMultiset multiset;
+  for (int profile = 1; profile <= FLAGS_profiles; profile++) {
+    Stage add("agent", "multiset_add", profile);
+    for (size_t i = 0; i < traces.stacks.size(); i++) {
+      multiset.Add(traces.attrs[i], traces.stacks[i].size(),
+                   const_cast<JVMPI_CallFrame *>(traces.stacks[i].data()),
+                   traces.counts[i]);
+    }
+    add.Done();
+
+    Stage populate("agent", "populate", profile);
+    builder.Start(&jvm->jni, compression);
+    builder.Populate(&jvm->jni, kTypeCPU, multiset, kNanosPerSecond * 10,
+                     kNanosPerMilli * 10);
+    builder.AddArtificialSample("[Unknown]", 1, kNanosPerMilli * 10);
+    multiset.Clear();
+    populate.Done();
+
+    Stage emit("agent", "emit", profile);
+    std::string data = builder.Emit();
+    emit.Done(data.size());
+  }
+}
+
+void RunLibPath(FakeJvm *jvm, const Traces &traces, bool heap) {
+  const char *path = heap ? "lib_heap" : "lib_cpu";
+  google::javaprofiler::TestProfileFrameCache cache;
+  std::vector<JVMPI_CallTrace> call_traces(traces.stacks.size());
+  for (size_t i = 0; i < traces.stacks.size(); i++) {
+    call_traces[i].env_id = &jvm->jni;
+    call_traces[i].num_frames = traces.stacks[i].size();
+    call_traces[i].frames =
+        const_cast<JVMPI_CallFrame *>(traces.stacks[i].data());
+  }
+  for (int profile = 1; profile <= FLAGS_profiles; profile++) {
+    Stage add(path, "add_traces", profile);
+    std::vector<google::javaprofiler::ProfileStackTrace> stack_traces;
+    stack_traces.reserve(call_traces.size());
+    for (size_t i = 0; i < call_traces.size(); i++) {
+      // Heap samples weigh their size in bytes, CPU samples their time.
+      int64_t metric = heap ? traces.counts[i] * 4096
+                            : traces.counts[i] * kNanosPerMilli * 10;
+      stack_traces.emplace_back(&call_traces[i], metric);
+      if (traces.attrs[i] != 0) {
+        stack_traces.back().trace_and_labels.AddLabel(
+            "attr", google::javaprofiler::AttributeTable::GetString(
+                        traces.attrs[i]));
+      }
+    }
+    std::unique_ptr<google::javaprofiler::ProfileProtoBuilder> builder =
+        heap ? google::javaprofiler::ProfileProtoBuilder::ForHeap(
+                   &jvm->jni, &jvm->jvmti, 512 * 1024, &cache)
+             : google::javaprofiler::ProfileProtoBuilder::ForCpu(
+                   &jvm->jni, &jvm->jvmti, kNanosPerSecond * 10,
+                   kNanosPerMilli * 10, &cache);
+    builder->AddTraces(stack_traces.data(), traces.counts.data(),
+                       stack_traces.size());
+    add.Done();
+
+    Stage create(path, heap ? "create_unsampl" : "create_sampled", profile);
+    std::unique_ptr<perftools::profiles::Profile> proto =
+        builder->CreateProto();
+    create.Done();
+
+    Stage marshal(path, "marshal", profile);
+    std::string data;
+    perftools::profiles::Builder::Marshal(*proto, &data);
+    marshal.Done(data.size());
+  }
+}
+
+}  // namespace
+}  // namespace profiler
+}  // namespace cloud
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  google::javaprofiler::AttributeTable::Init();
+
+  cloud::profiler::FakeJvm jvm;
+  cloud::profiler::Traces traces;
+  printf("%d stacks of %d frames, %d shared, over %d methods, %d "
+         "attributes\n",
+         FLAGS_stacks, FLAGS_depth, FLAGS_shared_frames, FLAGS_methods,
+         FLAGS_attributes);
+  printf("%-10s %-14s %7s %10s %10s %11s %11s\n", "path", "stage", "profile",
+         "ms", "peak_mb", "retained_mb", "bytes");
+  {
+    cloud::profiler::Stage generate("synthetic", "generate", 0);
+    cloud::profiler::GenerateTraces(&traces);
+    generate.Done();
+  }
+  cloud::profiler::RunAgentPath(&jvm, traces);
+  cloud::profiler::RunLibPath(&jvm, traces, false);
+  cloud::profiler::RunLibPath(&jvm, traces, true);
+  return 0;
+}
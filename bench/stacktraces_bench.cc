@@ -0,0 +1,281 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the sampling data structures the way the signal handlers and the
+// profiling thread use them: threads adding traces to an
+// AsyncSafeTraceMultiset while a harvester thread extracts them into a
+// TraceMultiset with HarvestSamples, as Profiler::Flush() does.
+//
+// Usage: stacktraces_bench [--threads=1,2,...] [--duration_ms=N]
+//
+// Each configuration is a distribution of the traces, a stack depth and a
+// number of adding threads. The "hot" distribution spreads the samples
+// over a few stacks, as a service spending its time in one loop does, and
+// "distinct" gives nearly every sample its own stack. The report gives the
+// throughput of Add(), its latency percentiles, reading the clock included,
+// over one call in --latency_sampling, the share of samples dropped because
+// the table was full, and the time spent per harvest.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "src/clock.h"
+#include "src/globals.h"
+#include "src/string.h"
+#include "third_party/javaprofiler/stacktraces.h"
+
+DEFINE_string(threads, "1,2,4,8,16,32,64,128",
+              "comma-separated numbers of threads adding traces");
+DEFINE_string(depths, "8,32,128",
+              "comma-separated stack depths, at most kMaxFramesToCapture");
+DEFINE_int32(duration_ms, 500, "duration of each configuration");
+DEFINE_int32(max_entries, 4096, "number of entries of the async-safe table");
+DEFINE_int32(hot_stacks, 16, "number of stacks of the hot distribution");
+DEFINE_int32(harvest_interval_ms, 10,
+             "interval between two harvests, 0 for no harvest");
+DEFINE_int32(latency_sampling, 8, "time one Add() in this many");
+
+namespace cloud {
+namespace profiler {
+namespace {
+
+using google::javaprofiler::AsyncSafeTraceMultiset;
+using google::javaprofiler::JVMPI_CallFrame;
+using google::javaprofiler::JVMPI_CallTrace;
+using google::javaprofiler::TraceMultiset;
+using google::javaprofiler::kMaxFramesToCapture;
+
+int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * kNanosPerSecond + ts.tv_nsec;
+}
+
+uint64_t Mix(uint64_t x) {
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+// Fills the frames of stack number id. The frames near the root are shared
+// by most stacks, like the dispatch loops of a server.
+void FillStack(uint64_t id, int depth, JVMPI_CallFrame *frames) {
+  for (int d = 0; d < depth; d++) {
+    int from_root = depth - 1 - d;
+    uint64_t method =
+        from_root < 4 ? from_root + 1 : Mix(id * kMaxFramesToCapture + d);
+    frames[d].lineno = static_cast<jint>(method % 1000);
+    frames[d].method_id = reinterpret_cast<jmethodID>(
+        static_cast<uintptr_t>(method | 1));
+  }
+}
+
+// Histogram of latencies, with 8 sub-buckets per power of two.
+class LatencyHistogram {
+ public:
+  static const int kSubBuckets = 8;
+  static const int kBuckets = 64 * kSubBuckets;
+
+  void Record(int64_t nanos) {
+    counts_[Bucket(nanos > 0 ? nanos : 1)]++;
+    total_++;
+  }
+
+  void Merge(const LatencyHistogram &other) {
+    for (int i = 0; i < kBuckets; i++) {
+      counts_[i] += other.counts_[i];
+    }
+    total_ += other.total_;
+  }
+
+  // Returns the upper bound of the bucket holding the given quantile.
+  int64_t Percentile(double quantile) const {
+    int64_t rank = static_cast<int64_t>(quantile * total_);
+    int64_t seen = 0;
+    for (int i = 0; i < kBuckets; i++) {
+      seen += counts_[i];
+      if (seen > rank) {
+        return UpperBound(i);
+      }
+    }
+    return 0;
+  }
+
+ private:
+  static int Bucket(int64_t nanos) {
+    int log = 63 - __builtin_clzll(nanos);
+    if (log < 3) {
+      return nanos;
+    }
+    int sub = (nanos >> (log - 3)) & (kSubBuckets - 1);
+    return log * kSubBuckets + sub;
+  }
+
+  static int64_t UpperBound(int bucket) {
+    int log = bucket / kSubBuckets;
+    if (log < 3) {
+      return bucket;
+    }
+    int sub = bucket % kSubBuckets;
+    return (int64_t{kSubBuckets + sub + 1} << (log - 3)) - 1;
+  }
+
+  int64_t counts_[kBuckets] = {};
+  int64_t total_ = 0;
+};
+
+struct AdderStats {
+  int64_t adds = 0;
+  int64_t drops = 0;
+  LatencyHistogram latency;
+};
+
+struct Config {
+  const char *distribution;
+  int stacks;  // 0 for distinct stacks.
+  int depth;
+  int threads;
+};
+
+void Adder(const Config &config, int index, AsyncSafeTraceMultiset *table,
+           const std::atomic<bool> *stop, AdderStats *stats) {
+  JVMPI_CallFrame frames[kMaxFramesToCapture];
+  JVMPI_CallTrace trace = {nullptr, config.depth, frames};
+  uint64_t seed = Mix(index + 1);
+  int sampling = std::max(1, FLAGS_latency_sampling);
+  for (int64_t i = 0; !stop->load(std::memory_order_relaxed); i++) {
+    seed = Mix(seed);
+    uint64_t id = config.stacks > 0 ? seed % config.stacks : seed;
+    FillStack(id, config.depth, frames);
+    bool added;
+    if (i % sampling == 0) {
+      int64_t start = NowNanos();
+      added = table->Add(0, &trace);
+      stats->latency.Record(NowNanos() - start);
+    } else {
+      added = table->Add(0, &trace);
+    }
+    stats->adds++;
+    if (!added) {
+      stats->drops++;
+    }
+  }
+}
+
+void Run(const Config &config) {
+  AsyncSafeTraceMultiset table(
+      FLAGS_max_entries,
+      int64_t{FLAGS_max_entries} *
+          AsyncSafeTraceMultiset::kDefaultFramesPerTrace);
+  TraceMultiset harvested;
+  std::atomic<bool> stop(false);
+  std::vector<AdderStats> stats(config.threads);
+  std::vector<std::thread> adders;
+  int64_t start = NowNanos();
+  for (int i = 0; i < config.threads; i++) {
+    adders.emplace_back(Adder, std::cref(config), i, &table, &stop,
+                        &stats[i]);
+  }
+
+  // Harvests on this thread, like the profiling thread flushing the table
+  // while the signal handlers keep adding to it.
+  int64_t harvests = 0;
+  int64_t harvest_nanos = 0;
+  int64_t max_harvest_nanos = 0;
+  int64_t end = start + int64_t{FLAGS_duration_ms} * kNanosPerMilli;
+  struct timespec interval =
+      NanosToTimeSpec(int64_t{FLAGS_harvest_interval_ms} * kNanosPerMilli);
+  while (NowNanos() < end) {
+    if (FLAGS_harvest_interval_ms <= 0) {
+      DefaultClock()->SleepFor(NanosToTimeSpec(kNanosPerMilli));
+      continue;
+    }
+    DefaultClock()->SleepFor(interval);
+    int64_t harvest_start = NowNanos();
+    google::javaprofiler::HarvestSamples(&table, &harvested);
+    int64_t nanos = NowNanos() - harvest_start;
+    harvests++;
+    harvest_nanos += nanos;
+    max_harvest_nanos = std::max(max_harvest_nanos, nanos);
+  }
+  stop = true;
+  for (std::thread &adder : adders) {
+    adder.join();
+  }
+  double seconds = static_cast<double>(NowNanos() - start) / kNanosPerSecond;
+
+  AdderStats total;
+  for (const AdderStats &s : stats) {
+    total.adds += s.adds;
+    total.drops += s.drops;
+    total.latency.Merge(s.latency);
+  }
+  printf("%-9s %5d %7d %10.2f %7lld %7lld %7lld %7.2f%% %8lld %7.3f %7.3f\n",
+         config.distribution, config.depth, config.threads,
+         total.adds / seconds / 1e6,
+         static_cast<long long>(total.latency.Percentile(0.5)),    // NOLINT
+         static_cast<long long>(total.latency.Percentile(0.99)),   // NOLINT
+         static_cast<long long>(total.latency.Percentile(0.999)),  // NOLINT
+         total.adds > 0 ? 100.0 * total.drops / total.adds : 0.0,
+         static_cast<long long>(harvests),  // NOLINT
+         harvests > 0 ? harvest_nanos / 1e6 / harvests : 0.0,
+         max_harvest_nanos / 1e6);
+  fflush(stdout);
+}
+
+std::vector<int> ParseList(const std::string &list) {
+  std::vector<int> values;
+  for (const std::string &value : Split(list, ',')) {
+    int n = atoi(value.c_str());
+    if (n > 0) {
+      values.push_back(n);
+    }
+  }
+  return values;
+}
+
+}  // namespace
+}  // namespace profiler
+}  // namespace cloud
+
+int main(int argc, char **argv) {
+  google::ParseCommandLineFlags(&argc, &argv, true);
+  using cloud::profiler::Config;
+
+  printf("%d entries, harvest every %dms, %dms per configuration\n",
+         FLAGS_max_entries, FLAGS_harvest_interval_ms, FLAGS_duration_ms);
+  printf("%-9s %5s %7s %10s %7s %7s %7s %8s %8s %7s %7s\n", "dist", "depth",
+         "threads", "Madds/s", "p50ns", "p99ns", "p999ns", "dropped",
+         "harvests", "avg_ms", "max_ms");
+  for (int stacks : {FLAGS_hot_stacks, 0}) {
+    for (int depth : cloud::profiler::ParseList(FLAGS_depths)) {
+      depth = std::min(depth, google::javaprofiler::kMaxFramesToCapture);
+      for (int threads : cloud::profiler::ParseList(FLAGS_threads)) {
+        Config config = {stacks > 0 ? "hot" : "distinct", stacks, depth,
+                         threads};
+        cloud::profiler::Run(config);
+      }
+    }
+  }
+  return 0;
+}
@@ -14,6 +14,7 @@
 
 #include "src/cloud_env.h"
 
+#include <chrono>  // NOLINT
 #include <cstdlib>
 #include <sstream>
 #include <string>
@@ -52,6 +53,19 @@ const char kNoData[] = "";
 
 namespace {
 
+// A cached access token is refreshed this long before it expires, or half
+// way through its lifetime if shorter.
+const int64_t kTokenRefreshMarginNanos = 5 * 60 * kNanosPerSecond;
+
+// A cached access token is not handed out if it expires sooner than this,
+// as the request it is for may not complete in time.
+const int64_t kTokenMinValidityNanos = 30 * kNanosPerSecond;
+
+// Backoff before retrying a failed background refresh.
+const int64_t kTokenRefreshRetryNanos = 10 * kNanosPerSecond;
+
+int64_t NowNanos() { return TimeSpecToNanos(DefaultClock()->Now()); }
+
 std::string GceMetadataRequest(HTTPRequest* req, const std::string& path) {
   Clock* clock = DefaultClock();
   req->AddHeader("Metadata-Flavor", "Google");
@@ -146,6 +160,17 @@ CloudEnv::CloudEnv() {
   }
 }
 
+CloudEnv::~CloudEnv() {
+  {
+    std::lock_guard<std::mutex> lock(token_mutex_);
+    stopping_ = true;
+  }
+  token_changed_.notify_all();
+  if (token_refresher_.joinable()) {
+    token_refresher_.join();
+  }
+}
+
 std::string CloudEnv::ProjectID() {
   HTTPRequest req;
   return ProjectID(&req);
@@ -193,8 +218,26 @@ std::string CloudEnv::ZoneName(HTTPRequest* req) {
 }
 
 std::string CloudEnv::Oauth2AccessToken() {
+  if (!FLAGS_cprof_access_token_test_only.empty()) {
+    LOG(WARNING) << "Using access token from flags, test-only";
+    return FLAGS_cprof_access_token_test_only;
+  }
+  {
+    std::lock_guard<std::mutex> lock(token_mutex_);
+    if (!access_token_.empty() &&
+        NowNanos() + kTokenMinValidityNanos < token_expiry_nanos_) {
+      return access_token_;
+    }
+  }
+
   HTTPRequest req;
-  return Oauth2AccessToken(&req);
+  std::string token = Oauth2AccessToken(&req);
+  std::lock_guard<std::mutex> lock(token_mutex_);
+  if (!token_refresher_.joinable() && token_refresh_nanos_ != 0 &&
+      !stopping_) {
+    token_refresher_ = std::thread(&CloudEnv::RefreshAccessToken, this);
+  }
+  return token;
 }
 
 std::string CloudEnv::Oauth2AccessToken(HTTPRequest* req) {
@@ -203,13 +246,15 @@ std::string CloudEnv::Oauth2AccessToken(HTTPRequest* req) {
     return FLAGS_cprof_access_token_test_only;
   }
 
-  // TODO: Cache the access token as it's valid for ~1 hour.
+  int64_t fetch_nanos = NowNanos();
   std::string resp = GceMetadataRequest(req, kTokenPath);
   if (resp == kNoData) {
     LOG(ERROR) << "Failed to acquire an access token";
     return resp;
   }
 
+  std::string token;
+  int64_t expires_in_sec = 0;
   std::vector<std::string> lines = Split(resp, '\n');
   for (const std::string& line : lines) {
     std::vector<std::string> pair = Split(line, ' ');
@@ -219,11 +264,49 @@ std::string CloudEnv::Oauth2AccessToken(HTTPRequest* req) {
       continue;
     }
     if (pair[0] == "access_token") {
-      return std::move(pair[1]);
+      token = std::move(pair[1]);
+    } else if (pair[0] == "expires_in") {
+      expires_in_sec = strtoll(pair[1].c_str(), nullptr, 10);
+    }
+  }
+  if (token.empty()) {
+    LOG(ERROR) << "Could not parse access token out of '" << resp << "'";
+    return kNoData;
+  }
+
+  // Without a lifetime, the token is not cached.
+  if (expires_in_sec > 0) {
+    int64_t lifetime_nanos = expires_in_sec * kNanosPerSecond;
+    int64_t margin_nanos = lifetime_nanos / 2 < kTokenRefreshMarginNanos
+                               ? lifetime_nanos / 2
+                               : kTokenRefreshMarginNanos;
+    std::lock_guard<std::mutex> lock(token_mutex_);
+    access_token_ = token;
+    token_expiry_nanos_ = fetch_nanos + lifetime_nanos;
+    token_refresh_nanos_ = token_expiry_nanos_ - margin_nanos;
+  }
+  token_changed_.notify_all();
+  return token;
+}
+
+void CloudEnv::RefreshAccessToken() {
+  std::unique_lock<std::mutex> lock(token_mutex_);
+  while (!stopping_) {
+    int64_t wait_nanos = token_refresh_nanos_ - NowNanos();
+    if (wait_nanos > 0) {
+      token_changed_.wait_for(lock, std::chrono::nanoseconds(wait_nanos));
+      continue;
+    }
+    lock.unlock();
+    HTTPRequest req;
+    bool refreshed = !Oauth2AccessToken(&req).empty();
+    lock.lock();
+    if (!refreshed) {
+      LOG(WARNING) << "Failed to refresh the access token, will retry in "
+                   << kTokenRefreshRetryNanos / kNanosPerSecond << "s";
+      token_refresh_nanos_ = NowNanos() + kTokenRefreshRetryNanos;
     }
   }
-  LOG(ERROR) << "Could not parse access token out of '" << resp << "'";
-  return kNoData;
 }
 
 std::string CloudEnv::Service() { return service_; }
@@ -231,9 +314,11 @@ std::string CloudEnv::Service() { return service_; }
 std::string CloudEnv::ServiceVersion() { return service_version_; }
 
 CloudEnv* DefaultCloudEnv() {
-  // Deferred initialization to make sure the flags are parsed.
-  static CloudEnv cloud_env;
-  return &cloud_env;
+  // Deferred initialization to make sure the flags are parsed. Leaked, so
+  // that the token refresher is not joined at exit while the profiling
+  // threads may still ask for tokens.
+  static CloudEnv* cloud_env = new CloudEnv();
+  return cloud_env;
 }
 
 }  // namespace profiler
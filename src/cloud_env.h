@@ -17,7 +17,12 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_CLOUD_ENV_H_
 #define CLOUD_PROFILER_AGENT_JAVA_CLOUD_ENV_H_
 
+#include <stdint.h>
+
+#include <condition_variable>  // NOLINT
+#include <mutex>               // NOLINT
 #include <string>
+#include <thread>  // NOLINT
 
 #include "src/globals.h"
 
@@ -27,7 +32,9 @@ namespace profiler {
 class HTTPRequest;
 
 // Agent cloud environment (creds, project ID etc.), mockable for testing.
-// The implementation is thread-unsafe, the caller must synchronize the access.
+// The implementation is thread-unsafe, the caller must synchronize the access,
+// except for the OAuth2 access token, which is cached until shortly before
+// it expires and then refreshed in the background.
 class CloudEnv {
  public:
   CloudEnv();
@@ -36,7 +43,7 @@ class CloudEnv {
   CloudEnv(const CloudEnv&) = delete;
   CloudEnv& operator=(const CloudEnv&) = delete;
 
-  virtual ~CloudEnv() {}
+  virtual ~CloudEnv();
 
   // Returns the current cloud project ID.
   virtual std::string ProjectID();
@@ -49,7 +56,7 @@ class CloudEnv {
   // service account assigned or an error occurred while trying to fetch the
   // access token. The token may carry limited set of OAuth2 scopes, so the
   // later use of the token for a specific operation may fail with an
-  // authorization error.
+  // authorization error. The token is served from the cache while valid.
   virtual std::string Oauth2AccessToken();
 
   // Returns the profiled service name for the current environment.
@@ -66,15 +73,29 @@ class CloudEnv {
   // Visible for testing.
   std::string ZoneName(HTTPRequest* req);
 
-  // Implements the method using the given HTTP request for communication.
-  // Visible for testing.
+  // Implements the method using the given HTTP request for communication,
+  // always fetching a new token, which is then cached. Visible for testing.
   std::string Oauth2AccessToken(HTTPRequest* req);
 
  private:
+  // Refreshes the cached access token ahead of its expiry, until the
+  // destructor runs.
+  void RefreshAccessToken();
+
   std::string project_id_;
   std::string zone_name_;
   std::string service_;
   std::string service_version_;
+
+  std::mutex token_mutex_;
+  std::condition_variable token_changed_;
+  std::string access_token_;
+  // Monotonic times at which the cached token expires, and at which it
+  // should be refreshed.
+  int64_t token_expiry_nanos_ = 0;
+  int64_t token_refresh_nanos_ = 0;
+  bool stopping_ = false;
+  std::thread token_refresher_;
 };
 
 // Returns the default instance of a cloud env object. The returned
@@ -0,0 +1,219 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/compression.h"
+
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "google/protobuf/io/gzip_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+#include "src/globals.h"
+
+#ifdef CLOUD_PROFILER_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+DEFINE_string(cprof_compression, "gzip",
+              "compression of the profiles, gzip or zstd; zstd is only used "
+              "for profiles saved with -cprof_profile_filename");
+DEFINE_int32(cprof_compression_level, -1,
+             "compression level, -1 for the default level of the format");
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// First bytes of a zstd frame.
+const char kZstdMagic[] = "\x28\xb5\x2f\xfd";
+
+class GzipCompressedOutputStream : public CompressedOutputStream {
+ public:
+  GzipCompressedOutputStream(int level, std::string *output)
+      : stream_(output), gzip_stream_(&stream_, GzipOptions(level)) {}
+
+  bool Next(void **data, int *size) override {
+    return gzip_stream_.Next(data, size);
+  }
+  void BackUp(int count) override { gzip_stream_.BackUp(count); }
+  int64_t ByteCount() const override { return gzip_stream_.ByteCount(); }
+  bool Close() override { return gzip_stream_.Close(); }
+
+ private:
+  static google::protobuf::io::GzipOutputStream::Options GzipOptions(
+      int level) {
+    google::protobuf::io::GzipOutputStream::Options options;
+    if (level >= 0) {
+      options.compression_level = level;
+    }
+    return options;
+  }
+
+  google::protobuf::io::StringOutputStream stream_;
+  google::protobuf::io::GzipOutputStream gzip_stream_;
+};
+
+#ifdef CLOUD_PROFILER_HAVE_ZSTD
+
+class ZstdCompressedOutputStream : public CompressedOutputStream {
+ public:
+  ZstdCompressedOutputStream(int level, std::string *output)
+      : output_(output),
+        cctx_(ZSTD_createCCtx()),
+        buffer_(ZSTD_CStreamInSize()) {
+    if (cctx_ == nullptr) {
+      failed_ = true;
+      return;
+    }
+    if (level >= 0) {
+      ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, level);
+    }
+  }
+
+  ~ZstdCompressedOutputStream() override { ZSTD_freeCCtx(cctx_); }
+
+  bool Next(void **data, int *size) override {
+    if (!Compress(ZSTD_e_continue)) {
+      return false;
+    }
+    *data = buffer_.data();
+    *size = buffer_.size();
+    used_ = buffer_.size();
+    byte_count_ += used_;
+    return true;
+  }
+
+  void BackUp(int count) override {
+    used_ -= count;
+    byte_count_ -= count;
+  }
+
+  int64_t ByteCount() const override { return byte_count_; }
+
+  bool Close() override { return Compress(ZSTD_e_end); }
+
+ private:
+  // Compresses the used part of the buffer into the output. With
+  // ZSTD_e_end, also writes out the end of the frame.
+  bool Compress(ZSTD_EndDirective mode) {
+    if (failed_) {
+      return false;
+    }
+    if (used_ == 0 && mode == ZSTD_e_continue) {
+      return true;
+    }
+    ZSTD_inBuffer in = {buffer_.data(), used_, 0};
+    size_t remaining;
+    do {
+      size_t offset = output_->size();
+      size_t capacity = ZSTD_CStreamOutSize();
+      output_->resize(offset + capacity);
+      ZSTD_outBuffer out = {&(*output_)[offset], capacity, 0};
+      remaining = ZSTD_compressStream2(cctx_, &out, &in, mode);
+      output_->resize(offset + out.pos);
+      if (ZSTD_isError(remaining)) {
+        LOG(ERROR) << "zstd compression failed: "
+                   << ZSTD_getErrorName(remaining);
+        failed_ = true;
+        return false;
+      }
+    } while (mode == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+    used_ = 0;
+    return true;
+  }
+
+  std::string *output_;
+  ZSTD_CCtx *cctx_;
+  std::vector<char> buffer_;
+  size_t used_ = 0;
+  int64_t byte_count_ = 0;
+  bool failed_ = false;
+};
+
+#endif  // CLOUD_PROFILER_HAVE_ZSTD
+
+}  // namespace
+
+CompressionOptions CompressionFromFlags(bool allow_zstd) {
+  CompressionOptions options;
+  options.level = FLAGS_cprof_compression_level;
+  if (FLAGS_cprof_compression == "zstd") {
+#ifdef CLOUD_PROFILER_HAVE_ZSTD
+    if (allow_zstd) {
+      options.format = CompressionFormat::kZstd;
+    } else {
+      LOG(WARNING) << "zstd compression is only supported for profiles "
+                   << "saved with -cprof_profile_filename, using gzip";
+    }
+#else
+    LOG(WARNING) << "The agent was built without zstd support, using gzip";
+#endif
+  } else if (FLAGS_cprof_compression != "gzip") {
+    LOG(WARNING) << "Unknown compression '" << FLAGS_cprof_compression
+                 << "', using gzip";
+  }
+  if (options.format == CompressionFormat::kGzip && options.level > 9) {
+    LOG(WARNING) << "gzip compression level " << options.level
+                 << " is out of range, using the default level";
+    options.level = -1;
+  }
+  return options;
+}
+
+std::string CompressionName(const CompressionOptions &options) {
+  std::string name =
+      options.format == CompressionFormat::kZstd ? "zstd" : "gzip";
+  if (options.level >= 0) {
+    name += "-" + std::to_string(options.level);
+  }
+  return name;
+}
+
+std::unique_ptr<CompressedOutputStream> CompressedOutputStream::New(
+    const CompressionOptions &options, std::string *output) {
+#ifdef CLOUD_PROFILER_HAVE_ZSTD
+  if (options.format == CompressionFormat::kZstd) {
+    return std::unique_ptr<CompressedOutputStream>(
+        new ZstdCompressedOutputStream(options.level, output));
+  }
+#endif
+  return std::unique_ptr<CompressedOutputStream>(
+      new GzipCompressedOutputStream(options.level, output));
+}
+
+bool CompressProfile(const perftools::profiles::Profile &profile,
+                     const CompressionOptions &options, std::string *output) {
+  output->clear();
+  std::unique_ptr<CompressedOutputStream> stream =
+      CompressedOutputStream::New(options, output);
+  if (!profile.SerializeToZeroCopyStream(stream.get())) {
+    LOG(ERROR) << "Failed to serialize to " << CompressionName(options)
+               << " stream";
+    return false;
+  }
+  return stream->Close();
+}
+
+const char *ProfileFileExtension(const std::string &profile) {
+  if (profile.compare(0, sizeof(kZstdMagic) - 1, kZstdMagic) == 0) {
+    return ".pb.zst";
+  }
+  return ".pb.gz";
+}
+
+}  // namespace profiler
+}  // namespace cloud
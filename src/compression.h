@@ -0,0 +1,78 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_COMPRESSION_H_
+#define CLOUD_PROFILER_AGENT_JAVA_COMPRESSION_H_
+
+#include <memory>
+#include <string>
+
+#include "google/protobuf/io/zero_copy_stream.h"
+#include "perftools/profiles/proto/builder.h"
+
+namespace cloud {
+namespace profiler {
+
+enum class CompressionFormat {
+  kGzip,
+  // Only available when built with CLOUD_PROFILER_HAVE_ZSTD, and only for
+  // profiles saved to files or GCS: the Cloud Profiler API expects gzip.
+  kZstd,
+};
+
+struct CompressionOptions {
+  CompressionFormat format = CompressionFormat::kGzip;
+  // Compression level, or -1 for the default level of the format.
+  int level = -1;
+};
+
+// Returns the compression set with -cprof_compression and
+// -cprof_compression_level. Falls back to gzip when zstd is requested but
+// not allowed or not available.
+CompressionOptions CompressionFromFlags(bool allow_zstd);
+
+// Returns a description of the compression, e.g. "gzip-6", for logging.
+std::string CompressionName(const CompressionOptions &options);
+
+// Output stream compressing the data written to it into a string.
+class CompressedOutputStream
+    : public google::protobuf::io::ZeroCopyOutputStream {
+ public:
+  // Returns a stream appending the data compressed as per options to
+  // output, which must outlive it.
+  static std::unique_ptr<CompressedOutputStream> New(
+      const CompressionOptions &options, std::string *output);
+
+  // Writes out the end of the compressed data. Returns false if there were
+  // errors on the compression, and the output string will not contain
+  // valid data. No further writes should be made after this.
+  virtual bool Close() = 0;
+};
+
+// Serializes and compresses a profile into a string, replacing its
+// contents. Returns false if there were errors on the serialization or
+// compression.
+bool CompressProfile(const perftools::profiles::Profile &profile,
+                     const CompressionOptions &options, std::string *output);
+
+// Returns the file name extension for a compressed profile, based on the
+// format of its data: ".pb.zst" for zstd and ".pb.gz" otherwise.
+const char *ProfileFileExtension(const std::string &profile);
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_COMPRESSION_H_
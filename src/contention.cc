@@ -0,0 +1,228 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/contention.h"
+
+#include <string.h>
+#include <time.h>
+
+#include <vector>
+
+#include "src/clock.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+using google::javaprofiler::JVMPI_CallFrame;
+using google::javaprofiler::kMaxFramesToCapture;
+
+// Contended entry of a thread, between its MonitorContendedEnter and
+// MonitorContendedEntered events.
+struct PendingEntry {
+  // Entries left to skip before the next sampled one.
+  int countdown = 0;
+  // Window the sampled entry started in, or 0 when the current entry is
+  // not sampled.
+  int64_t window = 0;
+  int64_t start_nanos = 0;
+  int num_frames = 0;
+  JVMPI_CallFrame frames[kMaxFramesToCapture];
+};
+
+// Entry of the current thread, allocated on its first contended entry
+// while collecting, so that only the contending threads pay for the
+// frames, and freed when the thread ends.
+__thread PendingEntry *pending_entry = nullptr;
+
+int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return TimeSpecToNanos(ts);
+}
+
+}  // namespace
+
+jvmtiEnv *ContentionProfiler::jvmti_ = nullptr;
+int ContentionProfiler::sampling_rate_ = 1;
+google::javaprofiler::AsyncSafeTraceMultiset *ContentionProfiler::traces_ =
+    nullptr;
+std::atomic<int64_t> ContentionProfiler::window_(0);
+std::atomic<bool> ContentionProfiler::collecting_(false);
+std::atomic<int64_t> ContentionProfiler::dropped_(0);
+
+void ContentionProfiler::AddCallback(jvmtiEventCallbacks *callbacks) {
+  callbacks->MonitorContendedEnter = &MonitorContendedEnter;
+  callbacks->MonitorContendedEntered = &MonitorContendedEntered;
+}
+
+bool ContentionProfiler::Enable(jvmtiEnv *jvmti, int sampling_rate,
+                                int64_t max_stacks) {
+  jvmtiCapabilities caps;
+  memset(&caps, 0, sizeof(caps));
+  caps.can_generate_monitor_events = 1;
+  if (jvmti->AddCapabilities(&caps) != JVMTI_ERROR_NONE) {
+    LOG(WARNING) << "Failed to add the monitor events capability, disabling "
+                 << "the contention profiling";
+    return false;
+  }
+
+  sampling_rate_ = sampling_rate > 0 ? sampling_rate : 1;
+  traces_ = new google::javaprofiler::AsyncSafeTraceMultiset(max_stacks);
+  jvmti_ = jvmti;
+  return true;
+}
+
+void ContentionProfiler::ThreadEnd() {
+  delete pending_entry;
+  pending_entry = nullptr;
+}
+
+bool ContentionProfiler::Start() {
+  if (!Enabled()) {
+    return false;
+  }
+  window_++;
+  dropped_ = 0;
+  collecting_ = true;
+  if (!SetEvents(JVMTI_ENABLE)) {
+    LOG(ERROR) << "Failed to enable the monitor contention events";
+    collecting_ = false;
+    SetEvents(JVMTI_DISABLE);
+    return false;
+  }
+  return true;
+}
+
+std::unique_ptr<perftools::profiles::Profile> ContentionProfiler::Stop(
+    JNIEnv *jni, int64_t duration_nanos,
+    google::javaprofiler::ProfileFrameCache *cache) {
+  if (!Enabled()) {
+    return nullptr;
+  }
+  collecting_ = false;
+  SetEvents(JVMTI_DISABLE);
+
+  // Extracting also frees the entries of the table for the next window.
+  int64_t max_entries = traces_->MaxEntries();
+  std::vector<std::vector<JVMPI_CallFrame>> frames;
+  std::vector<int32_t> counts;
+  std::vector<int64_t> delays_micros;
+  JVMPI_CallFrame buffer[kMaxFramesToCapture];
+  for (int64_t i = 0; i < max_entries; i++) {
+    int64_t attr, count, delay_nanos;
+    int num_frames = traces_->Extract(i, &attr, kMaxFramesToCapture, buffer,
+                                      &count, &delay_nanos);
+    if (num_frames > 0 && count > 0) {
+      frames.emplace_back(buffer, buffer + num_frames);
+      counts.push_back(count);
+      delays_micros.push_back(delay_nanos / 1000);
+    }
+  }
+  if (dropped_ > 0) {
+    LOG(WARNING) << "Dropped " << dropped_ << " contention samples, the "
+                 << "table of " << max_entries << " stacks was full";
+  }
+
+  std::vector<JVMPI_CallTrace> calltraces(frames.size());
+  std::vector<google::javaprofiler::ProfileStackTrace> traces;
+  traces.reserve(frames.size());
+  for (size_t i = 0; i < frames.size(); i++) {
+    calltraces[i].env_id = jni;
+    calltraces[i].num_frames = frames[i].size();
+    calltraces[i].frames = frames[i].data();
+    traces.emplace_back(&calltraces[i], delays_micros[i]);
+  }
+
+  std::unique_ptr<google::javaprofiler::ProfileProtoBuilder> builder =
+      google::javaprofiler::ProfileProtoBuilder::ForContention(
+          jni, jvmti_, duration_nanos, sampling_rate_, cache);
+  builder->AddTraces(traces.data(), counts.data(), traces.size());
+  return builder->CreateProto();
+}
+
+bool ContentionProfiler::SetEvents(jvmtiEventMode mode) {
+  bool ok = true;
+  for (jvmtiEvent event : {JVMTI_EVENT_MONITOR_CONTENDED_ENTER,
+                           JVMTI_EVENT_MONITOR_CONTENDED_ENTERED}) {
+    if (jvmti_->SetEventNotificationMode(mode, event, nullptr) !=
+        JVMTI_ERROR_NONE) {
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+void JNICALL ContentionProfiler::MonitorContendedEnter(jvmtiEnv *jvmti,
+                                                       JNIEnv *jni,
+                                                       jthread thread,
+                                                       jobject object) {
+  PendingEntry *pending = pending_entry;
+  if (pending != nullptr) {
+    pending->window = 0;
+  }
+  if (!collecting_.load(std::memory_order_relaxed)) {
+    return;
+  }
+  if (pending == nullptr) {
+    pending = new PendingEntry();
+    pending_entry = pending;
+  }
+  PendingEntry &entry = *pending;
+  if (entry.countdown <= 0) {
+    // Spread the first sample of each thread over the sampling period.
+    entry.countdown =
+        1 + (reinterpret_cast<uintptr_t>(&entry) >> 6) % sampling_rate_;
+  }
+  if (--entry.countdown > 0) {
+    return;
+  }
+  entry.countdown = sampling_rate_;
+
+  entry.num_frames = google::javaprofiler::Asgct::GetCurrentThreadTrace(
+      jni, kMaxFramesToCapture, entry.frames);
+  if (entry.num_frames <= 0) {
+    // Keep the delay under an unknown frame.
+    entry.frames[0] = JVMPI_CallFrame{0, nullptr};
+    entry.num_frames = 1;
+  }
+  entry.window = window_.load(std::memory_order_relaxed);
+  entry.start_nanos = NowNanos();
+}
+
+void JNICALL ContentionProfiler::MonitorContendedEntered(jvmtiEnv *jvmti,
+                                                         JNIEnv *jni,
+                                                         jthread thread,
+                                                         jobject object) {
+  if (pending_entry == nullptr || pending_entry->window == 0) {
+    return;
+  }
+  PendingEntry &entry = *pending_entry;
+  int64_t delay_nanos = NowNanos() - entry.start_nanos;
+  bool current = entry.window == window_.load(std::memory_order_relaxed) &&
+                 collecting_.load(std::memory_order_relaxed);
+  entry.window = 0;
+  if (!current) {
+    return;
+  }
+
+  JVMPI_CallTrace trace = {jni, entry.num_frames, entry.frames};
+  if (!traces_->Add(0, &trace, 1, delay_nanos)) {
+    dropped_++;
+  }
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_CONTENTION_H_
+#define CLOUD_PROFILER_AGENT_JAVA_CONTENTION_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+#include "src/globals.h"
+#include "third_party/javaprofiler/profile_proto_builder.h"
+#include "third_party/javaprofiler/stacktraces.h"
+
+namespace cloud {
+namespace profiler {
+
+// Collects profiles of the time threads wait to enter contended Java
+// monitors, from the JVMTI MonitorContendedEnter and MonitorContendedEntered
+// events, which are only enabled while a profile is collected.
+//
+// One in sampling_rate contended entries of each thread is sampled: its
+// stack is captured on MonitorContendedEnter, before the thread blocks, so
+// that MonitorContendedEntered, run with the monitor held, only has to
+// aggregate the delay into a fixed table of stacks. Sampled delays are
+// weighted by sampling_rate in the profile.
+class ContentionProfiler {
+ public:
+  // Sets the JVMTI callbacks of the monitor events.
+  static void AddCallback(jvmtiEventCallbacks *callbacks);
+
+  // Adds the JVMTI capability of the monitor events and allocates the
+  // table of up to max_stacks distinct stacks. Returns whether contention
+  // profiles can be collected.
+  static bool Enable(jvmtiEnv *jvmti, int sampling_rate, int64_t max_stacks);
+
+  static bool Enabled() { return jvmti_ != nullptr; }
+
+  // Frees the state of the current thread, from its ThreadEnd event.
+  static void ThreadEnd();
+
+  // Starts counting the contended monitor entries.
+  static bool Start();
+
+  // Stops counting, and returns the profile of the entries counted since
+  // Start(), over duration_nanos. Frames are symbolized with cache.
+  static std::unique_ptr<perftools::profiles::Profile> Stop(
+      JNIEnv *jni, int64_t duration_nanos,
+      google::javaprofiler::ProfileFrameCache *cache);
+
+ private:
+  static void JNICALL MonitorContendedEnter(jvmtiEnv *jvmti, JNIEnv *jni,
+                                            jthread thread, jobject object);
+  static void JNICALL MonitorContendedEntered(jvmtiEnv *jvmti, JNIEnv *jni,
+                                              jthread thread, jobject object);
+
+  static bool SetEvents(jvmtiEventMode mode);
+
+  static jvmtiEnv *jvmti_;
+  static int sampling_rate_;
+  // Distinct stacks and their summed delays, in nanoseconds. Allocated by
+  // Enable() and never freed, as callbacks may still be running when a
+  // collection stops.
+  static google::javaprofiler::AsyncSafeTraceMultiset *traces_;
+  // Incremented by Start(), so that entries started in an earlier window
+  // are not counted in the current one.
+  static std::atomic<int64_t> window_;
+  static std::atomic<bool> collecting_;
+  // Sampled entries dropped because traces_ was full.
+  static std::atomic<int64_t> dropped_;
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_CONTENTION_H_
@@ -17,32 +17,115 @@
 #include <string>
 #include <vector>
 
+#include "src/contention.h"
 #include "src/globals.h"
+#include "src/jit_code_map.h"
+#include "src/jvm_activity.h"
+#include "src/method_ids.h"
+#include "src/native_unwinder.h"
 #include "src/string.h"
+#include "src/thread_context.h"
+#include "src/virtual_threads.h"
 #include "src/worker.h"
 #include "third_party/javaprofiler/accessors.h"
 #include "third_party/javaprofiler/globals.h"
 #include "third_party/javaprofiler/heap_sampler.h"
 #include "third_party/javaprofiler/stacktraces.h"
+#include "third_party/javaprofiler/tags.h"
 
 DEFINE_bool(cprof_cpu_use_per_thread_timers, false,
             "when true, use per-thread CLOCK_THREAD_CPUTIME_ID timers; "
             "only profiles Java threads, non-Java threads will be missed. "
             "This flag is ignored on Alpine.");
+DEFINE_string(cprof_cpu_perf_event, "",
+              "when set to 'task-clock' or 'cycles', use per-thread perf "
+              "events of that kind to drive CPU sampling, falling back to "
+              "per-thread timers where perf events cannot be opened; only "
+              "profiles Java threads.");
 DEFINE_bool(cprof_force_debug_non_safepoints, true,
             "when true, force DebugNonSafepoints flag by subscribing to the"
             "code generation events. This improves the accuracy of profiles,"
             "but may incur a bit of overhead.");
+DEFINE_bool(cprof_jit_code_map, true,
+            "when true, map the code of the JIT-compiled methods from the "
+            "code generation events, to attribute the CPU and wall samples "
+            "whose Java stack cannot be walked to the method they hit");
 DEFINE_bool(cprof_enable_heap_sampling, false,
             "when unset, heap allocation sampling is disabled");
 DEFINE_int32(cprof_heap_sampling_interval, 512 * 1024,
              "sampling interval for heap allocation sampling, 512k by default");
+DEFINE_int32(cprof_heap_sampling_target_rate, 0,
+             "when set, adjust the heap sampling interval so that about this "
+             "many allocations are sampled per second");
+DEFINE_int32(cprof_heap_sampling_min_interval, 32 * 1024,
+             "minimum heap sampling interval with "
+             "-cprof_heap_sampling_target_rate");
+DEFINE_int32(cprof_heap_sampling_max_interval, 16 * 1024 * 1024,
+             "maximum heap sampling interval with "
+             "-cprof_heap_sampling_target_rate");
+DEFINE_int32(cprof_heap_alloc_max_stacks, 4096,
+             "maximum number of distinct stacks counted in a heap allocation "
+             "profile");
+DEFINE_int32(cprof_heap_max_memory_mb, 64,
+             "memory budget of the live heap samples, in megabytes; over it, "
+             "fewer samples are tracked and weighted up; 0 for no limit");
+DEFINE_bool(cprof_heap_fast_stacks, true,
+            "capture the stacks of heap samples with AsyncGetCallTrace "
+            "rather than JVMTI GetStackTrace");
+DEFINE_bool(cprof_enable_contention_profiling, false,
+            "when set, also collect profiles of the time spent waiting to "
+            "enter contended Java monitors");
+DEFINE_int32(cprof_contention_sampling_rate, 10,
+             "sample one in this many contended monitor entries of each "
+             "thread for contention profiling");
+DEFINE_int32(cprof_contention_max_stacks, 4096,
+             "maximum number of distinct stacks counted in a contention "
+             "profile");
+DEFINE_bool(cprof_virtual_threads, false,
+            "when true, on JDK 21 and later, label the CPU and wall samples "
+            "of the carrier threads with the id of the virtual thread they "
+            "run, and add the time the virtual threads spend unmounted to "
+            "the wall profiles");
+DEFINE_int32(cprof_virtual_thread_sampling_rate, 100,
+             "sample one in this many virtual thread unmounts of each "
+             "carrier thread for the wall profiles");
+DEFINE_int32(cprof_virtual_thread_max_parked, 512,
+             "maximum number of sampled unmounted virtual threads tracked "
+             "at once for the wall profiles");
+DEFINE_bool(cprof_jvm_activity_samples, false,
+            "when true, add the GC pauses and the JIT compiler threads CPU "
+            "time of each collection to the CPU and wall profiles, as "
+            "artificial samples");
+DEFINE_bool(cprof_defer_method_id_priming, true,
+            "when true, create the jmethodIDs of the classes loaded before "
+            "VM init from the worker thread, before it starts profiling, "
+            "rather than during VM init. Ignored when the heap samples get "
+            "their stacks from AsyncGetCallTrace, as they are taken as "
+            "soon as VM init.");
+DEFINE_bool(cprof_lazy_activation, false,
+            "when true, only enable the class events and create the "
+            "jmethodIDs of the loaded classes once the first profile is "
+            "due, for processes which may never get profiled. Ignored when "
+            "the heap samples get their stacks from AsyncGetCallTrace.");
 
 namespace cloud {
 namespace profiler {
 
 static Worker *worker;
 
+// Whether the JVMTI capability of the virtual threads was added on load.
+static bool virtual_threads_capable;
+
+// Whether the heap samples, taken from VM init on, capture their stacks with
+// AsyncGetCallTrace, which needs the jmethodIDs of the loaded classes.
+static bool HeapSamplesUseAsgct() {
+  return FLAGS_cprof_enable_heap_sampling && FLAGS_cprof_heap_fast_stacks;
+}
+
+static bool LazyActivation() {
+  return FLAGS_cprof_lazy_activation && !HeapSamplesUseAsgct();
+}
+
 // ThreadStart / ThreadEnd events may arrive after VMDeath event which destroys
 // the worker, so managing the lifetime of the thread table is a bit tricky.
 // Just make it a global singleton cleared up when the process exit.
@@ -53,15 +136,19 @@ static void JNICALL OnThreadStart(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
   IMPLICITLY_USE(jvmti_env);
   IMPLICITLY_USE(thread);
   google::javaprofiler::Accessors::SetCurrentJniEnv(jni_env);
+  google::javaprofiler::Accessors::InitTags();
+  NativeUnwinder::RegisterCurrentThread();
   threads->RegisterCurrent();
 }
 
 static void JNICALL OnThreadEnd(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
                                 jthread thread) {
   IMPLICITLY_USE(jvmti_env);
-  IMPLICITLY_USE(jni_env);
   IMPLICITLY_USE(thread);
   google::javaprofiler::Accessors::SetCurrentJniEnv(nullptr);
+  google::javaprofiler::Accessors::DestroyTags();
+  ThreadContext::Unregister(jni_env);
+  ContentionProfiler::ThreadEnd();
   threads->UnregisterCurrent();
 }
 
@@ -82,54 +169,81 @@ static void JNICALL OnCompiledMethodLoad(jvmtiEnv *jvmti_env, jmethodID method,
                                          const void *compile_info) {
   // The callback is here to enable DebugNonSafepoints by default. See
   // https://stackoverflow.com/questions/37298962/how-can-jvmti-agent-set-a-jvm-flag-on-startup.
+  // It also maps the code of the method, see JitCodeMap.
   IMPLICITLY_USE(jvmti_env);
-  IMPLICITLY_USE(method);
-  IMPLICITLY_USE(code_size);
-  IMPLICITLY_USE(code_addr);
   IMPLICITLY_USE(map_length);
   IMPLICITLY_USE(map);
   IMPLICITLY_USE(compile_info);
+  if (FLAGS_cprof_jit_code_map) {
+    JitCodeMap::Add(method, code_addr, code_size);
+  }
+  JvmActivity::MethodCompiled();
 }
 
-// Calls GetClassMethods on a given class to force the creation of
-// jmethodIDs of it.
-void CreateJMethodIDsForClass(jvmtiEnv *jvmti, jclass klass) {
-  jint method_count;
-  google::javaprofiler::JvmtiScopedPtr<jmethodID> methods(jvmti);
-  jvmtiError e = jvmti->GetClassMethods(klass, &method_count, methods.GetRef());
-  if (e != JVMTI_ERROR_NONE && e != JVMTI_ERROR_CLASS_NOT_PREPARED) {
-    // JVMTI_ERROR_CLASS_NOT_PREPARED is okay because some classes may
-    // be loaded but not prepared at this point.
-    google::javaprofiler::JvmtiScopedPtr<char> ksig(jvmti);
-    JVMTI_ERROR((jvmti->GetClassSignature(klass, ksig.GetRef(), nullptr)));
-    LOG(ERROR) << "Failed to create method IDs for methods in class "
-               << ksig.Get() << " with error " << e;
-  }
+static void JNICALL OnCompiledMethodUnload(jvmtiEnv *jvmti_env,
+                                           jmethodID method,
+                                           const void *code_addr) {
+  IMPLICITLY_USE(jvmti_env);
+  JitCodeMap::Remove(method, code_addr);
 }
 
 void JNICALL OnVMInit(jvmtiEnv *jvmti, JNIEnv *jni_env, jthread thread) {
   IMPLICITLY_USE(thread);
   LOG(INFO) << "On VM init";
-  // Forces the creation of jmethodIDs of the classes that had already
-  // been loaded (eg java.lang.Object, java.lang.ClassLoader) and
-  // OnClassPrepare() misses.
-  jint class_count;
-  google::javaprofiler::JvmtiScopedPtr<jclass> classes(jvmti);
-  JVMTI_ERROR((jvmti->GetLoadedClasses(&class_count, classes.GetRef())));
-  jclass *class_list = classes.Get();
-  for (int i = 0; i < class_count; ++i) {
-    jclass klass = class_list[i];
-    CreateJMethodIDsForClass(jvmti, klass);
+  // The jmethodIDs of the classes that had already been loaded (eg
+  // java.lang.Object, java.lang.ClassLoader) and OnClassPrepare() misses
+  // must be created before any stack is captured with AsyncGetCallTrace.
+  // Unless the heap samples capture them from now on, the worker does it
+  // before it starts profiling, off the VM init path.
+  Worker::Activation activation = Worker::kActive;
+  if (LazyActivation()) {
+    activation = Worker::kLazy;
+  } else if (FLAGS_cprof_defer_method_id_priming && !HeapSamplesUseAsgct()) {
+    activation = Worker::kPrimeLoadedClasses;
+  }
+  if (activation == Worker::kActive) {
+    jint class_count;
+    google::javaprofiler::JvmtiScopedPtr<jclass> classes(jvmti);
+    JVMTI_ERROR((jvmti->GetLoadedClasses(&class_count, classes.GetRef())));
+    jclass *class_list = classes.Get();
+    for (int i = 0; i < class_count; ++i) {
+      jclass klass = class_list[i];
+      CreateJMethodIDsForClass(jvmti, klass);
+    }
   }
 
   if (FLAGS_cprof_enable_heap_sampling) {
+    google::javaprofiler::HeapMonitor::SetAdaptiveSampling(
+        FLAGS_cprof_heap_sampling_target_rate,
+        FLAGS_cprof_heap_sampling_min_interval,
+        FLAGS_cprof_heap_sampling_max_interval);
     if (!google::javaprofiler::HeapMonitor::Enable(
-            jvmti, jni_env, FLAGS_cprof_heap_sampling_interval)) {
+            jvmti, jni_env, FLAGS_cprof_heap_sampling_interval,
+            4096 /* max_garbage_size */, FLAGS_cprof_heap_fast_stacks,
+            FLAGS_cprof_heap_alloc_max_stacks,
+            static_cast<int64_t>(FLAGS_cprof_heap_max_memory_mb) << 20)) {
       LOG(WARNING) << "Failed to start HeapMonitor.";
     }
   }
 
-  worker->Start(jni_env);
+  if (FLAGS_cprof_jvm_activity_samples && !JvmActivity::Enable(jvmti)) {
+    LOG(WARNING) << "Failed to enable the JVM activity accounting.";
+  }
+
+  if (FLAGS_cprof_enable_contention_profiling &&
+      !ContentionProfiler::Enable(jvmti, FLAGS_cprof_contention_sampling_rate,
+                                  FLAGS_cprof_contention_max_stacks)) {
+    LOG(WARNING) << "Failed to enable the contention profiling.";
+  }
+
+  if (virtual_threads_capable &&
+      !VirtualThreads::Enable(jvmti, jni_env,
+                              FLAGS_cprof_virtual_thread_sampling_rate,
+                              FLAGS_cprof_virtual_thread_max_parked)) {
+    LOG(WARNING) << "Failed to enable the virtual threads tracking.";
+  }
+
+  worker->Start(jni_env, activation);
 }
 
 void JNICALL OnClassPrepare(jvmtiEnv *jvmti_env, JNIEnv *jni_env,
@@ -170,7 +284,7 @@ static bool PrepareJvmti(JavaVM *vm, jvmtiEnv *jvmti) {
   caps.can_get_line_numbers = 1;
   caps.can_get_bytecodes = 1;
   caps.can_get_constant_pool = 1;
-  if (FLAGS_cprof_force_debug_non_safepoints) {
+  if (FLAGS_cprof_force_debug_non_safepoints || FLAGS_cprof_jit_code_map) {
     caps.can_generate_compiled_method_load_events = 1;
   }
 
@@ -214,17 +328,28 @@ static bool RegisterJvmti(jvmtiEnv *jvmti) {
   callbacks.ClassPrepare = &OnClassPrepare;
 
   google::javaprofiler::HeapMonitor::AddCallback(&callbacks);
+  ContentionProfiler::AddCallback(&callbacks);
+  // Last, as it chains to the garbage collection callback of the heap
+  // monitor.
+  JvmActivity::AddCallback(&callbacks);
 
+  // The thread events cannot wait for a lazy activation: a thread only
+  // gets profiled if it was registered when it started.
   std::vector<jvmtiEvent> events = {
-      JVMTI_EVENT_CLASS_LOAD, JVMTI_EVENT_CLASS_PREPARE,
-      JVMTI_EVENT_THREAD_END, JVMTI_EVENT_THREAD_START,
-      JVMTI_EVENT_VM_DEATH,   JVMTI_EVENT_VM_INIT,
+      JVMTI_EVENT_THREAD_END,
+      JVMTI_EVENT_THREAD_START,
+      JVMTI_EVENT_VM_DEATH,
+      JVMTI_EVENT_VM_INIT,
   };
 
-  if (FLAGS_cprof_force_debug_non_safepoints) {
+  if (FLAGS_cprof_force_debug_non_safepoints || FLAGS_cprof_jit_code_map) {
     callbacks.CompiledMethodLoad = &OnCompiledMethodLoad;
     events.push_back(JVMTI_EVENT_COMPILED_METHOD_LOAD);
   }
+  if (FLAGS_cprof_jit_code_map) {
+    callbacks.CompiledMethodUnload = &OnCompiledMethodUnload;
+    events.push_back(JVMTI_EVENT_COMPILED_METHOD_UNLOAD);
+  }
 
   JVMTI_ERROR_1(
       (jvmti->SetEventCallbacks(&callbacks, sizeof(jvmtiEventCallbacks))),
@@ -237,6 +362,10 @@ static bool RegisterJvmti(jvmtiEnv *jvmti) {
         (jvmti->SetEventNotificationMode(JVMTI_ENABLE, events[i], nullptr)),
         false);
   }
+  // Otherwise enabled by the worker thread once activated.
+  if (!LazyActivation() && !EnableClassEvents(jvmti)) {
+    return false;
+  }
 
   return true;
 }
@@ -276,6 +405,9 @@ jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
             << CLOUD_PROFILER_AGENT_VERSION;
   LOG(INFO) << "Profiler agent loaded";
   google::javaprofiler::AttributeTable::Init();
+  // Before the thread events, which allocate the tags of each thread.
+  google::javaprofiler::AsyncRefCountedString::Init();
+  google::javaprofiler::Tags::Init();
 
   // Try to get the latest JVMTI_VERSION the agent was built with.
   err = vm->GetEnv(reinterpret_cast<void **>(&jvmti), JVMTI_VERSION);
@@ -293,19 +425,26 @@ jint JNICALL Agent_OnLoad(JavaVM *vm, char *options, void *reserved) {
     LOG(ERROR) << "Failed to initialize JVMTI.  Continuing...";
     return 0;
   }
+  // Only available on load, and apart as the JVM may not support it.
+  virtual_threads_capable =
+      FLAGS_cprof_virtual_threads && VirtualThreads::AddCapability(jvmti);
 
   // The process exit will free the memory. See comments to the variable on why.
   // Initialize before registering the JVMTI callbacks to avoid the unlikely
   // race of getting thread events before the thread table is born.
+  bool use_perf_events = !FLAGS_cprof_cpu_perf_event.empty();
 #ifdef ALPINE
-  // musl does not support SIGEV_THREAD_ID. Disable per thread timers.
+  // musl does not support SIGEV_THREAD_ID. Disable per thread timers, perf
+  // events do not depend on it.
   if (FLAGS_cprof_cpu_use_per_thread_timers) {
     LOG(WARNING) << "Per thread timers not available in Alpine. "
                  << "Ignoring '-cprof_cpu_use_per_thread_timers' flag.";
   }
-  threads = new ThreadTable(false);
+  threads = new ThreadTable(use_perf_events, FLAGS_cprof_cpu_perf_event);
 #else
-  threads = new ThreadTable(FLAGS_cprof_cpu_use_per_thread_timers);
+  threads = new ThreadTable(
+      FLAGS_cprof_cpu_use_per_thread_timers || use_perf_events,
+      FLAGS_cprof_cpu_perf_event);
 #endif
 
   if (!RegisterJvmti(jvmti)) {
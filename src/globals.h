@@ -64,12 +64,14 @@ using google::javaprofiler::kNotWalkableFrameJava;
 using google::javaprofiler::kNotWalkableFrameNotJava;
 using google::javaprofiler::kSafepoint;
 using google::javaprofiler::kThreadExit;
+using google::javaprofiler::kTruncatedStack;
 using google::javaprofiler::kUnknownJava;
 using google::javaprofiler::kUnknownNotJava;
 using google::javaprofiler::kUnknownState;
 
 using google::javaprofiler::kCallTraceErrorLineNum;
 using google::javaprofiler::kMaxFramesToCapture;
+using google::javaprofiler::kMaxStackDepth;
 using google::javaprofiler::kNativeFrameLineNum;
 using google::javaprofiler::kNumCallTraceErrors;
 
@@ -14,7 +14,9 @@
 
 #include "src/http.h"
 
+#include <mutex>  // NOLINT(build/c++11)
 #include <string>
+#include <vector>
 
 #include "curl/curl.h"
 
@@ -23,8 +25,97 @@ namespace profiler {
 
 typedef long curl_long_t;  // NOLINT 'long'
 
+namespace {
+
+// Max number of idle easy handles kept for reuse.
+const size_t kMaxIdleHandles = 4;
+
+// The easy handles of the requests, along with their connections. A
+// finished request returns its handle, which keeps its connections alive
+// for the next request to the same host, sparing it the TCP and TLS
+// handshakes. The handles share their DNS cache and TLS sessions, but
+// not their connections: libcurl does not support sharing them across
+// threads.
+class HandlePool {
+ public:
+  HandlePool() : share_(curl_share_init()) {
+    if (share_ == nullptr) {
+      LOG(ERROR) << "Failed to initialize the curl share handle";
+      return;
+    }
+    curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, &Lock);
+    curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, &Unlock);
+    curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  }
+
+  // This type is neither copyable nor movable.
+  HandlePool(const HandlePool&) = delete;
+  HandlePool& operator=(const HandlePool&) = delete;
+
+  // Returns an idle handle, or a new one, or null on error.
+  CURL* Acquire() {
+    CURL* curl = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!idle_.empty()) {
+        curl = idle_.back();
+        idle_.pop_back();
+      }
+    }
+    if (curl == nullptr) {
+      curl = curl_easy_init();
+      if (curl == nullptr) {
+        return nullptr;
+      }
+    }
+    if (share_ != nullptr) {
+      curl_easy_setopt(curl, CURLOPT_SHARE, share_);
+    }
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    return curl;
+  }
+
+  // Takes back a handle, resetting its options but not its connections.
+  void Release(CURL* curl) {
+    curl_easy_reset(curl);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (idle_.size() < kMaxIdleHandles) {
+        idle_.push_back(curl);
+        return;
+      }
+    }
+    curl_easy_cleanup(curl);
+  }
+
+ private:
+  static void Lock(CURL* curl, curl_lock_data data, curl_lock_access access,
+                   void* pool) {
+    static_cast<HandlePool*>(pool)->share_mutexes_[data].lock();
+  }
+
+  static void Unlock(CURL* curl, curl_lock_data data, void* pool) {
+    static_cast<HandlePool*>(pool)->share_mutexes_[data].unlock();
+  }
+
+  CURLSH* share_;
+  std::mutex share_mutexes_[CURL_LOCK_DATA_LAST];
+  std::mutex mutex_;
+  std::vector<CURL*> idle_;
+};
+
+// Never destroyed, as requests may still be made while the process exits.
+HandlePool* Handles() {
+  static HandlePool* pool = new HandlePool();
+  return pool;
+}
+
+}  // namespace
+
 HTTPRequest::HTTPRequest() : headers_(nullptr) {
-  curl_ = curl_easy_init();
+  curl_ = Handles()->Acquire();
   if (!curl_) {
     LOG(ERROR) << "Failed to initialize curl";
   }
@@ -36,7 +127,7 @@ HTTPRequest::~HTTPRequest() {
     headers_ = nullptr;
   }
   if (curl_) {
-    curl_easy_cleanup(curl_);
+    Handles()->Release(curl_);
     curl_ = nullptr;
   }
 }
@@ -67,6 +158,8 @@ bool HTTPRequest::DoGet(const std::string& url, std::string* data) {
 }
 
 bool HTTPRequest::DoPut(const std::string& url, const std::string& data) {
+  // Falls back to HTTP/1.1 when libcurl or the server lack HTTP/2.
+  curl_easy_setopt(curl_, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_2TLS);
   curl_easy_setopt(curl_, CURLOPT_CUSTOMREQUEST, "PUT");
   curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, data.c_str());  // does not copy
   curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, (curl_long_t)data.size());
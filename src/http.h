@@ -29,7 +29,9 @@ namespace profiler {
 
 const int kHTTPStatusOK = 200;
 
-// A simple libcurl-based HTTP transport.
+// A simple libcurl-based HTTP transport. The requests draw their handle
+// from a process-wide pool, reusing the keep-alive connections of earlier
+// requests to the same hosts.
 class HTTPRequest {
  public:
   HTTPRequest();
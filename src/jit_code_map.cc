@@ -0,0 +1,186 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/jit_code_map.h"
+
+#include <sched.h>
+
+#include <algorithm>
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Minimum number of pending methods merged into the tables by Add(). The
+// merge copies the tables, so they are merged once the pending methods
+// also reach 1/kMergeRatio of the tables.
+const size_t kMinMergeBatch = 64;
+const size_t kMergeRatio = 8;
+
+}  // namespace
+
+std::mutex JitCodeMap::mutex_;
+std::vector<JitCodeMap::Range> JitCodeMap::pending_;
+JitCodeMap::Table JitCodeMap::tables_[2];
+std::atomic<int> JitCodeMap::active_;
+std::atomic<int> JitCodeMap::readers_[2];
+
+void JitCodeMap::Add(jmethodID method, const void *code_addr,
+                     jint code_size) {
+  if (method == nullptr || code_addr == nullptr || code_size <= 0) {
+    return;
+  }
+  uintptr_t start = reinterpret_cast<uintptr_t>(code_addr);
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_.push_back(Range{start, start + code_size, method});
+  size_t size = tables_[active_.load(std::memory_order_relaxed)].size;
+  if (pending_.size() >= std::max(kMinMergeBatch, size / kMergeRatio)) {
+    MergePending();
+  }
+}
+
+void JitCodeMap::Remove(jmethodID method, const void *code_addr) {
+  uintptr_t start = reinterpret_cast<uintptr_t>(code_addr);
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_.erase(std::remove_if(pending_.begin(), pending_.end(),
+                                [method, start](const Range &range) {
+                                  return range.method == method &&
+                                         range.start == start;
+                                }),
+                 pending_.end());
+  // Clearing the method is a single store readers may observe either
+  // side of, so both tables are updated in place.
+  Clear(&tables_[0], method, start);
+  Clear(&tables_[1], method, start);
+}
+
+void JitCodeMap::Publish() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!pending_.empty()) {
+    MergePending();
+  }
+}
+
+jmethodID JitCodeMap::Find(uintptr_t pc) {
+  // Two attempts, in case a merge makes the other table active between
+  // reading active_ and announcing the read.
+  for (int attempt = 0; attempt < 2; attempt++) {
+    int side = active_.load();
+    readers_[side].fetch_add(1);
+    if (active_.load() != side) {
+      readers_[side].fetch_sub(1);
+      continue;
+    }
+    const Table &table = tables_[side];
+    jmethodID method = nullptr;
+    ptrdiff_t i = Search(table, pc);
+    if (i >= 0 && pc < table.entries[i].end) {
+      method = table.entries[i].method.load(std::memory_order_relaxed);
+    }
+    readers_[side].fetch_sub(1);
+    return method;
+  }
+  return nullptr;
+}
+
+void JitCodeMap::MergePending() {
+  // Stable, for the ranges added last to win over those they overlap.
+  std::stable_sort(
+      pending_.begin(), pending_.end(),
+      [](const Range &a, const Range &b) { return a.start < b.start; });
+  int side = active_.load();
+  int other = 1 - side;
+  // Nobody reads the inactive table: the last merge waited for its
+  // readers to leave, and the ones coming since saw the other one active.
+  MergeInto(&tables_[other]);
+  active_.store(other);
+  while (readers_[side].load() != 0) {
+    sched_yield();
+  }
+  MergeInto(&tables_[side]);
+  pending_.clear();
+}
+
+void JitCodeMap::MergeInto(Table *table) {
+  Entry *entries = new Entry[table->size + pending_.size()];
+  // Whether each merged entry is one of the pending ones.
+  std::vector<bool> added(table->size + pending_.size());
+  size_t size = 0;
+  size_t i = 0;
+  auto pending = pending_.begin();
+  while (i < table->size || pending != pending_.end()) {
+    Range range;
+    bool is_added =
+        pending != pending_.end() &&
+        (i == table->size || pending->start <= table->entries[i].start);
+    if (is_added) {
+      range = *pending;
+      ++pending;
+    } else {
+      const Entry &entry = table->entries[i];
+      range = Range{entry.start, entry.end,
+                    entry.method.load(std::memory_order_relaxed)};
+      i++;
+    }
+    if (range.method == nullptr) {
+      continue;
+    }
+    // The code cache reuses the space of the methods unloaded, whose
+    // unload event may not have arrived yet: the ranges added last win.
+    bool dropped = false;
+    while (size > 0 && entries[size - 1].end > range.start) {
+      if (added[size - 1] && !is_added) {
+        dropped = true;
+        break;
+      }
+      size--;
+    }
+    if (dropped) {
+      continue;
+    }
+    entries[size].start = range.start;
+    entries[size].end = range.end;
+    entries[size].method.store(range.method, std::memory_order_relaxed);
+    added[size] = is_added;
+    size++;
+  }
+  delete[] table->entries;
+  table->entries = entries;
+  table->size = size;
+}
+
+void JitCodeMap::Clear(Table *table, jmethodID method, uintptr_t start) {
+  ptrdiff_t i = Search(*table, start);
+  if (i >= 0 && table->entries[i].start == start &&
+      table->entries[i].method.load(std::memory_order_relaxed) == method) {
+    table->entries[i].method.store(nullptr, std::memory_order_relaxed);
+  }
+}
+
+ptrdiff_t JitCodeMap::Search(const Table &table, uintptr_t pc) {
+  size_t lo = 0, hi = table.size;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (table.entries[mid].start <= pc) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return static_cast<ptrdiff_t>(lo) - 1;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_JIT_CODE_MAP_H_
+#define CLOUD_PROFILER_AGENT_JAVA_JIT_CODE_MAP_H_
+
+#include <jni.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>  // NOLINT(build/c++11)
+#include <vector>
+
+namespace cloud {
+namespace profiler {
+
+// Map of the code ranges of the JIT-compiled methods, maintained from the
+// CompiledMethodLoad and CompiledMethodUnload events, so that the signal
+// handler can tell which method a program counter is in when
+// AsyncGetCallTrace cannot walk the stack.
+//
+// The ranges are kept in two sorted arrays. The signal handler searches
+// the active one, while updates are applied to the other before it is made
+// active, once the readers of the former have left it, and the update is
+// applied to that one in turn. New methods are added in batches, merged
+// into the arrays whenever enough are pending or Publish() is called;
+// unloaded methods are cleared from the arrays right away.
+class JitCodeMap {
+ public:
+  // This type is neither copyable nor movable.
+  JitCodeMap(const JitCodeMap &) = delete;
+  JitCodeMap &operator=(const JitCodeMap &) = delete;
+
+  // Records the code of a compiled method.
+  static void Add(jmethodID method, const void *code_addr, jint code_size);
+
+  // Forgets the code of a method at code_addr.
+  static void Remove(jmethodID method, const void *code_addr);
+
+  // Makes the methods added so far visible to Find().
+  static void Publish();
+
+  // Returns the compiled method whose code contains pc, or null. This is
+  // async-safe.
+  static jmethodID Find(uintptr_t pc);
+
+ private:
+  struct Entry {
+    uintptr_t start;
+    uintptr_t end;
+    // Cleared when the method is unloaded, while readers may look at it.
+    std::atomic<jmethodID> method;
+  };
+
+  struct Table {
+    Entry *entries = nullptr;
+    size_t size = 0;
+  };
+
+  struct Range {
+    uintptr_t start;
+    uintptr_t end;
+    jmethodID method;
+  };
+
+  // Merges the pending ranges into the tables. Requires mutex_.
+  static void MergePending();
+
+  // Merges the pending ranges into table, dropping the cleared entries.
+  static void MergeInto(Table *table);
+
+  // Clears the entry of method at start in table, if any.
+  static void Clear(Table *table, jmethodID method, uintptr_t start);
+
+  // Returns the index of the last entry starting at or before pc, or -1.
+  // This is async-safe.
+  static ptrdiff_t Search(const Table &table, uintptr_t pc);
+
+  static std::mutex mutex_;
+  static std::vector<Range> pending_;  // Guarded by mutex_.
+  static Table tables_[2];
+  static std::atomic<int> active_;
+  static std::atomic<int> readers_[2];
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_JIT_CODE_MAP_H_
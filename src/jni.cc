@@ -14,6 +14,8 @@
 
 #include <jni.h>
 
+#include "src/overhead.h"
+#include "src/thread_context.h"
 #include "src/worker.h"
 #include "third_party/javaprofiler/accessors.h"
 #include "third_party/javaprofiler/stacktraces.h"
@@ -53,3 +55,66 @@ Java_org_apache_beam_runners_dataflow_worker_profiler_Profiler_getAttribute(
   int64_t ret = google::javaprofiler::Accessors::GetAttribute();
   return static_cast<jint>(ret);
 }
+
+extern "C" AGENTEXPORT jstring JNICALL
+Java_org_apache_beam_runners_dataflow_worker_profiler_Profiler_getOverhead(
+    JNIEnv *env, jclass) {
+  std::string summary = cloud::profiler::Overhead::Summary(
+      cloud::profiler::Overhead::Snapshot());
+  return env->NewStringUTF(summary.c_str());
+}
+
+// Sets the tag key of the current thread to value, or clears it if value
+// is null. The samples of the thread are labeled with its tags. Returns
+// false if there is no room left for a new key.
+extern "C" AGENTEXPORT jboolean JNICALL
+Java_org_apache_beam_runners_dataflow_worker_profiler_Profiler_setTag(
+    JNIEnv *env, jclass, jstring key, jstring value) {
+  google::javaprofiler::Tags *tags =
+      google::javaprofiler::Accessors::GetMutableTags();
+  if (tags == nullptr) {
+    // Threads started before the agent was loaded own no tags yet.
+    google::javaprofiler::Accessors::InitTags();
+    tags = google::javaprofiler::Accessors::GetMutableTags();
+  }
+  const char *key_utf = env->GetStringUTFChars(key, nullptr);
+  google::javaprofiler::AsyncRefCountedString value_string;
+  if (value != nullptr) {
+    const char *value_utf = env->GetStringUTFChars(value, nullptr);
+    value_string = google::javaprofiler::AsyncRefCountedString(value_utf);
+    env->ReleaseStringUTFChars(value, value_utf);
+  }
+  bool ret = tags->Set(key_utf, value_string);
+  env->ReleaseStringUTFChars(key, key_utf);
+  return ret ? JNI_TRUE : JNI_FALSE;
+}
+
+extern "C" AGENTEXPORT void JNICALL
+Java_org_apache_beam_runners_dataflow_worker_profiler_Profiler_clearTags(
+    JNIEnv *env, jclass) {
+  google::javaprofiler::Tags *tags =
+      google::javaprofiler::Accessors::GetMutableTags();
+  if (tags != nullptr) {
+    tags->ClearAll();
+  }
+}
+
+// Makes buffer, a direct ByteBuffer in native order, the context of the
+// current thread, or drops it if null. See ThreadContext for its layout.
+extern "C" AGENTEXPORT jboolean JNICALL
+Java_org_apache_beam_runners_dataflow_worker_profiler_Profiler_registerContextBuffer(
+    JNIEnv *env, jclass, jobject buffer) {
+  return cloud::profiler::ThreadContext::Register(env, buffer) ? JNI_TRUE
+                                                               : JNI_FALSE;
+}
+
+// Returns the slot of the thread context buffers holding the value of the
+// tag key, or 0 if all the slots are taken.
+extern "C" AGENTEXPORT jint JNICALL
+Java_org_apache_beam_runners_dataflow_worker_profiler_Profiler_registerContextKey(
+    JNIEnv *env, jclass, jstring key) {
+  const char *key_utf = env->GetStringUTFChars(key, nullptr);
+  int key_id = google::javaprofiler::AttributeTable::RegisterString(key_utf);
+  env->ReleaseStringUTFChars(key, key_utf);
+  return cloud::profiler::ThreadContext::RegisterKey(key_id);
+}
@@ -0,0 +1,158 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/jvm_activity.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "src/clock.h"
+#include "src/threads.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return TimeSpecToNanos(ts);
+}
+
+// Whether a thread name, as truncated by the kernel to 15 characters, is
+// that of a HotSpot C1 or C2 compiler thread, or of a JVMCI one.
+bool IsCompilerThread(const char *name) {
+  return strncmp(name, "C1 CompilerThre", 15) == 0 ||
+         strncmp(name, "C2 CompilerThre", 15) == 0 ||
+         strncmp(name, "JVMCI", 5) == 0;
+}
+
+}  // namespace
+
+bool JvmActivity::enabled_ = false;
+jvmtiEventGarbageCollectionFinish JvmActivity::chained_gc_finish_ = nullptr;
+std::atomic<int64_t> JvmActivity::gc_start_nanos_(0);
+std::atomic<int64_t> JvmActivity::gc_pauses_(0);
+std::atomic<int64_t> JvmActivity::gc_pause_nanos_(0);
+std::atomic<int64_t> JvmActivity::compiled_methods_(0);
+
+JvmActivity::Stats JvmActivity::Stats::Since(const Stats &earlier) const {
+  Stats delta;
+  delta.gc_pauses = gc_pauses - earlier.gc_pauses;
+  delta.gc_pause_nanos = gc_pause_nanos - earlier.gc_pause_nanos;
+  delta.compiled_methods = compiled_methods - earlier.compiled_methods;
+  // Compiler threads may exit, taking their CPU time with them.
+  delta.compiler_cpu_nanos = compiler_cpu_nanos - earlier.compiler_cpu_nanos;
+  if (delta.compiler_cpu_nanos < 0) {
+    delta.compiler_cpu_nanos = 0;
+  }
+  return delta;
+}
+
+void JvmActivity::AddCallback(jvmtiEventCallbacks *callbacks) {
+  chained_gc_finish_ = callbacks->GarbageCollectionFinish;
+  callbacks->GarbageCollectionStart = &GarbageCollectionStart;
+  callbacks->GarbageCollectionFinish = &GarbageCollectionFinish;
+}
+
+bool JvmActivity::Enable(jvmtiEnv *jvmti) {
+  jvmtiCapabilities caps;
+  memset(&caps, 0, sizeof(caps));
+  caps.can_generate_garbage_collection_events = 1;
+  if (jvmti->AddCapabilities(&caps) != JVMTI_ERROR_NONE) {
+    LOG(WARNING) << "Failed to add the garbage collection events capability";
+    return false;
+  }
+  for (jvmtiEvent event : {JVMTI_EVENT_GARBAGE_COLLECTION_START,
+                           JVMTI_EVENT_GARBAGE_COLLECTION_FINISH}) {
+    if (jvmti->SetEventNotificationMode(JVMTI_ENABLE, event, nullptr) !=
+        JVMTI_ERROR_NONE) {
+      LOG(WARNING) << "Failed to enable the garbage collection events";
+      return false;
+    }
+  }
+  enabled_ = true;
+  return true;
+}
+
+JvmActivity::Stats JvmActivity::Snapshot() {
+  Stats stats;
+  stats.gc_pauses = gc_pauses_.load(std::memory_order_relaxed);
+  stats.gc_pause_nanos = gc_pause_nanos_.load(std::memory_order_relaxed);
+  stats.compiled_methods = compiled_methods_.load(std::memory_order_relaxed);
+  stats.compiler_cpu_nanos = CompilerCpuNanos();
+  return stats;
+}
+
+// The events are sent from the VM thread while the application threads
+// are stopped. They must neither block nor call JNI.
+void JNICALL JvmActivity::GarbageCollectionStart(jvmtiEnv *jvmti) {
+  gc_start_nanos_.store(NowNanos(), std::memory_order_relaxed);
+}
+
+void JNICALL JvmActivity::GarbageCollectionFinish(jvmtiEnv *jvmti) {
+  int64_t start_nanos = gc_start_nanos_.exchange(0, std::memory_order_relaxed);
+  if (start_nanos != 0) {
+    gc_pauses_.fetch_add(1, std::memory_order_relaxed);
+    gc_pause_nanos_.fetch_add(NowNanos() - start_nanos,
+                              std::memory_order_relaxed);
+  }
+  if (chained_gc_finish_ != nullptr) {
+    chained_gc_finish_(jvmti);
+  }
+}
+
+int64_t JvmActivity::CompilerCpuNanos() {
+  DIR *dir = opendir("/proc/self/task");
+  if (dir == nullptr) {
+    return 0;
+  }
+  int64_t total = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+      continue;
+    }
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/task/%s/comm", entry->d_name);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      continue;
+    }
+    char name[32];
+    ssize_t len = read(fd, name, sizeof(name) - 1);
+    close(fd);
+    if (len <= 0) {
+      continue;
+    }
+    name[len] = '\0';
+    if (IsCompilerThread(name)) {
+      int64_t cpu_nanos = ThreadCpuTimeNanos(atoi(entry->d_name));
+      if (cpu_nanos > 0) {
+        total += cpu_nanos;
+      }
+    }
+  }
+  closedir(dir);
+  return total;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,84 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_JVM_ACTIVITY_H_
+#define CLOUD_PROFILER_AGENT_JAVA_JVM_ACTIVITY_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// Accounts for the work the JVM does on its own, which the CPU and wall
+// profiles cannot attribute to a Java stack: the garbage collection pauses,
+// timed between the JVMTI GarbageCollectionStart and GarbageCollectionFinish
+// events, and the JIT compilation, measured as the CPU time of the compiler
+// threads and counted by CompiledMethodLoad events when they are enabled.
+class JvmActivity {
+ public:
+  struct Stats {
+    int64_t gc_pauses = 0;
+    int64_t gc_pause_nanos = 0;
+    int64_t compiled_methods = 0;
+    int64_t compiler_cpu_nanos = 0;
+
+    // Returns the activity since an earlier snapshot.
+    Stats Since(const Stats &earlier) const;
+  };
+
+  // Sets the JVMTI callbacks of the garbage collection events, chaining to
+  // those already set. Must be called after the other modules set theirs.
+  static void AddCallback(jvmtiEventCallbacks *callbacks);
+
+  // Adds the JVMTI capability of the garbage collection events and enables
+  // them. Returns whether the activity is accounted for.
+  static bool Enable(jvmtiEnv *jvmti);
+
+  static bool Enabled() { return enabled_; }
+
+  // Counts a method compiled by the JIT, from CompiledMethodLoad.
+  static void MethodCompiled() {
+    compiled_methods_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // Returns the activity since the process started. Not async-safe, as it
+  // lists the threads of the process.
+  static Stats Snapshot();
+
+ private:
+  static void JNICALL GarbageCollectionStart(jvmtiEnv *jvmti);
+  static void JNICALL GarbageCollectionFinish(jvmtiEnv *jvmti);
+
+  // Returns the CPU time used by the live JIT compiler threads.
+  static int64_t CompilerCpuNanos();
+
+  static bool enabled_;
+  // GarbageCollectionFinish callback set before AddCallback().
+  static jvmtiEventGarbageCollectionFinish chained_gc_finish_;
+  static std::atomic<int64_t> gc_start_nanos_;
+  static std::atomic<int64_t> gc_pauses_;
+  static std::atomic<int64_t> gc_pause_nanos_;
+  static std::atomic<int64_t> compiled_methods_;
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_JVM_ACTIVITY_H_
@@ -0,0 +1,181 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/method_cache.h"
+
+#include <utility>
+
+#include "third_party/javaprofiler/stacktrace_fixer.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+void SetNames(const std::string &class_name, const std::string &method_name,
+              const std::string &signature, MethodCache::Method *method) {
+  method->function_name.clear();
+  if (!class_name.empty()) {
+    method->function_name = class_name + ".";
+  }
+  method->function_name += method_name;
+  method->function_name += signature;
+
+  method->simplified_name = method->function_name;
+  google::javaprofiler::SimplifyFunctionName(&method->simplified_name);
+}
+
+}  // namespace
+
+MethodCache::MethodCache(jvmtiEnv *jvmti, int64_t max_entries)
+    : jvmti_(jvmti), max_entries_(max_entries) {}
+
+void MethodCache::BeginProfile(JNIEnv *jni) {
+  if (hits_ + misses_ > 0) {
+    LOG(INFO) << "Method cache: " << methods_.size() << " entries, " << hits_
+              << " hits, " << misses_ << " misses in the last profile";
+  }
+  hits_ = 0;
+  misses_ = 0;
+  if (max_entries_ > 0 && methods_.size() >= max_entries_) {
+    Evict(jni);
+  }
+  generation_++;
+}
+
+MethodCache::Method *MethodCache::Lookup(
+    JNIEnv *jni, const google::javaprofiler::JVMPI_CallFrame &frame,
+    int *line_number) {
+  auto it = methods_.find(frame.method_id);
+  if (it != methods_.end()) {
+    Method *method = &it->second;
+    if (method->generation == generation_ ||
+        IsValid(jni, frame.method_id, *method)) {
+      hits_++;
+      method->generation = generation_;
+      *line_number = LineNumber(frame.method_id, frame.lineno, method);
+      return method;
+    }
+    jni->DeleteWeakGlobalRef(method->declaring_class);
+    methods_.erase(it);
+  }
+
+  misses_++;
+  Method *method = &uncached_;
+  if (max_entries_ == 0 || methods_.size() < max_entries_) {
+    Method resolved;
+    if (Resolve(jni, frame.method_id, &resolved)) {
+      method = &methods_[frame.method_id];
+      *method = std::move(resolved);
+      method->generation = generation_;
+      *line_number = LineNumber(frame.method_id, frame.lineno, method);
+      return method;
+    }
+  }
+
+  // Either the cache is full or the method cannot be tied to a class;
+  // symbolize it without caching.
+  std::string file_name, class_name, method_name, signature;
+  google::javaprofiler::GetStackFrameElements(jni, jvmti_, frame, &file_name,
+                                              &class_name, &method_name,
+                                              &signature, line_number);
+  google::javaprofiler::FixMethodParameters(&signature);
+  SetNames(class_name, method_name, signature, method);
+  method->file_name = file_name;
+  method->function_id = -1;
+  return method;
+}
+
+void MethodCache::Clear(JNIEnv *jni) {
+  for (auto &it : methods_) {
+    jni->DeleteWeakGlobalRef(it.second.declaring_class);
+  }
+  methods_.clear();
+}
+
+void MethodCache::ResetFunctionIds() {
+  for (auto &it : methods_) {
+    it.second.function_id = -1;
+  }
+}
+
+bool MethodCache::Resolve(JNIEnv *jni, jmethodID method_id, Method *method) {
+  jclass declaring_class = nullptr;
+  if (jvmti_->GetMethodDeclaringClass(method_id, &declaring_class) !=
+      JVMTI_ERROR_NONE) {
+    return false;
+  }
+  google::javaprofiler::ScopedLocalRef<jclass> declaring_class_managed(
+      jni, declaring_class);
+
+  std::string file_name, class_name, method_name, signature;
+  google::javaprofiler::JVMPI_CallFrame frame = {0, method_id};
+  google::javaprofiler::GetStackFrameElements(
+      jvmti_, frame, declaring_class, &file_name, &class_name, &method_name,
+      &signature, nullptr);
+  google::javaprofiler::FixMethodParameters(&signature);
+
+  method->declaring_class = jni->NewWeakGlobalRef(declaring_class);
+  if (method->declaring_class == nullptr) {
+    return false;
+  }
+  SetNames(class_name, method_name, signature, method);
+  method->file_name = file_name;
+  return true;
+}
+
+bool MethodCache::IsValid(JNIEnv *jni, jmethodID method_id,
+                          const Method &method) {
+  jclass declaring_class = nullptr;
+  if (jvmti_->GetMethodDeclaringClass(method_id, &declaring_class) !=
+      JVMTI_ERROR_NONE) {
+    return false;
+  }
+  // A collected weak reference compares equal to null only, so this also
+  // catches the unloading of the original class.
+  bool valid = jni->IsSameObject(declaring_class, method.declaring_class);
+  jni->DeleteLocalRef(declaring_class);
+  return valid;
+}
+
+int MethodCache::LineNumber(jmethodID method_id, jint bci, Method *method) {
+  if (bci < 0) {
+    return -1;
+  }
+  if (!method->line_table.Loaded()) {
+    method->line_table.Load(jvmti_, method_id);
+  }
+  return method->line_table.LineNumber(bci);
+}
+
+void MethodCache::Evict(JNIEnv *jni) {
+  // Keep what the last profile used, as the next one likely needs the
+  // same methods.
+  for (auto it = methods_.begin(); it != methods_.end();) {
+    if (it->second.generation != generation_) {
+      jni->DeleteWeakGlobalRef(it->second.declaring_class);
+      it = methods_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  if (methods_.size() >= max_entries_) {
+    Clear(jni);
+  }
+  LOG(INFO) << "Method cache was full, kept " << methods_.size()
+            << " entries";
+}
+
+}  // namespace profiler
+}  // namespace cloud
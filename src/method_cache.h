@@ -0,0 +1,102 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_METHOD_CACHE_H_
+#define CLOUD_PROFILER_AGENT_JAVA_METHOD_CACHE_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+
+#include "src/globals.h"
+#include "third_party/javaprofiler/display.h"
+
+namespace cloud {
+namespace profiler {
+
+// Symbolization data for jmethodIDs, kept across profiles so that each
+// profile only pays the JVMTI cost for methods it has not seen before.
+//
+// jmethodIDs of unloaded classes may be recycled by the JVM for other
+// methods, so entries hold a weak reference to their declaring class and
+// are revalidated on their first use in each profile: an entry is dropped
+// when its class was unloaded or the id now belongs to another class.
+//
+// Not thread-safe; it is only used from the profiler worker thread.
+class MethodCache {
+ public:
+  struct Method {
+    std::string function_name;    // Class.method(params)
+    std::string simplified_name;  // Class.method
+    std::string file_name;
+    // Id of the function in the dictionary of the ProfileProtoBuilder, or
+    // -1 until it is added.
+    int64_t function_id = -1;
+
+    // Internal bookkeeping of the cache.
+    jweak declaring_class = nullptr;
+    int64_t generation = 0;  // Generation of the last validation.
+    google::javaprofiler::LineNumberTable line_table;
+  };
+
+  // At most max_entries methods are kept; 0 disables the limit.
+  MethodCache(jvmtiEnv *jvmti, int64_t max_entries);
+
+  // This type is neither copyable nor movable.
+  MethodCache(const MethodCache &) = delete;
+  MethodCache &operator=(const MethodCache &) = delete;
+
+  // Starts a new profile. Cached entries get revalidated on their first
+  // use, and entries left unused by the previous profiles are evicted
+  // when the cache is full.
+  void BeginProfile(JNIEnv *jni);
+
+  // Returns the symbolization data of the frame's method and stores the
+  // frame's line number in *line_number. The returned pointer stays valid
+  // until the next call to BeginProfile() or Clear().
+  Method *Lookup(JNIEnv *jni,
+                 const google::javaprofiler::JVMPI_CallFrame &frame,
+                 int *line_number);
+
+  // Drops all entries.
+  void Clear(JNIEnv *jni);
+
+  // Resets the function_id of all entries.
+  void ResetFunctionIds();
+
+  int64_t Size() const { return methods_.size(); }
+
+ private:
+  bool Resolve(JNIEnv *jni, jmethodID method_id, Method *method);
+  bool IsValid(JNIEnv *jni, jmethodID method_id, const Method &method);
+  int LineNumber(jmethodID method_id, jint bci, Method *method);
+  void Evict(JNIEnv *jni);
+
+  jvmtiEnv *jvmti_;
+  int64_t max_entries_;
+  int64_t generation_ = 0;
+  std::unordered_map<jmethodID, Method> methods_;
+  // Holds methods resolved when the cache is full.
+  Method uncached_;
+  int64_t hits_ = 0;
+  int64_t misses_ = 0;
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_METHOD_CACHE_H_
@@ -0,0 +1,87 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/method_ids.h"
+
+#include "src/clock.h"
+#include "src/overhead.h"
+
+DEFINE_int32(cprof_method_id_priming_batch, 512,
+             "number of already loaded classes whose jmethodIDs are created "
+             "at once when the priming is deferred to the worker thread");
+DEFINE_int32(cprof_method_id_priming_pause_msec, 5,
+             "pause between two batches of deferred jmethodID priming, in "
+             "milliseconds");
+
+namespace cloud {
+namespace profiler {
+
+void CreateJMethodIDsForClass(jvmtiEnv *jvmti, jclass klass) {
+  ScopedOverheadTimer timer(Overhead::kMethodIdPriming);
+  jint method_count;
+  google::javaprofiler::JvmtiScopedPtr<jmethodID> methods(jvmti);
+  jvmtiError e = jvmti->GetClassMethods(klass, &method_count, methods.GetRef());
+  if (e != JVMTI_ERROR_NONE && e != JVMTI_ERROR_CLASS_NOT_PREPARED) {
+    // JVMTI_ERROR_CLASS_NOT_PREPARED is okay because some classes may
+    // be loaded but not prepared at this point.
+    google::javaprofiler::JvmtiScopedPtr<char> ksig(jvmti);
+    JVMTI_ERROR((jvmti->GetClassSignature(klass, ksig.GetRef(), nullptr)));
+    LOG(ERROR) << "Failed to create method IDs for methods in class "
+               << ksig.Get() << " with error " << e;
+  }
+}
+
+bool EnableClassEvents(jvmtiEnv *jvmti) {
+  for (jvmtiEvent event :
+       {JVMTI_EVENT_CLASS_LOAD, JVMTI_EVENT_CLASS_PREPARE}) {
+    JVMTI_ERROR_1(
+        (jvmti->SetEventNotificationMode(JVMTI_ENABLE, event, nullptr)),
+        false);
+  }
+  return true;
+}
+
+int CreateJMethodIDsForLoadedClasses(jvmtiEnv *jvmti, JNIEnv *jni,
+                                     const std::atomic<bool> *stopping) {
+  jint class_count;
+  google::javaprofiler::JvmtiScopedPtr<jclass> classes(jvmti);
+  JVMTI_ERROR_1((jvmti->GetLoadedClasses(&class_count, classes.GetRef())),
+                0);
+  jclass *class_list = classes.Get();
+  int batch = FLAGS_cprof_method_id_priming_batch > 0
+                  ? FLAGS_cprof_method_id_priming_batch
+                  : class_count;
+  struct timespec pause =
+      NanosToTimeSpec(FLAGS_cprof_method_id_priming_pause_msec *
+                      kNanosPerMilli);
+  int primed = 0;
+  for (int i = 0; i < class_count; ++i) {
+    bool prime = stopping == nullptr || !*stopping;
+    if (prime) {
+      CreateJMethodIDsForClass(jvmti, class_list[i]);
+      primed++;
+    }
+    // The calling thread does not return to Java, which would free the
+    // local references.
+    jni->DeleteLocalRef(class_list[i]);
+    if (prime && primed % batch == 0 && i + 1 < class_count &&
+        FLAGS_cprof_method_id_priming_pause_msec > 0) {
+      DefaultClock()->SleepFor(pause);
+    }
+  }
+  return primed;
+}
+
+}  // namespace profiler
+}  // namespace cloud
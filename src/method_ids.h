@@ -0,0 +1,47 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_METHOD_IDS_H_
+#define CLOUD_PROFILER_AGENT_JAVA_METHOD_IDS_H_
+
+#include <atomic>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+// Calls GetClassMethods on a given class to force the creation of
+// jmethodIDs of it, which AsyncGetCallTrace needs to report its frames.
+// Timed as Overhead::kMethodIdPriming.
+void CreateJMethodIDsForClass(jvmtiEnv *jvmti, jclass klass);
+
+// Enables the ClassLoad event, without which AsyncGetCallTrace reports no
+// frame, and the ClassPrepare one, which creates the jmethodIDs of the
+// classes prepared from then on. Returns false on error.
+bool EnableClassEvents(jvmtiEnv *jvmti);
+
+// Forces the creation of the jmethodIDs of the classes loaded so far, in
+// batches of --cprof_method_id_priming_batch classes paced so as not to
+// hold back the application threads loading classes meanwhile. Stops
+// early once stopping is set. Returns the number of classes primed.
+int CreateJMethodIDsForLoadedClasses(jvmtiEnv *jvmti, JNIEnv *jni,
+                                     const std::atomic<bool> *stopping);
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_METHOD_IDS_H_
@@ -0,0 +1,358 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/native_symbols.h"
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Rough per-entry overhead of the hash maps, for the memory accounting.
+const int64_t kEntryOverheadBytes = 64;
+
+// Read-only mapping of a file, unmapped when going out of scope.
+class MappedFile {
+ public:
+  explicit MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *data =
+          mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (data != MAP_FAILED) {
+        data_ = static_cast<const char *>(data);
+        size_ = st.st_size;
+      }
+    }
+    close(fd);
+  }
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  // This type is neither copyable nor movable.
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // Returns a pointer to count objects of type T at offset, or null when
+  // they are not within the file.
+  template <typename T>
+  const T *At(uint64_t offset, uint64_t count = 1) const {
+    if (data_ == nullptr || offset > size_ ||
+        count > (size_ - offset) / sizeof(T)) {
+      return nullptr;
+    }
+    return reinterpret_cast<const T *>(data_ + offset);
+  }
+
+  uint64_t Size() const { return size_; }
+
+ private:
+  const char *data_ = nullptr;
+  uint64_t size_ = 0;
+};
+
+std::string Demangle(const char *name) {
+  int status = 0;
+  char *demangled = abi::__cxa_demangle(name, nullptr, nullptr, &status);
+  if (demangled == nullptr) {
+    return name;
+  }
+  std::string result(demangled);
+  free(demangled);
+  return result;
+}
+
+}  // namespace
+
+NativeSymbolCache::NativeSymbolCache(
+    const google::javaprofiler::NativeProcessInfo *native_info,
+    int64_t max_bytes)
+    : native_info_(native_info), max_bytes_(max_bytes) {}
+
+const std::string &NativeSymbolCache::FunctionName(uint64_t address) {
+  if (native_info_->Generation() != native_info_generation_) {
+    // Addresses may now belong to other files.
+    native_info_generation_ = native_info_->Generation();
+    bytes_ -= functions_bytes_;
+    functions_bytes_ = 0;
+    functions_.clear();
+  }
+  lookups_++;
+
+  auto it = functions_.find(address);
+  if (it != functions_.end()) {
+    return it->second;
+  }
+
+  int index = native_info_->Find(address - 1);
+  if (index < 0) {
+    return unknown_;
+  }
+  const google::javaprofiler::NativeProcessInfo::Mapping &mapping =
+      native_info_->Mappings()[index];
+  SymbolTable *table = Table(mapping.name);
+  if (table == nullptr) {
+    return unknown_;
+  }
+  // A return address points past its call, which may be the start of the
+  // next function.
+  const char *name =
+      Lookup(*table, address - 1 - mapping.start + mapping.offset);
+  if (name == nullptr) {
+    return unknown_;
+  }
+
+  std::string demangled = Demangle(name);
+  int64_t bytes = AddressBytes(demangled);
+  if (max_bytes_ > 0 && bytes_ + bytes > max_bytes_) {
+    Trim(bytes);
+  }
+  std::string &cached = functions_[address];
+  cached = std::move(demangled);
+  functions_bytes_ += bytes;
+  bytes_ += bytes;
+  return cached;
+}
+
+perftools::profiles::Location *NativeSymbolCache::GetLocation(
+    const google::javaprofiler::JVMPI_CallFrame &jvm_frame,
+    google::javaprofiler::LocationBuilder *location_builder) {
+  uint64_t address = reinterpret_cast<uint64_t>(jvm_frame.method_id);
+  std::string name = FunctionName(address);
+  std::string file_name;
+  int index = native_info_->Find(address - 1);
+  if (index >= 0) {
+    file_name = native_info_->Mappings()[index].name;
+  }
+  if (name.empty()) {
+    name = "[Unknown non-Java frame]";
+  }
+  return location_builder->LocationFor(
+      "", name, file_name, 0, google::javaprofiler::kNativeFrameLineNum,
+      address);
+}
+
+std::string NativeSymbolCache::GetFunctionName(
+    const google::javaprofiler::JVMPI_CallFrame &jvm_frame) {
+  return FunctionName(reinterpret_cast<uint64_t>(jvm_frame.method_id));
+}
+
+int64_t NativeSymbolCache::SymbolTable::Bytes() const {
+  return sizeof(SymbolTable) + segments.capacity() * sizeof(Segment) +
+         symbols.capacity() * sizeof(Symbol) + names.capacity() +
+         kEntryOverheadBytes;
+}
+
+int64_t NativeSymbolCache::AddressBytes(const std::string &name) const {
+  return sizeof(uint64_t) + sizeof(std::string) + name.capacity() +
+         kEntryOverheadBytes;
+}
+
+NativeSymbolCache::SymbolTable *NativeSymbolCache::Table(
+    const std::string &path) {
+  auto it = tables_.find(path);
+  if (it != tables_.end()) {
+    if (it->second != nullptr) {
+      it->second->last_used = lookups_;
+    }
+    return it->second.get();
+  }
+
+  std::unique_ptr<SymbolTable> table(new SymbolTable);
+  if (!Load(path, table.get())) {
+    LOG(INFO) << "No symbols loaded for " << path;
+    table.reset();
+  } else {
+    int64_t bytes = table->Bytes();
+    if (max_bytes_ > 0 && bytes > max_bytes_) {
+      LOG(WARNING) << "Symbols of " << path << " take " << bytes
+                   << " bytes, over the budget of " << max_bytes_;
+      table.reset();
+    } else {
+      if (max_bytes_ > 0 && bytes_ + bytes > max_bytes_) {
+        Trim(bytes);
+      }
+      bytes_ += bytes;
+      table->last_used = lookups_;
+    }
+  }
+  bytes_ += kEntryOverheadBytes + path.capacity();
+  return (tables_[path] = std::move(table)).get();
+}
+
+void NativeSymbolCache::Trim(int64_t needed_bytes) {
+  if (!functions_.empty()) {
+    bytes_ -= functions_bytes_;
+    functions_bytes_ = 0;
+    functions_.clear();
+  }
+  while (bytes_ + needed_bytes > max_bytes_) {
+    auto lru = tables_.end();
+    for (auto it = tables_.begin(); it != tables_.end(); ++it) {
+      if (it->second != nullptr &&
+          (lru == tables_.end() ||
+           it->second->last_used < lru->second->last_used)) {
+        lru = it;
+      }
+    }
+    if (lru == tables_.end()) {
+      break;
+    }
+    // Erase the entry so that the table gets loaded again if needed.
+    bytes_ -= lru->second->Bytes() + kEntryOverheadBytes +
+              lru->first.capacity();
+    tables_.erase(lru);
+  }
+}
+
+bool NativeSymbolCache::Load(const std::string &path, SymbolTable *table) {
+  MappedFile file(path);
+  const Elf64_Ehdr *ehdr = file.At<Elf64_Ehdr>(0);
+  if (ehdr == nullptr || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+      ehdr->e_shentsize != sizeof(Elf64_Shdr) ||
+      ehdr->e_phentsize != sizeof(Elf64_Phdr)) {
+    return false;
+  }
+
+  const Elf64_Phdr *phdrs = file.At<Elf64_Phdr>(ehdr->e_phoff, ehdr->e_phnum);
+  if (phdrs == nullptr) {
+    return false;
+  }
+  for (int i = 0; i < ehdr->e_phnum; ++i) {
+    if (phdrs[i].p_type == PT_LOAD && (phdrs[i].p_flags & PF_X)) {
+      table->segments.push_back(
+          Segment{phdrs[i].p_offset, phdrs[i].p_filesz, phdrs[i].p_vaddr});
+    }
+  }
+
+  const Elf64_Shdr *shdrs = file.At<Elf64_Shdr>(ehdr->e_shoff, ehdr->e_shnum);
+  if (shdrs == nullptr || table->segments.empty()) {
+    return false;
+  }
+  // Prefer the full symbol table, which stripped files do not have.
+  const Elf64_Shdr *symtab = nullptr;
+  for (int i = 0; i < ehdr->e_shnum; ++i) {
+    if (shdrs[i].sh_type == SHT_SYMTAB ||
+        (shdrs[i].sh_type == SHT_DYNSYM && symtab == nullptr)) {
+      symtab = &shdrs[i];
+    }
+  }
+  if (symtab == nullptr || symtab->sh_link >= ehdr->e_shnum ||
+      symtab->sh_entsize != sizeof(Elf64_Sym)) {
+    return false;
+  }
+  const Elf64_Shdr &strtab = shdrs[symtab->sh_link];
+  uint64_t num_syms = symtab->sh_size / sizeof(Elf64_Sym);
+  const Elf64_Sym *syms = file.At<Elf64_Sym>(symtab->sh_offset, num_syms);
+  const char *strs = file.At<char>(strtab.sh_offset, strtab.sh_size);
+  if (syms == nullptr || strs == nullptr) {
+    return false;
+  }
+
+  for (uint64_t i = 0; i < num_syms; ++i) {
+    const Elf64_Sym &sym = syms[i];
+    int type = ELF64_ST_TYPE(sym.st_info);
+    if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+        sym.st_shndx == SHN_UNDEF || sym.st_value == 0 ||
+        sym.st_name >= strtab.sh_size) {
+      continue;
+    }
+    const char *name = strs + sym.st_name;
+    size_t len = strnlen(name, strtab.sh_size - sym.st_name);
+    if (len == 0 || len == strtab.sh_size - sym.st_name) {
+      continue;
+    }
+    table->symbols.push_back(
+        Symbol{sym.st_value, sym.st_size,
+               static_cast<uint32_t>(table->names.size())});
+    table->names.append(name, len + 1);
+  }
+  if (table->symbols.empty()) {
+    return false;
+  }
+
+  // Aliases share an address: keep one, preferring those with a size.
+  std::sort(table->symbols.begin(), table->symbols.end(),
+            [](const Symbol &a, const Symbol &b) {
+              return a.start < b.start ||
+                     (a.start == b.start && a.size > b.size);
+            });
+  table->symbols.erase(
+      std::unique(table->symbols.begin(), table->symbols.end(),
+                  [](const Symbol &a, const Symbol &b) {
+                    return a.start == b.start;
+                  }),
+      table->symbols.end());
+  table->symbols.shrink_to_fit();
+  table->names.shrink_to_fit();
+  return true;
+}
+
+const char *NativeSymbolCache::Lookup(const SymbolTable &table,
+                                      uint64_t file_offset) {
+  uint64_t vaddr = 0;
+  bool found = false;
+  for (const Segment &segment : table.segments) {
+    if (file_offset >= segment.offset &&
+        file_offset - segment.offset < segment.size) {
+      vaddr = file_offset - segment.offset + segment.vaddr;
+      found = true;
+      break;
+    }
+  }
+  if (!found) {
+    return nullptr;
+  }
+
+  auto it = std::upper_bound(
+      table.symbols.begin(), table.symbols.end(), vaddr,
+      [](uint64_t a, const Symbol &s) { return a < s.start; });
+  if (it == table.symbols.begin()) {
+    return nullptr;
+  }
+  --it;
+  // Symbols without a size extend to the next one.
+  if (it->size != 0 && vaddr - it->start >= it->size) {
+    return nullptr;
+  }
+  return table.names.data() + it->name;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,114 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_NATIVE_SYMBOLS_H_
+#define CLOUD_PROFILER_AGENT_JAVA_NATIVE_SYMBOLS_H_
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "third_party/javaprofiler/native.h"
+#include "third_party/javaprofiler/profile_proto_builder.h"
+
+namespace cloud {
+namespace profiler {
+
+// Symbolizes native code addresses from the ELF symbol tables of the mapped
+// files. The symbol table of a file is loaded on the first lookup of an
+// address in it, and both the tables and the symbolized addresses are kept
+// across profiles, within a memory budget: past it, the address cache is
+// dropped first, then the tables least recently used.
+//
+// Not thread-safe; it is only used from the profiler worker thread.
+class NativeSymbolCache : public google::javaprofiler::ProfileFrameCache {
+ public:
+  // Keeps at most max_bytes of symbol data; 0 disables the limit.
+  NativeSymbolCache(const google::javaprofiler::NativeProcessInfo *native_info,
+                    int64_t max_bytes);
+
+  // This type is neither copyable nor movable.
+  NativeSymbolCache(const NativeSymbolCache &) = delete;
+  NativeSymbolCache &operator=(const NativeSymbolCache &) = delete;
+
+  // Returns the demangled name of the function containing address, or an
+  // empty string when it is unknown. address is taken to be a return
+  // address, as in native stack traces. The returned reference stays valid
+  // until the next call.
+  const std::string &FunctionName(uint64_t address);
+
+  // ProfileFrameCache, for native frames holding their address as
+  // method_id, which the native_info should have been refreshed for.
+  void ProcessTraces(const google::javaprofiler::ProfileStackTrace *traces,
+                     int num_traces) override {}
+  perftools::profiles::Location *GetLocation(
+      const google::javaprofiler::JVMPI_CallFrame &jvm_frame,
+      google::javaprofiler::LocationBuilder *location_builder) override;
+  std::string GetFunctionName(
+      const google::javaprofiler::JVMPI_CallFrame &jvm_frame) override;
+
+ private:
+  struct Symbol {
+    uint64_t start;
+    uint64_t size;
+    uint32_t name;  // Offset in SymbolTable::names.
+  };
+
+  // A loadable segment, to map file offsets to ELF virtual addresses.
+  struct Segment {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t vaddr;
+  };
+
+  struct SymbolTable {
+    std::vector<Segment> segments;
+    std::vector<Symbol> symbols;  // Sorted by start.
+    std::string names;
+    int64_t last_used = 0;
+
+    int64_t Bytes() const;
+  };
+
+  // Returns the symbol table of file path, loading it if needed, or null
+  // if it cannot be loaded.
+  SymbolTable *Table(const std::string &path);
+  static bool Load(const std::string &path, SymbolTable *table);
+  static const char *Lookup(const SymbolTable &table, uint64_t file_offset);
+  // Drops cached data until a table of the given size fits in the budget.
+  void Trim(int64_t needed_bytes);
+  int64_t AddressBytes(const std::string &name) const;
+
+  const google::javaprofiler::NativeProcessInfo *native_info_;
+  const int64_t max_bytes_;
+  int64_t bytes_ = 0;
+  int64_t lookups_ = 0;
+  int64_t native_info_generation_ = -1;
+  // Tables by file name; null for the files that could not be loaded.
+  std::unordered_map<std::string, std::unique_ptr<SymbolTable>> tables_;
+  // Demangled function names by address, valid for as long as the
+  // mappings do not change.
+  std::unordered_map<uint64_t, std::string> functions_;
+  int64_t functions_bytes_ = 0;
+  const std::string unknown_;
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_NATIVE_SYMBOLS_H_
@@ -0,0 +1,918 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/native_unwinder.h"
+
+#include <elf.h>
+#include <link.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/ucontext.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>  // NOLINT(build/c++11)
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "src/globals.h"
+#include "src/string.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Row of the unwind table of an object, giving the rules of the code from
+// pc to the next row.
+struct UnwindRow {
+  uint32_t pc;  // Offset from the load address of the object.
+  // The canonical frame address is cfa_register plus cfa_offset, with the
+  // return address right below it.
+  int32_t cfa_offset;
+  // Offset from the CFA of the saved frame pointer, or 0 if the frame
+  // pointer is unchanged.
+  int16_t fp_offset;
+  uint8_t cfa_register;
+};
+
+// Executable segment of a loaded object.
+struct UnwindObject {
+  uintptr_t start;
+  uintptr_t end;
+  uintptr_t bias;
+  const UnwindRow *rows;  // Sorted by pc, may be null.
+  size_t num_rows;
+};
+
+// Part of the stack of the thread being unwound known to be readable.
+struct StackBounds {
+  uintptr_t lo;
+  uintptr_t hi;
+  // Whether hi may be raised by probing the pages above it.
+  bool probing;
+};
+
+// Values of UnwindRow::cfa_register.
+const uint8_t kNoUnwindInfo = 0;
+const uint8_t kCfaSp = 1;
+const uint8_t kCfaFp = 2;
+
+// Page size assumed by the probes of the stack of unregistered threads. A
+// larger page size only makes them probe more often.
+const uintptr_t kPageSize = 4096;
+
+// Farthest above the known part of the stack of an unregistered thread a
+// read may probe, as a stack frame is rarely larger.
+const uintptr_t kMaxProbeBytes = 256 * 1024;
+
+// Returns whether the page holding address is readable, asking the kernel
+// so that a bad address fails the read instead of faulting. This is
+// async-safe.
+bool ProbePage(uintptr_t address) {
+  char byte;
+  struct iovec local = {&byte, 1};
+  struct iovec remote = {reinterpret_cast<void *>(address), 1};
+  return process_vm_readv(getpid(), &local, 1, &remote, 1, 0) == 1;
+}
+
+uintptr_t PageStart(uintptr_t address) { return address & ~(kPageSize - 1); }
+
+// Reads the word of the stack at address. This is async-safe.
+bool Read(uintptr_t address, StackBounds *bounds, uintptr_t *value) {
+  if (address % sizeof(uintptr_t) != 0 || address < bounds->lo) {
+    return false;
+  }
+  uintptr_t end = address + sizeof(uintptr_t);
+  if (end > bounds->hi) {
+    if (!bounds->probing || end - bounds->hi > kMaxProbeBytes) {
+      return false;
+    }
+    while (bounds->hi < end) {
+      if (!ProbePage(bounds->hi)) {
+        return false;
+      }
+      bounds->hi += kPageSize;
+    }
+  }
+  *value = *reinterpret_cast<const uintptr_t *>(address);
+  return true;
+}
+
+// Returns the object holding the code at pc, or null. This is async-safe.
+const UnwindObject *FindObject(const std::vector<UnwindObject> &objects,
+                               uintptr_t pc) {
+  size_t lo = 0, hi = objects.size();
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (objects[mid].start <= pc) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || pc >= objects[lo - 1].end) {
+    return nullptr;
+  }
+  return &objects[lo - 1];
+}
+
+// Returns the row of the unwind table of object covering pc, or null.
+// This is async-safe.
+const UnwindRow *FindRow(const UnwindObject &object, uintptr_t pc) {
+  uintptr_t offset = pc - object.bias;
+  if (object.num_rows == 0 || offset > UINT32_MAX) {
+    return nullptr;
+  }
+  size_t lo = 0, hi = object.num_rows;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (object.rows[mid].pc <= offset) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo == 0 ? nullptr : &object.rows[lo - 1];
+}
+
+#if defined(__x86_64__)
+
+// DWARF register numbers of x86-64.
+const uint64_t kDwarfFp = 6;
+const uint64_t kDwarfSp = 7;
+const uint64_t kDwarfRa = 16;
+
+// Pointer encodings of .eh_frame, see the Linux Standard Base.
+const uint8_t kPeOmit = 0xff;
+const uint8_t kPeUleb128 = 0x01;
+const uint8_t kPeUdata2 = 0x02;
+const uint8_t kPeUdata4 = 0x03;
+const uint8_t kPeUdata8 = 0x04;
+const uint8_t kPeSleb128 = 0x09;
+const uint8_t kPeSdata2 = 0x0a;
+const uint8_t kPeSdata4 = 0x0b;
+const uint8_t kPeSdata8 = 0x0c;
+const uint8_t kPePcrel = 0x10;
+const uint8_t kPeDatarel = 0x30;
+const uint8_t kPeIndirect = 0x80;
+
+// Reads the call frame information of an object loaded in memory.
+class CfiReader {
+ public:
+  CfiReader(const uint8_t *start, const uint8_t *end)
+      : p_(start), end_(end) {}
+
+  bool Ok() const { return ok_; }
+  bool AtEnd() const { return !ok_ || p_ >= end_; }
+  const uint8_t *Position() const { return p_; }
+
+  template <typename T>
+  T Fixed() {
+    T value = 0;
+    if (end_ - p_ < static_cast<ptrdiff_t>(sizeof(T))) {
+      ok_ = false;
+      return value;
+    }
+    memcpy(&value, p_, sizeof(T));
+    p_ += sizeof(T);
+    return value;
+  }
+
+  uint64_t Uleb128() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t byte = Fixed<uint8_t>();
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    ok_ = false;
+    return value;
+  }
+
+  int64_t Sleb128() {
+    int64_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+      byte = Fixed<uint8_t>();
+      value |= static_cast<int64_t>(byte & 0x7f) << shift;
+      shift += 7;
+    } while ((byte & 0x80) != 0 && shift < 64 && ok_);
+    if (shift < 64 && (byte & 0x40) != 0) {
+      value |= -(static_cast<int64_t>(1) << shift);
+    }
+    return value;
+  }
+
+  // Reads a pointer of the given encoding. data_base is the address the
+  // data-relative encodings are relative to.
+  uintptr_t Pointer(uint8_t encoding, uintptr_t data_base) {
+    if (encoding == kPeOmit) {
+      return 0;
+    }
+    uintptr_t here = reinterpret_cast<uintptr_t>(p_);
+    uintptr_t value;
+    switch (encoding & 0x0f) {
+      case 0:
+        value = Fixed<uintptr_t>();
+        break;
+      case kPeUleb128:
+        value = Uleb128();
+        break;
+      case kPeUdata2:
+        value = Fixed<uint16_t>();
+        break;
+      case kPeUdata4:
+        value = Fixed<uint32_t>();
+        break;
+      case kPeUdata8:
+        value = Fixed<uint64_t>();
+        break;
+      case kPeSleb128:
+        value = Sleb128();
+        break;
+      case kPeSdata2:
+        value = Fixed<int16_t>();
+        break;
+      case kPeSdata4:
+        value = Fixed<int32_t>();
+        break;
+      case kPeSdata8:
+        value = Fixed<int64_t>();
+        break;
+      default:
+        ok_ = false;
+        return 0;
+    }
+    switch (encoding & 0x70) {
+      case 0:
+        break;
+      case kPePcrel:
+        value += here;
+        break;
+      case kPeDatarel:
+        value += data_base;
+        break;
+      default:
+        ok_ = false;
+        return 0;
+    }
+    if ((encoding & kPeIndirect) != 0) {
+      // Only used for personality routines, which are not needed.
+      return 0;
+    }
+    return value;
+  }
+
+  void Skip(uint64_t bytes) {
+    if (bytes > static_cast<uint64_t>(end_ - p_)) {
+      ok_ = false;
+      return;
+    }
+    p_ += bytes;
+  }
+
+ private:
+  const uint8_t *p_;
+  const uint8_t *end_;
+  bool ok_ = true;
+};
+
+// Common information entry, shared by the frame description entries.
+struct Cie {
+  uint64_t code_align = 1;
+  int64_t data_align = 1;
+  uint64_t ra_register = kDwarfRa;
+  uint8_t fde_encoding = 0;
+  bool has_augmentation_data = false;
+  const uint8_t *instructions = nullptr;
+  const uint8_t *end = nullptr;
+};
+
+// Reads an entry of .eh_frame at p, setting *body to its content after
+// the length and *end past it. Returns false on a terminator or an entry
+// which cannot be read.
+bool ReadEntry(const uint8_t *p, const uint8_t **body, const uint8_t **end) {
+  uint32_t length;
+  memcpy(&length, p, sizeof(length));
+  if (length == 0 || length == 0xffffffff) {
+    // The 64-bit format is not used in .eh_frame.
+    return false;
+  }
+  *body = p + sizeof(length);
+  *end = *body + length;
+  return true;
+}
+
+bool ParseCie(const uint8_t *p, Cie *cie) {
+  const uint8_t *body, *end;
+  if (!ReadEntry(p, &body, &end)) {
+    return false;
+  }
+  CfiReader reader(body, end);
+  if (reader.Fixed<uint32_t>() != 0) {
+    return false;  // Not a CIE.
+  }
+  uint8_t version = reader.Fixed<uint8_t>();
+  const char *augmentation = reinterpret_cast<const char *>(reader.Position());
+  size_t augmentation_len = strnlen(augmentation, end - reader.Position());
+  reader.Skip(augmentation_len + 1);
+  if (strstr(augmentation, "eh") != nullptr) {
+    reader.Skip(sizeof(uintptr_t));
+  }
+  cie->code_align = reader.Uleb128();
+  cie->data_align = reader.Sleb128();
+  cie->ra_register =
+      version == 1 ? reader.Fixed<uint8_t>() : reader.Uleb128();
+  if (augmentation[0] == 'z') {
+    cie->has_augmentation_data = true;
+    uint64_t length = reader.Uleb128();
+    const uint8_t *data_end = reader.Position() + length;
+    for (const char *c = augmentation + 1; *c != '\0' && reader.Ok(); c++) {
+      if (*c == 'R') {
+        cie->fde_encoding = reader.Fixed<uint8_t>();
+      } else if (*c == 'L') {
+        reader.Fixed<uint8_t>();
+      } else if (*c == 'P') {
+        reader.Pointer(reader.Fixed<uint8_t>(), 0);
+      } else if (*c != 'S' && *c != 'B') {
+        break;
+      }
+    }
+    reader.Skip(data_end - reader.Position());
+  }
+  cie->instructions = reader.Position();
+  cie->end = end;
+  return reader.Ok();
+}
+
+// Rules of the call frame information for a code location, as far as the
+// unwinder needs them.
+struct CfiState {
+  uint64_t cfa_register = kDwarfSp;
+  int64_t cfa_offset = 0;
+  bool cfa_known = true;
+  // DW_CFA_undefined, DW_CFA_expression and the like make the saved frame
+  // pointer or return address unknown.
+  bool fp_saved = false;
+  bool fp_known = true;
+  int64_t fp_offset = 0;
+  bool ra_known = true;
+  int64_t ra_offset = -8;
+};
+
+// Interprets call frame instructions, appending a row to the table for
+// each code range with distinct rules.
+class CfiInterpreter {
+ public:
+  CfiInterpreter(const Cie &cie, uintptr_t bias,
+                 std::vector<UnwindRow> *rows)
+      : cie_(cie), bias_(bias), rows_(rows) {}
+
+  // Runs the initial instructions of the CIE.
+  bool Init() {
+    if (!Run(cie_.instructions, cie_.end, 0, 0)) {
+      return false;
+    }
+    initial_ = state_;
+    return true;
+  }
+
+  // Runs the instructions of an FDE covering [start, end).
+  bool Run(const uint8_t *instructions, const uint8_t *instructions_end,
+           uintptr_t start, uintptr_t end) {
+    CfiReader reader(instructions, instructions_end);
+    uintptr_t location = start;
+    CfiState stack[kMaxRememberedStates];
+    int depth = 0;
+    while (!reader.AtEnd()) {
+      uint8_t op = reader.Fixed<uint8_t>();
+      uint8_t operand = op & 0x3f;
+      uintptr_t advance = 0;
+      if ((op & 0xc0) == 0x40) {  // DW_CFA_advance_loc
+        advance = operand * cie_.code_align;
+      } else if ((op & 0xc0) == 0x80) {  // DW_CFA_offset
+        SetOffset(operand, reader.Uleb128() * cie_.data_align);
+      } else if ((op & 0xc0) == 0xc0) {  // DW_CFA_restore
+        Restore(operand);
+      } else {
+        switch (op) {
+          case 0x00:  // DW_CFA_nop
+            break;
+          case 0x01:  // DW_CFA_set_loc
+            advance = reader.Pointer(cie_.fde_encoding, 0) - location;
+            break;
+          case 0x02:  // DW_CFA_advance_loc1
+            advance = reader.Fixed<uint8_t>() * cie_.code_align;
+            break;
+          case 0x03:  // DW_CFA_advance_loc2
+            advance = reader.Fixed<uint16_t>() * cie_.code_align;
+            break;
+          case 0x04:  // DW_CFA_advance_loc4
+            advance = reader.Fixed<uint32_t>() * cie_.code_align;
+            break;
+          case 0x05: {  // DW_CFA_offset_extended
+            uint64_t reg = reader.Uleb128();
+            SetOffset(reg, reader.Uleb128() * cie_.data_align);
+            break;
+          }
+          case 0x06:  // DW_CFA_restore_extended
+            Restore(reader.Uleb128());
+            break;
+          case 0x07:  // DW_CFA_undefined
+          case 0x09:  // DW_CFA_register
+            SetUnknown(reader.Uleb128());
+            if (op == 0x09) {
+              reader.Uleb128();
+            }
+            break;
+          case 0x08:  // DW_CFA_same_value
+            SetSame(reader.Uleb128());
+            break;
+          case 0x0a:  // DW_CFA_remember_state
+            if (depth == kMaxRememberedStates) {
+              return false;
+            }
+            stack[depth++] = state_;
+            break;
+          case 0x0b:  // DW_CFA_restore_state
+            if (depth == 0) {
+              return false;
+            }
+            state_ = stack[--depth];
+            break;
+          case 0x0c:  // DW_CFA_def_cfa
+            state_.cfa_register = reader.Uleb128();
+            state_.cfa_offset = reader.Uleb128();
+            state_.cfa_known = true;
+            break;
+          case 0x0d:  // DW_CFA_def_cfa_register
+            state_.cfa_register = reader.Uleb128();
+            break;
+          case 0x0e:  // DW_CFA_def_cfa_offset
+            state_.cfa_offset = reader.Uleb128();
+            break;
+          case 0x0f:  // DW_CFA_def_cfa_expression
+            state_.cfa_known = false;
+            reader.Skip(reader.Uleb128());
+            break;
+          case 0x10:    // DW_CFA_expression
+          case 0x16: {  // DW_CFA_val_expression
+            SetUnknown(reader.Uleb128());
+            reader.Skip(reader.Uleb128());
+            break;
+          }
+          case 0x11: {  // DW_CFA_offset_extended_sf
+            uint64_t reg = reader.Uleb128();
+            SetOffset(reg, reader.Sleb128() * cie_.data_align);
+            break;
+          }
+          case 0x12:  // DW_CFA_def_cfa_sf
+            state_.cfa_register = reader.Uleb128();
+            state_.cfa_offset = reader.Sleb128() * cie_.data_align;
+            state_.cfa_known = true;
+            break;
+          case 0x13:  // DW_CFA_def_cfa_offset_sf
+            state_.cfa_offset = reader.Sleb128() * cie_.data_align;
+            break;
+          case 0x14:    // DW_CFA_val_offset
+          case 0x15: {  // DW_CFA_val_offset_sf
+            SetUnknown(reader.Uleb128());
+            reader.Uleb128();
+            break;
+          }
+          case 0x2e:  // DW_CFA_GNU_args_size
+            reader.Uleb128();
+            break;
+          case 0x2f: {  // DW_CFA_GNU_negative_offset_extended
+            uint64_t reg = reader.Uleb128();
+            SetOffset(reg, -static_cast<int64_t>(reader.Uleb128()) *
+                               cie_.data_align);
+            break;
+          }
+          default:
+            return false;
+        }
+      }
+      if (advance != 0 && end != 0) {
+        Emit(location);
+        location += advance;
+      }
+    }
+    if (!reader.Ok()) {
+      return false;
+    }
+    if (end != 0) {
+      Emit(location);
+      // Nothing is known past the end of the function.
+      AppendRow(end, UnwindRow{0, 0, 0, kNoUnwindInfo});
+    }
+    return true;
+  }
+
+ private:
+  static const int kMaxRememberedStates = 8;
+
+  void SetOffset(uint64_t reg, int64_t offset) {
+    if (reg == kDwarfFp) {
+      state_.fp_saved = true;
+      state_.fp_known = true;
+      state_.fp_offset = offset;
+    } else if (reg == cie_.ra_register) {
+      state_.ra_known = true;
+      state_.ra_offset = offset;
+    }
+  }
+
+  void SetSame(uint64_t reg) {
+    if (reg == kDwarfFp) {
+      state_.fp_saved = false;
+      state_.fp_known = true;
+    }
+  }
+
+  void SetUnknown(uint64_t reg) {
+    if (reg == kDwarfFp) {
+      state_.fp_known = false;
+    } else if (reg == cie_.ra_register) {
+      state_.ra_known = false;
+    }
+  }
+
+  void Restore(uint64_t reg) {
+    if (reg == kDwarfFp) {
+      state_.fp_saved = initial_.fp_saved;
+      state_.fp_known = initial_.fp_known;
+      state_.fp_offset = initial_.fp_offset;
+    } else if (reg == cie_.ra_register) {
+      state_.ra_known = initial_.ra_known;
+      state_.ra_offset = initial_.ra_offset;
+    }
+  }
+
+  void Emit(uintptr_t location) {
+    UnwindRow row = {0, 0, 0, kNoUnwindInfo};
+    // The return address is always right below the CFA on x86-64, which
+    // rows that say otherwise are left out for.
+    bool usable = state_.cfa_known && state_.fp_known && state_.ra_known &&
+                  state_.ra_offset == -8 &&
+                  (state_.cfa_register == kDwarfSp ||
+                   state_.cfa_register == kDwarfFp) &&
+                  state_.cfa_offset > 0 && state_.cfa_offset <= INT32_MAX &&
+                  (!state_.fp_saved || (state_.fp_offset < 0 &&
+                                        state_.fp_offset >= INT16_MIN));
+    if (usable) {
+      row.cfa_register = state_.cfa_register == kDwarfSp ? kCfaSp : kCfaFp;
+      row.cfa_offset = state_.cfa_offset;
+      row.fp_offset = state_.fp_saved ? state_.fp_offset : 0;
+    }
+    AppendRow(location, row);
+  }
+
+  void AppendRow(uintptr_t location, UnwindRow row) {
+    if (location < bias_ || location - bias_ > UINT32_MAX) {
+      return;
+    }
+    row.pc = location - bias_;
+    if (!rows_->empty() && rows_->back().pc == row.pc) {
+      rows_->back() = row;
+    } else {
+      rows_->push_back(row);
+    }
+  }
+
+  const Cie &cie_;
+  const uintptr_t bias_;
+  std::vector<UnwindRow> *rows_;
+  CfiState state_;
+  CfiState initial_;
+};
+
+// Builds the unwind table of an object from its .eh_frame_hdr, which
+// lists the frame description entries sorted by address.
+void BuildRows(uintptr_t bias, const uint8_t *eh_frame_hdr,
+               std::vector<UnwindRow> *rows) {
+  uintptr_t hdr = reinterpret_cast<uintptr_t>(eh_frame_hdr);
+  CfiReader reader(eh_frame_hdr, eh_frame_hdr + 4 + 2 * sizeof(uintptr_t));
+  uint8_t version = reader.Fixed<uint8_t>();
+  uint8_t eh_frame_ptr_encoding = reader.Fixed<uint8_t>();
+  uint8_t fde_count_encoding = reader.Fixed<uint8_t>();
+  uint8_t table_encoding = reader.Fixed<uint8_t>();
+  reader.Pointer(eh_frame_ptr_encoding, hdr);
+  uint64_t fde_count = reader.Pointer(fde_count_encoding, hdr);
+  // The table is sorted, and in this encoding, in practice.
+  if (!reader.Ok() || version != 1 ||
+      table_encoding != (kPeDatarel | kPeSdata4)) {
+    return;
+  }
+  const int32_t *table = reinterpret_cast<const int32_t *>(reader.Position());
+
+  std::unordered_map<const uint8_t *, Cie> cies;
+  for (uint64_t i = 0; i < fde_count; i++) {
+    const uint8_t *fde = reinterpret_cast<const uint8_t *>(
+        hdr + static_cast<intptr_t>(table[2 * i + 1]));
+    const uint8_t *body, *end;
+    if (!ReadEntry(fde, &body, &end)) {
+      continue;
+    }
+    CfiReader fde_reader(body, end);
+    uint32_t cie_offset = fde_reader.Fixed<uint32_t>();
+    if (cie_offset == 0) {
+      continue;  // A CIE.
+    }
+    const uint8_t *cie_ptr = body - cie_offset;
+    auto it = cies.find(cie_ptr);
+    if (it == cies.end()) {
+      Cie cie;
+      if (!ParseCie(cie_ptr, &cie)) {
+        cie.instructions = nullptr;
+      }
+      it = cies.emplace(cie_ptr, cie).first;
+    }
+    const Cie &cie = it->second;
+    if (cie.instructions == nullptr) {
+      continue;
+    }
+    uintptr_t start = fde_reader.Pointer(cie.fde_encoding, 0);
+    uintptr_t range = fde_reader.Pointer(cie.fde_encoding & 0x0f, 0);
+    if (cie.has_augmentation_data) {
+      fde_reader.Skip(fde_reader.Uleb128());
+    }
+    if (!fde_reader.Ok() || range == 0) {
+      continue;
+    }
+    CfiInterpreter interpreter(cie, bias, rows);
+    size_t first_row = rows->size();
+    if (!interpreter.Init() ||
+        !interpreter.Run(fde_reader.Position(), end, start, start + range)) {
+      // Leave the function to the frame pointer walk.
+      rows->resize(first_row);
+    }
+  }
+
+  // Keeps a single row per location, the last one, and merges the rows
+  // with the same rules.
+  std::stable_sort(rows->begin(), rows->end(),
+                   [](const UnwindRow &a, const UnwindRow &b) {
+                     return a.pc < b.pc;
+                   });
+  std::vector<UnwindRow> merged;
+  for (const UnwindRow &row : *rows) {
+    if (!merged.empty() && merged.back().pc == row.pc) {
+      merged.back() = row;
+    } else {
+      merged.push_back(row);
+    }
+    if (merged.size() >= 2) {
+      const UnwindRow &prev = merged[merged.size() - 2];
+      const UnwindRow &last = merged.back();
+      if (prev.cfa_register == last.cfa_register &&
+          prev.cfa_offset == last.cfa_offset &&
+          prev.fp_offset == last.fp_offset) {
+        merged.pop_back();
+      }
+    }
+  }
+  merged.shrink_to_fit();
+  rows->swap(merged);
+}
+
+#endif  // __x86_64__
+
+// Signature of the set of loaded objects, telling when it changes.
+struct LoadedObjects {
+  uint64_t adds = 0;
+  uint64_t subs = 0;
+  uint64_t count = 0;
+  uintptr_t address_sum = 0;
+
+  bool operator==(const LoadedObjects &other) const {
+    return adds == other.adds && subs == other.subs &&
+           count == other.count && address_sum == other.address_sum;
+  }
+};
+
+std::mutex refresh_mutex;
+LoadedObjects loaded_objects;
+
+// Unwind tables by object file name and load address. They are kept for
+// the lifetime of the process, as the signal handler may be reading them
+// when the object is unloaded.
+std::map<std::pair<std::string, uintptr_t>, std::vector<UnwindRow> *>
+    unwind_tables;
+
+int AddLoadedObject(struct dl_phdr_info *info, size_t size, void *data) {
+  LoadedObjects *objects = static_cast<LoadedObjects *>(data);
+  if (size >= offsetof(struct dl_phdr_info, dlpi_subs) +
+                  sizeof(info->dlpi_subs)) {
+    objects->adds = info->dlpi_adds;
+    objects->subs = info->dlpi_subs;
+  }
+  objects->count++;
+  objects->address_sum += info->dlpi_addr;
+  return 0;
+}
+
+// Returns the unwind table of a loaded object, building it the first
+// time.
+const std::vector<UnwindRow> &UnwindTable(struct dl_phdr_info *info) {
+  static const std::vector<UnwindRow> kNoRows;
+#if defined(__x86_64__)
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+    if (phdr.p_type != PT_GNU_EH_FRAME) {
+      continue;
+    }
+    auto key = std::make_pair(std::string(info->dlpi_name), info->dlpi_addr);
+    auto it = unwind_tables.find(key);
+    if (it == unwind_tables.end()) {
+      std::vector<UnwindRow> *rows = new std::vector<UnwindRow>();
+      BuildRows(info->dlpi_addr,
+                reinterpret_cast<const uint8_t *>(info->dlpi_addr +
+                                                  phdr.p_vaddr),
+                rows);
+      LOG(INFO) << "Built an unwind table of " << rows->size()
+                << " rows for " << info->dlpi_name;
+      it = unwind_tables.emplace(key, rows).first;
+    }
+    return *it->second;
+  }
+#endif
+  return kNoRows;
+}
+
+struct RefreshState {
+  std::vector<std::string> libraries;
+  std::vector<UnwindObject> objects;
+};
+
+int AddObjectCode(struct dl_phdr_info *info, size_t size, void *data) {
+  RefreshState *state = static_cast<RefreshState *>(data);
+  const char *name = info->dlpi_name != nullptr ? info->dlpi_name : "";
+  const UnwindRow *rows = nullptr;
+  size_t num_rows = 0;
+  for (const std::string &library : state->libraries) {
+    if (strstr(name, library.c_str()) != nullptr) {
+      const std::vector<UnwindRow> &table = UnwindTable(info);
+      rows = table.data();
+      num_rows = table.size();
+      break;
+    }
+  }
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr) &phdr = info->dlpi_phdr[i];
+    if (phdr.p_type == PT_LOAD && (phdr.p_flags & PF_X) != 0) {
+      uintptr_t start = info->dlpi_addr + phdr.p_vaddr;
+      state->objects.push_back(UnwindObject{start, start + phdr.p_memsz,
+                                            info->dlpi_addr, rows, num_rows});
+    }
+  }
+  return 0;
+}
+
+}  // namespace
+
+struct NativeUnwinder::ObjectTable {
+  std::vector<UnwindObject> objects;  // Sorted by start.
+};
+
+std::atomic<const NativeUnwinder::ObjectTable *> NativeUnwinder::objects_;
+__thread uintptr_t NativeUnwinder::stack_lo_;
+__thread uintptr_t NativeUnwinder::stack_hi_;
+__thread uintptr_t NativeUnwinder::probed_lo_;
+__thread uintptr_t NativeUnwinder::probed_hi_;
+
+void NativeUnwinder::RegisterCurrentThread() {
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+    return;
+  }
+  void *addr;
+  size_t size;
+  if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+    stack_lo_ = reinterpret_cast<uintptr_t>(addr);
+    stack_hi_ = stack_lo_ + size;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+void NativeUnwinder::Refresh(const std::string &unwind_table_libraries) {
+  std::lock_guard<std::mutex> lock(refresh_mutex);
+  LoadedObjects loaded;
+  dl_iterate_phdr(&AddLoadedObject, &loaded);
+  if (objects_.load() != nullptr && loaded == loaded_objects) {
+    return;
+  }
+  loaded_objects = loaded;
+
+  RefreshState state;
+  for (const std::string &library : Split(unwind_table_libraries, ',')) {
+    if (!library.empty()) {
+      state.libraries.push_back(library);
+    }
+  }
+  dl_iterate_phdr(&AddObjectCode, &state);
+  ObjectTable *table = new ObjectTable();
+  table->objects.swap(state.objects);
+  std::sort(table->objects.begin(), table->objects.end(),
+            [](const UnwindObject &a, const UnwindObject &b) {
+              return a.start < b.start;
+            });
+  objects_.store(table, std::memory_order_release);
+}
+
+int NativeUnwinder::Unwind(const void *ucontext, void **pcs,
+                           int max_frames) {
+  const ucontext_t *uc = static_cast<const ucontext_t *>(ucontext);
+#if defined(__x86_64__)
+  uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+  uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+  uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+#elif defined(__aarch64__)
+  uintptr_t pc = uc->uc_mcontext.pc;
+  uintptr_t sp = uc->uc_mcontext.sp;
+  uintptr_t fp = uc->uc_mcontext.regs[29];
+#else
+  return 0;
+#endif
+  StackBounds bounds = {stack_lo_, stack_hi_, false};
+  if (sp < bounds.lo || sp >= bounds.hi) {
+    // Not on the registered stack: only the page of the stack pointer is
+    // known to be mapped, along with the pages probed in earlier walks
+    // while the stack pointer was above them.
+    if (sp < probed_lo_ || sp >= probed_hi_) {
+      probed_lo_ = PageStart(sp);
+      probed_hi_ = probed_lo_ + kPageSize;
+    }
+    bounds = {probed_lo_, probed_hi_, true};
+  }
+
+  const ObjectTable *table = objects_.load(std::memory_order_acquire);
+  int num_frames = 0;
+  for (bool leaf = true; num_frames < max_frames; leaf = false) {
+    pcs[num_frames++] = reinterpret_cast<void *>(pc);
+    if (table == nullptr) {
+      break;
+    }
+    // A return address may be past the end of its function, when the call
+    // is the last instruction of it.
+    uintptr_t lookup_pc = leaf ? pc : pc - 1;
+    const UnwindObject *object = FindObject(table->objects, lookup_pc);
+    if (object == nullptr) {
+      // JIT-compiled or interpreted code, or a bad address.
+      break;
+    }
+    const UnwindRow *row = FindRow(*object, lookup_pc);
+    uintptr_t next_pc, next_sp, next_fp = fp;
+    if (row != nullptr && row->cfa_register != kNoUnwindInfo) {
+      uintptr_t cfa =
+          (row->cfa_register == kCfaSp ? sp : fp) + row->cfa_offset;
+      if (cfa <= sp ||
+          !Read(cfa - sizeof(uintptr_t), &bounds, &next_pc) ||
+          (row->fp_offset != 0 &&
+           !Read(cfa + row->fp_offset, &bounds, &next_fp))) {
+        break;
+      }
+      next_sp = cfa;
+    } else {
+      // The frame record: the frame pointer of the caller, then the
+      // return address.
+      if (fp < sp || !Read(fp, &bounds, &next_fp) ||
+          !Read(fp + sizeof(uintptr_t), &bounds, &next_pc)) {
+        break;
+      }
+      next_sp = fp + 2 * sizeof(uintptr_t);
+    }
+    if (next_pc == 0 || next_sp <= sp) {
+      break;
+    }
+    pc = next_pc;
+    sp = next_sp;
+    fp = next_fp;
+  }
+  if (bounds.probing) {
+    probed_hi_ = bounds.hi;
+  }
+  return num_frames;
+}
+
+}  // namespace profiler
+}  // namespace cloud
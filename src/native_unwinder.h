@@ -0,0 +1,108 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_NATIVE_UNWINDER_H_
+#define CLOUD_PROFILER_AGENT_JAVA_NATIVE_UNWINDER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+namespace cloud {
+namespace profiler {
+
+// Async-safe unwinder of native stacks, for the signal handler to use
+// instead of backtrace(), which may allocate, take the loader lock or
+// fault on a corrupt stack.
+//
+// The stack is walked from the interrupted context by following the frame
+// pointers. Every read of the stack is checked to be within the bounds of
+// the stack of the thread, registered when the thread starts. On threads
+// which did not register, the stack is only trusted from the page of the
+// interrupted stack pointer up to the pages found readable by probing them
+// through process_vm_readv(), so that a bad frame pointer fails the read
+// rather than faulting. The walk stops
+// at the first address outside of the code of the loaded objects, which is
+// where native frames give way to the JIT-compiled and interpreted ones.
+//
+// Code built without frame pointers, like most of libc, hides its callers
+// from such a walk. On x86-64, the frames of the objects given to
+// Refresh() are instead unwound from a table precomputed out of their
+// .eh_frame call frame information, a compact row per code range giving
+// how to find the canonical frame address and the saved frame pointer.
+class NativeUnwinder {
+ public:
+  // This type is neither copyable nor movable.
+  NativeUnwinder(const NativeUnwinder &) = delete;
+  NativeUnwinder &operator=(const NativeUnwinder &) = delete;
+
+  // Records the bounds of the stack of the current thread. Called when a
+  // thread starts, this is not async-safe.
+  static void RegisterCurrentThread();
+
+  // Updates the code ranges of the loaded objects if objects were loaded
+  // or unloaded since the last call, and builds the unwind tables of the
+  // objects whose file name contains one of the comma-separated
+  // unwind_table_libraries, e.g. "libc.so,libjvm.so". This is not
+  // async-safe and must be called before the signal handlers using
+  // Unwind() are installed.
+  static void Refresh(const std::string &unwind_table_libraries);
+
+  // Stores up to max_frames addresses of the native stack interrupted by
+  // a signal, given the ucontext_t passed to its handler: the interrupted
+  // program counter followed by the return addresses of its callers.
+  // Returns the number of addresses stored. This is async-safe.
+  static int Unwind(const void *ucontext, void **pcs, int max_frames);
+
+ private:
+  struct ObjectTable;
+
+  // The code ranges and unwind tables of the loaded objects. Replaced by
+  // Refresh() and never freed, as Unwind() may still be reading a previous
+  // table.
+  static std::atomic<const ObjectTable *> objects_;
+
+  // Bounds of the stack registered by the current thread, or 0. When the
+  // thread did not register, or runs on another stack, probed_lo_ and
+  // probed_hi_ delimit the part of its stack known to be readable.
+  // Accessed from the signal handler, see the comments of Accessors on the
+  // TLS model.
+#if defined(JAVAPROFILER_GLOBAL_DYNAMIC_TLS) || defined(ALPINE)
+  static __thread uintptr_t stack_lo_
+      __attribute__((tls_model("global-dynamic")));
+  static __thread uintptr_t stack_hi_
+      __attribute__((tls_model("global-dynamic")));
+  static __thread uintptr_t probed_lo_
+      __attribute__((tls_model("global-dynamic")));
+  static __thread uintptr_t probed_hi_
+      __attribute__((tls_model("global-dynamic")));
+#else
+  static __thread uintptr_t stack_lo_
+      __attribute__((tls_model("initial-exec")));
+  static __thread uintptr_t stack_hi_
+      __attribute__((tls_model("initial-exec")));
+  static __thread uintptr_t probed_lo_
+      __attribute__((tls_model("initial-exec")));
+  static __thread uintptr_t probed_hi_
+      __attribute__((tls_model("initial-exec")));
+#endif
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_NATIVE_UNWINDER_H_
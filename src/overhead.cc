@@ -0,0 +1,154 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/overhead.h"
+
+#include <time.h>
+
+#include <sstream>
+
+namespace cloud {
+namespace profiler {
+
+Overhead::AtomicTimerStats Overhead::timers_[Overhead::kNumTimers];
+std::atomic<int64_t> Overhead::counters_[Overhead::kNumCounters];
+
+int64_t Overhead::TimerStats::QuantileNanos(double quantile) const {
+  int64_t threshold = static_cast<int64_t>(quantile * count);
+  int64_t seen = 0;
+  for (int i = 0; i < kNumBuckets; i++) {
+    seen += buckets[i];
+    if (seen > threshold) {
+      int64_t upper = int64_t{2} << i;
+      return upper < max_nanos ? upper : max_nanos;
+    }
+  }
+  return max_nanos;
+}
+
+Overhead::Stats Overhead::Stats::Since(const Stats &earlier) const {
+  Stats delta = *this;
+  for (int t = 0; t < kNumTimers; t++) {
+    delta.timers[t].count -= earlier.timers[t].count;
+    delta.timers[t].total_nanos -= earlier.timers[t].total_nanos;
+    for (int i = 0; i < kNumBuckets; i++) {
+      delta.timers[t].buckets[i] -= earlier.timers[t].buckets[i];
+    }
+  }
+  for (int c = 0; c < kNumCounters; c++) {
+    delta.counters[c] -= earlier.counters[c];
+  }
+  return delta;
+}
+
+void Overhead::Record(Timer timer, int64_t nanos) {
+  if (nanos < 0) {
+    nanos = 0;
+  }
+  AtomicTimerStats &stats = timers_[timer];
+  stats.count.fetch_add(1, std::memory_order_relaxed);
+  stats.total_nanos.fetch_add(nanos, std::memory_order_relaxed);
+  int64_t max = stats.max_nanos.load(std::memory_order_relaxed);
+  while (nanos > max && !stats.max_nanos.compare_exchange_weak(
+                            max, nanos, std::memory_order_relaxed)) {
+  }
+  int bucket = nanos > 0 ? 63 - __builtin_clzll(nanos) : 0;
+  if (bucket >= kNumBuckets) {
+    bucket = kNumBuckets - 1;
+  }
+  stats.buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+int64_t Overhead::NowNanos() {
+  // clock_gettime is async-signal-safe, and served from the vDSO.
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+Overhead::Stats Overhead::Snapshot() {
+  Stats stats;
+  for (int t = 0; t < kNumTimers; t++) {
+    const AtomicTimerStats &from = timers_[t];
+    TimerStats &to = stats.timers[t];
+    to.count = from.count.load(std::memory_order_relaxed);
+    to.total_nanos = from.total_nanos.load(std::memory_order_relaxed);
+    to.max_nanos = from.max_nanos.load(std::memory_order_relaxed);
+    for (int i = 0; i < kNumBuckets; i++) {
+      to.buckets[i] = from.buckets[i].load(std::memory_order_relaxed);
+    }
+  }
+  for (int c = 0; c < kNumCounters; c++) {
+    stats.counters[c] = counters_[c].load(std::memory_order_relaxed);
+  }
+  return stats;
+}
+
+std::string Overhead::Summary(const Stats &stats) {
+  std::ostringstream out;
+  bool first = true;
+  for (int t = 0; t < kNumTimers; t++) {
+    const TimerStats &timer = stats.timers[t];
+    if (timer.count == 0) {
+      continue;
+    }
+    out << (first ? "" : "; ") << TimerName(static_cast<Timer>(t))
+        << ": n=" << timer.count << " total=" << timer.total_nanos / 1000000
+        << "ms p50<=" << timer.QuantileNanos(0.5) / 1000
+        << "us p99<=" << timer.QuantileNanos(0.99) / 1000
+        << "us max=" << timer.max_nanos / 1000 << "us";
+    first = false;
+  }
+  for (int c = 0; c < kNumCounters; c++) {
+    out << (first ? "" : "; ") << CounterName(static_cast<Counter>(c)) << "="
+        << stats.counters[c];
+    first = false;
+  }
+  return out.str();
+}
+
+const char *Overhead::TimerName(Timer timer) {
+  switch (timer) {
+    case kSignalHandler:
+      return "signal_handler";
+    case kHarvest:
+      return "harvest";
+    case kSerialize:
+      return "serialize";
+    case kEmit:
+      return "emit";
+    case kNativeInfoRefresh:
+      return "native_info_refresh";
+    case kUpload:
+      return "upload";
+    case kMethodIdPriming:
+      return "method_id_priming";
+    default:
+      return "unknown";
+  }
+}
+
+const char *Overhead::CounterName(Counter counter) {
+  switch (counter) {
+    case kOverflowSamples:
+      return "overflow_samples";
+    case kDroppedSamples:
+      return "dropped_samples";
+    default:
+      return "unknown";
+  }
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,131 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_OVERHEAD_H_
+#define CLOUD_PROFILER_AGENT_JAVA_OVERHEAD_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+
+namespace cloud {
+namespace profiler {
+
+// Counters and latency histograms of the work done by the agent itself,
+// kept for the lifetime of the process. Recording is lock-free and
+// async-safe, so that the signal handler can time itself.
+class Overhead {
+ public:
+  // Timed operations.
+  enum Timer {
+    kSignalHandler,      // Profiler::Handle().
+    kHarvest,            // Moving samples out of the fixed tables.
+    kSerialize,          // Encoding the traces into a profile.
+    kEmit,               // Finishing the compressed profile.
+    kNativeInfoRefresh,  // Reloading the native mappings.
+    kUpload,             // Uploading a profile to the API.
+    kMethodIdPriming,    // Creating the jmethodIDs of a class.
+    kNumTimers,
+  };
+
+  // Event counters.
+  enum Counter {
+    kOverflowSamples,  // Samples recorded into the overflow table.
+    kDroppedSamples,   // Samples lost because the tables were full.
+    kNumCounters,
+  };
+
+  // Latencies are bucketed by powers of two of nanoseconds: bucket i holds
+  // those in [2^i, 2^(i+1)).
+  static const int kNumBuckets = 40;
+
+  struct TimerStats {
+    int64_t count = 0;
+    int64_t total_nanos = 0;
+    int64_t max_nanos = 0;
+    int64_t buckets[kNumBuckets] = {};
+
+    // Returns an upper bound of the given quantile of the latencies, from
+    // the histogram, or 0 if there are none.
+    int64_t QuantileNanos(double quantile) const;
+  };
+
+  struct Stats {
+    TimerStats timers[kNumTimers];
+    int64_t counters[kNumCounters] = {};
+
+    // Returns the difference of the counts and totals with an earlier
+    // snapshot. The max latencies are left as in this snapshot.
+    Stats Since(const Stats &earlier) const;
+  };
+
+  // Records an operation of the given latency. This is async-safe.
+  static void Record(Timer timer, int64_t nanos);
+
+  // Increments a counter by n. This is async-safe.
+  static void Increment(Counter counter, int64_t n = 1) {
+    counters_[counter].fetch_add(n, std::memory_order_relaxed);
+  }
+
+  // Returns a monotonic time in nanoseconds. This is async-safe.
+  static int64_t NowNanos();
+
+  // Returns a snapshot of the statistics.
+  static Stats Snapshot();
+
+  // Returns a one line summary of the statistics.
+  static std::string Summary(const Stats &stats);
+
+  static const char *TimerName(Timer timer);
+  static const char *CounterName(Counter counter);
+
+ private:
+  struct AtomicTimerStats {
+    std::atomic<int64_t> count;
+    std::atomic<int64_t> total_nanos;
+    std::atomic<int64_t> max_nanos;
+    std::atomic<int64_t> buckets[kNumBuckets];
+  };
+
+  static AtomicTimerStats timers_[kNumTimers];
+  static std::atomic<int64_t> counters_[kNumCounters];
+};
+
+// Records the latency of the enclosing scope into an Overhead timer. This
+// is async-safe.
+class ScopedOverheadTimer {
+ public:
+  explicit ScopedOverheadTimer(Overhead::Timer timer)
+      : timer_(timer), start_nanos_(Overhead::NowNanos()) {}
+
+  ~ScopedOverheadTimer() {
+    Overhead::Record(timer_, Overhead::NowNanos() - start_nanos_);
+  }
+
+  // This type is neither copyable nor movable.
+  ScopedOverheadTimer(const ScopedOverheadTimer &) = delete;
+  ScopedOverheadTimer &operator=(const ScopedOverheadTimer &) = delete;
+
+ private:
+  Overhead::Timer timer_;
+  int64_t start_nanos_;
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_OVERHEAD_H_
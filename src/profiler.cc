@@ -14,40 +14,296 @@
 
 #include "src/profiler.h"
 
+#include <alloca.h>
 #include <errno.h>
-#include <execinfo.h>
+#include <sched.h>
 #include <sys/time.h>
 #include <sys/ucontext.h>
 
 #include <atomic>
 #include <cstdlib>
 #include <cstring>
+#include <memory>
 #include <string>
+#include <thread>  // NOLINT(build/c++11)
+#include <unordered_map>
 #include <vector>
 
 #include "src/clock.h"
 #include "src/globals.h"
+#include "src/jit_code_map.h"
+#include "src/native_unwinder.h"
+#include "src/overhead.h"
 #include "src/proto.h"
+#include "src/thread_context.h"
+#include "src/virtual_threads.h"
 #include "third_party/javaprofiler/accessors.h"
 
 DEFINE_int32(cprof_wall_num_threads_cutoff, 4096,
-             "Do not take wall profiles if more than this # of threads exist.");
+             "Do not take wall profiles if more than this # of threads exist. "
+             "Ignored with --cprof_wall_subsample_threads.");
 DEFINE_int32(cprof_wall_max_threads_per_sec, 160,
              "Max total # of threads to wake up per second in wall profiling.");
-// Off by default since it may cause rare crashes, b/27615794.
+DEFINE_bool(cprof_wall_subsample_threads, true,
+            "In wall profiling, when there are more threads than can be "
+            "woken up per period, signal a rotating pseudo-random subset of "
+            "them each period, weighting their samples by the periods the "
+            "subset stands for, instead of lengthening the period.");
+DEFINE_int32(cprof_wall_idle_sample_interval, 1,
+             "In wall profiling, signal threads that have stayed idle since "
+             "they were last signaled only once every this many periods, "
+             "weighting their sample by the periods skipped. 1 disables.");
+DEFINE_int32(cprof_wall_idle_cpu_usec, 200,
+             "CPU time below which a thread is considered idle between two "
+             "wall profiling periods, leaving room for the signal handler.");
+DEFINE_bool(cprof_wall_cpu_labels, false,
+            "Whether to label the wall samples with whether their thread used "
+            "more than --cprof_wall_idle_cpu_usec of CPU over the period "
+            "before the sample, so that on-CPU and off-CPU wall time can be "
+            "told apart.");
+DEFINE_int32(cprof_wall_signal_threads, 1,
+             "# of threads sending signals in wall profiling, each handling "
+             "a share of the profiled threads.");
+DEFINE_int32(cprof_threads_max_per_snapshot, 256,
+             "Max # of threads signaled per snapshot in threads profiling; "
+             "larger thread tables are covered over successive snapshots.");
 DEFINE_bool(cprof_record_native_stack, false,
             "Whether to unwind native stack and put atop of the Java one.");
+DEFINE_string(cprof_native_unwind_tables, "libc.so",
+              "Comma-separated substrings of the file names of the native "
+              "libraries, e.g. libc.so,libjvm.so, whose frames are unwound "
+              "from their call frame information rather than their frame "
+              "pointers, when recording native stacks.");
+DEFINE_int32(cprof_max_stack_traces, 2048,
+             "Max # of distinct stack traces held by each sample table "
+             "between flushes. 0 means size it from the thread count.");
+DEFINE_int32(cprof_frames_per_stack_trace, 64,
+             "Average # of frames reserved per entry in the frame storage "
+             "of the sample tables.");
+DEFINE_int32(cprof_max_stack_depth, 128,
+             "Max # of frames stored per stack trace, at most 2048. Deeper "
+             "stacks keep their leaf-most quarter and their root-most "
+             "frames, around a [Truncated stack] frame.");
+DEFINE_int32(cprof_stack_walk_depth, 0,
+             "Max # of frames walked per stack trace, at least and by "
+             "default --cprof_max_stack_depth, at most 2048. The root-most "
+             "frames of deeper stacks are lost. The walked frames are held "
+             "on the signal stack, 16 bytes each, eg 32KB for 2048.");
+DEFINE_int32(cprof_overflow_stack_traces, 2048,
+             "Max # of distinct stack traces held by the shared overflow "
+             "table used once a sample table is full. 0 disables it.");
+DEFINE_int32(cprof_flush_high_water_percent, 50,
+             "Target fill level of the sample tables, as a percentage, at "
+             "which collected samples are flushed.");
+DEFINE_int32(cprof_flush_min_interval_msec, 10,
+             "Min interval between flushes of the sample tables.");
+DEFINE_int32(cprof_flush_max_interval_msec, 1000,
+             "Max interval between flushes of the sample tables.");
+DEFINE_bool(cprof_aggregate_call_tree, false,
+            "Whether to aggregate samples into a prefix-sharing call tree, "
+            "which saves memory on deep, high-cardinality stacks.");
+DEFINE_bool(cprof_overhead_samples, false,
+            "Whether to add the time the agent spent collecting a CPU, wall "
+            "or threads profile to it, as artificial samples.");
+DEFINE_int32(cprof_max_tag_sets, 1024,
+             "Maximum number of distinct sets of thread tags and attribute "
+             "to label the samples of a profile with. Samples beyond it "
+             "are recorded without labels.");
+DEFINE_int32(cprof_time_buckets, 0,
+             "Number of buckets of time the duration of a profile is split "
+             "into to count when the samples of each stack trace were "
+             "taken, reported as a window_offset label. 0 disables, it is "
+             "ignored with --cprof_aggregate_call_tree.");
+DEFINE_int32(cprof_sampling_shards, 1,
+             "Number of sample tables to spread signal handler updates "
+             "across, selected by CPU. 0 means one per online CPU.");
 
 namespace cloud {
 namespace profiler {
 
 using google::javaprofiler::AlmostThere;
 
-google::javaprofiler::AsyncSafeTraceMultiset *Profiler::fixed_traces_ = nullptr;
+google::javaprofiler::AsyncSafeTraceMultiset **Profiler::fixed_traces_ =
+    nullptr;
+int Profiler::num_shards_ = 0;
+google::javaprofiler::AsyncSafeTraceMultiset *Profiler::overflow_traces_ =
+    nullptr;
+TagSetTable *Profiler::tag_sets_ = nullptr;
+int Profiler::pending_merges_ = 0;
+google::javaprofiler::TraceMultiset *Profiler::aggregated_traces_ = nullptr;
+google::javaprofiler::CallTraceTree *Profiler::aggregated_tree_ = nullptr;
+int Profiler::num_time_buckets_ = 0;
+int Profiler::max_stack_depth_ = kMaxFramesToCapture;
+int Profiler::stack_walk_depth_ = kMaxFramesToCapture;
+std::atomic<int64_t> Profiler::window_start_nanos_;
+std::atomic<int64_t> Profiler::time_bucket_nanos_;
 std::atomic<int> Profiler::unknown_stack_count_;
+std::atomic<int> Profiler::overflow_stack_count_;
 
 namespace {
 
+// Upper bound on the number of sample table shards.
+const int kMaxSamplingShards = 256;
+
+// Returns the number of shards to allocate, as requested by
+// --cprof_sampling_shards.
+int NumSamplingShards() {
+  int shards = FLAGS_cprof_sampling_shards;
+  if (shards <= 0) {
+    shards = std::thread::hardware_concurrency();
+  }
+  if (shards <= 0) {
+    shards = 1;
+  }
+  if (shards > kMaxSamplingShards) {
+    shards = kMaxSamplingShards;
+  }
+  return shards;
+}
+
+// Bounds on the sample table size when derived from the thread count.
+const int64_t kMinStackTracesPerTable = 2048;
+const int64_t kMaxStackTracesPerTable = 64 * 1024;
+const int64_t kStackTracesPerThread = 16;
+
+// Returns the number of entries for each sample table, as requested by
+// --cprof_max_stack_traces, or derived from num_threads.
+int64_t MaxStackTraces(int64_t num_threads, int num_shards) {
+  if (FLAGS_cprof_max_stack_traces > 0) {
+    return FLAGS_cprof_max_stack_traces;
+  }
+  int64_t entries = num_threads * kStackTracesPerThread / num_shards;
+  if (entries < kMinStackTracesPerTable) {
+    entries = kMinStackTracesPerTable;
+  }
+  if (entries > kMaxStackTracesPerTable) {
+    entries = kMaxStackTracesPerTable;
+  }
+  return entries;
+}
+
+// Returns the number of frames stored per trace, as requested by
+// --cprof_max_stack_depth.
+int MaxStackDepth() {
+  int depth = FLAGS_cprof_max_stack_depth;
+  if (depth < 1) {
+    depth = 1;
+  }
+  return depth < kMaxStackDepth ? depth : kMaxStackDepth;
+}
+
+// Returns the number of frames walked per trace, as requested by
+// --cprof_stack_walk_depth.
+int StackWalkDepth(int max_stack_depth) {
+  int depth = FLAGS_cprof_stack_walk_depth;
+  if (depth < max_stack_depth) {
+    depth = max_stack_depth;
+  }
+  return depth < kMaxStackDepth ? depth : kMaxStackDepth;
+}
+
+// Cuts a trace longer than max_depth frames down to max_depth: its
+// leaf-most quarter, a kTruncatedStack frame and its root-most frames.
+// Keeping the root side means the samples of a deep recursion or call
+// chain still merge under their common callers, whatever the depth they
+// were taken at. This is async-safe.
+void TruncateStack(int max_depth, JVMPI_CallTrace *trace) {
+  if (trace->num_frames <= max_depth) {
+    return;
+  }
+  if (max_depth < 3) {
+    trace->num_frames = max_depth;
+    return;
+  }
+  int leaf = max_depth / 4;
+  int root = max_depth - leaf - 1;
+  JVMPI_CallFrame *frames = trace->frames;
+  frames[leaf] = JVMPI_CallFrame{
+      kCallTraceErrorLineNum, reinterpret_cast<jmethodID>(kTruncatedStack)};
+  const JVMPI_CallFrame *root_frames = frames + trace->num_frames - root;
+  for (int i = 0; i < root; i++) {
+    frames[leaf + 1 + i] = root_frames[i];
+  }
+  trace->num_frames = max_depth;
+}
+
+// Upper bound on --cprof_wall_signal_threads.
+const int kMaxWallSignalThreads = 16;
+
+// Shortest slice of a wall profiling period over which a batch of
+// threads gets signaled.
+const int64_t kMinWallSliceNanos = kNanosPerMilli;
+
+// Returns the pseudo-random phase in [0, interval) of the wall profiling
+// periods in which thread tid gets signaled when signaling one thread out
+// of every interval per period, varying with seed.
+int64_t SubsamplePhase(pid_t tid, uint64_t seed, int64_t interval) {
+  return static_cast<int64_t>(ThreadHash(tid, seed) %
+                              static_cast<uint64_t>(interval));
+}
+
+// Interval between the first flushes of a profile, before they adapt
+// to the fill level of the sample tables.
+const int64_t kInitialFlushIntervalNanos = 100 * kNanosPerMilli;
+
+int64_t MinFlushIntervalNanos() {
+  return FLAGS_cprof_flush_min_interval_msec * kNanosPerMilli;
+}
+
+int64_t MaxFlushIntervalNanos() {
+  int64_t max_interval = FLAGS_cprof_flush_max_interval_msec * kNanosPerMilli;
+  return max_interval > MinFlushIntervalNanos() ? max_interval
+                                                : MinFlushIntervalNanos();
+}
+
+double FlushHighWater() { return FLAGS_cprof_flush_high_water_percent / 100.0; }
+
+// Returns the interval until the next flush, given the fill ratio the
+// tables reached over the last interval. Assuming samples keep arriving
+// at the same rate, the next interval is scaled so that the tables
+// reach the high water mark when they are flushed again.
+int64_t NextFlushIntervalNanos(int64_t interval_nanos, double fill_ratio) {
+  int64_t next = MaxFlushIntervalNanos();
+  if (fill_ratio > 0) {
+    double scaled = interval_nanos * FlushHighWater() / fill_ratio;
+    if (scaled < next) {
+      next = static_cast<int64_t>(scaled);
+    }
+  }
+  if (next < MinFlushIntervalNanos()) {
+    next = MinFlushIntervalNanos();
+  }
+  return next;
+}
+
+// Returns the number of time buckets of the traces, as requested by
+// --cprof_time_buckets.
+int NumTimeBuckets() {
+  if (FLAGS_cprof_aggregate_call_tree || FLAGS_cprof_time_buckets <= 0) {
+    return 0;
+  }
+  const int max_buckets =
+      google::javaprofiler::AsyncSafeTraceMultiset::kMaxTimeBuckets;
+  return FLAGS_cprof_time_buckets < max_buckets ? FLAGS_cprof_time_buckets
+                                                : max_buckets;
+}
+
+// Reads the monotonic clock, which is async-safe.
+int64_t MonotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return TimeSpecToNanos(ts);
+}
+
+// Returns the program counter interrupted by a signal. This is async-safe.
+uint64_t InterruptedPc(void *context) {
+#ifdef __aarch64__
+  return static_cast<ucontext_t *>(context)->uc_mcontext.pc;
+#else
+  return static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_RIP];
+#endif
+}
+
 // Helper class to store and reset errno when in a signal handler.
 class ErrnoRaii {
  public:
@@ -64,66 +320,161 @@ class ErrnoRaii {
 
 }  // namespace
 
+google::javaprofiler::AsyncSafeTraceMultiset *Profiler::CurrentShard() {
+  if (num_shards_ == 1) {
+    return fixed_traces_[0];
+  }
+  // sched_getcpu is served from the vDSO and does not take locks. If it
+  // is unavailable fall back to the thread id, which still keeps a
+  // given thread on a single shard.
+  int key = sched_getcpu();
+  if (key < 0) {
+    key = GetTid();
+  }
+  return fixed_traces_[key % num_shards_];
+}
+
+int Profiler::CurrentTimeBucket() {
+  if (num_time_buckets_ == 0) {
+    return -1;
+  }
+  int64_t elapsed =
+      MonotonicNanos() - window_start_nanos_.load(std::memory_order_relaxed);
+  int64_t bucket =
+      elapsed / time_bucket_nanos_.load(std::memory_order_relaxed);
+  // Late samples of a profile land in its last bucket.
+  if (bucket < 0) {
+    return 0;
+  }
+  return bucket < num_time_buckets_ ? bucket : num_time_buckets_ - 1;
+}
+
+void Profiler::Record(google::javaprofiler::AsyncSafeTraceMultiset *shard,
+                      int attr, JVMPI_CallTrace *trace, int64_t weight,
+                      int time_bucket) {
+  if (shard->Add(attr, trace, weight, 0, time_bucket)) {
+    return;
+  }
+  if (overflow_traces_ != nullptr &&
+      overflow_traces_->Add(attr, trace, weight, 0, time_bucket)) {
+    overflow_stack_count_ += weight;
+    Overhead::Increment(Overhead::kOverflowSamples, weight);
+    return;
+  }
+  unknown_stack_count_ += weight;
+  Overhead::Increment(Overhead::kDroppedSamples, weight);
+}
+
+void Profiler::RecordTrace(JVMPI_CallTrace *trace, int64_t weight,
+                           int cpu_state, int64_t virtual_thread) {
+  TruncateStack(max_stack_depth_, trace);
+  TagSetTable::Writer labels(tag_sets_);
+  int attr = labels.Intern(0, google::javaprofiler::Tags::Empty(), nullptr,
+                           cpu_state, virtual_thread);
+  Record(CurrentShard(), attr, trace, weight, CurrentTimeBucket());
+}
+
 void Profiler::Handle(int signum, siginfo_t *info, void *context) {
   IMPLICITLY_USE(signum);
-  IMPLICITLY_USE(info);
   ErrnoRaii err_storage;  // stores and resets errno
+  ScopedOverheadTimer timer(Overhead::kSignalHandler);
+
+  // Signals queued by the wall profiler carry the number of periods the
+  // sample stands for and its CPU state, see WallProfiler::SignalValue().
+  // Those of the threads profiler carry a negative value, see
+  // ThreadsProfiler::SignalValue().
+  int64_t weight = 1;
+  int state_attr = 0;
+  int cpu_state = WallProfiler::kCpuUnknown;
+  if (info != nullptr && info->si_code == SI_QUEUE) {
+    int value = info->si_value.sival_int;
+    if (value > 0) {
+      weight = value & (WallProfiler::kMaxSignalWeight - 1);
+      cpu_state = value >> WallProfiler::kCpuStateShift;
+    } else if (value < 0) {
+      weight = -value >> 8;
+      state_attr = -(-value & 0xff);
+    }
+  }
 
   JVMPI_CallTrace trace;
-  JVMPI_CallFrame frames[kMaxFramesToCapture];
+  // Sized at runtime, alloca being async-safe.
+  JVMPI_CallFrame *frames = static_cast<JVMPI_CallFrame *>(
+      alloca(stack_walk_depth_ * sizeof(JVMPI_CallFrame)));
 
   JNIEnv *env = google::javaprofiler::Accessors::CurrentJniEnv();
   trace.frames = frames;
   trace.env_id = env;
   trace.num_frames = 0;
-  int attr = google::javaprofiler::Accessors::GetAttribute();
+  // The attribute written into the thread context, if any, takes over the
+  // one set through JNI.
+  const volatile int32_t *thread_context = ThreadContext::Current();
+  int64_t base_attr = state_attr;
+  if (base_attr == 0 && thread_context != nullptr) {
+    base_attr = thread_context[0];
+  }
+  if (base_attr == 0) {
+    base_attr = google::javaprofiler::Accessors::GetAttribute();
+  }
+  // Held until the sample is recorded, see TagSetTable::Swap().
+  TagSetTable::Writer labels(tag_sets_);
+  int attr = labels.Intern(base_attr,
+                           google::javaprofiler::Accessors::GetTags(),
+                           thread_context, cpu_state,
+                           VirtualThreads::Mounted());
+  google::javaprofiler::AsyncSafeTraceMultiset *fixed_traces = CurrentShard();
+  int time_bucket = CurrentTimeBucket();
 
   if (env != nullptr) {
     // This is a java thread.
     google::javaprofiler::ASGCTType asgct =
         google::javaprofiler::Asgct::GetAsgct();
-    (*asgct)(&trace, kMaxFramesToCapture, context);
+    (*asgct)(&trace, stack_walk_depth_, context);
 
     if (trace.num_frames < 0) {
       // Did not get a valid java trace.
-      trace.frames[0] =
-          JVMPI_CallFrame{kCallTraceErrorLineNum,
-                          reinterpret_cast<jmethodID>(trace.num_frames)};
-      trace.num_frames = 1;
-      if (!fixed_traces_->Add(attr, &trace)) {
-        unknown_stack_count_++;
+      int error = trace.num_frames;
+      trace.num_frames = 0;
+      if ((error == kUnknownJava || error == kNotWalkableFrameJava) &&
+          stack_walk_depth_ > 1) {
+        // The Java code interrupted may still be found among the compiled
+        // methods, kept as the leaf of the error frame. Its bci is unknown,
+        // and 0 gets it the first line of the method rather than the line
+        // that was running.
+        jmethodID method = JitCodeMap::Find(InterruptedPc(context));
+        if (method != nullptr) {
+          trace.frames[trace.num_frames++] = JVMPI_CallFrame{0, method};
+        }
       }
+      trace.frames[trace.num_frames++] = JVMPI_CallFrame{
+          kCallTraceErrorLineNum, reinterpret_cast<jmethodID>(error)};
+      Record(fixed_traces, attr, &trace, weight, time_bucket);
       return;
     }
+    TruncateStack(max_stack_depth_, &trace);
 
     if (frames[0].lineno >= 0) {
       // Leaf is a java frame, return java trace.
-      if (!fixed_traces_->Add(attr, &trace)) {
-        unknown_stack_count_++;
-      }
+      Record(fixed_traces, attr, &trace, weight, time_bucket);
       return;
     }
   }
 
-  // Collect native trace on top of java trace.
-  // Skip top two frames, which include this function and the signal
-  // handler.
-  const int kFramesToSkip = 2;
+  // Collect native trace on top of java trace, starting from the
+  // interrupted context.
   if (FLAGS_cprof_record_native_stack &&
-      (kMaxFramesToCapture + kFramesToSkip - trace.num_frames > 0)) {
-    void *raw_callstack[kMaxFramesToCapture + kFramesToSkip];
-    int stack_len =
-        backtrace(&raw_callstack[0],
-                  kMaxFramesToCapture + kFramesToSkip - trace.num_frames);
-    if (stack_len > kFramesToSkip) {
-      stack_len -= kFramesToSkip;
+      max_stack_depth_ - trace.num_frames > 0) {
+    void **callstack = static_cast<void **>(
+        alloca((max_stack_depth_ - trace.num_frames) * sizeof(void *)));
+    int stack_len = NativeUnwinder::Unwind(
+        context, callstack, max_stack_depth_ - trace.num_frames);
+    if (stack_len > 0) {
       // Shift java frames to make room for native frames.
       if (trace.num_frames > 0) {
         for (int i = trace.num_frames; i > 0; i--) {
           trace.frames[stack_len + i - 1] = trace.frames[i - 1];
         }
       }
-      void **callstack = &raw_callstack[kFramesToSkip];
       for (int i = 0; i < stack_len; i++) {
         trace.frames[i] = JVMPI_CallFrame{kNativeFrameLineNum,
                                           static_cast<jmethodID>(callstack[i])};
@@ -140,20 +491,13 @@ void Profiler::Handle(int signum, siginfo_t *info, void *context) {
     // counter in such case to provide at least some clue into where the time is
     // being spent. The alternative would be to mark such samples as erroneous
     // but it appears even having just the shared object name is more useful.
-#ifdef __aarch64__
-    uint64_t pc = static_cast<ucontext_t *>(context)->uc_mcontext.pc;
-#else
-    uint64_t pc =
-        static_cast<ucontext_t *>(context)->uc_mcontext.gregs[REG_RIP];
-#endif
+    uint64_t pc = InterruptedPc(context);
     trace.frames[0] =
         JVMPI_CallFrame{kNativeFrameLineNum, reinterpret_cast<jmethodID>(pc)};
     ++trace.num_frames;
   }
 
-  if (!fixed_traces_->Add(attr, &trace)) {
-    unknown_stack_count_++;
-  }
+  Record(fixed_traces, attr, &trace, weight, time_bucket);
 }
 
 // This method schedules the SIGPROF timer to go off every specified interval.
@@ -190,18 +534,56 @@ struct sigaction SignalHandler::SetAction(void (*action)(int, siginfo_t *,
 
 void Profiler::Reset() {
   if (fixed_traces_ == nullptr) {
-    fixed_traces_ = new google::javaprofiler::AsyncSafeTraceMultiset();
+    // The number of shards is fixed for the lifetime of the process, as
+    // the tables can never be released.
+    num_shards_ = NumSamplingShards();
+    num_time_buckets_ = NumTimeBuckets();
+    max_stack_depth_ = MaxStackDepth();
+    stack_walk_depth_ = StackWalkDepth(max_stack_depth_);
+    int64_t max_entries = MaxStackTraces(threads_->Size(), num_shards_);
+    fixed_traces_ =
+        new google::javaprofiler::AsyncSafeTraceMultiset *[num_shards_];
+    for (int i = 0; i < num_shards_; i++) {
+      fixed_traces_[i] = new google::javaprofiler::AsyncSafeTraceMultiset(
+          max_entries, max_entries * FLAGS_cprof_frames_per_stack_trace,
+          num_time_buckets_);
+    }
+    tag_sets_ = new TagSetTable(FLAGS_cprof_max_tag_sets);
+    if (FLAGS_cprof_aggregate_call_tree) {
+      aggregated_tree_ = new google::javaprofiler::CallTraceTree();
+    } else {
+      aggregated_traces_ =
+          new google::javaprofiler::TraceMultiset(num_time_buckets_);
+    }
+    if (FLAGS_cprof_overflow_stack_traces > 0) {
+      overflow_traces_ = new google::javaprofiler::AsyncSafeTraceMultiset(
+          FLAGS_cprof_overflow_stack_traces,
+          static_cast<int64_t>(FLAGS_cprof_overflow_stack_traces) *
+              FLAGS_cprof_frames_per_stack_trace,
+          num_time_buckets_);
+    }
   } else {
-    fixed_traces_->Reset();
+    for (int i = 0; i < num_shards_; i++) {
+      fixed_traces_[i]->Reset();
+    }
+    if (overflow_traces_ != nullptr) {
+      overflow_traces_->Reset();
+    }
+    if (pending_merges_ == 0) {
+      tag_sets_->Clear();
+    }
+    if (aggregated_tree_ != nullptr) {
+      aggregated_tree_->Clear();
+    } else {
+      aggregated_traces_->Clear();
+    }
   }
-  unknown_stack_count_ = 0;
+  ResetWindowStats();
 
   if (FLAGS_cprof_record_native_stack) {
-    // When native stack collection requested, gather a single backtrace before
-    // setting up the signal handler, to avoid running internal initialization
-    // within backtrace from the signal handler.
-    void *raw_callstack[1];
-    backtrace(&raw_callstack[0], 1);
+    // Picks up the libraries loaded since the last profile, before the
+    // signal handler may unwind through them.
+    NativeUnwinder::Refresh(FLAGS_cprof_native_unwind_tables);
   }
 
   // old_action_ is stored, but never used.  This is in case of future
@@ -209,11 +591,192 @@ void Profiler::Reset() {
   old_action_ = handler_.SetAction(&Profiler::Handle);
 }
 
-std::string Profiler::SerializeProfile(
-    JNIEnv *jni, const google::javaprofiler::NativeProcessInfo &native_info) {
+void Profiler::ResetWindowStats() {
+  unknown_stack_count_ = 0;
+  overflow_stack_count_ = 0;
+  flush_count_ = 0;
+  overhead_start_ = Overhead::Snapshot();
+  if (JvmActivity::Enabled()) {
+    jvm_activity_start_ = JvmActivity::Snapshot();
+  }
+  if (num_time_buckets_ > 0) {
+    int64_t bucket_nanos = duration_nanos_ / num_time_buckets_;
+    time_bucket_nanos_.store(bucket_nanos > 0 ? bucket_nanos : 1,
+                             std::memory_order_relaxed);
+    window_start_nanos_.store(MonotonicNanos(), std::memory_order_relaxed);
+  }
+}
+
+double Profiler::MaxFillRatio() {
+  double max_fill = 0;
+  for (int i = 0; i < num_shards_; i++) {
+    double fill = fixed_traces_[i]->FillRatio();
+    if (fill > max_fill) {
+      max_fill = fill;
+    }
+  }
+  return max_fill;
+}
+
+int Profiler::Flush() {
+  flush_count_++;
+  // Methods compiled since the last flush become visible to the signal
+  // handler.
+  JitCodeMap::Publish();
+  int trace_count = 0;
+  for (int i = 0; i < num_shards_; i++) {
+    trace_count += Harvest(fixed_traces_[i]);
+  }
+  if (overflow_traces_ != nullptr) {
+    trace_count += Harvest(overflow_traces_);
+  }
+  return trace_count;
+}
+
+int Profiler::Harvest(google::javaprofiler::AsyncSafeTraceMultiset *from) {
+  ScopedOverheadTimer timer(Overhead::kHarvest);
+  if (aggregated_tree_ != nullptr) {
+    return HarvestSamples(from, aggregated_tree_);
+  }
+  return HarvestSamples(from, aggregated_traces_);
+}
+
+void Profiler::LogCollectionStats() {
+  if (tag_sets_->DroppedCount() > 0) {
+    LOG(WARNING) << ProfileType() << " profile: " << tag_sets_->DroppedCount()
+                 << " samples were recorded without labels, the table of "
+                 << FLAGS_cprof_max_tag_sets << " tag sets was full";
+  }
+  if (tag_sets_->VirtualThreadDroppedCount() > 0) {
+    LOG(WARNING) << ProfileType() << " profile: "
+                 << tag_sets_->VirtualThreadDroppedCount()
+                 << " samples were recorded without their virtual thread, "
+                 << "half of the " << FLAGS_cprof_max_tag_sets
+                 << " tag sets were taken";
+  }
+  if (google::javaprofiler::AttributeTable::DroppedCount() > 0) {
+    LOG(WARNING) << ProfileType() << " profile: "
+                 << google::javaprofiler::AttributeTable::DroppedCount()
+                 << " attribute strings were dropped since the start, "
+                 << "the table of "
+                 << google::javaprofiler::AttributeTable::kMaxStrings
+                 << " strings is full";
+  }
+  int64_t overflow = overflow_stack_count_;
+  int64_t unknown = unknown_stack_count_;
+  if (overflow == 0 && unknown == 0) {
+    LOG(INFO) << ProfileType() << " profile: " << flush_count_ << " flushes";
+    return;
+  }
+  int64_t total = unknown;
+  if (aggregated_tree_ != nullptr) {
+    for (const auto &sample : aggregated_tree_->Samples()) {
+      total += sample.count;
+    }
+  } else {
+    for (const auto &trace : *aggregated_traces_) {
+      total += trace.count;
+    }
+  }
+  LOG(INFO) << ProfileType() << " profile: " << flush_count_ << " flushes, "
+            << overflow << " of " << total
+            << " samples (" << (100.0 * overflow / total)
+            << "%) used the overflow table, " << unknown << " ("
+            << (100.0 * unknown / total) << "%) were dropped. Table size is "
+            << fixed_traces_[0]->MaxEntries() << " x " << num_shards_
+            << " shard(s), overflow size is "
+            << (overflow_traces_ != nullptr ? overflow_traces_->MaxEntries()
+                                            : 0);
+}
+
+std::vector<ArtificialSample> Profiler::ArtificialSamples() {
+  std::vector<ArtificialSample> artificial_samples;
+  if (FLAGS_cprof_overhead_samples) {
+    Overhead::Stats overhead = Overhead::Snapshot().Since(overhead_start_);
+    for (int t = 0; t < Overhead::kNumTimers; t++) {
+      const Overhead::TimerStats &stats = overhead.timers[t];
+      if (stats.count > 0) {
+        artificial_samples.push_back(
+            {std::string("[Profiler overhead: ") +
+                 Overhead::TimerName(static_cast<Overhead::Timer>(t)) + "]",
+             stats.count, stats.total_nanos});
+      }
+    }
+  }
+  if (JvmActivity::Enabled()) {
+    // The pauses stop every thread, they are accounted for once rather
+    // than per thread in the wall profiles.
+    JvmActivity::Stats activity =
+        JvmActivity::Snapshot().Since(jvm_activity_start_);
+    if (activity.gc_pauses > 0) {
+      artificial_samples.push_back(
+          {"[JVM GC pause]", activity.gc_pauses, activity.gc_pause_nanos});
+    }
+    if (activity.compiler_cpu_nanos > 0 || activity.compiled_methods > 0) {
+      artificial_samples.push_back({"[JVM JIT compilation]",
+                                    activity.compiled_methods,
+                                    activity.compiler_cpu_nanos});
+    }
+  }
+  return artificial_samples;
+}
+
+std::string Profiler::SerializeProfile(JNIEnv *jni,
+                                       ProfileProtoBuilder *builder,
+                                       const CompressionOptions &compression) {
+  LogCollectionStats();
+  std::vector<ArtificialSample> artificial_samples = ArtificialSamples();
+  if (aggregated_tree_ != nullptr) {
+    return SerializeAndClearJavaCpuTraces(
+        jni, builder, compression, ProfileType(), duration_nanos_,
+        period_nanos_, aggregated_tree_, unknown_stack_count_, tag_sets_,
+        &artificial_samples);
+  }
   return SerializeAndClearJavaCpuTraces(
-      jni, jvmti_, native_info, ProfileType(), duration_nanos_, period_nanos_,
-      &aggregated_traces_, unknown_stack_count_);
+      jni, builder, compression, ProfileType(), duration_nanos_,
+      period_nanos_, aggregated_traces_, unknown_stack_count_, tag_sets_,
+      &artificial_samples);
+}
+
+bool Profiler::MergeInto(MergedTraces *merged) {
+  if (aggregated_tree_ != nullptr) {
+    return false;
+  }
+  LogCollectionStats();
+  for (const auto &trace : *aggregated_traces_) {
+    // Add() copies the frames.
+    merged->traces.Add(trace.attr, trace.num_frames,
+                       const_cast<JVMPI_CallFrame *>(trace.frames),
+                       trace.count);
+  }
+  aggregated_traces_->Clear();
+  if (merged->collections == 0) {
+    pending_merges_++;
+  }
+  merged->collections++;
+  merged->duration_nanos += duration_nanos_;
+  merged->unknown_stack_count += unknown_stack_count_;
+  return true;
+}
+
+std::string Profiler::SerializeMerged(JNIEnv *jni,
+                                      ProfileProtoBuilder *builder,
+                                      const CompressionOptions &compression,
+                                      MergedTraces *merged) {
+  std::vector<ArtificialSample> artificial_samples = ArtificialSamples();
+  LOG(INFO) << ProfileType() << " profile: merged " << merged->collections
+            << " collections, " << merged->traces.Size() << " traces";
+  std::string profile = SerializeAndClearJavaCpuTraces(
+      jni, builder, compression, ProfileType(), merged->duration_nanos,
+      period_nanos_, &merged->traces, merged->unknown_stack_count, tag_sets_,
+      &artificial_samples);
+  if (merged->collections > 0) {
+    pending_merges_--;
+  }
+  merged->collections = 0;
+  merged->duration_nanos = 0;
+  merged->unknown_stack_count = 0;
+  return profile;
 }
 
 bool CPUProfiler::Collect() {
@@ -224,23 +787,71 @@ bool CPUProfiler::Collect() {
   }
 
   Clock *clock = DefaultClock();
-  // Flush the async table every 100 ms
-  struct timespec flush_interval = {0, 100 * 1000 * 1000};  // 100 millisec
   struct timespec finish_line =
       TimeAdd(clock->Now(), NanosToTimeSpec(duration_nanos_));
+  SleepAndFlush(finish_line, nullptr);
+  Stop();
+  // Delay to allow last signals to be processed.
+  clock->SleepUntil(
+      TimeAdd(finish_line, NanosToTimeSpec(kInitialFlushIntervalNanos)));
+  Flush();
+  return true;
+}
+
+bool CPUProfiler::StartContinuous() {
+  Reset();
+  return Start();
+}
+
+bool CPUProfiler::CollectWindow(int64_t duration_nanos,
+                                const std::atomic<bool> *stopping) {
+  // The statistics cover the window, while the traces harvested since the
+  // last window, if any, were already cleared by its serialization.
+  duration_nanos_ = duration_nanos;
+  // The labels of the last window were serialized, and its bank can be
+  // reused by this one's swap.
+  ClearInactiveTagSets();
+  ResetWindowStats();
+  Clock *clock = DefaultClock();
+  struct timespec start = clock->Now();
+  SleepAndFlush(TimeAdd(start, NanosToTimeSpec(duration_nanos)), stopping);
+  // Samples labeled from now on refer to the other bank, which the
+  // traces of this window can still be serialized along with. Once it
+  // returns, the samples labeled from the former bank were all recorded,
+  // so the flush below takes them into this window.
+  SwapTagSets();
+  // Samples recorded after this flush go to the next window.
+  Flush();
+  duration_nanos_ = TimeSpecToNanos(clock->Now()) - TimeSpecToNanos(start);
+  return !*stopping;
+}
+
+void CPUProfiler::SleepAndFlush(struct timespec finish_line,
+                                const std::atomic<bool> *stopping) {
+  Clock *clock = DefaultClock();
+  // Flush the async tables at an interval that adapts to how fast they
+  // fill up, within the configured bounds.
+  int64_t flush_interval_nanos = NextFlushIntervalNanos(
+      kInitialFlushIntervalNanos, FlushHighWater());
+  struct timespec min_flush_interval = NanosToTimeSpec(MinFlushIntervalNanos());
 
   // Sleep until finish_line, but wakeup periodically to flush the
   // internal tables.
-  while (!AlmostThere(clock, finish_line, flush_interval)) {
-    clock->SleepFor(flush_interval);
+  while (!AlmostThere(clock, finish_line, min_flush_interval)) {
+    if (stopping != nullptr && *stopping) {
+      return;
+    }
+    struct timespec next =
+        TimeAdd(clock->Now(), NanosToTimeSpec(flush_interval_nanos));
+    if (TimeLessThan(finish_line, next)) {
+      next = finish_line;
+    }
+    clock->SleepUntil(next);
+    flush_interval_nanos =
+        NextFlushIntervalNanos(flush_interval_nanos, MaxFillRatio());
     Flush();
   }
   clock->SleepUntil(finish_line);
-  Stop();
-  // Delay to allow last signals to be processed.
-  clock->SleepUntil(TimeAdd(finish_line, flush_interval));
-  Flush();
-  return true;
 }
 
 bool CPUProfiler::Start() {
@@ -266,9 +877,27 @@ void CPUProfiler::Stop() {
 WallProfiler::WallProfiler(jvmtiEnv *jvmti, ThreadTable *threads,
                            int64_t duration_nanos, int64_t period_nanos)
     : Profiler(jvmti, threads, duration_nanos,
-               EffectivePeriodNanos(period_nanos, threads->Size(),
-                                    FLAGS_cprof_wall_max_threads_per_sec,
-                                    duration_nanos)) {}
+               EffectivePeriodNanos(
+                   period_nanos,
+                   // Subsampling the threads keeps the period.
+                   FLAGS_cprof_wall_subsample_threads ? 0 : threads->Size(),
+                   FLAGS_cprof_wall_max_threads_per_sec, duration_nanos)) {}
+
+int64_t WallProfiler::SubsampleInterval(int64_t num_threads,
+                                        int64_t max_threads_per_second,
+                                        int64_t period_nanos) {
+  int64_t threads_per_period =
+      max_threads_per_second * period_nanos / kNanosPerSecond;
+  if (threads_per_period < 1) {
+    threads_per_period = 1;
+  }
+  int64_t interval =
+      (num_threads + threads_per_period - 1) / threads_per_period;
+  if (interval < 1) {
+    interval = 1;
+  }
+  return interval < kMaxSignalWeight ? interval : kMaxSignalWeight - 1;
+}
 
 int64_t WallProfiler::EffectivePeriodNanos(int64_t period_nanos,
                                            int64_t num_threads,
@@ -295,47 +924,347 @@ int64_t WallProfiler::EffectivePeriodNanos(int64_t period_nanos,
 bool WallProfiler::Collect() {
   Reset();
   pid_t my_tid = GetTid();
+  VirtualThreads::StartParkedSampling(period_nanos_,
+                                      &WallProfiler::RecordParked);
 
   Clock *clock = DefaultClock();
-  struct timespec profile_period = {0, period_nanos_};
+  struct timespec start = clock->Now();
   struct timespec finish_line =
-      TimeAdd(clock->Now(), NanosToTimeSpec(duration_nanos_));
+      TimeAdd(start, NanosToTimeSpec(duration_nanos_));
+
+  int num_senders = FLAGS_cprof_wall_signal_threads;
+  if (num_senders < 1) {
+    num_senders = 1;
+  }
+  if (num_senders > kMaxWallSignalThreads) {
+    num_senders = kMaxWallSignalThreads;
+  }
 
   // Send signals to all threads to wakeup and report themselves. Stop
-  // after we reach the finish line.
-  struct timespec next = clock->Now();
+  // after we reach the finish line. The threads are split across the
+  // senders, this thread being the first one.
+  std::atomic<bool> aborted(false);
+  std::vector<std::thread> senders;
+  for (int sender = 1; sender < num_senders; sender++) {
+    senders.emplace_back(&WallProfiler::SignalThreads, this, sender,
+                         num_senders, start, finish_line, my_tid, &aborted);
+  }
+  struct timespec next = SignalThreads(0, num_senders, start, finish_line,
+                                       my_tid, &aborted);
+  for (auto &sender : senders) {
+    sender.join();
+  }
+  VirtualThreads::StopParkedSampling();
+  if (aborted) {
+    return false;
+  }
 
-  int64_t count = 0;
-  const int kFlushPeriod = 128;  // Flush table every 128 samples
-  while (TimeLessThan(next, finish_line)) {
-    if (count > kFlushPeriod) {
-      count = 0;
-      // Periodically flush the internal tables.
+  // Delay to allow last signals to be processed.
+  clock->SleepUntil(TimeAdd(next, NanosToTimeSpec(period_nanos_)));
+  signal(SIGPROF, SIG_IGN);
+  Flush();
+  return true;
+}
+
+bool WallProfiler::ShouldSignal(pid_t tid, int idle_interval,
+                                IdleState *state, int *weight,
+                                CpuState *cpu_state) {
+  int64_t cpu_nanos = ThreadCpuTimeNanos(tid);
+  bool known = state->cpu_nanos >= 0 && cpu_nanos >= 0;
+  bool idle = known && cpu_nanos - state->cpu_nanos <=
+                           FLAGS_cprof_wall_idle_cpu_usec * 1000;
+  state->cpu_nanos = cpu_nanos;
+  *cpu_state = !known ? kCpuUnknown : idle ? kCpuOff : kCpuOn;
+  if (idle && state->skipped + 1 < idle_interval) {
+    // The thread has not run since it was last looked at, so its stack
+    // is unchanged. Credit this period to the next sample instead.
+    // While the thread stays idle this is exact; if it wakes up, the
+    // skipped periods are attributed to the stack it is sampled at.
+    state->skipped++;
+    return false;
+  }
+  *weight = state->skipped + 1;
+  if (*weight >= kMaxSignalWeight) {
+    *weight = kMaxSignalWeight - 1;
+  }
+  state->skipped = 0;
+  return true;
+}
+
+void WallProfiler::RecordParked(JVMPI_CallTrace *trace,
+                                int64_t virtual_thread, int64_t weight) {
+  RecordTrace(trace, weight,
+              FLAGS_cprof_wall_cpu_labels ? kCpuOff : kCpuUnknown,
+              virtual_thread);
+}
+
+const char *WallProfiler::CpuStateName(CpuState cpu_state) {
+  switch (cpu_state) {
+    case kCpuOff:
+      return "off";
+    case kCpuOn:
+      return "on";
+    default:
+      return "unknown";
+  }
+}
+
+struct timespec WallProfiler::SignalThreads(int sender, int num_senders,
+                                            struct timespec start,
+                                            struct timespec finish_line,
+                                            pid_t skip_tid,
+                                            std::atomic<bool> *aborted) {
+  Clock *clock = DefaultClock();
+  struct timespec next = start;
+
+  // Flush the internal tables once they reach the high water mark, or
+  // when the max flush interval elapses, but not more often than the
+  // min flush interval. Only the first sender flushes, as flushes
+  // cannot run concurrently.
+  struct timespec last_flush = next;
+  struct timespec min_flush_interval = NanosToTimeSpec(MinFlushIntervalNanos());
+  struct timespec max_flush_interval = NanosToTimeSpec(MaxFlushIntervalNanos());
+
+  // The thread snapshot is only replaced when the table changed.
+  std::shared_ptr<const std::vector<pid_t>> snapshot;
+
+  // State of the threads handled by this sender, used to skip idle
+  // threads and to label the samples with their CPU state. Rebuilt when
+  // the snapshot changes.
+  const int idle_interval = FLAGS_cprof_wall_idle_sample_interval;
+  const bool track_cpu = idle_interval > 1 || FLAGS_cprof_wall_cpu_labels;
+  std::unordered_map<pid_t, IdleState> idle_threads;
+
+  // With too many threads to signal them all every period, each one is
+  // only signaled once every subsample_interval periods, in the period
+  // given by its pseudo-random phase, its sample standing for all of
+  // them. The seed is the same for all the senders.
+  const bool subsample = FLAGS_cprof_wall_subsample_threads;
+  const uint64_t seed = static_cast<uint64_t>(TimeSpecToNanos(start));
+  int64_t subsample_interval = 1;
+  int64_t period = 0;
+  // Threads to signal over the current period.
+  std::vector<pid_t> targets;
+
+  while (TimeLessThan(next, finish_line) && !*aborted) {
+    struct timespec now = clock->Now();
+    if (sender == 0 &&
+        (TimeLessThan(TimeAdd(last_flush, max_flush_interval), now) ||
+         (MaxFillRatio() >= FlushHighWater() &&
+          TimeLessThan(TimeAdd(last_flush, min_flush_interval), now)))) {
+      last_flush = now;
       Flush();
     }
-    clock->SleepUntil(next);
-    std::vector<pid_t> threads = threads_->Threads();
-    if (threads.size() > FLAGS_cprof_wall_num_threads_cutoff) {
-      LOG(WARNING) << "Aborting wall profiling due to too many threads. "
-                   << "Got " << threads.size() << " threads. "
-                   << "Want up to " << FLAGS_cprof_wall_num_threads_cutoff;
-      return false;  // Too many threads, abort
+
+    std::shared_ptr<const std::vector<pid_t>> current = threads_->Snapshot();
+    if (current != snapshot) {
+      snapshot = current;
+      if (subsample) {
+        int64_t interval =
+            SubsampleInterval(snapshot->size(),
+                              FLAGS_cprof_wall_max_threads_per_sec,
+                              period_nanos_);
+        if (sender == 0 && interval != subsample_interval) {
+          LOG(INFO) << "Wall profiling " << snapshot->size()
+                    << " threads, signaling 1 in " << interval
+                    << " of them per period";
+        }
+        subsample_interval = interval;
+      } else if (snapshot->size() > FLAGS_cprof_wall_num_threads_cutoff) {
+        if (sender == 0) {
+          LOG(WARNING) << "Aborting wall profiling due to too many threads. "
+                       << "Got " << snapshot->size() << " threads. "
+                       << "Want up to " << FLAGS_cprof_wall_num_threads_cutoff;
+        }
+        *aborted = true;  // Too many threads, abort
+        break;
+      }
+      if (track_cpu) {
+        // Drop the state of threads that are gone.
+        std::unordered_map<pid_t, IdleState> live_threads;
+        for (size_t i = sender; i < snapshot->size(); i += num_senders) {
+          auto it = idle_threads.find((*snapshot)[i]);
+          if (it != idle_threads.end()) {
+            live_threads.insert(*it);
+          }
+        }
+        idle_threads.swap(live_threads);
+      }
     }
-    count += threads.size();
-    for (pid_t tid : threads) {
-      if (tid != my_tid) {
+
+    // This sender handles every num_senders-th thread, starting at
+    // sender.
+    const std::vector<pid_t> &threads = *snapshot;
+    const int64_t phase = period % subsample_interval;
+    targets.clear();
+    for (size_t i = sender; i < threads.size(); i += num_senders) {
+      pid_t tid = threads[i];
+      if (tid == skip_tid) {
         // Skip profiler worker thread.
-        TgKill(tid, SIGPROF);
+        continue;
+      }
+      if (subsample_interval > 1 &&
+          SubsamplePhase(tid, seed, subsample_interval) != phase) {
+        continue;
+      }
+      targets.push_back(tid);
+    }
+
+    // Rather than signaling the threads all at once, spread them over
+    // slices of the period, so that each thread is sampled at evenly
+    // spaced times and the signal handlers do not run in a burst.
+    int64_t num_threads = targets.size();
+    int64_t num_slices = period_nanos_ / kMinWallSliceNanos;
+    if (num_slices > num_threads) {
+      num_slices = num_threads;
+    }
+    if (num_slices < 1) {
+      num_slices = 1;
+    }
+    int64_t slice_nanos = period_nanos_ / num_slices;
+    // Offset the senders from each other within a slice.
+    struct timespec slice_start =
+        TimeAdd(next, NanosToTimeSpec(slice_nanos * sender / num_senders));
+    for (int64_t slice = 0; slice < num_slices; slice++) {
+      clock->SleepUntil(
+          TimeAdd(slice_start, NanosToTimeSpec(slice_nanos * slice)));
+      int64_t first = num_threads * slice / num_slices;
+      int64_t last = num_threads * (slice + 1) / num_slices;
+      for (int64_t i = first; i < last; i++) {
+        pid_t tid = targets[i];
+        if (!track_cpu) {
+          if (subsample_interval > 1) {
+            TgSigQueue(tid, SIGPROF,
+                       SignalValue(subsample_interval, kCpuUnknown));
+          } else {
+            TgKill(tid, SIGPROF);
+          }
+          continue;
+        }
+        int weight;
+        CpuState cpu_state;
+        if (ShouldSignal(tid, idle_interval, &idle_threads[tid], &weight,
+                         &cpu_state)) {
+          if (!FLAGS_cprof_wall_cpu_labels) {
+            cpu_state = kCpuUnknown;
+          }
+          // The idle periods skipped are counted in looks at the thread.
+          int64_t periods = weight * subsample_interval;
+          if (periods >= kMaxSignalWeight) {
+            periods = kMaxSignalWeight - 1;
+          }
+          TgSigQueue(tid, SIGPROF, SignalValue(periods, cpu_state));
+        }
+      }
+    }
+    next = TimeAdd(next, NanosToTimeSpec(period_nanos_));
+    period++;
+  }
+  return next;
+}
+
+bool ThreadsProfiler::Collect() {
+  Reset();
+  pid_t my_tid = GetTid();
+
+  Clock *clock = DefaultClock();
+  struct timespec next = clock->Now();
+  struct timespec finish_line =
+      TimeAdd(next, NanosToTimeSpec(duration_nanos_));
+  int64_t max_threads = FLAGS_cprof_threads_max_per_snapshot;
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+
+  // Position in the thread table of the first thread of the next snapshot,
+  // when a snapshot cannot cover all the threads.
+  size_t offset = 0;
+  while (TimeLessThan(next, finish_line)) {
+    clock->SleepUntil(next);
+    std::shared_ptr<const std::vector<pid_t>> snapshot = threads_->Snapshot();
+    const std::vector<pid_t> &threads = *snapshot;
+    int64_t num_threads = threads.size();
+    int64_t num_signaled =
+        num_threads < max_threads ? num_threads : max_threads;
+    if (offset >= threads.size()) {
+      offset = 0;
+    }
+    for (int64_t i = 0; i < num_signaled; i++) {
+      pid_t tid = threads[(offset + i) % threads.size()];
+      // Spread the threads left out over the signaled ones, so that the
+      // weights sum up to the number of threads.
+      int weight = num_threads * (i + 1) / num_signaled -
+                   num_threads * i / num_signaled;
+      char state = ThreadSchedulerState(tid);
+      if (tid == my_tid || state == 0) {
+        // Skip profiler worker thread, and threads that just exited.
+        continue;
       }
+      TgSigQueue(tid, SIGPROF, SignalValue(state, weight));
+    }
+    offset += num_signaled;
+    next = TimeAdd(next, NanosToTimeSpec(period_nanos_));
+    if (MaxFillRatio() >= FlushHighWater()) {
+      Flush();
     }
-    next = TimeAdd(next, profile_period);
   }
+
   // Delay to allow last signals to be processed.
-  clock->SleepUntil(TimeAdd(next, profile_period));
+  clock->SleepFor(NanosToTimeSpec(kInitialFlushIntervalNanos));
   signal(SIGPROF, SIG_IGN);
   Flush();
   return true;
 }
 
+int ThreadsProfiler::SignalValue(char scheduler_state, int weight) {
+  return -((weight << 8) | (scheduler_state & 0xff));
+}
+
+ThreadState ThreadsProfiler::State(int64_t attr,
+                                   const std::string &top_function,
+                                   bool java_frame) {
+  char scheduler_state = static_cast<char>(-attr);
+  if (scheduler_state == 'R') {
+    return kThreadRunnable;
+  }
+  if (top_function == "jdk.internal.misc.Unsafe.park" ||
+      top_function == "sun.misc.Unsafe.park") {
+    return kThreadParked;
+  }
+  if (top_function == "java.lang.Object.wait" ||
+      top_function == "java.lang.Object.wait0" ||
+      top_function == "java.lang.Thread.sleep" ||
+      top_function == "java.lang.Thread.sleep0" ||
+      top_function == "java.lang.Thread.sleepNanos0") {
+    return kThreadWaiting;
+  }
+  if (java_frame) {
+    // Java code only sleeps in the runtime, to enter a monitor or at a
+    // safepoint; the other blocking operations are native methods.
+    return kThreadBlocked;
+  }
+  if (!top_function.empty()) {
+    return kThreadNative;
+  }
+  return kThreadUnknown;
+}
+
+const char *ThreadsProfiler::StateName(ThreadState state) {
+  switch (state) {
+    case kThreadRunnable:
+      return "runnable";
+    case kThreadBlocked:
+      return "blocked";
+    case kThreadWaiting:
+      return "waiting";
+    case kThreadParked:
+      return "parked";
+    case kThreadNative:
+      return "native";
+    default:
+      return "unknown";
+  }
+}
+
 }  // namespace profiler
 }  // namespace cloud
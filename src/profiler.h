@@ -21,13 +21,30 @@
 
 #include <atomic>
 #include <string>
+#include <vector>
 
+#include "src/compression.h"
+#include "src/jvm_activity.h"
+#include "src/overhead.h"
+#include "src/tag_sets.h"
 #include "src/threads.h"
 #include "third_party/javaprofiler/stacktraces.h"
 
 namespace cloud {
 namespace profiler {
 
+class ProfileProtoBuilder;
+struct ArtificialSample;
+
+// Traces of successive collections of a profiler, serialized together as a
+// single profile, see Profiler::MergeInto().
+struct MergedTraces {
+  google::javaprofiler::TraceMultiset traces;
+  int64_t duration_nanos = 0;
+  int64_t unknown_stack_count = 0;
+  int collections = 0;
+};
+
 class SignalHandler {
  public:
   SignalHandler() {}
@@ -62,9 +79,22 @@ class Profiler {
   // Implicitly does a Reset() before starting collection.
   virtual bool Collect() = 0;
 
-  // Serialize the collected traces into a compressed serialized profile.proto
-  std::string SerializeProfile(
-      JNIEnv *jni, const google::javaprofiler::NativeProcessInfo &native_info);
+  // Serialize the collected traces into a compressed serialized profile.proto,
+  // with the given builder.
+  std::string SerializeProfile(JNIEnv *jni, ProfileProtoBuilder *builder,
+                               const CompressionOptions &compression);
+
+  // Moves the traces of the last collection into merged, to be serialized
+  // along with those of the next collections by SerializeMerged(). Their
+  // time buckets are dropped, as each collection has its own. Returns
+  // false, leaving the traces in place, with --cprof_aggregate_call_tree.
+  bool MergeInto(MergedTraces *merged);
+
+  // Serializes the merged traces into a single profile and clears them.
+  // The overhead and JVM activity samples only cover the last collection.
+  std::string SerializeMerged(JNIEnv *jni, ProfileProtoBuilder *builder,
+                              const CompressionOptions &compression,
+                              MergedTraces *merged);
 
   // Signal handler, which records the current stack trace into the profile.
   static void Handle(int signum, siginfo_t *info, void *context);
@@ -72,9 +102,29 @@ class Profiler {
   // Reset internal state to support data collection.
   void Reset();
 
-  // Migrate data from fixed internal table into growable data structure.
-  // Returns number of entries extracted.
-  int Flush() { return HarvestSamples(fixed_traces_, &aggregated_traces_); }
+  // Resets the statistics of the collection, so that the next serialized
+  // profile only accounts for what follows. Unlike Reset(), this can be
+  // called while samples are being recorded.
+  void ResetWindowStats();
+
+  // Migrate data from the fixed internal tables into growable data
+  // structure. Returns number of entries extracted.
+  int Flush();
+
+  // Number of calls to Flush() since the last Reset().
+  int64_t FlushCount() const { return flush_count_; }
+
+  // Duration of the profile, as measured by the last collection in
+  // continuous mode.
+  int64_t DurationNanos() const { return duration_nanos_; }
+
+  // Number of samples dropped since the last Reset() because the fixed
+  // internal tables were full.
+  static int64_t DroppedSampleCount() { return unknown_stack_count_; }
+
+  // Returns the fill ratio of the fullest fixed table. This is
+  // async-safe.
+  static double MaxFillRatio();
 
   // String description of the profile type
   virtual const char *ProfileType() = 0;
@@ -85,22 +135,103 @@ class Profiler {
   int64_t duration_nanos_;
   int64_t period_nanos_;
 
+  // Records a trace walked outside of the signal handler, standing for
+  // weight samples, and labeled with cpu_state and virtual_thread. This is
+  // async-safe.
+  static void RecordTrace(JVMPI_CallTrace *trace, int64_t weight,
+                          int cpu_state, int64_t virtual_thread);
+
+  // When sampling goes on across profiles, moves the labels of the samples
+  // taken from now on to the other bank of the tag sets, and drops the
+  // sets of the bank left once serialized. See TagSetTable::Swap().
+  static void SwapTagSets() { tag_sets_->Swap(); }
+  static void ClearInactiveTagSets() { tag_sets_->ClearInactive(); }
+
  private:
-  // Points to a fixed multiset of traces used during collection. This
-  // is allocated on the first call to Reset(). Will be reused by
+  // Returns the shard of fixed_traces_ the calling thread should record
+  // into. This is async-safe.
+  static google::javaprofiler::AsyncSafeTraceMultiset *CurrentShard();
+
+  // Records a trace into the given shard, spilling into overflow_traces_
+  // when the shard is full. This is async-safe.
+  static void Record(google::javaprofiler::AsyncSafeTraceMultiset *shard,
+                     int attr, JVMPI_CallTrace *trace, int64_t weight,
+                     int time_bucket);
+
+  // Returns the time bucket of a sample taken now, or -1 if the traces
+  // have no time buckets. This is async-safe.
+  static int CurrentTimeBucket();
+
+  // Harvests a fixed table into the aggregated traces or tree.
+  int Harvest(google::javaprofiler::AsyncSafeTraceMultiset *from);
+
+  // Returns the overhead and JVM activity samples to add to the profile,
+  // as enabled.
+  std::vector<ArtificialSample> ArtificialSamples();
+
+  // Logs the number of flushes, and how many samples spilled into the
+  // overflow table or were lost, relative to the total collected.
+  void LogCollectionStats();
+
+  // Points to an array of num_shards_ fixed multisets of traces used
+  // during collection. Samples are spread across the shards by the CPU
+  // the signal is handled on, so that threads running concurrently on
+  // different cores do not contend on the same entries. This is
+  // allocated on the first call to Reset(). Will be reused by
   // subsequent allocations. Cannot be deallocated as it could be in
   // use by other threads, triggered from a signal handler.
-  static google::javaprofiler::AsyncSafeTraceMultiset *fixed_traces_;
+  static google::javaprofiler::AsyncSafeTraceMultiset **fixed_traces_;
+  static int num_shards_;
+
+  // Secondary fixed multiset shared by all shards, used to absorb
+  // traces when a shard runs out of entries. Allocated along with
+  // fixed_traces_, may be null if disabled.
+  static google::javaprofiler::AsyncSafeTraceMultiset *overflow_traces_;
+
+  // Labels of the samples, made of their attribute and the tags of their
+  // thread. The traces record the ids of their tag sets as attributes.
+  // Allocated along with fixed_traces_, and cleared by Reset() unless
+  // merged traces still refer to them.
+  static TagSetTable *tag_sets_;
+  // Number of MergedTraces holding traces not serialized yet.
+  static int pending_merges_;
 
   // Aggregated profile data, populated using data extracted from
-  // fixed_traces.
-  google::javaprofiler::TraceMultiset aggregated_traces_;
+  // fixed_traces. Like fixed_traces_, it is allocated on the first call
+  // to Reset() and shared by subsequent profiles, so that its storage is
+  // reused rather than reallocated for every collection.
+  static google::javaprofiler::TraceMultiset *aggregated_traces_;
+
+  // Calling context tree used instead of aggregated_traces_ when
+  // --cprof_aggregate_call_tree is set. Allocated and shared the same way.
+  static google::javaprofiler::CallTraceTree *aggregated_tree_;
+
+  // Number of time buckets the duration of a profile is split into, fixed
+  // along with fixed_traces_, and 0 when the traces have none. The start
+  // of the profile and the length of its buckets are set by
+  // ResetWindowStats(), as the monotonic clock.
+  static int num_time_buckets_;
+  static std::atomic<int64_t> window_start_nanos_;
+  static std::atomic<int64_t> time_bucket_nanos_;
+
+  // Number of frames stored per trace and walked per sample, fixed along
+  // with fixed_traces_. Stacks walked deeper than stored are cut by
+  // TruncateStack().
+  static int max_stack_depth_;
+  static int stack_walk_depth_;
   jvmtiEnv *jvmti_;
+  int64_t flush_count_ = 0;
+  // Overhead and JVM activity statistics at the last Reset().
+  Overhead::Stats overhead_start_;
+  JvmActivity::Stats jvm_activity_start_;
 
   struct sigaction old_action_;
 
   // Number of samples where the stack aggregation failed.
   static std::atomic<int> unknown_stack_count_;
+
+  // Number of samples recorded into overflow_traces_.
+  static std::atomic<int> overflow_stack_count_;
 };
 
 // CPUProfiler collects cpu profiles by setting up a CPU timer and
@@ -118,12 +249,29 @@ class CPUProfiler : public Profiler {
 
   const char *ProfileType() override { return "cpu"; }
 
+  // Continuous collection, where the profiler keeps sampling across
+  // successive windows, each serialized into its own profile, without
+  // reinstalling the signal handler or re-arming the timers in between.
+  // Starts sampling.
+  bool StartContinuous();
+  // Collects a window of duration_nanos, which ends early once stopping
+  // is set. Returns whether the window should be serialized.
+  bool CollectWindow(int64_t duration_nanos,
+                     const std::atomic<bool> *stopping);
+  // Stops sampling.
+  void StopContinuous() { Stop(); }
+
  private:
   // Initiate data collection at a fixed interval
   bool Start();
 
   // Stop data collection
   void Stop();
+
+  // Sleeps until finish_line, or until stopping is set if not null,
+  // flushing the fixed tables as they fill up.
+  void SleepAndFlush(struct timespec finish_line,
+                     const std::atomic<bool> *stopping);
 };
 
 // WallProfiler collects wallclock profiles by explicitly sending
@@ -142,12 +290,110 @@ class WallProfiler : public Profiler {
                                       int64_t period_nanos,
                                       int64_t duration_nanos);
 
+  // Returns the number of periods over which each of num_threads threads
+  // gets signaled once, for no more than max_threads_per_second to be
+  // signaled per second, see --cprof_wall_subsample_threads.
+  static int64_t SubsampleInterval(int64_t num_threads,
+                                   int64_t max_threads_per_second,
+                                   int64_t period_nanos);
+
   const char *ProfileType() override { return "wall"; }
 
+  // Whether a thread used CPU over the period before a wall sample, see
+  // --cprof_wall_cpu_labels. Recorded in TagSetTable::TagSet::cpu_state.
+  enum CpuState {
+    kCpuUnknown = 0,
+    kCpuOff,
+    kCpuOn,
+  };
+
+  // Returns the value of the signals queued to take a sample standing for
+  // weight periods, which must be less than kMaxSignalWeight.
+  static int SignalValue(int weight, CpuState cpu_state) {
+    return weight | (cpu_state << kCpuStateShift);
+  }
+  static const int kCpuStateShift = 24;
+  static const int kMaxSignalWeight = 1 << kCpuStateShift;
+
+  static const char *CpuStateName(CpuState cpu_state);
+
  private:
+  // Idleness tracking of a thread, see --cprof_wall_idle_sample_interval.
+  struct IdleState {
+    // CPU time of the thread when it was last looked at, or -1.
+    int64_t cpu_nanos = -1;
+    // Number of periods skipped since the thread was last signaled.
+    int skipped = 0;
+  };
+
+  // Returns whether thread tid should be signaled this period, and if
+  // so sets weight to the number of periods the sample stands for, and
+  // cpu_state to whether it ran over the last period.
+  static bool ShouldSignal(pid_t tid, int idle_interval, IdleState *state,
+                           int *weight, CpuState *cpu_state);
+
+  // Records the sample of an unmounted virtual thread, see
+  // VirtualThreads::ParkedRecorder.
+  static void RecordParked(JVMPI_CallTrace *trace, int64_t virtual_thread,
+                           int64_t weight);
+
+  // Signals the share of registered threads handled by sender, out of
+  // num_senders, once per period from start until finish_line or until
+  // aborted is set. Sets aborted if there are too many threads and they
+  // are not subsampled. Returns the end of the last period.
+  struct timespec SignalThreads(int sender, int num_senders,
+                                struct timespec start,
+                                struct timespec finish_line, pid_t skip_tid,
+                                std::atomic<bool> *aborted);
+
   DISALLOW_COPY_AND_ASSIGN(WallProfiler);
 };
 
+// Thread states labeling the samples of the threads profile. The samples
+// are recorded with the negated scheduler state of the thread as attribute,
+// and get their state from it and their top frame when serialized.
+enum ThreadState {
+  kThreadRunnable = 1,
+  kThreadBlocked,   // Waiting to enter a monitor.
+  kThreadWaiting,   // In Object.wait() or Thread.sleep().
+  kThreadParked,    // In LockSupport.park().
+  kThreadNative,    // Sleeping in another native method, e.g. on I/O.
+  kThreadUnknown,
+};
+
+// ThreadsProfiler collects profiles of the state and stack of the threads,
+// by signaling up to --cprof_threads_max_per_snapshot threads of the thread
+// table once per period. When the table holds more threads, successive
+// snapshots cover it in turn and each sample is weighted by the threads it
+// stands for, so that the cost is bounded by the number of threads signaled.
+class ThreadsProfiler : public Profiler {
+ public:
+  using Profiler::Profiler;
+
+  // This type is neither copyable nor movable.
+  ThreadsProfiler(const ThreadsProfiler &) = delete;
+  ThreadsProfiler &operator=(const ThreadsProfiler &) = delete;
+
+  // Collect profiling data.
+  bool Collect() override;
+
+  const char *ProfileType() override { return "threads"; }
+
+  // Returns the signal value that has Handle() record a sample of weight
+  // for a thread in the given scheduler state.
+  static int SignalValue(char scheduler_state, int weight);
+
+  // Returns the thread state of a sample recorded with attribute attr,
+  // whose top frame is in the given function, as simplified by the method
+  // cache, or empty for native and unknown frames. java_frame tells
+  // whether the top frame is a Java method that is not native.
+  static ThreadState State(int64_t attr, const std::string &top_function,
+                           bool java_frame);
+
+  // Returns the label of a thread state.
+  static const char *StateName(ThreadState state);
+};
+
 }  // namespace profiler
 }  // namespace cloud
 
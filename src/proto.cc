@@ -18,88 +18,32 @@
 #include <stdlib.h>
 #include <sys/time.h>
 
-#include <map>
+#include <algorithm>
+#include <functional>
+#include <memory>
 #include <string>
 #include <tuple>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "perftools/profiles/proto/builder.h"
+#include "src/clock.h"
+#include "src/overhead.h"
+#include "src/thread_context.h"
 #include "third_party/javaprofiler/display.h"
 #include "third_party/javaprofiler/stacktrace_fixer.h"
 
+DEFINE_int32(cprof_max_samples_per_profile, 0,
+             "maximum number of distinct traces added as is to a CPU, wall "
+             "or threads profile, the others being truncated, 0 for no "
+             "limit");
+DEFINE_int32(cprof_pruned_stack_depth, 8,
+             "number of outermost frames kept of the traces truncated "
+             "beyond -cprof_max_samples_per_profile");
+
 namespace cloud {
 namespace profiler {
 
-// Encodes a set of java stack traces into a CPU profile, symbolized using
-// the jvmti.
-class ProfileProtoBuilder {
- public:
-  ProfileProtoBuilder(
-      jvmtiEnv *jvmti,
-      const google::javaprofiler::NativeProcessInfo &native_info)
-      : jvmti_(jvmti), native_info_(native_info) {
-    for (const auto &it : google::javaprofiler::AttributeTable::GetStrings()) {
-      builder_.StringId(it.c_str());
-    }
-  }
-
-  // This type is neither copyable nor movable.
-  ProfileProtoBuilder(const ProfileProtoBuilder &) = delete;
-  ProfileProtoBuilder &operator=(const ProfileProtoBuilder &) = delete;
-
-  // Populate the profile with a set of traces
-  void Populate(JNIEnv *jni, const char *profile_type,
-                const google::javaprofiler::TraceMultiset &traces,
-                int64_t duration_ns, int64_t period_ns);
-  void AddArtificialSample(const std::string &name, int64_t count,
-                           int64_t weight);
-  int64_t TotalCount() const;
-  int64_t TotalWeight() const;
-
-  std::string Emit() {
-    std::string out;
-    builder_.Emit(&out);
-    return out;
-  }
-  void Encode(perftools::profiles::Profile *p) {
-    p->Swap(builder_.mutable_profile());
-  }
-
- private:
-  void AddSample(const std::vector<uint64_t> &locations, int64_t count,
-                 int64_t weight, int64_t attr);
-  uint64_t LocationID(JNIEnv *jni,
-                      const google::javaprofiler::JVMPI_CallFrame &frame);
-  uint64_t LocationID(uint64_t address);
-  uint64_t LocationID(const std::string &name);
-  uint64_t LocationID(const std::string &class_name,
-                      const std::string &method_name,
-                      const std::string &signature,
-                      const std::string &file_name, int line_number);
-
-  jvmtiEnv *jvmti_;
-  int64_t total_count_ = 0;
-  int64_t total_weight_ = 0;
-  perftools::profiles::Builder builder_;
-
-  typedef std::tuple<uint64_t, int> Line;
-  class LineHasher {
-   public:
-    size_t operator()(const Line &f) const {
-      size_t hash = std::get<0>(f);
-      hash = hash + ((hash << 8) ^ std::get<1>(f));
-      return static_cast<size_t>(hash);
-    }
-  };
-
-  std::unordered_map<Line, uint64_t, LineHasher> line_map_;
-  std::unordered_map<uint64_t, uint64_t> address_location_;
-
-  const google::javaprofiler::NativeProcessInfo &native_info_;
-};
-
 namespace {
 
 std::string CallTraceErrorToName(int64_t err) {
@@ -124,21 +68,195 @@ std::string CallTraceErrorToName(int64_t err) {
       return "[Deopt]";
     case kSafepoint:
       return "[Safepoint]";
+    case kTruncatedStack:
+      return "[Truncated stack]";
     default:
       return "[Unknown]";
   }
 }
 
+// Whether the frame holds a jmethodID, rather than a native address or a
+// call trace error.
+bool IsMethodFrame(const google::javaprofiler::JVMPI_CallFrame &frame) {
+  return frame.lineno != google::javaprofiler::kNativeFrameLineNum &&
+         frame.lineno != google::javaprofiler::kCallTraceErrorLineNum;
+}
+
+// Sets min_count and min_count_kept so as to keep only the max_samples
+// highest of counts: traces sampled fewer than min_count times are
+// pruned, and so are those sampled exactly min_count times beyond the
+// first min_count_kept ones. Reorders counts.
+void PruningThreshold(std::vector<uint64_t> *counts, int64_t max_samples,
+                      uint64_t *min_count, int64_t *min_count_kept) {
+  std::nth_element(counts->begin(), counts->begin() + max_samples - 1,
+                   counts->end(), std::greater<uint64_t>());
+  *min_count = (*counts)[max_samples - 1];
+  *min_count_kept = max_samples;
+  for (uint64_t count : *counts) {
+    if (count > *min_count) {
+      (*min_count_kept)--;
+    }
+  }
+}
+
 }  // namespace
 
+ProfileProtoBuilder::ProfileProtoBuilder(
+    const google::javaprofiler::NativeProcessInfo *native_info,
+    NativeSymbolCache *native_symbols, MethodCache *methods,
+    int64_t max_entries)
+    : native_info_(native_info),
+      native_symbols_(native_symbols),
+      methods_(methods),
+      max_entries_(max_entries) {}
+
+void ProfileProtoBuilder::Start(JNIEnv *jni,
+                                const CompressionOptions &compression) {
+  methods_->BeginProfile(jni);
+
+  int64_t entries = strings_.size() + functions_.size() + locations_.size();
+  if (max_entries_ > 0 && entries > max_entries_) {
+    LOG(INFO) << "Dropping the profile dictionaries, holding " << entries
+              << " entries";
+    strings_.Clear();
+    functions_.Clear();
+    locations_.clear();
+    function_locations_.Clear();
+    address_locations_.Clear();
+    mapping_names_.clear();
+    attributes_.clear();
+    methods_->ResetFunctionIds();
+    native_info_generation_ = -1;
+  }
+  if (strings_.size() == 0) {
+    // Dictionary id 0 is the empty string, as in the profiles.
+    DictionaryString("");
+  }
+  if (native_info_->Generation() != native_info_generation_) {
+    // Addresses may now belong to other mappings.
+    native_info_generation_ = native_info_->Generation();
+    address_locations_.Clear();
+    mapping_names_.clear();
+    for (const auto &mapping : native_info_->Mappings()) {
+      mapping_names_.push_back(DictionaryString(mapping.name));
+    }
+  }
+
+  // Bumping the profile invalidates all the local ids.
+  profile_++;
+  function_count_ = 0;
+  location_count_ = 0;
+  total_count_ = 0;
+  total_weight_ = 0;
+  tag_labels_.clear();
+  tag_labels_resolved_.clear();
+  out_.clear();
+  stream_ = CompressedOutputStream::New(compression, &out_);
+  if (builder_ == nullptr) {
+    builder_.reset(new perftools::profiles::StreamingBuilder(stream_.get()));
+  } else {
+    builder_->Reset(stream_.get());
+  }
+  local_strings_.resize(strings_.size());
+  local_strings_[0].profile = profile_;
+  local_strings_[0].id = 0;
+}
+
+std::string ProfileProtoBuilder::Emit() {
+  ScopedOverheadTimer timer(Overhead::kEmit);
+  bool ok = builder_->Finish() && stream_->Close();
+  stream_.reset();
+  if (!ok) {
+    return "";
+  }
+  return std::move(out_);
+}
+
 void ProfileProtoBuilder::AddArtificialSample(const std::string &name,
                                               int64_t count, int64_t weight) {
   AddSample({LocationID(name)}, count, weight, 0);
 }
 
-int64_t ProfileProtoBuilder::TotalCount() const { return total_count_; }
+int64_t ProfileProtoBuilder::DictionaryString(const std::string &str) {
+  return strings_.Insert(str.data(), str.size()).first;
+}
+
+int64_t ProfileProtoBuilder::DictionaryFunction(
+    const std::string &simplified_name, const std::string &function_name,
+    const std::string &file_name) {
+  auto fn = std::make_tuple(DictionaryString(simplified_name),
+                            DictionaryString(function_name),
+                            DictionaryString(file_name), int64_t{0});
+  return *functions_.Insert(fn, functions_.size()).first;
+}
+
+int64_t ProfileProtoBuilder::DictionaryLocation(int64_t function,
+                                                int64_t line) {
+  auto inserted = function_locations_.Insert(FunctionLine(function, line),
+                                             locations_.size());
+  if (inserted.second) {
+    locations_.push_back(Location{function, line, 0});
+  }
+  return *inserted.first;
+}
+
+int64_t ProfileProtoBuilder::StringID(int64_t string) {
+  if (string >= local_strings_.size()) {
+    local_strings_.resize(strings_.size());
+  }
+  LocalId &local = local_strings_[string];
+  if (local.profile != profile_) {
+    const perftools::profiles::StringRef &str = strings_.Get(string);
+    local.profile = profile_;
+    local.id = builder_->AddString(str.data, str.size);
+  }
+  return local.id;
+}
+
+uint64_t ProfileProtoBuilder::FunctionID(int64_t function) {
+  if (function >= local_functions_.size()) {
+    local_functions_.resize(functions_.size());
+  }
+  LocalId &local = local_functions_[function];
+  if (local.profile != profile_) {
+    const auto &fn = functions_.KeyAt(function);
+    local.profile = profile_;
+    local.id = ++function_count_;
+    function_.set_id(local.id);
+    function_.set_name(StringID(std::get<0>(fn)));
+    function_.set_system_name(StringID(std::get<1>(fn)));
+    function_.set_filename(StringID(std::get<2>(fn)));
+    function_.set_start_line(std::get<3>(fn));
+    builder_->AddFunction(function_);
+  }
+  return local.id;
+}
 
-int64_t ProfileProtoBuilder::TotalWeight() const { return total_weight_; }
+uint64_t ProfileProtoBuilder::LocationIDFor(uint64_t location) {
+  if (location >= local_locations_.size()) {
+    local_locations_.resize(locations_.size());
+  }
+  LocalId &local = local_locations_[location];
+  if (local.profile != profile_) {
+    const Location &l = locations_[location];
+    local.profile = profile_;
+    local.id = ++location_count_;
+    location_.Clear();
+    location_.set_id(local.id);
+    if (l.address != 0) {
+      // The ids of the mappings follow their order, see PopulateMappings().
+      location_.set_mapping_id(native_info_->Find(l.address) + 1);
+      location_.set_address(l.address);
+    }
+    if (l.function >= 0) {
+      perftools::profiles::Line *line = location_.add_line();
+      line->set_function_id(FunctionID(l.function));
+      line->set_line(l.line);
+    }
+    builder_->AddLocation(location_);
+  }
+  return local.id;
+}
 
 uint64_t ProfileProtoBuilder::LocationID(
     JNIEnv *jni, const google::javaprofiler::JVMPI_CallFrame &frame) {
@@ -151,153 +269,407 @@ uint64_t ProfileProtoBuilder::LocationID(
         CallTraceErrorToName(reinterpret_cast<size_t>(frame.method_id)));
   }
 
-  std::string method_name, class_name, file_name, signature;
   int line_number = 0;
-  google::javaprofiler::GetStackFrameElements(jni, jvmti_, frame, &file_name,
-                                              &class_name, &method_name,
-                                              &signature, &line_number);
-  google::javaprofiler::FixMethodParameters(&signature);
-
-  return LocationID(class_name, method_name, signature, file_name, line_number);
+  MethodCache::Method *method = methods_->Lookup(jni, frame, &line_number);
+  if (method->function_id < 0) {
+    method->function_id = DictionaryFunction(
+        method->simplified_name, method->function_name, method->file_name);
+  }
+  return LocationIDFor(DictionaryLocation(method->function_id, line_number));
 }
 
 uint64_t ProfileProtoBuilder::LocationID(uint64_t address) {
-  uint64_t location_id = address_location_[address];
-  if (location_id != 0) {
-    return location_id;
+  auto inserted = address_locations_.Insert(address, locations_.size());
+  if (inserted.second) {
+    Location location = {-1, 0, address};
+    int mapping = native_info_->Find(address);
+    if (native_symbols_ != nullptr && mapping >= 0) {
+      const std::string &name = native_symbols_->FunctionName(address);
+      if (!name.empty()) {
+        location.function = DictionaryFunction(
+            name, name, native_info_->Mappings()[mapping].name);
+      }
+    }
+    locations_.push_back(location);
   }
-
-  perftools::profiles::Profile *profile = builder_.mutable_profile();
-  location_id = profile->location_size() + 1;
-  address_location_[address] = location_id;
-
-  perftools::profiles::Location *loc = profile->add_location();
-  loc->set_id(location_id);
-  loc->set_address(address);
-
-  return location_id;
+  return LocationIDFor(*inserted.first);
 }
 
 uint64_t ProfileProtoBuilder::LocationID(const std::string &name) {
-  return LocationID("", name, "", "", 0);
+  return LocationIDFor(
+      DictionaryLocation(DictionaryFunction(name, name, ""), 0));
 }
 
-uint64_t ProfileProtoBuilder::LocationID(const std::string &class_name,
-                                         const std::string &method_name,
-                                         const std::string &signature,
-                                         const std::string &file_name,
-                                         int line_number) {
-  perftools::profiles::Profile *profile = builder_.mutable_profile();
-
-  std::string frame_name;
-  if (!class_name.empty()) {
-    frame_name = class_name + ".";
+void ProfileProtoBuilder::Populate(
+    JNIEnv *jni, const char *profile_type,
+    const google::javaprofiler::TraceMultiset &traces, int64_t duration_ns,
+    int64_t period_ns, const TagSetTable *tag_sets) {
+  PopulateHeader(profile_type, duration_ns, period_ns);
+  PopulateMappings();
+
+  uint64_t min_count = 0;
+  int64_t min_count_kept = 0;
+  int64_t max_samples = FLAGS_cprof_max_samples_per_profile;
+  if (max_samples > 0 && traces.Size() > max_samples) {
+    std::vector<uint64_t> counts;
+    counts.reserve(traces.Size());
+    for (const auto &trace : traces) {
+      counts.push_back(trace.count);
+    }
+    PruningThreshold(&counts, max_samples, &min_count, &min_count_kept);
   }
-  frame_name += method_name;
 
-  if (!signature.empty()) {
-    frame_name += signature;
+  google::javaprofiler::TraceMultiset pruned(traces.NumTimeBuckets());
+  int max_depth = FLAGS_cprof_pruned_stack_depth;
+  for (const auto &trace : traces) {
+    if (trace.count == 0) {
+      continue;
+    }
+    if (trace.count < min_count ||
+        (trace.count == min_count && min_count_kept-- <= 0)) {
+      // The outermost frames are the last ones.
+      int depth = trace.num_frames < max_depth ? trace.num_frames : max_depth;
+      pruned.Add(trace.attr, depth,
+                 const_cast<google::javaprofiler::JVMPI_CallFrame *>(
+                     trace.frames + trace.num_frames - depth),
+                 trace.count, trace.time_buckets);
+      continue;
+    }
+    AddTrace(jni, trace, traces.NumTimeBuckets(), duration_ns, period_ns,
+             tag_sets, 0);
   }
+  AddPrunedTraces(jni, profile_type, pruned, duration_ns, period_ns,
+                  tag_sets);
+}
 
-  std::string simplified_name = frame_name;
-  ::google::javaprofiler::SimplifyFunctionName(&simplified_name);
-
-  uint64_t function_id = builder_.FunctionId(
-      simplified_name.c_str(), frame_name.c_str(), file_name.c_str(), 0);
-
-  uint64_t location_id = profile->location_size() + 1;
-  Line function_line(function_id, line_number);
-  auto inserted = line_map_.insert(std::make_pair(function_line, location_id));
-  if (!inserted.second) {
-    return inserted.first->second;
+void ProfileProtoBuilder::AddPrunedTraces(
+    JNIEnv *jni, const char *profile_type,
+    const google::javaprofiler::TraceMultiset &pruned, int64_t duration_ns,
+    int64_t period_ns, const TagSetTable *tag_sets) {
+  if (pruned.Size() == 0) {
+    return;
   }
+  LOG(INFO) << profile_type << " profile: pruned " << pruned.Size()
+            << " truncated traces beyond the "
+            << FLAGS_cprof_max_samples_per_profile << " most sampled ones";
+  uint64_t leaf = LocationID("[Pruned stack]");
+  for (const auto &trace : pruned) {
+    AddTrace(jni, trace, pruned.NumTimeBuckets(), duration_ns, period_ns,
+             tag_sets, leaf);
+  }
+}
 
-  perftools::profiles::Location *loc = profile->add_location();
-  loc->set_id(location_id);
-  perftools::profiles::Line *line = loc->add_line();
-  line->set_function_id(function_id);
-  line->set_line(line_number);
-
-  return location_id;
+void ProfileProtoBuilder::AddTrace(
+    JNIEnv *jni, const google::javaprofiler::TraceMultiset::Trace &trace,
+    int num_time_buckets, int64_t duration_ns, int64_t period_ns,
+    const TagSetTable *tag_sets, uint64_t leaf) {
+  std::vector<uint64_t> &locations = trace_locations_;
+  locations.clear();
+  if (leaf != 0) {
+    locations.push_back(leaf);
+  }
+  const google::javaprofiler::JVMPI_CallFrame *top = nullptr;
+  for (int i = 0; i < trace.num_frames; ++i) {
+    locations.push_back(LocationID(jni, trace.frames[i]));
+    if (top == nullptr && IsMethodFrame(trace.frames[i])) {
+      top = &trace.frames[i];
+    }
+  }
+  int64_t attr;
+  const TagSetTable::TagSet *tag_set =
+      SampleTagSet(tag_sets, trace.attr, &attr);
+  attr = SampleAttribute(jni, attr, top);
+  int64_t count = trace.count;
+  if (trace.time_buckets != nullptr) {
+    for (int i = 0; i < num_time_buckets; ++i) {
+      int64_t bucket_count = trace.time_buckets[i];
+      if (bucket_count != 0) {
+        AddSample(locations, bucket_count, bucket_count * period_ns, attr,
+                  tag_set, trace.attr,
+                  duration_ns * i / num_time_buckets / kNanosPerMilli);
+        count -= bucket_count;
+      }
+    }
+  }
+  if (count > 0) {
+    AddSample(locations, count, count * period_ns, attr, tag_set,
+              trace.attr);
+  }
 }
 
 void ProfileProtoBuilder::Populate(
     JNIEnv *jni, const char *profile_type,
-    const google::javaprofiler::TraceMultiset &traces, int64_t duration_ns,
-    int64_t period_ns) {
-  perftools::profiles::Profile *profile = builder_.mutable_profile();
+    const google::javaprofiler::CallTraceTree &traces, int64_t duration_ns,
+    int64_t period_ns, const TagSetTable *tag_sets) {
+  using google::javaprofiler::CallTraceTree;
+  PopulateHeader(profile_type, duration_ns, period_ns);
+  PopulateMappings();
+
+  const std::vector<CallTraceTree::Node> &nodes = traces.Nodes();
+  const std::vector<CallTraceTree::Sample> &samples = traces.Samples();
+  uint64_t min_count = 0;
+  int64_t min_count_kept = 0;
+  int64_t max_samples = FLAGS_cprof_max_samples_per_profile;
+  if (max_samples > 0 && samples.size() > max_samples) {
+    std::vector<uint64_t> counts;
+    counts.reserve(samples.size());
+    for (const auto &sample : samples) {
+      counts.push_back(sample.count);
+    }
+    PruningThreshold(&counts, max_samples, &min_count, &min_count_kept);
+  }
 
-  profile->mutable_period_type()->set_type(builder_.StringId(profile_type));
-  profile->mutable_period_type()->set_unit(builder_.StringId("nanoseconds"));
-  profile->set_period(period_ns);
-  perftools::profiles::ValueType *sample_type = profile->add_sample_type();
-  sample_type->set_type(builder_.StringId("sample"));
-  sample_type->set_unit(builder_.StringId("count"));
+  // Location of each tree node, resolved on first use. Zero is not a
+  // valid location id.
+  std::vector<uint64_t> node_locations(nodes.size(), 0);
+  std::vector<uint64_t> locations;
+  google::javaprofiler::TraceMultiset pruned;
+  std::vector<google::javaprofiler::JVMPI_CallFrame> frames;
+  int max_depth = FLAGS_cprof_pruned_stack_depth;
+  for (const auto &sample : samples) {
+    int64_t count = sample.count;
+    if (count == 0) {
+      continue;
+    }
+    if (sample.count < min_count ||
+        (sample.count == min_count && min_count_kept-- <= 0)) {
+      frames.clear();
+      for (uint32_t node = sample.node; node != CallTraceTree::kRootNode;
+           node = nodes[node].parent) {
+        frames.push_back(nodes[node].frame);
+      }
+      // The outermost frames are the last ones.
+      int num_frames = frames.size();
+      int depth = num_frames < max_depth ? num_frames : max_depth;
+      pruned.Add(sample.attr, depth, frames.data() + num_frames - depth,
+                 count);
+      continue;
+    }
+    locations.clear();
+    const google::javaprofiler::JVMPI_CallFrame *top = nullptr;
+    for (uint32_t node = sample.node; node != CallTraceTree::kRootNode;
+         node = nodes[node].parent) {
+      uint64_t &location = node_locations[node];
+      if (location == 0) {
+        location = LocationID(jni, nodes[node].frame);
+      }
+      locations.push_back(location);
+      if (top == nullptr && IsMethodFrame(nodes[node].frame)) {
+        top = &nodes[node].frame;
+      }
+    }
+    int64_t attr;
+    const TagSetTable::TagSet *tag_set =
+        SampleTagSet(tag_sets, sample.attr, &attr);
+    AddSample(locations, count, count * period_ns,
+              SampleAttribute(jni, attr, top), tag_set, sample.attr);
+  }
+  AddPrunedTraces(jni, profile_type, pruned, duration_ns, period_ns,
+                  tag_sets);
+}
 
-  sample_type = profile->add_sample_type();
-  sample_type->set_type(builder_.StringId(profile_type));
-  sample_type->set_unit(builder_.StringId("nanoseconds"));
+void ProfileProtoBuilder::PopulateHeader(const char *profile_type,
+                                         int64_t duration_ns,
+                                         int64_t period_ns) {
+  perftools::profiles::Profile header;
 
-  profile->set_default_sample_type(builder_.StringId(profile_type));
+  header.mutable_period_type()->set_type(StringID(profile_type));
+  header.mutable_period_type()->set_unit(StringID("nanoseconds"));
+  header.set_period(period_ns);
+  perftools::profiles::ValueType *sample_type = header.add_sample_type();
+  sample_type->set_type(StringID("sample"));
+  sample_type->set_unit(StringID("count"));
 
-  profile->set_duration_nanos(duration_ns);
+  sample_type = header.add_sample_type();
+  sample_type->set_type(StringID(profile_type));
+  sample_type->set_unit(StringID("nanoseconds"));
 
-  for (const auto &trace : traces) {
-    int64_t count = trace.second;
-    if (count != 0) {
-      std::vector<uint64_t> locations;
-      locations.reserve(trace.first.frames.size());
-      for (const auto &frame : trace.first.frames) {
-        locations.push_back(LocationID(jni, frame));
-      }
-      AddSample(locations, count, count * period_ns, trace.first.attr);
-    }
-  }
+  header.set_default_sample_type(StringID(profile_type));
+
+  header.set_duration_nanos(duration_ns);
+  builder_->AddFields(header);
+}
 
-  for (const auto &mapping : native_info_.Mappings()) {
-    perftools::profiles::Mapping *m = profile->add_mapping();
-    m->set_id(profile->mapping_size());
-    m->set_memory_start(mapping.start);
-    m->set_memory_limit(mapping.limit);
-    m->set_filename(builder_.StringId(mapping.name.c_str()));
+// Mappings are encoded ahead of the samples so that native locations can
+// be associated to them as they are created.
+void ProfileProtoBuilder::PopulateMappings() {
+  perftools::profiles::Mapping m;
+  const auto &mappings = native_info_->Mappings();
+  for (size_t i = 0; i < mappings.size(); ++i) {
+    m.set_id(i + 1);
+    m.set_memory_start(mappings[i].start);
+    m.set_memory_limit(mappings[i].limit);
+    m.set_filename(StringID(mapping_names_[i]));
+    builder_->AddMapping(m);
   }
 }
 
 void ProfileProtoBuilder::AddSample(const std::vector<uint64_t> &locations,
                                     int64_t count, int64_t weight,
-                                    int64_t attr) {
-  perftools::profiles::Profile *profile = builder_.mutable_profile();
-
-  perftools::profiles::Sample *sample = profile->add_sample();
-  sample->add_value(count);
+                                    int64_t attr,
+                                    const TagSetTable::TagSet *tag_set,
+                                    int id, int64_t offset_ms) {
+  sample_.Clear();
+  sample_.add_value(count);
   total_count_ += count;
-  sample->add_value(weight);
+  sample_.add_value(weight);
   total_weight_ += weight;
 
   for (const auto &location : locations) {
-    sample->add_location_id(location);
+    sample_.add_location_id(location);
+  }
+
+  if (attr < 0) {
+    perftools::profiles::Label *label = sample_.add_label();
+    label->set_key(StringID("state"));
+    label->set_str(StringID(
+        ThreadsProfiler::StateName(static_cast<ThreadState>(-attr))));
+  } else if (attr != 0) {
+    if (attr >= attributes_.size()) {
+      // Attributes are registered as the application runs, only add the
+      // new ones.
+      using google::javaprofiler::AttributeTable;
+      for (int i = attributes_.size(), size = AttributeTable::Size();
+           i < size; i++) {
+        attributes_.push_back(
+            DictionaryString(AttributeTable::GetString(i)));
+      }
+    }
+    if (attr < attributes_.size()) {
+      perftools::profiles::Label *label = sample_.add_label();
+      label->set_key(StringID("attr"));
+      label->set_str(StringID(attributes_[attr]));
+    }
+  }
+  if (tag_set != nullptr) {
+    if (id >= tag_labels_.size()) {
+      tag_labels_.resize(id + 1);
+      tag_labels_resolved_.resize(id + 1, false);
+    }
+    std::vector<std::pair<int64_t, int64_t>> &labels = tag_labels_[id];
+    if (!tag_labels_resolved_[id]) {
+      // Reading the tags takes a lock, only do it once per tag set.
+      for (const auto &tag : tag_set->tags.GetAll()) {
+        const std::string *value = tag.second.Get();
+        if (value != nullptr) {
+          labels.emplace_back(DictionaryString(tag.first),
+                              DictionaryString(*value));
+        }
+      }
+      using google::javaprofiler::AttributeTable;
+      for (int i = 0; i < ThreadContext::kNumTags; i++) {
+        int key = ThreadContext::KeyId(i + 1);
+        int value = tag_set->context_tags[i];
+        if (key != 0 && value > 0 && value < AttributeTable::Size()) {
+          labels.emplace_back(
+              DictionaryString(AttributeTable::GetString(key)),
+              DictionaryString(AttributeTable::GetString(value)));
+        }
+      }
+      if (tag_set->cpu_state != WallProfiler::kCpuUnknown) {
+        labels.emplace_back(
+            DictionaryString("cpu"),
+            DictionaryString(WallProfiler::CpuStateName(
+                static_cast<WallProfiler::CpuState>(tag_set->cpu_state))));
+      }
+      if (tag_set->virtual_thread != 0) {
+        labels.emplace_back(
+            DictionaryString("virtual_thread"),
+            DictionaryString(std::to_string(tag_set->virtual_thread)));
+      }
+      tag_labels_resolved_[id] = true;
+    }
+    for (const auto &key_value : labels) {
+      perftools::profiles::Label *label = sample_.add_label();
+      label->set_key(StringID(key_value.first));
+      label->set_str(StringID(key_value.second));
+    }
+  }
+  if (offset_ms >= 0) {
+    perftools::profiles::Label *label = sample_.add_label();
+    label->set_key(StringID("window_offset"));
+    label->set_num(offset_ms);
+    label->set_num_unit(StringID("milliseconds"));
   }
+  builder_->AddSample(sample_);
+}
 
-  if (attr != 0) {
-    perftools::profiles::Label *label = sample->add_label();
-    label->set_key(builder_.StringId("attr"));
-    label->set_str(attr);
+const TagSetTable::TagSet *ProfileProtoBuilder::SampleTagSet(
+    const TagSetTable *tag_sets, int64_t id, int64_t *attr) const {
+  if (tag_sets == nullptr) {
+    *attr = id;
+    return nullptr;
   }
+  const TagSetTable::TagSet *tag_set = tag_sets->Get(id);
+  *attr = tag_set != nullptr ? tag_set->attr : 0;
+  return tag_set;
 }
 
-std::string SerializeAndClearJavaCpuTraces(
-    JNIEnv *env, jvmtiEnv *jvmti,
-    const google::javaprofiler::NativeProcessInfo &native_info,
+int64_t ProfileProtoBuilder::SampleAttribute(
+    JNIEnv *jni, int64_t attr,
+    const google::javaprofiler::JVMPI_CallFrame *top) {
+  if (attr >= 0) {
+    return attr;
+  }
+  std::string top_function;
+  bool java_frame = false;
+  if (top != nullptr) {
+    int line_number;
+    top_function = methods_->Lookup(jni, *top, &line_number)->simplified_name;
+    java_frame = top->lineno >= 0;
+  }
+  return -ThreadsProfiler::State(attr, top_function, java_frame);
+}
+
+namespace {
+
+template <typename Traces>
+std::string SerializeAndClear(
+    JNIEnv *env, ProfileProtoBuilder *b, const CompressionOptions &compression,
     const char *profile_type, int64_t duration_ns, int64_t period_ns,
-    google::javaprofiler::TraceMultiset *traces, int64_t unknown_count) {
-  ProfileProtoBuilder b(jvmti, native_info);
-  b.Populate(env, profile_type, *traces, duration_ns, period_ns);
-  b.AddArtificialSample("[Unknown]", unknown_count, unknown_count * period_ns);
-  LOG(INFO) << "Collected a profile: total count=" << b.TotalCount()
-            << ", weight=" << b.TotalWeight();
-
-  traces->Clear();  // Release traces before binary encoding to reuse memory
-  return b.Emit();
+    Traces *traces, int64_t unknown_count, const TagSetTable *tag_sets,
+    const std::vector<ArtificialSample> *artificial_samples) {
+  ScopedOverheadTimer timer(Overhead::kSerialize);
+  b->Start(env, compression);
+  b->Populate(env, profile_type, *traces, duration_ns, period_ns, tag_sets);
+  b->AddArtificialSample("[Unknown]", unknown_count,
+                         unknown_count * period_ns);
+  if (artificial_samples != nullptr) {
+    for (const auto &sample : *artificial_samples) {
+      b->AddArtificialSample(sample.name, sample.count, sample.weight);
+    }
+  }
+  LOG(INFO) << "Collected a profile: total count=" << b->TotalCount()
+            << ", weight=" << b->TotalWeight();
+
+  traces->Clear();  // Storage is kept for reuse by the next profile
+  return b->Emit();
+}
+
+}  // namespace
+
+std::string SerializeAndClearJavaCpuTraces(
+    JNIEnv *env, ProfileProtoBuilder *builder,
+    const CompressionOptions &compression, const char *profile_type,
+    int64_t duration_ns, int64_t period_ns,
+    google::javaprofiler::TraceMultiset *traces, int64_t unknown_count,
+    const TagSetTable *tag_sets,
+    const std::vector<ArtificialSample> *artificial_samples) {
+  return SerializeAndClear(env, builder, compression, profile_type,
+                           duration_ns, period_ns, traces, unknown_count,
+                           tag_sets, artificial_samples);
+}
+
+std::string SerializeAndClearJavaCpuTraces(
+    JNIEnv *env, ProfileProtoBuilder *builder,
+    const CompressionOptions &compression, const char *profile_type,
+    int64_t duration_ns, int64_t period_ns,
+    google::javaprofiler::CallTraceTree *traces, int64_t unknown_count,
+    const TagSetTable *tag_sets,
+    const std::vector<ArtificialSample> *artificial_samples) {
+  return SerializeAndClear(env, builder, compression, profile_type,
+                           duration_ns, period_ns, traces, unknown_count,
+                           tag_sets, artificial_samples);
 }
 
 }  // namespace profiler
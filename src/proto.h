@@ -17,22 +17,230 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_PROTO_H_
 #define CLOUD_PROFILER_AGENT_JAVA_PROTO_H_
 
+#include <stdint.h>
+
+#include <memory>
 #include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
 
+#include "src/compression.h"
+#include "src/method_cache.h"
+#include "src/native_symbols.h"
 #include "src/profiler.h"
+#include "src/tag_sets.h"
 #include "perftools/profiles/proto/builder.h"
 
 namespace cloud {
 namespace profiler {
 
-// Generates a CPU profile in a compressed serialized profile.proto
-// from a collection of java stack traces, symbolized using the jvmti.
-// Data in traces will be cleared.
+// Encodes sets of java stack traces into CPU profiles, symbolized using the
+// jvmti through the methods cache, and native frames through native_symbols
+// unless null. Each profile is streamed into its compressed serialization
+// as it is populated.
+//
+// The builder is reused across profiles: the strings, functions and
+// locations it encodes are kept in dictionaries, so that a profile only
+// pays for the content the previous ones did not have. Each profile only
+// holds the dictionary entries it references, under ids of its own.
+//
+// Not thread-safe; it is only used from the profiler worker thread.
+class ProfileProtoBuilder {
+ public:
+  // The dictionaries are dropped when a profile starts and they hold more
+  // than max_entries entries; 0 disables the limit.
+  ProfileProtoBuilder(
+      const google::javaprofiler::NativeProcessInfo *native_info,
+      NativeSymbolCache *native_symbols, MethodCache *methods,
+      int64_t max_entries);
+
+  // This type is neither copyable nor movable.
+  ProfileProtoBuilder(const ProfileProtoBuilder &) = delete;
+  ProfileProtoBuilder &operator=(const ProfileProtoBuilder &) = delete;
+
+  // Starts a new profile, compressed as per compression.
+  void Start(JNIEnv *jni, const CompressionOptions &compression);
+
+  // Populate the profile with a set of traces. Unless tag_sets is null,
+  // the attributes of the traces are ids of its tag sets, whose tags are
+  // added as labels. Traces counted per time bucket are split into a
+  // sample per bucket, labeled with the offset of the bucket in the
+  // profile, so that pprof still merges them. Beyond
+  // --cprof_max_samples_per_profile distinct traces, only the most
+  // sampled ones are added as is, the others are truncated to their
+  // outermost frames under a "[Pruned stack]" frame, preserving the totals
+  // and time buckets. This applies to both overloads.
+  void Populate(JNIEnv *jni, const char *profile_type,
+                const google::javaprofiler::TraceMultiset &traces,
+                int64_t duration_ns, int64_t period_ns,
+                const TagSetTable *tag_sets = nullptr);
+  void Populate(JNIEnv *jni, const char *profile_type,
+                const google::javaprofiler::CallTraceTree &traces,
+                int64_t duration_ns, int64_t period_ns,
+                const TagSetTable *tag_sets = nullptr);
+  void AddArtificialSample(const std::string &name, int64_t count,
+                           int64_t weight);
+  int64_t TotalCount() const { return total_count_; }
+  int64_t TotalWeight() const { return total_weight_; }
+
+  // Returns the compressed profile. No further calls should be made
+  // before the next Start().
+  std::string Emit();
+
+ private:
+  // Id of a dictionary entry in the current profile.
+  struct LocalId {
+    uint32_t profile = 0;  // Profile the id belongs to.
+    uint64_t id = 0;
+  };
+
+  struct Location {
+    int64_t function;  // Dictionary id, or -1 for unsymbolized addresses.
+    int64_t line;
+    uint64_t address;
+  };
+
+  typedef std::tuple<int64_t, int64_t> FunctionLine;
+  class FunctionLineHasher {
+   public:
+    size_t operator()(const FunctionLine &f) const {
+      size_t hash = std::get<0>(f);
+      hash = hash + ((hash << 8) ^ std::get<1>(f));
+      return static_cast<size_t>(hash);
+    }
+  };
+
+  class AddressHasher {
+   public:
+    size_t operator()(uint64_t address) const { return address; }
+  };
+
+  // attr is either an attribute of the AttributeTable, or the negated
+  // ThreadState of a threads profile sample. The tags of the tag set, if
+  // not null, are added as labels, and so is the offset of the sample in
+  // the profile unless negative.
+  void AddSample(const std::vector<uint64_t> &locations, int64_t count,
+                 int64_t weight, int64_t attr,
+                 const TagSetTable::TagSet *tag_set = nullptr, int id = 0,
+                 int64_t offset_ms = -1);
+  // Adds the samples of a trace of a multiset with num_time_buckets, under
+  // the leaf location unless 0.
+  void AddTrace(JNIEnv *jni,
+                const google::javaprofiler::TraceMultiset::Trace &trace,
+                int num_time_buckets, int64_t duration_ns, int64_t period_ns,
+                const TagSetTable *tag_sets, uint64_t leaf);
+  // Adds the traces pruned beyond --cprof_max_samples_per_profile, under
+  // a "[Pruned stack]" location.
+  void AddPrunedTraces(JNIEnv *jni, const char *profile_type,
+                       const google::javaprofiler::TraceMultiset &pruned,
+                       int64_t duration_ns, int64_t period_ns,
+                       const TagSetTable *tag_sets);
+  // Returns the tag set of a sample recorded with attribute id, and sets
+  // attr to its attribute.
+  const TagSetTable::TagSet *SampleTagSet(const TagSetTable *tag_sets,
+                                          int64_t id, int64_t *attr) const;
+  // Returns the attribute of a sample recorded with attribute attr, which
+  // for the samples of the threads profile is turned into their negated
+  // ThreadState, given their topmost Java method frame, or null.
+  int64_t SampleAttribute(JNIEnv *jni, int64_t attr,
+                          const google::javaprofiler::JVMPI_CallFrame *top);
+  void PopulateHeader(const char *profile_type, int64_t duration_ns,
+                      int64_t period_ns);
+  void PopulateMappings();
+  uint64_t LocationID(JNIEnv *jni,
+                      const google::javaprofiler::JVMPI_CallFrame &frame);
+  uint64_t LocationID(uint64_t address);
+  uint64_t LocationID(const std::string &name);
+
+  // Return dictionary ids, adding the entries if needed.
+  int64_t DictionaryString(const std::string &str);
+  int64_t DictionaryFunction(const std::string &simplified_name,
+                             const std::string &function_name,
+                             const std::string &file_name);
+  int64_t DictionaryLocation(int64_t function, int64_t line);
+
+  // Return the ids in the current profile of dictionary entries, adding
+  // them to the profile if needed.
+  int64_t StringID(int64_t string);
+  int64_t StringID(const std::string &str) {
+    return StringID(DictionaryString(str));
+  }
+  uint64_t FunctionID(int64_t function);
+  uint64_t LocationIDFor(uint64_t location);
+
+  const google::javaprofiler::NativeProcessInfo *native_info_;
+  NativeSymbolCache *native_symbols_;
+  MethodCache *methods_;
+  const int64_t max_entries_;
+
+  // The dictionaries, kept across profiles.
+  perftools::profiles::StringTable strings_;
+  perftools::profiles::FunctionIndexMap functions_;
+  std::vector<Location> locations_;
+  perftools::profiles::FlatHashMap<FunctionLine, uint64_t, FunctionLineHasher>
+      function_locations_;
+  // Native locations by address, valid while the mappings do not change.
+  perftools::profiles::FlatHashMap<uint64_t, uint64_t, AddressHasher>
+      address_locations_;
+  int64_t native_info_generation_ = -1;
+  // Dictionary ids of the names of the mappings, and of the attribute
+  // strings by attribute.
+  std::vector<int64_t> mapping_names_;
+  std::vector<int64_t> attributes_;
+
+  // State of the current profile.
+  uint32_t profile_ = 0;
+  std::vector<LocalId> local_strings_;
+  std::vector<LocalId> local_functions_;
+  std::vector<LocalId> local_locations_;
+  uint64_t function_count_ = 0;
+  uint64_t location_count_ = 0;
+  int64_t total_count_ = 0;
+  int64_t total_weight_ = 0;
+  // Dictionary ids of the keys and values of the tags, by tag set id, as
+  // the ids are reassigned by each profile. Empty until first used.
+  std::vector<std::vector<std::pair<int64_t, int64_t>>> tag_labels_;
+  std::vector<bool> tag_labels_resolved_;
+  std::string out_;
+  std::unique_ptr<CompressedOutputStream> stream_;
+  std::unique_ptr<perftools::profiles::StreamingBuilder> builder_;
+  // Reused for the locations of each trace.
+  std::vector<uint64_t> trace_locations_;
+  // Reused to encode each sample, location and function.
+  perftools::profiles::Sample sample_;
+  perftools::profiles::Location location_;
+  perftools::profiles::Function function_;
+};
+
+// Activity without a Java stack, added to a profile under a single frame.
+struct ArtificialSample {
+  std::string name;
+  int64_t count;
+  int64_t weight;
+};
+
+// Generates a CPU profile in a compressed serialized profile.proto from a
+// collection of java stack traces, with the builder. Data in traces will
+// be cleared. Unless null, the attributes of the traces are ids of the
+// tag_sets, and the artificial samples are added to the profile.
+std::string SerializeAndClearJavaCpuTraces(
+    JNIEnv *jni, ProfileProtoBuilder *builder,
+    const CompressionOptions &compression, const char *profile_type,
+    int64_t duration_nanos, int64_t period_nanos,
+    google::javaprofiler::TraceMultiset *traces, int64_t unknown_count,
+    const TagSetTable *tag_sets = nullptr,
+    const std::vector<ArtificialSample> *artificial_samples = nullptr);
+
+// Same as above, for traces aggregated into a calling context tree. Each
+// distinct tree node is symbolized once.
 std::string SerializeAndClearJavaCpuTraces(
-    JNIEnv *jni, jvmtiEnv *jvmti,
-    const google::javaprofiler::NativeProcessInfo &native_info,
-    const char *profile_type, int64_t duration_nanos, int64_t period_nanos,
-    google::javaprofiler::TraceMultiset *traces, int64_t unknown_count);
+    JNIEnv *jni, ProfileProtoBuilder *builder,
+    const CompressionOptions &compression, const char *profile_type,
+    int64_t duration_nanos, int64_t period_nanos,
+    google::javaprofiler::CallTraceTree *traces, int64_t unknown_count,
+    const TagSetTable *tag_sets = nullptr,
+    const std::vector<ArtificialSample> *artificial_samples = nullptr);
 
 }  // namespace profiler
 }  // namespace cloud
@@ -0,0 +1,216 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/tag_sets.h"
+
+#include <sched.h>
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+int64_t RoundUpToPowerOfTwo(int64_t n) {
+  int64_t rounded = 1;
+  while (rounded < n) {
+    rounded <<= 1;
+  }
+  return rounded;
+}
+
+bool SameContextTags(const TagSetTable::TagSet &set,
+                     const int32_t *context_tags) {
+  for (int i = 0; i < ThreadContext::kNumTags; i++) {
+    if (set.context_tags[i] != context_tags[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+TagSetTable::TagSetTable(int64_t capacity)
+    : capacity_(RoundUpToPowerOfTwo(capacity > 0 ? capacity : 1)),
+      slots_(new Slot[2 * capacity_]),
+      bank_(0),
+      dropped_(0),
+      virtual_thread_dropped_(0) {
+  size_[0].store(0, std::memory_order_relaxed);
+  size_[1].store(0, std::memory_order_relaxed);
+  writers_[0].count.store(0, std::memory_order_relaxed);
+  writers_[1].count.store(0, std::memory_order_relaxed);
+  for (int64_t i = 0; i < 2 * capacity_; i++) {
+    slots_[i].state.store(kFree, std::memory_order_relaxed);
+    slots_[i].hash = 0;
+    slots_[i].set.attr = 0;
+    slots_[i].set.cpu_state = 0;
+    slots_[i].set.virtual_thread = 0;
+    for (int j = 0; j < ThreadContext::kNumTags; j++) {
+      slots_[i].set.context_tags[j] = 0;
+    }
+  }
+}
+
+int TagSetTable::BeginWrite() {
+  while (true) {
+    int bank = bank_.load();
+    writers_[bank].count.fetch_add(1);
+    // Unless swapped meanwhile, Swap() sees this writer.
+    if (bank_.load() == bank) {
+      return bank;
+    }
+    writers_[bank].count.fetch_sub(1);
+  }
+}
+
+int TagSetTable::Intern(int bank, int64_t attr,
+                        const google::javaprofiler::Tags &tags,
+                        const volatile int32_t *context, int cpu_state,
+                        int64_t virtual_thread) {
+  // The application may update its context concurrently, work on a copy.
+  int32_t context_tags[ThreadContext::kNumTags] = {};
+  bool has_context_tags = false;
+  if (context != nullptr) {
+    for (int i = 0; i < ThreadContext::kNumTags; i++) {
+      context_tags[i] = context[i + 1];
+      has_context_tags |= context_tags[i] != 0;
+    }
+  }
+  if (virtual_thread != 0) {
+    // There may be many more virtual threads than sets, they may only take
+    // half of the table, and are left out of the labels past that.
+    bool insert = size_[bank].load(std::memory_order_relaxed) < capacity_ / 2;
+    int id = Find(bank, attr, tags, context_tags, cpu_state, virtual_thread,
+                  insert);
+    if (id >= 0) {
+      return id;
+    }
+    virtual_thread_dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+  if (attr == 0 && !has_context_tags && cpu_state == 0 &&
+      tags == google::javaprofiler::Tags::Empty()) {
+    return kEmptyId;
+  }
+  int id = Find(bank, attr, tags, context_tags, cpu_state, 0, true);
+  if (id >= 0) {
+    return id;
+  }
+  dropped_.fetch_add(1, std::memory_order_relaxed);
+  return kEmptyId;
+}
+
+int TagSetTable::Find(int bank, int64_t attr,
+                      const google::javaprofiler::Tags &tags,
+                      const int32_t *context_tags, int cpu_state,
+                      int64_t virtual_thread, bool insert) {
+  uint64_t hash = tags.Hash() ^ (static_cast<uint64_t>(attr) *
+                                 uint64_t{0x9e3779b97f4a7c15}) ^
+                  static_cast<uint64_t>(cpu_state) ^
+                  (static_cast<uint64_t>(virtual_thread) *
+                   uint64_t{0xbf58476d1ce4e5b9});
+  for (int i = 0; i < ThreadContext::kNumTags; i++) {
+    hash = (hash ^ static_cast<uint32_t>(context_tags[i])) *
+           uint64_t{0x100000001b3};
+  }
+  int64_t mask = capacity_ - 1;
+  int64_t base = bank * capacity_;
+  for (int64_t probe = 0; probe < capacity_; probe++) {
+    int64_t i = base + ((hash + probe) & mask);
+    Slot &slot = slots_[i];
+    int state = slot.state.load(std::memory_order_acquire);
+    if (state == kFree) {
+      if (!insert) {
+        return -1;
+      }
+      if (slot.state.compare_exchange_strong(state, kWriting,
+                                             std::memory_order_acquire)) {
+        slot.hash = hash;
+        slot.set.attr = attr;
+        slot.set.cpu_state = cpu_state;
+        slot.set.virtual_thread = virtual_thread;
+        for (int j = 0; j < ThreadContext::kNumTags; j++) {
+          slot.set.context_tags[j] = context_tags[j];
+        }
+        slot.set.tags.AsyncSafeCopy(tags);
+        size_[bank].fetch_add(1, std::memory_order_relaxed);
+        slot.state.store(kReady, std::memory_order_release);
+        return i + 1;
+      }
+      // Claimed concurrently, state now holds its new state.
+    }
+    // A slot being written is skipped rather than waited for, as its
+    // writer may not run until this handler returns. At worst the same
+    // labels get a second id.
+    if (state == kReady && slot.hash == hash && slot.set.attr == attr &&
+        slot.set.cpu_state == cpu_state &&
+        slot.set.virtual_thread == virtual_thread &&
+        SameContextTags(slot.set, context_tags) && slot.set.tags == tags) {
+      return i + 1;
+    }
+  }
+  return -1;
+}
+
+const TagSetTable::TagSet *TagSetTable::Get(int id) const {
+  if (id <= kEmptyId || id > 2 * capacity_) {
+    return nullptr;
+  }
+  const Slot &slot = slots_[id - 1];
+  if (slot.state.load(std::memory_order_acquire) != kReady) {
+    return nullptr;
+  }
+  return &slot.set;
+}
+
+void TagSetTable::Clear() {
+  ClearBank(0);
+  ClearBank(1);
+  bank_.store(0, std::memory_order_release);
+  dropped_.store(0, std::memory_order_relaxed);
+  virtual_thread_dropped_.store(0, std::memory_order_relaxed);
+}
+
+void TagSetTable::Swap() {
+  int former = bank_.load(std::memory_order_relaxed);
+  bank_.store(1 - former);
+  // The signal handlers hold their writers for a bounded time.
+  while (writers_[former].count.load() != 0) {
+    sched_yield();
+  }
+}
+
+void TagSetTable::ClearInactive() {
+  ClearBank(1 - bank_.load(std::memory_order_relaxed));
+  dropped_.store(0, std::memory_order_relaxed);
+  virtual_thread_dropped_.store(0, std::memory_order_relaxed);
+}
+
+void TagSetTable::ClearBank(int bank) {
+  for (int64_t i = bank * capacity_; i < (bank + 1) * capacity_; i++) {
+    Slot &slot = slots_[i];
+    if (slot.state.load(std::memory_order_acquire) != kFree) {
+      slot.set.tags.ClearAll();
+      slot.set.attr = 0;
+      slot.set.cpu_state = 0;
+      slot.set.virtual_thread = 0;
+      slot.hash = 0;
+      slot.state.store(kFree, std::memory_order_release);
+    }
+  }
+  size_[bank].store(0, std::memory_order_relaxed);
+}
+
+}  // namespace profiler
+}  // namespace cloud
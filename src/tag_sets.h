@@ -0,0 +1,181 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_TAG_SETS_H_
+#define CLOUD_PROFILER_AGENT_JAVA_TAG_SETS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+#include "src/thread_context.h"
+#include "third_party/javaprofiler/tags.h"
+
+namespace cloud {
+namespace profiler {
+
+// Interns the labels of the samples, made of an integer attribute, of the
+// Tags of the sampled thread, of the tags of its ThreadContext and of the
+// virtual thread mounted on it, into small ids that the trace multisets
+// use as their attribute. Equal labels get the same id, so that samples
+// only differing by the tags of their thread are aggregated, and each
+// distinct set of labels is only resolved once per profile.
+//
+// The table has a fixed capacity and is filled from the signal handler.
+// It is cleared between profiles, when no sample is being recorded. When
+// sampling goes on across profiles, the table has two banks instead: the
+// signal handler fills one while the labels of the last profile are read
+// from the other, which is cleared before the next swap. The handlers
+// label their samples through a Writer, which Swap() waits for, so that
+// no sample gets recorded with an id of the bank left once it returns.
+class TagSetTable {
+ public:
+  class Writer;
+
+  struct TagSet {
+    int64_t attr;
+    google::javaprofiler::Tags tags;
+    // AttributeTable ids of the values of the ThreadContext tags.
+    int32_t context_tags[ThreadContext::kNumTags];
+    // WallProfiler::CpuState of the samples, or 0.
+    int cpu_state;
+    // Id of the virtual thread of the samples, or 0, see VirtualThreads.
+    int64_t virtual_thread;
+  };
+
+  // Id of the samples with no attribute and no tags.
+  static const int kEmptyId = 0;
+
+  // Creates a table of up to capacity sets, rounded up to a power of two.
+  explicit TagSetTable(int64_t capacity);
+
+  // This type is neither copyable nor movable.
+  TagSetTable(const TagSetTable &) = delete;
+  TagSetTable &operator=(const TagSetTable &) = delete;
+
+  // Returns the labels of an id returned by Intern(), or null for
+  // kEmptyId. The returned pointer is valid until the bank of the id gets
+  // cleared.
+  const TagSet *Get(int id) const;
+
+  // Drops all the sets, and makes the first bank active. This is not
+  // async-safe, and must not run concurrently with Intern().
+  void Clear();
+
+  // Makes the writers add to the other bank, which must have been
+  // cleared, and waits for those still adding to the former one. Ids
+  // returned so far stay valid. This is not async-safe.
+  void Swap();
+
+  // Drops the sets of the inactive bank, once the samples labeled with
+  // them were serialized. This is not async-safe.
+  void ClearInactive();
+
+  // Number of calls to Writer::Intern() since the last Clear() or
+  // ClearInactive() that found the table full.
+  int64_t DroppedCount() const {
+    return dropped_.load(std::memory_order_relaxed);
+  }
+
+  // Number of calls to Writer::Intern() since the last Clear() or
+  // ClearInactive() that left the virtual thread out of the labels.
+  int64_t VirtualThreadDroppedCount() const {
+    return virtual_thread_dropped_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  enum SlotState { kFree, kWriting, kReady };
+
+  struct Slot {
+    std::atomic<int> state;
+    uint64_t hash;
+    TagSet set;
+  };
+
+  // Counts a writer of the active bank, and returns the bank.
+  int BeginWrite();
+  void EndWrite(int bank) {
+    writers_[bank].count.fetch_sub(1, std::memory_order_release);
+  }
+
+  // Implements Writer::Intern(), adding to bank.
+  int Intern(int bank, int64_t attr, const google::javaprofiler::Tags &tags,
+             const volatile int32_t *context, int cpu_state,
+             int64_t virtual_thread);
+
+  // Returns the id of the labels in bank, adding them if insert is set, or
+  // -1 if they are not found or the bank is full.
+  int Find(int bank, int64_t attr, const google::javaprofiler::Tags &tags,
+           const int32_t *context_tags, int cpu_state, int64_t virtual_thread,
+           bool insert);
+
+  // Drops the sets of bank.
+  void ClearBank(int bank);
+
+  // Number of sets per bank.
+  int64_t capacity_;
+  // The two banks, one after the other.
+  std::unique_ptr<Slot[]> slots_;
+  // Bank the writers add to.
+  std::atomic<int> bank_;
+  // Number of writers of each bank, on cache lines of their own as every
+  // sample updates them.
+  struct WriterCount {
+    std::atomic<int> count;
+    char padding[64 - sizeof(std::atomic<int>)];
+  };
+  WriterCount writers_[2];
+  // Number of slots taken in each bank.
+  std::atomic<int64_t> size_[2];
+  std::atomic<int64_t> dropped_;
+  std::atomic<int64_t> virtual_thread_dropped_;
+};
+
+// Labels the samples recorded by a signal handler, from its creation
+// until its destruction, which must cover the recording of the samples.
+// This is async-safe.
+class TagSetTable::Writer {
+ public:
+  explicit Writer(TagSetTable *table)
+      : table_(table), bank_(table->BeginWrite()) {}
+  ~Writer() { table_->EndWrite(bank_); }
+
+  // This type is neither copyable nor movable.
+  Writer(const Writer &) = delete;
+  Writer &operator=(const Writer &) = delete;
+
+  // Returns the id of the labels made of attr, tags, the tag slots of
+  // context, if not null, cpu_state and virtual_thread, adding them if
+  // needed. Returns kEmptyId when the table is full. Once half of the
+  // table is taken, new labels leave virtual_thread out. This takes a
+  // bounded time.
+  int Intern(int64_t attr, const google::javaprofiler::Tags &tags,
+             const volatile int32_t *context = nullptr, int cpu_state = 0,
+             int64_t virtual_thread = 0) {
+    return table_->Intern(bank_, attr, tags, context, cpu_state,
+                          virtual_thread);
+  }
+
+ private:
+  TagSetTable *table_;
+  int bank_;
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_TAG_SETS_H_
@@ -0,0 +1,82 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/thread_context.h"
+
+#include <mutex>  // NOLINT(build/c++11)
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+std::mutex key_mutex;
+
+}  // namespace
+
+std::atomic<int> ThreadContext::key_ids_[ThreadContext::kNumSlots];
+__thread const volatile int32_t *ThreadContext::slots_;
+__thread jobject ThreadContext::buffer_;
+
+bool ThreadContext::Register(JNIEnv *jni, jobject buffer) {
+  const volatile int32_t *slots = nullptr;
+  if (buffer != nullptr) {
+    slots = static_cast<int32_t *>(jni->GetDirectBufferAddress(buffer));
+    jlong capacity = jni->GetDirectBufferCapacity(buffer);
+    const jlong min_capacity = kNumSlots * sizeof(int32_t);
+    if (slots == nullptr || capacity < min_capacity ||
+        reinterpret_cast<uintptr_t>(slots) % alignof(int32_t) != 0) {
+      LOG(WARNING) << "Ignoring a thread context buffer which is not an "
+                   << "aligned direct buffer of " << kNumSlots << " integers";
+      return false;
+    }
+  }
+
+  // Unpublish the old buffer before releasing it.
+  slots_ = nullptr;
+  __asm__ __volatile__("" : : : "memory");
+  if (buffer_ != nullptr) {
+    jni->DeleteGlobalRef(buffer_);
+    buffer_ = nullptr;
+  }
+  if (slots != nullptr) {
+    buffer_ = jni->NewGlobalRef(buffer);
+    __asm__ __volatile__("" : : : "memory");
+    slots_ = slots;
+  }
+  return true;
+}
+
+int ThreadContext::RegisterKey(int key_id) {
+  if (key_id == 0) {
+    return 0;
+  }
+  std::lock_guard<std::mutex> lock(key_mutex);
+  for (int slot = 1; slot < kNumSlots; slot++) {
+    int id = key_ids_[slot].load(std::memory_order_relaxed);
+    if (id == key_id) {
+      return slot;
+    }
+    if (id == 0) {
+      key_ids_[slot].store(key_id, std::memory_order_release);
+      return slot;
+    }
+  }
+  return 0;
+}
+
+}  // namespace profiler
+}  // namespace cloud
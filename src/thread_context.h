@@ -0,0 +1,86 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_THREAD_CONTEXT_H_
+#define CLOUD_PROFILER_AGENT_JAVA_THREAD_CONTEXT_H_
+
+#include <jni.h>
+#include <stdint.h>
+
+#include <atomic>
+
+namespace cloud {
+namespace profiler {
+
+// Per-thread context the application writes directly into memory shared
+// with the agent, so that switching the attribute or the tags of a thread
+// is a plain store rather than a JNI call.
+//
+// Each thread registers a direct ByteBuffer of at least kNumSlots native
+// order 32-bit integers. Slot 0 holds the attribute of the samples of the
+// thread, and slot i > 0 the value of the i-th registered key. All of them
+// are AttributeTable ids, with 0 meaning unset. The signal handler reads
+// the slots of the thread it interrupts.
+class ThreadContext {
+ public:
+  static const int kNumSlots = 8;
+  static const int kNumTags = kNumSlots - 1;
+
+  // This type is neither copyable nor movable.
+  ThreadContext(const ThreadContext &) = delete;
+  ThreadContext &operator=(const ThreadContext &) = delete;
+
+  // Makes buffer the context of the current thread, replacing any
+  // previous one, or drops it if buffer is null. Returns false if buffer
+  // is not a direct buffer of at least kNumSlots integers.
+  static bool Register(JNIEnv *jni, jobject buffer);
+
+  // Drops the context of the current thread.
+  static void Unregister(JNIEnv *jni) { Register(jni, nullptr); }
+
+  // Returns the slots of the current thread, or null if it has no
+  // context. This is async-safe.
+  static const volatile int32_t *Current() { return slots_; }
+
+  // Returns the slot of the tag key of AttributeTable id key_id,
+  // allocating one if needed, or 0 if all the slots are taken.
+  static int RegisterKey(int key_id);
+
+  // Returns the AttributeTable id of the key of a tag slot, or 0.
+  static int KeyId(int slot) {
+    return key_ids_[slot].load(std::memory_order_acquire);
+  }
+
+ private:
+  static std::atomic<int> key_ids_[kNumSlots];
+
+  // Accessed from the signal handler, see the comments of Accessors on the
+  // TLS model.
+#if defined(JAVAPROFILER_GLOBAL_DYNAMIC_TLS) || defined(ALPINE)
+  static __thread const volatile int32_t *slots_
+      __attribute__((tls_model("global-dynamic")));
+#else
+  static __thread const volatile int32_t *slots_
+      __attribute__((tls_model("initial-exec")));
+#endif
+  // Global reference keeping the buffer of the thread alive.
+  static __thread jobject buffer_;
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_THREAD_CONTEXT_H_
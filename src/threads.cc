@@ -14,14 +14,26 @@
 
 #include "src/threads.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sched.h>
 #include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
 #include <sys/syscall.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <memory>
 #include <mutex>
+#include <string>
 #include <vector>
 
+#include "src/clock.h"
+
 namespace cloud {
 namespace profiler {
 
@@ -48,11 +60,24 @@ timer_t CreateTimer(pid_t tid) {
 #endif
 }
 
-bool SetTimer(timer_t timer, int64_t period_usec) {
+// Number of timers armed or disarmed at once by StartTimers(), between
+// which the arming thread releases the table lock and yields the CPU.
+const size_t kTimerArmBatch = 256;
+
+// Returns a pseudo-random delay in [1, period_usec] for the first expiry
+// of the timer of thread tid, varying with seed.
+int64_t InitialDelayUsec(pid_t tid, uint64_t seed, int64_t period_usec) {
+  return 1 + static_cast<int64_t>(ThreadHash(tid, seed) %
+                                  static_cast<uint64_t>(period_usec));
+}
+
+// Arms the timer to fire every period_usec of CPU time, first after
+// initial_usec, or disarms it if period_usec is zero.
+bool SetTimer(timer_t timer, int64_t period_usec, int64_t initial_usec) {
   struct itimerspec its = {};
-  its.it_interval.tv_sec = 0;
-  its.it_interval.tv_nsec = period_usec * 1000;
-  its.it_value = its.it_interval;
+  its.it_interval = NanosToTimeSpec(period_usec * 1000);
+  its.it_value = period_usec > 0 ? NanosToTimeSpec(initial_usec * 1000)
+                                 : its.it_interval;
   int err = timer_settime(timer, 0, &its, nullptr);
   if (err) {
     LOG(ERROR) << "Failed to set timer: " << err;
@@ -68,55 +93,248 @@ void DeleteTimer(timer_t timer) {
   }
 }
 
+int CreatePerfEvent(pid_t tid, uint32_t type, uint64_t config, bool freq) {
+  struct perf_event_attr attr = {};
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  attr.freq = freq;
+  // Placeholder until armed, real period or frequency is set on start.
+  attr.sample_period = 1;
+  attr.disabled = 1;
+  // Needed for unprivileged use with perf_event_paranoid >= 2.
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  // Generate a signal on every counter overflow.
+  attr.wakeup_events = 1;
+  int fd = syscall(__NR_perf_event_open, &attr, tid, -1, -1,
+                   PERF_FLAG_FD_CLOEXEC);
+  if (fd == -1) {
+    // This fails the same way for every thread, only report it once.
+    static std::atomic<bool> reported(false);
+    if (!reported.exchange(true)) {
+      LOG(WARNING) << "Failed to open perf event, falling back to timers: "
+                   << strerror(errno);
+    }
+    return -1;
+  }
+  // Deliver SIGPROF to the sampled thread on overflow.
+  struct f_owner_ex owner = {F_OWNER_TID, tid};
+  if (fcntl(fd, F_SETFL, O_ASYNC) == -1 || fcntl(fd, F_SETSIG, SIGPROF) == -1 ||
+      fcntl(fd, F_SETOWN_EX, &owner) == -1) {
+    LOG(ERROR) << "Failed to set up perf event signals: " << strerror(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool SetPerfEvent(int fd, int64_t period_usec, bool freq) {
+  if (period_usec == 0) {
+    if (ioctl(fd, PERF_EVENT_IOC_DISABLE, 0) == -1) {
+      LOG(ERROR) << "Failed to disable perf event: " << strerror(errno);
+      return false;
+    }
+    return true;
+  }
+  // Frequency events sample at a rate in Hz, the task clock counts
+  // nanoseconds.
+  uint64_t period = freq ? 1000 * 1000 / period_usec : period_usec * 1000;
+  if (period == 0) {
+    period = 1;
+  }
+  if (ioctl(fd, PERF_EVENT_IOC_PERIOD, &period) == -1 ||
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0) == -1) {
+    LOG(ERROR) << "Failed to enable perf event: " << strerror(errno);
+    return false;
+  }
+  return true;
+}
+
 }  // namespace
 
+uint64_t ThreadHash(pid_t tid, uint64_t seed) {
+  uint64_t x = (static_cast<uint64_t>(tid) << 32) ^ seed;
+  x += 0x9e3779b97f4a7c15;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+  return x ^ (x >> 31);
+}
+
+ThreadTable::ThreadTable(bool use_timers, const std::string& perf_event)
+    : use_timers_(use_timers),
+      use_perf_events_(false),
+      perf_type_(),
+      perf_config_(),
+      perf_freq_(false),
+      period_usec_(),
+      arm_seed_(),
+      version_(),
+      size_(),
+      snapshot_version_() {
+  if (perf_event.empty()) {
+    return;
+  }
+  if (perf_event == "task-clock") {
+    perf_type_ = PERF_TYPE_SOFTWARE;
+    perf_config_ = PERF_COUNT_SW_TASK_CLOCK;
+  } else if (perf_event == "cycles") {
+    perf_type_ = PERF_TYPE_HARDWARE;
+    perf_config_ = PERF_COUNT_HW_CPU_CYCLES;
+    // There is no fixed number of cycles per unit of time, let the
+    // kernel adjust the period to reach the requested rate.
+    perf_freq_ = true;
+  } else {
+    LOG(ERROR) << "Unknown perf event '" << perf_event
+               << "', using POSIX timers";
+    return;
+  }
+  use_perf_events_ = true;
+}
+
+ThreadTable::ThreadTimer ThreadTable::CreateThreadTimer(pid_t tid) const {
+  ThreadTimer timer = {kInvalidTimer, -1};
+  if (use_perf_events_) {
+    timer.perf_fd = CreatePerfEvent(tid, perf_type_, perf_config_, perf_freq_);
+  }
+  if (timer.perf_fd == -1) {
+    // perf events may be restricted, e.g. in containers.
+    timer.timer = CreateTimer(tid);
+  }
+  return timer;
+}
+
+void ThreadTable::ArmThreadTimer(pid_t tid, const ThreadTimer& timer,
+                                 int64_t period_usec) const {
+  if (timer.perf_fd != -1) {
+    // The kernel does not let the first overflow be moved, the counters
+    // of the threads do differ though.
+    SetPerfEvent(timer.perf_fd, period_usec, perf_freq_);
+  } else if (timer.timer != kInvalidTimer) {
+    // Timers armed together and expiring together would have their
+    // signals delivered in bursts, and sample the threads in lockstep.
+    int64_t initial_usec =
+        period_usec > 0
+            ? InitialDelayUsec(tid, arm_seed_.load(std::memory_order_relaxed),
+                               period_usec)
+            : 0;
+    SetTimer(timer.timer, period_usec, initial_usec);
+  }
+}
+
+void ThreadTable::DeleteThreadTimer(const ThreadTimer& timer) {
+  if (timer.perf_fd != -1) {
+    close(timer.perf_fd);
+  } else if (timer.timer != kInvalidTimer) {
+    DeleteTimer(timer.timer);
+  }
+}
+
 void ThreadTable::RegisterCurrent() {
   pid_t tid = GetTid();
-  timer_t timer = kInvalidTimer;
+  ThreadTimer timer = {kInvalidTimer, -1};
   if (use_timers_) {
-    timer = CreateTimer(tid);
+    timer = CreateThreadTimer(tid);
   }
   std::lock_guard<std::mutex> lock(thread_mutex_);
+  thread_index_[tid] = threads_.size();
   threads_.push_back({tid, timer});
-  if (timer != kInvalidTimer && period_usec_ > 0) {
-    SetTimer(timer, period_usec_);
+  size_.store(threads_.size(), std::memory_order_relaxed);
+  version_.fetch_add(1, std::memory_order_release);
+  // The period only changes under the lock, so the timer cannot be armed
+  // with a period StartTimers() or StopTimers() already replaced.
+  int64_t period_usec = period_usec_.load();
+  if (period_usec > 0) {
+    ArmThreadTimer(tid, timer, period_usec);
   }
 }
 
 void ThreadTable::UnregisterCurrent() {
   pid_t tid = GetTid();
   std::lock_guard<std::mutex> lock(thread_mutex_);
-  for (auto i = threads_.begin(); i != threads_.end(); ++i) {
-    if (i->first == tid) {
-      if (i->second != kInvalidTimer) {
-        DeleteTimer(i->second);
-      }
-      threads_.erase(i);
-      return;
-    }
+  auto it = thread_index_.find(tid);
+  if (it == thread_index_.end()) {
+    return;
   }
+  size_t pos = it->second;
+  thread_index_.erase(it);
+  DeleteThreadTimer(threads_[pos].second);
+  // Move the last thread into the vacated position.
+  if (pos != threads_.size() - 1) {
+    threads_[pos] = threads_.back();
+    thread_index_[threads_[pos].first] = pos;
+  }
+  threads_.pop_back();
+  size_.store(threads_.size(), std::memory_order_relaxed);
+  version_.fetch_add(1, std::memory_order_release);
 }
 
-int64_t ThreadTable::Size() const {
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  return threads_.size();
-}
+std::shared_ptr<const ThreadTable::ThreadSnapshot>
+ThreadTable::CurrentSnapshot() const {
+  uint64_t version = version_.load(std::memory_order_acquire);
+  if (snapshot_version_.load(std::memory_order_acquire) == version) {
+    std::shared_ptr<const ThreadSnapshot> snapshot =
+        std::atomic_load(&snapshot_);
+    if (snapshot != nullptr) {
+      return snapshot;
+    }
+  }
 
-std::vector<pid_t> ThreadTable::Threads() const {
-  std::vector<pid_t> tids;
   std::lock_guard<std::mutex> lock(thread_mutex_);
-  tids.reserve(threads_.size());
+  // The version cannot change while the lock is held.
+  version = version_.load(std::memory_order_acquire);
+  std::shared_ptr<const ThreadSnapshot> snapshot = std::atomic_load(&snapshot_);
+  if (snapshot != nullptr &&
+      snapshot_version_.load(std::memory_order_acquire) == version) {
+    // Another reader rebuilt it already.
+    return snapshot;
+  }
+  std::shared_ptr<ThreadSnapshot> rebuilt(new ThreadSnapshot());
+  rebuilt->tids.reserve(threads_.size());
   for (const auto& t : threads_) {
-    tids.push_back(t.first);
+    rebuilt->tids.push_back(t.first);
   }
-  return tids;
+  snapshot = rebuilt;
+  std::atomic_store(&snapshot_, snapshot);
+  snapshot_version_.store(version, std::memory_order_release);
+  return snapshot;
+}
+
+std::shared_ptr<const std::vector<pid_t>> ThreadTable::Snapshot() const {
+  std::shared_ptr<const ThreadSnapshot> snapshot = CurrentSnapshot();
+  // Share ownership of the whole snapshot.
+  return std::shared_ptr<const std::vector<pid_t>>(snapshot, &snapshot->tids);
 }
 
 void ThreadTable::StartTimers(int64_t period_usec) {
-  std::lock_guard<std::mutex> lock(thread_mutex_);
-  period_usec_ = period_usec;
-  for (const auto& t : threads_) {
-    SetTimer(t.second, period_usec);
+  if (period_usec > 0) {
+    // Different phases at every start.
+    arm_seed_.fetch_add(1, std::memory_order_relaxed);
+  }
+  {
+    std::lock_guard<std::mutex> lock(thread_mutex_);
+    period_usec_.store(period_usec);
+  }
+  // Threads registering from now on arm their timer with period_usec,
+  // those registered earlier are in the snapshot.
+  std::shared_ptr<const ThreadSnapshot> snapshot = CurrentSnapshot();
+  const std::vector<pid_t>& tids = snapshot->tids;
+  for (size_t first = 0; first < tids.size(); first += kTimerArmBatch) {
+    if (first > 0) {
+      sched_yield();
+    }
+    // Armed under the lock, as UnregisterCurrent() deletes the timers, and
+    // a deleted timer id or a closed perf event descriptor may be reused.
+    // The lock is released between batches, so that threads starting or
+    // ending meanwhile do not wait on the whole loop.
+    std::lock_guard<std::mutex> lock(thread_mutex_);
+    size_t last = std::min(first + kTimerArmBatch, tids.size());
+    for (size_t i = first; i < last; i++) {
+      auto it = thread_index_.find(tids[i]);
+      if (it != thread_index_.end()) {
+        ArmThreadTimer(tids[i], threads_[it->second].second, period_usec);
+      }
+    }
   }
 }
 
@@ -128,5 +346,51 @@ bool TgKill(pid_t tid, int signum) {
   return syscall(__NR_tgkill, getpid(), tid, signum) == 0;
 }
 
+bool TgSigQueue(pid_t tid, int signum, int value) {
+  siginfo_t info = {};
+  info.si_signo = signum;
+  info.si_code = SI_QUEUE;
+  info.si_pid = getpid();
+  info.si_uid = getuid();
+  info.si_value.sival_int = value;
+  return syscall(__NR_rt_tgsigqueueinfo, getpid(), tid, signum, &info) == 0;
+}
+
+int64_t ThreadCpuTimeNanos(pid_t tid) {
+  // The kernel encodes the CPU clock of another thread as the complement
+  // of its ID, followed by the per-thread and CPUCLOCK_SCHED bits. This
+  // is what pthread_getcpuclockid() returns for pthreads.
+  const clockid_t kPerThreadSchedClock = 6;
+  clockid_t clock = (~static_cast<clockid_t>(tid) << 3) | kPerThreadSchedClock;
+  struct timespec ts;
+  if (clock_gettime(clock, &ts) != 0) {
+    return -1;
+  }
+  return static_cast<int64_t>(ts.tv_sec) * 1000 * 1000 * 1000 + ts.tv_nsec;
+}
+
+char ThreadSchedulerState(pid_t tid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/stat", tid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  // The state follows the command name, which is within parentheses and
+  // may itself hold spaces and parentheses.
+  char buf[512];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return 0;
+  }
+  buf[len] = '\0';
+  const char *end = strrchr(buf, ')');
+  if (end == nullptr || end[1] != ' ' || end[2] == '\0') {
+    return 0;
+  }
+  return end[2];
+}
+
 }  // namespace profiler
 }  // namespace cloud
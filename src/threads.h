@@ -19,7 +19,11 @@
 
 #include <time.h>
 
+#include <atomic>
+#include <memory>
 #include <mutex>  // NOLINT(build/c++11)
+#include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
@@ -28,15 +32,29 @@
 namespace cloud {
 namespace profiler {
 
+// Returns a pseudo-random hash of thread tid varying with seed, from the
+// splitmix64 finalizer, to spread per-thread events over time.
+uint64_t ThreadHash(pid_t tid, uint64_t seed);
+
 // ThreadTable keeps track of the thread IDs of the known active threads.
 // It is meant to be updated from the OnThreadStart and OnThreadEnd callbacks.
 // When configured to do so, it manages per thread CPU time timers and allows
 // starting and stopping them to generate SIGPROF signal when certain amount of
-// the CPU time expires.
+// the CPU time expires. The timers are either POSIX CPU time timers, or
+// perf events counting the task clock or CPU cycles of the thread, which
+// have a finer resolution and are also available on Alpine.
+//
+// Registration and removal are O(1) and only mark the table as changed.
+// Readers get an immutable snapshot of the threads, which is rebuilt on
+// the first read after a change and shared by all readers until the
+// next change, so that reads of an unchanged table take no lock.
 class ThreadTable {
  public:
-  explicit ThreadTable(bool use_timers)
-      : use_timers_(use_timers), period_usec_() {}
+  // If use_timers is set, per-thread timers are created for registered
+  // threads. perf_event selects perf events instead of POSIX timers for
+  // them, either "task-clock" or "cycles"; POSIX timers are used if it is
+  // empty or unknown.
+  explicit ThreadTable(bool use_timers, const std::string& perf_event = "");
 
   // This type is neither copyable nor movable.
   ThreadTable(const ThreadTable&) = delete;
@@ -47,9 +65,13 @@ class ThreadTable {
   // Unregisters the current thread.
   void UnregisterCurrent();
   // Returns the number of registered threads.
-  int64_t Size() const;
+  int64_t Size() const { return size_.load(std::memory_order_relaxed); }
+  // Returns an immutable snapshot of the IDs of all registered threads.
+  // The same snapshot is returned until a thread is registered or
+  // unregistered, so callers can compare them to detect changes.
+  std::shared_ptr<const std::vector<pid_t>> Snapshot() const;
   // Returns the IDs of all registered threads.
-  std::vector<pid_t> Threads() const;
+  std::vector<pid_t> Threads() const { return *Snapshot(); }
   // Starts per-thread timers.
   void StartTimers(int64_t period_usec);
   // Stops per-thread timers.
@@ -58,14 +80,60 @@ class ThreadTable {
   bool UseTimers() const { return use_timers_; }
 
  private:
+  // Source of the CPU time sampling signals of a thread.
+  struct ThreadTimer {
+    // POSIX CPU time timer, or kInvalidTimer.
+    timer_t timer;
+    // perf event file descriptor, or -1.
+    int perf_fd;
+  };
+
+  struct ThreadSnapshot {
+    std::vector<pid_t> tids;
+  };
+
+  // Creates a disarmed timer for thread tid, of the configured kind.
+  ThreadTimer CreateThreadTimer(pid_t tid) const;
+  // Arms the timer of thread tid to fire every period_usec of CPU time,
+  // from a pseudo-random phase, or disarms it if period_usec is zero.
+  void ArmThreadTimer(pid_t tid, const ThreadTimer& timer,
+                      int64_t period_usec) const;
+  // Releases the timer.
+  static void DeleteThreadTimer(const ThreadTimer& timer);
+
+  // Returns the current snapshot, rebuilding it if the table changed.
+  std::shared_ptr<const ThreadSnapshot> CurrentSnapshot() const;
+
+  // Serializes updates to threads_, thread_index_ and period_usec_, the
+  // arming and deletion of the timers, and snapshot rebuilds.
   mutable std::mutex thread_mutex_;
-  // List of threads and associated timers. The timer ID is kInvalidTimer when
-  // the timer usage is off or the timer creation failed for the thread.
-  std::vector<std::pair<pid_t, timer_t>> threads_;
+  // List of threads and associated timers. The timer ID is kInvalidTimer and
+  // the perf event descriptor is -1 when the timer usage is off or the timer
+  // creation failed for the thread.
+  std::vector<std::pair<pid_t, ThreadTimer>> threads_;
+  // Position of each thread in threads_.
+  std::unordered_map<pid_t, size_t> thread_index_;
   // True when the timer usage is requested.
   bool use_timers_;
+  // True when the timers are perf events, of type perf_type_ and config
+  // perf_config_. perf_freq_ is set when the event is sampled at a
+  // frequency rather than a period of event counts.
+  bool use_perf_events_;
+  uint32_t perf_type_;
+  uint64_t perf_config_;
+  bool perf_freq_;
   // Non-zero when the thread timers have been started.
-  int64_t period_usec_;
+  std::atomic<int64_t> period_usec_;
+  // Varies the phases of the thread timers on every start.
+  std::atomic<uint64_t> arm_seed_;
+  // Incremented on every change to threads_.
+  std::atomic<uint64_t> version_;
+  // Number of entries in threads_.
+  std::atomic<int64_t> size_;
+  // Latest snapshot of threads_, and the version it was built at.
+  // Accessed with the std::atomic_* shared_ptr functions.
+  mutable std::shared_ptr<const ThreadSnapshot> snapshot_;
+  mutable std::atomic<uint64_t> snapshot_version_;
 };
 
 // Returns the thread ID of the current thread.
@@ -74,6 +142,19 @@ pid_t GetTid();
 // Sends a signal to the specified thread.
 bool TgKill(pid_t tid, int signum);
 
+// Sends a signal to the specified thread, along with value, which the
+// receiving SA_SIGINFO handler sees in si_value with si_code SI_QUEUE.
+bool TgSigQueue(pid_t tid, int signum, int value);
+
+// Returns the CPU time consumed by the specified thread of this process,
+// in nanoseconds, or -1 on failure.
+int64_t ThreadCpuTimeNanos(pid_t tid);
+
+// Returns the scheduler state of the specified thread of this process, as
+// reported in /proc, e.g. 'R' when it is running or runnable and 'S' when
+// it sleeps, or 0 on failure.
+char ThreadSchedulerState(pid_t tid);
+
 }  // namespace profiler
 }  // namespace cloud
 
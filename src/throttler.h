@@ -17,6 +17,7 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_THROTTLER_H_
 #define CLOUD_PROFILER_AGENT_JAVA_THROTTLER_H_
 
+#include <functional>
 #include <memory>
 #include <string>
 
@@ -27,7 +28,7 @@ namespace profiler {
 constexpr char kTypeCPU[] = "cpu";
 constexpr char kTypeWall[] = "wall";
 constexpr char kTypeHeap[] = "heap";
-// contention and threads are not supported in Java but are needed here for C++
+constexpr char kTypeHeapAlloc[] = "heap_alloc";
 constexpr char kTypeContention[] = "contention";
 constexpr char kTypeThreads[] = "threads";
 
@@ -64,6 +65,21 @@ class Throttler {
   // Upload the compressed profile proto bytes. Returns false on error.
   virtual bool Upload(std::string profile) = 0;
 
+  // Returns a function uploading the compressed profile proto bytes of this
+  // iteration, to be used in place of Upload(). Unlike Upload(), it remains
+  // valid after the next call to WaitNext(), so the client can upload a
+  // profile while it collects the next one. The calls of the returned
+  // functions must not run concurrently with each other, and must not be
+  // made after the throttler is destroyed.
+  virtual std::function<bool(std::string)> DetachUpload() = 0;
+
+  // Returns a function uploading the compressed profile proto bytes of a
+  // profile of the given type and duration that was not requested through
+  // WaitNext(), as collected by the continuous mode. The same constraints
+  // as for DetachUpload() apply to the returned function.
+  virtual std::function<bool(std::string)> OfflineUpload(
+      const std::string &profile_type, int64_t duration_nanos) = 0;
+
   // Closes the throttler by trying to cancel WaitNext() / Upload() in flight.
   // Those calls may return cancellation error. This method is thread-safe.
   virtual void Close() = 0;
@@ -27,6 +27,7 @@
 #include <cstddef>
 #include <cstdint>
 #include <ctime>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
@@ -39,6 +40,7 @@
 #include "src/clock.h"
 #include "src/cloud_env.h"
 #include "src/globals.h"
+#include "src/overhead.h"
 #include "src/pem_roots.h"
 #include "src/string.h"
 #include "src/throttler.h"
@@ -330,7 +332,7 @@ bool APIThrottler::WaitNext() {
     LOG(INFO) << "Creating a new profile via profiler service";
 
     profile_.Clear();
-    ResetClientContext();
+    ResetClientContext(&ctx_);
 
     // The system clock is used here directly, because clock_->now() returns
     // CLOCK_MONOTONIC, not CLOCK_REALTIME time.
@@ -357,7 +359,10 @@ bool APIThrottler::WaitNext() {
 }
 
 std::string APIThrottler::ProfileType() {
-  api::ProfileType pt = profile_.profile_type();
+  return ProfileTypeName(profile_.profile_type());
+}
+
+std::string APIThrottler::ProfileTypeName(api::ProfileType pt) {
   switch (pt) {
     case api::CPU:
       return kTypeCPU;
@@ -365,8 +370,8 @@ std::string APIThrottler::ProfileType() {
       return kTypeWall;
     case api::HEAP:
       return kTypeHeap;
-    // contention and threads are not supported in Java but are needed here
-    // for C++
+    case api::HEAP_ALLOC:
+      return kTypeHeapAlloc;
     case api::CONTENTION:
       return kTypeContention;
     case api::THREADS:
@@ -384,27 +389,40 @@ int64_t APIThrottler::DurationNanos() {
 }
 
 bool APIThrottler::Upload(std::string profile) {
-  LOG(INFO) << "Uploading " << profile.size() << " bytes of '" << ProfileType()
-            << "' profile data";
+  return UploadProfile(profile_, std::move(profile));
+}
 
-  if (!AddProfileLabels(&profile_, FLAGS_cprof_profile_labels)) {
+std::function<bool(std::string)> APIThrottler::DetachUpload() {
+  api::Profile created = profile_;
+  return [this, created](std::string profile) {
+    return UploadProfile(created, std::move(profile));
+  };
+}
+
+bool APIThrottler::UploadProfile(api::Profile created, std::string profile) {
+  ScopedOverheadTimer timer(Overhead::kUpload);
+  LOG(INFO) << "Uploading " << profile.size() << " bytes of '"
+            << ProfileTypeName(created.profile_type()) << "' profile data";
+
+  if (!AddProfileLabels(&created, FLAGS_cprof_profile_labels)) {
     LOG(ERROR) << "Failed to add profile labels, won't upload the profile";
     return false;
   }
 
   api::UpdateProfileRequest req;
-  *req.mutable_profile() = profile_;
+  *req.mutable_profile() = std::move(created);
 
   req.mutable_profile()->set_profile_bytes(std::move(profile));
-  ResetClientContext();
+  ResetClientContext(&upload_ctx_);
 
   // The system clock is used here directly, because clock_->now() returns
   // CLOCK_MONOTONIC, not CLOCK_REALTIME time.
   // The API server sets a 20 second server-side timeout. All agents should set
   // a corresponding 20 second timeout for UpdateProfile requests.
-  ctx_->set_deadline(std::chrono::system_clock::now() +
-                     std::chrono::seconds{20});
-  grpc::Status st = stub_->UpdateProfile(ctx_.get(), req, &profile_);
+  upload_ctx_->set_deadline(std::chrono::system_clock::now() +
+                            std::chrono::seconds{20});
+  api::Profile updated;
+  grpc::Status st = stub_->UpdateProfile(upload_ctx_.get(), req, &updated);
 
   if (!st.ok()) {
     // TODO: Recognize and retry transient errors.
@@ -415,6 +433,59 @@ bool APIThrottler::Upload(std::string profile) {
   return true;
 }
 
+std::function<bool(std::string)> APIThrottler::OfflineUpload(
+    const std::string& profile_type, int64_t duration_nanos) {
+  api::ProfileType pt = api::PROFILE_TYPE_UNSPECIFIED;
+  for (int i = api::ProfileType_MIN; i <= api::ProfileType_MAX; i++) {
+    if (api::ProfileType_IsValid(i) &&
+        ProfileTypeName(static_cast<api::ProfileType>(i)) == profile_type) {
+      pt = static_cast<api::ProfileType>(i);
+      break;
+    }
+  }
+  return [this, pt, duration_nanos](std::string profile) {
+    return UploadOfflineProfile(pt, duration_nanos, std::move(profile));
+  };
+}
+
+bool APIThrottler::UploadOfflineProfile(api::ProfileType profile_type,
+                                        int64_t duration_nanos,
+                                        std::string profile) {
+  ScopedOverheadTimer timer(Overhead::kUpload);
+  LOG(INFO) << "Uploading " << profile.size() << " bytes of offline '"
+            << ProfileTypeName(profile_type) << "' profile data";
+
+  api::CreateOfflineProfileRequest req;
+  api::Profile* p = req.mutable_profile();
+  if (!InitializeDeployment(env_, FLAGS_cprof_deployment_labels, language_,
+                            p->mutable_deployment())) {
+    LOG(ERROR) << "Failed to initialize deployment, won't upload the profile";
+    return false;
+  }
+  if (!AddProfileLabels(p, FLAGS_cprof_profile_labels)) {
+    LOG(ERROR) << "Failed to add profile labels, won't upload the profile";
+    return false;
+  }
+  req.set_parent("projects/" + p->deployment().project_id());
+  p->set_profile_type(profile_type);
+  p->mutable_duration()->set_seconds(duration_nanos / kNanosPerSecond);
+  p->mutable_duration()->set_nanos(duration_nanos % kNanosPerSecond);
+  p->set_profile_bytes(std::move(profile));
+  ResetClientContext(&upload_ctx_);
+
+  // Same timeout as for UpdateProfile requests.
+  upload_ctx_->set_deadline(std::chrono::system_clock::now() +
+                            std::chrono::seconds{20});
+  api::Profile created;
+  grpc::Status st =
+      stub_->CreateOfflineProfile(upload_ctx_.get(), req, &created);
+  if (!st.ok()) {
+    LOG(ERROR) << "Offline profile upload failed: " << DebugString(st);
+    return false;
+  }
+  return true;
+}
+
 void APIThrottler::OnCreationError(const grpc::Status& st) {
   if (st.error_code() == grpc::StatusCode::ABORTED) {
     int64_t backoff_ns;
@@ -437,15 +508,16 @@ void APIThrottler::OnCreationError(const grpc::Status& st) {
       kMaxBackoffNanos);
 }
 
-void APIThrottler::ResetClientContext() {
+void APIThrottler::ResetClientContext(
+    std::unique_ptr<grpc::ClientContext>* ctx) {
   std::lock_guard<std::mutex> lock(ctx_mutex_);
-  ctx_.reset(new grpc::ClientContext());  // NOLINT
-  ctx_->AddMetadata("x-goog-api-client",
-                    "gccl/" + std::string(CLOUD_PROFILER_AGENT_VERSION) +
-                        "gl-" + language_ + "/" + language_version_);
+  ctx->reset(new grpc::ClientContext());  // NOLINT
+  (*ctx)->AddMetadata("x-goog-api-client",
+                      "gccl/" + std::string(CLOUD_PROFILER_AGENT_VERSION) +
+                          "gl-" + language_ + "/" + language_version_);
 
   if (closed_) {
-    ctx_->TryCancel();
+    (*ctx)->TryCancel();
   }
 }
 
@@ -455,6 +527,9 @@ void APIThrottler::Close() {
   if (ctx_) {
     ctx_->TryCancel();
   }
+  if (upload_ctx_) {
+    upload_ctx_->TryCancel();
+  }
 }
 
 void APIThrottler::BackOff(timespec ts) {
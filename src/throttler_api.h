@@ -60,6 +60,9 @@ class APIThrottler : public Throttler {
   std::string ProfileType() override;
   int64_t DurationNanos() override;
   bool Upload(std::string profile) override;
+  std::function<bool(std::string)> DetachUpload() override;
+  std::function<bool(std::string)> OfflineUpload(
+      const std::string& profile_type, int64_t duration_nanos) override;
   void Close() override;
 
  private:
@@ -70,8 +73,22 @@ class APIThrottler : public Throttler {
   // exponentially increasing value, bounded by kMaxBackoffNanos.
   void OnCreationError(const grpc::Status& st);
 
-  // Resets the client gRPC context for the next call.
-  void ResetClientContext();
+  // Uploads the profile bytes for a profile returned by CreateProfile.
+  bool UploadProfile(google::devtools::cloudprofiler::v2::Profile created,
+                     std::string profile);
+
+  // Creates a profile of the given type and duration with the profile
+  // bytes, using CreateOfflineProfile.
+  bool UploadOfflineProfile(
+      google::devtools::cloudprofiler::v2::ProfileType profile_type,
+      int64_t duration_nanos, std::string profile);
+
+  // Returns the kType* constant for an API profile type.
+  static std::string ProfileTypeName(
+      google::devtools::cloudprofiler::v2::ProfileType pt);
+
+  // Resets a client gRPC context for the next call.
+  void ResetClientContext(std::unique_ptr<grpc::ClientContext>* ctx);
 
   // Back off for a given duration.
   void BackOff(timespec ts);
@@ -96,6 +113,9 @@ class APIThrottler : public Throttler {
   std::atomic<bool> closed_;
   std::mutex ctx_mutex_;
   std::unique_ptr<grpc::ClientContext> ctx_;
+  // Context of the uploads, which may run while the next profile is being
+  // created.
+  std::unique_ptr<grpc::ClientContext> upload_ctx_;
 
   // When true, indicates that the throttler is backing off.
   // For testing only.
@@ -15,6 +15,7 @@
 #include "src/throttler_timed.h"
 
 #include <algorithm>
+#include <functional>
 #include <memory>
 #include <random>
 #include <string>
@@ -22,6 +23,7 @@
 
 #include "src/uploader_file.h"
 #include "src/uploader_gcs.h"
+#include "src/uploader_socket.h"
 
 DEFINE_int32(cprof_interval_sec, cloud::profiler::kProfileWaitSeconds, "");
 DEFINE_int32(cprof_duration_sec, cloud::profiler::kProfileDurationSeconds, "");
@@ -38,11 +40,16 @@ const int64_t kRandomRange = 100000;
 
 // Gets the sampling configuration from the flags.
 int64_t GetConfiguration(int64_t* duration_cpu_ns, int64_t* duration_wall_ns,
-                         bool* enable_heap) {
+                         int64_t* duration_heap_alloc_ns,
+                         int64_t* duration_contention_ns,
+                         int64_t* duration_threads_ns, bool* enable_heap) {
   int64_t duration_ns = FLAGS_cprof_duration_sec * kNanosPerSecond;
 
   *duration_cpu_ns = 0;
   *duration_wall_ns = 0;
+  *duration_heap_alloc_ns = 0;
+  *duration_contention_ns = 0;
+  *duration_threads_ns = 0;
 
   // Currently heap is always disabled if not forced explictly.
   *enable_heap = false;
@@ -56,6 +63,12 @@ int64_t GetConfiguration(int64_t* duration_cpu_ns, int64_t* duration_wall_ns,
     *duration_wall_ns = duration_ns;
   } else if (FLAGS_cprof_force == kTypeHeap) {
     *enable_heap = true;
+  } else if (FLAGS_cprof_force == kTypeHeapAlloc) {
+    *duration_heap_alloc_ns = duration_ns;
+  } else if (FLAGS_cprof_force == kTypeContention) {
+    *duration_contention_ns = duration_ns;
+  } else if (FLAGS_cprof_force == kTypeThreads) {
+    *duration_threads_ns = duration_ns;
   } else {
     LOG(ERROR) << "Unrecognized option cprof_force=" << FLAGS_cprof_force
                << ", profiling disabled";
@@ -77,6 +90,12 @@ std::unique_ptr<ProfileUploader> UploaderFromFlags(const std::string& path) {
     LOG(ERROR) << "Expected non-empty profile path";
     return nullptr;
   }
+  std::string socket_path = TryStripPrefix(path, "unix:");
+  if (socket_path != path) {
+    LOG(INFO) << "Will hand profiles over to the host collector";
+    return std::unique_ptr<ProfileUploader>(
+        new SocketUploader(DefaultCloudEnv(), socket_path));
+  }
   std::string filename = TryStripPrefix(path, "gs://");
   if (filename != path) {
     LOG(INFO) << "Will upload profiles to Google Cloud Storage";
@@ -100,10 +119,16 @@ TimedThrottler::TimedThrottler(std::unique_ptr<ProfileUploader> uploader,
       profile_count_(),
       uploader_(std::move(uploader)) {
   interval_ns_ =
-      GetConfiguration(&duration_cpu_ns_, &duration_wall_ns_, &enable_heap_);
+      GetConfiguration(&duration_cpu_ns_, &duration_wall_ns_,
+                       &duration_heap_alloc_ns_, &duration_contention_ns_,
+                       &duration_threads_ns_, &enable_heap_);
 
   LOG(INFO) << "sampling duration: cpu=" << duration_cpu_ns_ / kNanosPerSecond
-            << "s, wall=" << duration_wall_ns_ / kNanosPerSecond;
+            << "s, wall=" << duration_wall_ns_ / kNanosPerSecond
+            << "s, heap_alloc=" << duration_heap_alloc_ns_ / kNanosPerSecond
+            << "s, contention="
+            << duration_contention_ns_ / kNanosPerSecond
+            << "s, threads=" << duration_threads_ns_ / kNanosPerSecond << "s";
   LOG(INFO) << "sampling interval: " << interval_ns_ / kNanosPerSecond << "s";
   LOG(INFO) << "sampling delay: " << FLAGS_cprof_delay_sec << "s";
   LOG(INFO) << "heap sampling enabled: " << enable_heap_;
@@ -128,8 +153,10 @@ TimedThrottler::TimedThrottler(std::unique_ptr<ProfileUploader> uploader,
 
 bool TimedThrottler::WaitNext() {
   if (!uploader_ ||
-      (duration_cpu_ns_ == 0 && duration_wall_ns_ == 0 && !enable_heap_)) {
-    // Refuse profiling if CPU, wall, and heap are disabled or no uploader.
+      (duration_cpu_ns_ == 0 && duration_wall_ns_ == 0 &&
+       duration_heap_alloc_ns_ == 0 && duration_contention_ns_ == 0 &&
+       duration_threads_ns_ == 0 && !enable_heap_)) {
+    // Refuse profiling if all profile types are disabled or no uploader.
     LOG(WARNING) << "Profiling disabled";
     return false;
   }
@@ -148,7 +175,9 @@ bool TimedThrottler::WaitNext() {
     profile_count_++;
 
     int64_t random_value = dist_(gen_);
-    int64_t wait_range_ns = interval_ns_ - duration_cpu_ns_ - duration_wall_ns_;
+    int64_t wait_range_ns = interval_ns_ - duration_cpu_ns_ -
+                            duration_wall_ns_ - duration_heap_alloc_ns_ -
+                            duration_contention_ns_ - duration_threads_ns_;
     if (wait_range_ns < 0) {
       wait_range_ns = 0;
     }
@@ -178,6 +207,15 @@ bool TimedThrottler::WaitNext() {
     if (enable_heap_) {
       cur_.push_back({kTypeHeap, 0});
     }
+    if (duration_heap_alloc_ns_ > 0) {
+      cur_.push_back({kTypeHeapAlloc, duration_heap_alloc_ns_});
+    }
+    if (duration_contention_ns_ > 0) {
+      cur_.push_back({kTypeContention, duration_contention_ns_});
+    }
+    if (duration_threads_ns_ > 0) {
+      cur_.push_back({kTypeThreads, duration_threads_ns_});
+    }
     // Randomize the profile type order.
     std::shuffle(cur_.begin(), cur_.end(), gen_);
   }
@@ -200,6 +238,28 @@ bool TimedThrottler::Upload(std::string profile) {
   return uploader_->Upload(cur_.back().first, profile);
 }
 
+std::function<bool(std::string)> TimedThrottler::DetachUpload() {
+  if (cur_.empty() || !uploader_) {
+    return [](std::string profile) { return false; };
+  }
+  ProfileUploader* uploader = uploader_.get();
+  std::string profile_type = cur_.back().first;
+  return [uploader, profile_type](std::string profile) {
+    return uploader->Upload(profile_type, profile);
+  };
+}
+
+std::function<bool(std::string)> TimedThrottler::OfflineUpload(
+    const std::string& profile_type, int64_t duration_nanos) {
+  if (!uploader_) {
+    return [](std::string profile) { return false; };
+  }
+  ProfileUploader* uploader = uploader_.get();
+  return [uploader, profile_type](std::string profile) {
+    return uploader->Upload(profile_type, profile);
+  };
+}
+
 void TimedThrottler::Close() { closed_ = true; }
 
 }  // namespace profiler
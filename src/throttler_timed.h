@@ -36,7 +36,8 @@ class TimedThrottler : public Throttler {
  public:
   // Creates a timed throttler where path specifies the prefix path at which to
   // store the collected profiles. The path may be a Google Cloud Storage path,
-  // prefixed with "gs://".
+  // prefixed with "gs://", or the Unix socket of a host collector, prefixed
+  // with "unix:".
   explicit TimedThrottler(const std::string& path);
 
   // Testing-only constructor.
@@ -47,12 +48,18 @@ class TimedThrottler : public Throttler {
   std::string ProfileType() override;
   int64_t DurationNanos() override;
   bool Upload(std::string profile) override;
+  std::function<bool(std::string)> DetachUpload() override;
+  std::function<bool(std::string)> OfflineUpload(
+      const std::string& profile_type, int64_t duration_nanos) override;
   void Close() override;
 
  private:
   Clock* clock_;
   int64_t duration_cpu_ns_;
   int64_t duration_wall_ns_;
+  int64_t duration_heap_alloc_ns_;
+  int64_t duration_contention_ns_;
+  int64_t duration_threads_ns_;
   bool enable_heap_;
   int64_t interval_ns_;
   // The throttler is closing, cancel ongoing and future requests.
@@ -0,0 +1,265 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/upload_queue.h"
+
+#include <algorithm>
+#include <chrono>  // NOLINT
+#include <utility>
+
+#include "src/clock.h"
+#include "src/globals.h"
+
+DEFINE_int32(cprof_upload_retries, 2,
+             "number of times a failed profile upload is retried, with "
+             "exponential backoff, before the profile is spilled to the "
+             "upload spool if any, or discarded");
+DEFINE_int32(cprof_upload_retry_backoff_msec, 1000,
+             "backoff before the first retry of a failed upload, in "
+             "milliseconds, doubled after each further failure");
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+// Upper bound on the backoff between upload attempts.
+const int64_t kMaxUploadBackoffNanos = 5 * 60 * kNanosPerSecond;
+
+// Interval at which the upload thread checks for spooled profiles to
+// upload while it has nothing else to do.
+const int64_t kSpoolPollNanos = kNanosPerSecond;
+
+int64_t InitialBackoffNanos() {
+  return int64_t{FLAGS_cprof_upload_retry_backoff_msec} * kNanosPerMilli;
+}
+
+int64_t NextBackoffNanos(int64_t backoff_nanos) {
+  return std::min(2 * backoff_nanos, kMaxUploadBackoffNanos);
+}
+
+int64_t NowNanos() { return TimeSpecToNanos(DefaultClock()->Now()); }
+
+}  // namespace
+
+UploadQueue::UploadQueue(int max_depth, std::unique_ptr<UploadSpool> spool,
+                         OfflineUpload offline_upload)
+    : max_depth_(max_depth < 1 ? 1 : max_depth),
+      spool_(std::move(spool)),
+      offline_upload_(std::move(offline_upload)) {}
+
+UploadQueue::~UploadQueue() { Stop(); }
+
+void UploadQueue::Start() { thread_ = std::thread(&UploadQueue::Run, this); }
+
+bool UploadQueue::Add(std::unique_ptr<PendingUpload> upload) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (queue_.size() >= max_depth_ && !stopping_) {
+    if (spool_ != nullptr) {
+      lock.unlock();
+      LOG(INFO) << "Spilling the " << upload->profile_type << " profile, "
+                << "waiting on " << max_depth_ << " pending uploads";
+      std::lock_guard<std::mutex> spool_lock(spool_mutex_);
+      Spill(upload.get());
+      return true;
+    }
+    LOG(INFO) << "Waiting on " << queue_.size()
+              << " pending uploads before the next profile";
+    changed_.wait(lock, [this] {
+      return stopping_ || queue_.size() < max_depth_;
+    });
+  }
+  if (stopping_) {
+    if (spool_ == nullptr) {
+      return false;
+    }
+    // Keep it for the next process to upload, as Stop() does with the
+    // pending ones.
+    lock.unlock();
+    LOG(INFO) << "Spilling the " << upload->profile_type << " profile, "
+              << "the uploads are stopped";
+    std::lock_guard<std::mutex> spool_lock(spool_mutex_);
+    Spill(upload.get());
+    return true;
+  }
+  queue_.push_back(std::move(upload));
+  changed_.notify_all();
+  return true;
+}
+
+void UploadQueue::Stop() {
+  std::deque<std::unique_ptr<PendingUpload>> pending;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    pending.swap(queue_);
+  }
+  changed_.notify_all();
+  if (thread_.joinable()) {
+    thread_.join();
+  }
+  if (pending.empty()) {
+    return;
+  }
+  if (spool_ == nullptr) {
+    LOG(WARNING) << "Discarding " << pending.size() << " pending uploads";
+    return;
+  }
+  // Keep them for the next process to upload.
+  std::lock_guard<std::mutex> spool_lock(spool_mutex_);
+  for (auto &upload : pending) {
+    Spill(upload.get());
+  }
+}
+
+bool UploadQueue::Upload(PendingUpload *upload) {
+  if (upload->proto != nullptr) {
+    if (!CompressProfile(*upload->proto, upload->compression,
+                         &upload->data)) {
+      return false;
+    }
+    upload->proto.reset();
+  }
+  if (upload->data.empty()) {
+    LOG(ERROR) << "No profile bytes collected, skipping the upload";
+    return false;
+  }
+  return upload->upload(upload->data);
+}
+
+void UploadQueue::Run() {
+  while (true) {
+    std::unique_ptr<PendingUpload> upload;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto ready = [this] { return stopping_ || !queue_.empty(); };
+      if (spool_ != nullptr) {
+        changed_.wait_for(lock, std::chrono::nanoseconds(kSpoolPollNanos),
+                          ready);
+      } else {
+        changed_.wait(lock, ready);
+      }
+      if (stopping_) {
+        return;
+      }
+      if (!queue_.empty()) {
+        upload = std::move(queue_.front());
+        queue_.pop_front();
+      }
+    }
+    if (upload == nullptr) {
+      // The fresh profiles go first, the spooled ones wait for a lull.
+      UploadSpooled();
+      continue;
+    }
+    // Let a blocked Add() go on with the next profile.
+    changed_.notify_all();
+    if (UploadWithRetries(upload.get())) {
+      continue;
+    }
+    if (spool_ != nullptr && !upload->data.empty()) {
+      std::lock_guard<std::mutex> spool_lock(spool_mutex_);
+      Spill(upload.get());
+    } else {
+      LOG(ERROR) << "Error on " << upload->profile_type
+                 << " profile upload, discarding the profile";
+    }
+  }
+}
+
+bool UploadQueue::UploadWithRetries(PendingUpload *upload) {
+  int64_t backoff_nanos = InitialBackoffNanos();
+  for (int attempt = 0;; attempt++) {
+    if (Upload(upload)) {
+      return true;
+    }
+    // No point in retrying when there is nothing to upload.
+    if (attempt >= FLAGS_cprof_upload_retries || upload->data.empty()) {
+      return false;
+    }
+    LOG(WARNING) << "Retrying the " << upload->profile_type
+                 << " profile upload in " << backoff_nanos / kNanosPerMilli
+                 << "ms";
+    if (!Backoff(backoff_nanos)) {
+      return false;
+    }
+    backoff_nanos = NextBackoffNanos(backoff_nanos);
+  }
+}
+
+void UploadQueue::UploadSpooled() {
+  UploadSpool::Entry entry;
+  std::string data;
+  {
+    std::lock_guard<std::mutex> spool_lock(spool_mutex_);
+    if (spool_ == nullptr || spool_->Empty() || !offline_upload_ ||
+        NowNanos() < next_spool_upload_nanos_) {
+      return;
+    }
+    entry = spool_->Oldest();
+    if (!spool_->ReadOldest(&data)) {
+      spool_->RemoveOldest();
+      return;
+    }
+  }
+
+  // The spool is not held during the upload, so that Add() can go on
+  // spilling profiles.
+  LOG(INFO) << "Uploading a spooled " << entry.profile_type << " profile";
+  bool uploaded =
+      offline_upload_(entry.profile_type, entry.duration_nanos)(
+          std::move(data));
+
+  std::lock_guard<std::mutex> spool_lock(spool_mutex_);
+  if (uploaded) {
+    spool_backoff_nanos_ = 0;
+    // Unless it was dropped meanwhile to make room.
+    if (!spool_->Empty() && spool_->Oldest().sequence == entry.sequence) {
+      spool_->RemoveOldest();
+    }
+    return;
+  }
+  spool_backoff_nanos_ = spool_backoff_nanos_ == 0
+                             ? InitialBackoffNanos()
+                             : NextBackoffNanos(spool_backoff_nanos_);
+  next_spool_upload_nanos_ = NowNanos() + spool_backoff_nanos_;
+  LOG(WARNING) << "Spooled profile upload failed, retrying in "
+               << spool_backoff_nanos_ / kNanosPerMilli << "ms";
+}
+
+void UploadQueue::Spill(PendingUpload *upload) {
+  if (upload->proto != nullptr) {
+    if (!CompressProfile(*upload->proto, upload->compression,
+                         &upload->data)) {
+      LOG(ERROR) << "Failed to compress the " << upload->profile_type
+                 << " profile, discarding it";
+      return;
+    }
+    upload->proto.reset();
+  }
+  if (!spool_->Write(upload->profile_type, upload->duration_nanos,
+                     upload->data)) {
+    LOG(ERROR) << "Failed to spill the " << upload->profile_type
+               << " profile, discarding it";
+  }
+}
+
+bool UploadQueue::Backoff(int64_t duration_nanos) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return !changed_.wait_for(lock, std::chrono::nanoseconds(duration_nanos),
+                            [this] { return stopping_; });
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,133 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_UPLOAD_QUEUE_H_
+#define CLOUD_PROFILER_AGENT_JAVA_UPLOAD_QUEUE_H_
+
+#include <condition_variable>  // NOLINT
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>  // NOLINT
+#include <string>
+#include <thread>  // NOLINT
+
+#include "perftools/profiles/proto/builder.h"
+#include "src/compression.h"
+#include "src/upload_spool.h"
+
+namespace cloud {
+namespace profiler {
+
+// A collected profile waiting for its upload.
+struct PendingUpload {
+  std::string profile_type;
+  int64_t duration_nanos = 0;
+  // Uploads the compressed profile, as returned by
+  // Throttler::DetachUpload().
+  std::function<bool(std::string)> upload;
+  // The compressed profile, or, when proto is set, empty until proto gets
+  // compressed as per compression by the upload thread.
+  std::string data;
+  std::unique_ptr<perftools::profiles::Profile> proto;
+  CompressionOptions compression;
+};
+
+// Uploads profiles from a thread of its own, so that the profiler worker
+// can go on with the next profile while the previous one is compressed and
+// uploaded. The work done on the upload thread makes no JNI or JVMTI call.
+//
+// At most max_depth profiles wait for their upload. Without a spool, Add()
+// blocks when the queue is full, holding back the collection of further
+// profiles until the uploads catch up. With a spool, the profiles that do
+// not fit in the queue, or whose upload still fails after its retries, are
+// spilled to it instead. The spooled profiles are uploaded when the queue
+// is empty, through the uploads returned by offline_upload, backing off
+// while they keep failing.
+class UploadQueue {
+ public:
+  // Returns the upload of a spooled profile.
+  typedef std::function<std::function<bool(std::string)>(
+      const std::string &profile_type, int64_t duration_nanos)>
+      OfflineUpload;
+
+  // spool and offline_upload may be null.
+  UploadQueue(int max_depth, std::unique_ptr<UploadSpool> spool,
+              OfflineUpload offline_upload);
+  ~UploadQueue();
+
+  // This type is neither copyable nor movable.
+  UploadQueue(const UploadQueue &) = delete;
+  UploadQueue &operator=(const UploadQueue &) = delete;
+
+  // Starts the upload thread.
+  void Start();
+
+  // Queues a profile for upload, waiting while the queue is full unless
+  // it spills to the spool. Once the queue is stopped, the profile is
+  // spilled, or without a spool dropped, returning false.
+  bool Add(std::unique_ptr<PendingUpload> upload);
+
+  // Wakes up the callers blocked in Add(), waits for the upload in flight
+  // to complete, and spills the profiles not uploaded yet, or discards
+  // them without a spool. Cancel the uploads through the throttler first
+  // to not wait on the network.
+  void Stop();
+
+  // Compresses the profile if needed and uploads it. Returns false on
+  // error, keeping the compressed profile so that the upload can be
+  // retried.
+  static bool Upload(PendingUpload *upload);
+
+ private:
+  void Run();
+
+  // Uploads a profile, retrying with backoff. Returns false if the upload
+  // still failed, or the queue was stopped.
+  bool UploadWithRetries(PendingUpload *upload);
+
+  // Uploads the oldest spooled profile, backing off the next attempt
+  // after a failure.
+  void UploadSpooled();
+
+  // Compresses the profile if needed and writes it to the spool. Must be
+  // called with spool_mutex_ held.
+  void Spill(PendingUpload *upload);
+
+  // Waits for duration_nanos, or until the queue is stopped. Returns
+  // false if it was stopped.
+  bool Backoff(int64_t duration_nanos);
+
+  const size_t max_depth_;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::deque<std::unique_ptr<PendingUpload>> queue_;
+  bool stopping_ = false;
+  std::thread thread_;
+
+  // Spilled profiles, written by Add() and read by the upload thread.
+  std::mutex spool_mutex_;
+  std::unique_ptr<UploadSpool> spool_;
+  OfflineUpload offline_upload_;
+  // Backoff of the spooled uploads, and monotonic time of the next one.
+  int64_t spool_backoff_nanos_ = 0;
+  int64_t next_spool_upload_nanos_ = 0;
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_UPLOAD_QUEUE_H_
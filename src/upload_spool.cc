@@ -0,0 +1,187 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/upload_spool.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "src/globals.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+const char kSuffix[] = ".prof";
+
+// Parses a file name written by UploadSpool::Path(), returning false for
+// other files.
+bool ParseName(const char *name, UploadSpool::Entry *entry) {
+  char *end;
+  entry->sequence = strtoll(name, &end, 10);
+  if (end == name || *end != '.') {
+    return false;
+  }
+  const char *duration = end + 1;
+  entry->duration_nanos = strtoll(duration, &end, 10);
+  if (end == duration || *end != '.') {
+    return false;
+  }
+  std::string type(end + 1);
+  size_t suffix_len = sizeof(kSuffix) - 1;
+  if (type.size() <= suffix_len ||
+      type.compare(type.size() - suffix_len, suffix_len, kSuffix) != 0) {
+    return false;
+  }
+  entry->profile_type = type.substr(0, type.size() - suffix_len);
+  return true;
+}
+
+}  // namespace
+
+UploadSpool::UploadSpool(const std::string &dir, int64_t max_bytes)
+    : dir_(dir), max_bytes_(max_bytes) {}
+
+bool UploadSpool::Open() {
+  if (mkdir(dir_.c_str(), 0700) != 0 && errno != EEXIST) {
+    LOG(ERROR) << "Failed to create the upload spool " << dir_ << ": "
+               << strerror(errno);
+    return false;
+  }
+  DIR *dir = opendir(dir_.c_str());
+  if (dir == nullptr) {
+    LOG(ERROR) << "Failed to open the upload spool " << dir_ << ": "
+               << strerror(errno);
+    return false;
+  }
+  struct dirent *file;
+  while ((file = readdir(dir)) != nullptr) {
+    Entry entry;
+    if (!ParseName(file->d_name, &entry)) {
+      size_t len = strlen(file->d_name);
+      if (len > 4 && strcmp(file->d_name + len - 4, ".tmp") == 0) {
+        // Left by a process which died while writing it.
+        unlink((dir_ + "/" + file->d_name).c_str());
+      }
+      continue;
+    }
+    struct stat st;
+    if (stat(Path(entry).c_str(), &st) != 0) {
+      continue;
+    }
+    entry.size = st.st_size;
+    entries_.push_back(entry);
+  }
+  closedir(dir);
+
+  std::sort(entries_.begin(), entries_.end(),
+            [](const Entry &a, const Entry &b) {
+              return a.sequence < b.sequence;
+            });
+  for (const Entry &entry : entries_) {
+    total_bytes_ += entry.size;
+  }
+  if (!entries_.empty()) {
+    next_sequence_ = entries_.back().sequence + 1;
+    LOG(INFO) << "Found " << entries_.size() << " profiles to upload in "
+              << dir_;
+  }
+  while (total_bytes_ > max_bytes_) {
+    RemoveOldest();
+  }
+  return true;
+}
+
+bool UploadSpool::Write(const std::string &profile_type,
+                        int64_t duration_nanos, const std::string &data) {
+  int64_t size = data.size();
+  if (size > max_bytes_) {
+    LOG(WARNING) << "Dropping a " << profile_type << " profile of " << size
+                 << " bytes, larger than the upload spool";
+    return false;
+  }
+  while (total_bytes_ + size > max_bytes_) {
+    LOG(WARNING) << "The upload spool is full, dropping the oldest "
+                 << Oldest().profile_type << " profile";
+    RemoveOldest();
+  }
+
+  Entry entry = {next_sequence_++, duration_nanos, profile_type, size};
+  std::string path = Path(entry);
+  // Written under a temporary name so that a partial file is never taken
+  // for a profile.
+  std::string tmp_path = path + ".tmp";
+  FILE *f = fopen(tmp_path.c_str(), "w");
+  if (f == nullptr) {
+    LOG(ERROR) << "Failed to create " << tmp_path << ": " << strerror(errno);
+    return false;
+  }
+  size_t wrote = fwrite(data.data(), 1, data.size(), f);
+  bool ok = fclose(f) == 0 && wrote == data.size();
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    LOG(ERROR) << "Failed to write " << path;
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  entries_.push_back(entry);
+  total_bytes_ += size;
+  return true;
+}
+
+bool UploadSpool::ReadOldest(std::string *data) const {
+  const Entry &entry = Oldest();
+  std::string path = Path(entry);
+  FILE *f = fopen(path.c_str(), "r");
+  if (f == nullptr) {
+    LOG(ERROR) << "Failed to open " << path << ": " << strerror(errno);
+    return false;
+  }
+  data->resize(entry.size);
+  size_t read = fread(&(*data)[0], 1, data->size(), f);
+  fclose(f);
+  if (read != data->size()) {
+    LOG(ERROR) << "Failed to read " << path;
+    return false;
+  }
+  return true;
+}
+
+void UploadSpool::RemoveOldest() {
+  const Entry &entry = Oldest();
+  if (unlink(Path(entry).c_str()) != 0 && errno != ENOENT) {
+    LOG(WARNING) << "Failed to remove " << Path(entry) << ": "
+                 << strerror(errno);
+  }
+  total_bytes_ -= entry.size;
+  entries_.pop_front();
+}
+
+std::string UploadSpool::Path(const Entry &entry) const {
+  char name[64];
+  snprintf(name, sizeof(name), "%020lld.%lld.",
+           static_cast<long long>(entry.sequence),         // NOLINT
+           static_cast<long long>(entry.duration_nanos));  // NOLINT
+  return dir_ + "/" + name + entry.profile_type + kSuffix;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_UPLOAD_SPOOL_H_
+#define CLOUD_PROFILER_AGENT_JAVA_UPLOAD_SPOOL_H_
+
+#include <stdint.h>
+
+#include <deque>
+#include <string>
+
+namespace cloud {
+namespace profiler {
+
+// Directory holding the compressed profiles that could not be uploaded in
+// time, so that they get uploaded later on rather than lost. The spool
+// holds at most max_bytes of profiles, dropping the oldest ones to make
+// room for new ones. The profiles left by a previous process are picked up
+// when the spool is opened.
+//
+// Each profile is a file named after its sequence number, its duration
+// and its type. Not thread-safe.
+class UploadSpool {
+ public:
+  struct Entry {
+    int64_t sequence;
+    int64_t duration_nanos;
+    std::string profile_type;
+    int64_t size;
+  };
+
+  UploadSpool(const std::string &dir, int64_t max_bytes);
+
+  // This type is neither copyable nor movable.
+  UploadSpool(const UploadSpool &) = delete;
+  UploadSpool &operator=(const UploadSpool &) = delete;
+
+  // Creates the directory if needed and lists the profiles it holds.
+  // Returns false if the directory cannot be used.
+  bool Open();
+
+  // Stores a profile. Returns false if it could not be written or is
+  // larger than the spool.
+  bool Write(const std::string &profile_type, int64_t duration_nanos,
+             const std::string &data);
+
+  bool Empty() const { return entries_.empty(); }
+
+  // Returns the oldest profile, which must exist.
+  const Entry &Oldest() const { return entries_.front(); }
+
+  // Reads the data of the oldest profile. Returns false on error, in
+  // which case the profile should be removed.
+  bool ReadOldest(std::string *data) const;
+
+  // Removes the oldest profile.
+  void RemoveOldest();
+
+ private:
+  std::string Path(const Entry &entry) const;
+
+  const std::string dir_;
+  const int64_t max_bytes_;
+  // The profiles, oldest first.
+  std::deque<Entry> entries_;
+  int64_t total_bytes_ = 0;
+  int64_t next_sequence_ = 0;
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_UPLOAD_SPOOL_H_
@@ -17,16 +17,20 @@
 #include <chrono>  // NOLINT(build/c++11)
 #include <string>
 
+#include "src/compression.h"
+
 namespace cloud {
 namespace profiler {
 
 std::string ProfilePath(const std::string& prefix,
-                        const std::string& profile_type) {
+                        const std::string& profile_type,
+                        const std::string& profile) {
   using std::chrono::system_clock;
   int64_t timestamp = std::chrono::duration_cast<std::chrono::seconds>(
                           system_clock::now().time_since_epoch())
                           .count();
-  return prefix + profile_type + "_" + std::to_string(timestamp) + ".pb.gz";
+  return prefix + profile_type + "_" + std::to_string(timestamp) +
+         ProfileFileExtension(profile);
 }
 
 }  // namespace profiler
@@ -32,9 +32,11 @@ class ProfileUploader {
 };
 
 // Returns the path to use for a profile.  The path will contain the current
-// timestamp which makes it fairly (but not necessarily globally) unique.
+// timestamp which makes it fairly (but not necessarily globally) unique, and
+// end with an extension matching the compression of the profile.
 std::string ProfilePath(const std::string& prefix,
-                        const std::string& profile_type);
+                        const std::string& profile_type,
+                        const std::string& profile);
 
 }  // namespace profiler
 }  // namespace cloud
@@ -0,0 +1,266 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/uploader_file.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "src/compression.h"
+#include "src/throttler.h"
+
+DEFINE_int32(cprof_profile_files_max_count, 0,
+             "maximum number of profiles kept with the "
+             "--cprof_profile_filename prefix, beyond which the oldest ones "
+             "are removed, 0 for no limit");
+DEFINE_int32(cprof_profile_files_max_mb, 0,
+             "maximum size of the profiles kept with the "
+             "--cprof_profile_filename prefix, in megabytes, beyond which "
+             "the oldest ones are removed, 0 for no limit");
+DEFINE_string(cprof_profile_files_sync, "none",
+              "how the saved profiles are flushed to disk: 'none' leaves it "
+              "to the kernel, 'async' starts the writeback without waiting "
+              "for it, 'full' waits for the profile and its directory entry "
+              "to be on disk");
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+const char *const kExtensions[] = {".pb.gz", ".pb.zst"};
+const char *const kTypes[] = {kTypeCPU,        kTypeWall,       kTypeHeap,
+                              kTypeHeapAlloc, kTypeContention, kTypeThreads};
+
+bool EndsWith(const std::string &s, const std::string &suffix) {
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Whether s is one or two numbers separated by an underscore.
+bool IsSequence(const std::string &s) {
+  size_t end = s.find('_');
+  std::string first = s.substr(0, end);
+  if (first.empty() ||
+      first.find_first_not_of("0123456789") != std::string::npos) {
+    return false;
+  }
+  return end == std::string::npos || IsSequence(s.substr(end + 1));
+}
+
+// Whether a file name is that of a profile saved with the base name, as
+// returned by ProfilePath() and FileUploader::NewPath().
+bool IsProfileName(const std::string &name, const std::string &base) {
+  if (name.compare(0, base.size(), base) != 0) {
+    return false;
+  }
+  std::string rest = name.substr(base.size());
+  bool has_extension = false;
+  for (const char *extension : kExtensions) {
+    if (EndsWith(rest, extension)) {
+      rest.resize(rest.size() - strlen(extension));
+      has_extension = true;
+      break;
+    }
+  }
+  if (!has_extension) {
+    return false;
+  }
+  for (const char *type : kTypes) {
+    size_t len = strlen(type);
+    if (rest.compare(0, len, type) == 0 && rest.size() > len + 1 &&
+        rest[len] == '_' && IsSequence(rest.substr(len + 1))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool WriteAll(int fd, const std::string &data) {
+  const char *p = data.data();
+  size_t left = data.size();
+  while (left > 0) {
+    ssize_t wrote = write(fd, p, left);
+    if (wrote < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    p += wrote;
+    left -= wrote;
+  }
+  return true;
+}
+
+}  // namespace
+
+FileUploader::FileUploader(const std::string &prefix) : prefix_(prefix) {
+  if (FLAGS_cprof_profile_files_max_count > 0 ||
+      FLAGS_cprof_profile_files_max_mb > 0) {
+    ScanExisting();
+  }
+  if (FLAGS_cprof_profile_files_sync != "none" &&
+      FLAGS_cprof_profile_files_sync != "async" &&
+      FLAGS_cprof_profile_files_sync != "full") {
+    LOG(WARNING) << "Unknown --cprof_profile_files_sync="
+                 << FLAGS_cprof_profile_files_sync << ", using 'none'";
+  }
+}
+
+bool FileUploader::Upload(const std::string &profile_type,
+                          const std::string &profile) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string filename = NewPath(profile_type, profile);
+  LOG(INFO) << "Saving profile to " << filename;
+  if (!Write(filename, profile)) {
+    return false;
+  }
+  files_.push_back({filename, static_cast<int64_t>(profile.size())});
+  total_bytes_ += profile.size();
+  // Only once the new profile is saved, so that a failed write does not
+  // cost older ones.
+  Rotate();
+  return true;
+}
+
+void FileUploader::ScanExisting() {
+  size_t slash = prefix_.rfind('/');
+  std::string dir_prefix =
+      slash == std::string::npos ? "" : prefix_.substr(0, slash + 1);
+  std::string base = prefix_.substr(dir_prefix.size());
+  DIR *dir = opendir(dir_prefix.empty() ? "." : dir_prefix.c_str());
+  if (dir == nullptr) {
+    return;
+  }
+  struct Existing {
+    File file;
+    time_t mtime;
+  };
+  std::vector<Existing> existing;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != nullptr) {
+    std::string name = entry->d_name;
+    std::string path = dir_prefix + name;
+    if (EndsWith(name, ".tmp") &&
+        IsProfileName(name.substr(0, name.size() - 4), base)) {
+      // Left by a process which died while writing it.
+      unlink(path.c_str());
+      continue;
+    }
+    struct stat st;
+    if (!IsProfileName(name, base) || stat(path.c_str(), &st) != 0 ||
+        !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    existing.push_back({{path, static_cast<int64_t>(st.st_size)},
+                        st.st_mtime});
+  }
+  closedir(dir);
+
+  std::sort(existing.begin(), existing.end(),
+            [](const Existing &a, const Existing &b) {
+              return a.mtime != b.mtime ? a.mtime < b.mtime
+                                        : a.file.path < b.file.path;
+            });
+  for (const Existing &e : existing) {
+    files_.push_back(e.file);
+    total_bytes_ += e.file.size;
+  }
+  if (!files_.empty()) {
+    LOG(INFO) << "Found " << files_.size() << " profiles saved earlier with "
+              << "the prefix " << prefix_;
+  }
+}
+
+std::string FileUploader::NewPath(const std::string &profile_type,
+                                  const std::string &profile) {
+  std::string path = ProfilePath(prefix_, profile_type, profile);
+  if (path != last_path_) {
+    last_path_ = path;
+    same_path_count_ = 0;
+    return path;
+  }
+  // Several profiles of the same type saved within one second.
+  same_path_count_++;
+  size_t extension_len = strlen(ProfileFileExtension(profile));
+  path.insert(path.size() - extension_len,
+              "_" + std::to_string(same_path_count_));
+  return path;
+}
+
+void FileUploader::Rotate() {
+  size_t max_count = FLAGS_cprof_profile_files_max_count;
+  int64_t max_bytes = int64_t{FLAGS_cprof_profile_files_max_mb} * 1024 * 1024;
+  while (files_.size() > 1 &&
+         ((max_count > 0 && files_.size() > max_count) ||
+          (max_bytes > 0 && total_bytes_ > max_bytes))) {
+    const File &oldest = files_.front();
+    if (unlink(oldest.path.c_str()) != 0 && errno != ENOENT) {
+      LOG(WARNING) << "Failed to remove " << oldest.path << ": "
+                   << strerror(errno);
+    }
+    total_bytes_ -= oldest.size;
+    files_.pop_front();
+  }
+}
+
+bool FileUploader::Write(const std::string &path, const std::string &profile) {
+  // Written under a temporary name so that a partial file is never taken
+  // for a profile.
+  std::string tmp_path = path + ".tmp";
+  int fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                0644);
+  if (fd < 0) {
+    LOG(ERROR) << "Failed to create file " << tmp_path << ": "
+               << strerror(errno);
+    return false;
+  }
+  bool ok = WriteAll(fd, profile);
+  if (ok && FLAGS_cprof_profile_files_sync == "async") {
+    // Starts the writeback without waiting for it, so the dirty pages of
+    // frequent profiles do not pile up.
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+  } else if (ok && FLAGS_cprof_profile_files_sync == "full") {
+    ok = fdatasync(fd) == 0;
+  }
+  ok = close(fd) == 0 && ok;
+  if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+    LOG(ERROR) << "Failed to write " << path << ": " << strerror(errno);
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  if (FLAGS_cprof_profile_files_sync == "full") {
+    // Makes the rename durable.
+    size_t slash = path.rfind('/');
+    std::string dir_name =
+        slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    int dir_fd = open(dir_name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd >= 0) {
+      fsync(dir_fd);
+      close(dir_fd);
+    }
+  }
+  return true;
+}
+
+}  // namespace profiler
+}  // namespace cloud
@@ -17,7 +17,10 @@
 #ifndef CLOUD_PROFILER_AGENT_JAVA_UPLOADER_FILE_H_
 #define CLOUD_PROFILER_AGENT_JAVA_UPLOADER_FILE_H_
 
-#include <cstdio>
+#include <stdint.h>
+
+#include <deque>
+#include <mutex>  // NOLINT
 #include <string>
 
 #include "src/uploader.h"
@@ -25,39 +28,50 @@
 namespace cloud {
 namespace profiler {
 
+// Saves the profiles as files named after the prefix, see ProfilePath().
+// Each file is written under a temporary name and renamed once complete, so
+// that readers never see a partial profile. The files are rotated: once
+// there are more than --cprof_profile_files_max_count of them, or they take
+// more than --cprof_profile_files_max_mb, the oldest ones are removed,
+// including those left by earlier processes with the same prefix.
 class FileUploader : public cloud::profiler::ProfileUploader {
  public:
-  explicit FileUploader(const std::string &prefix) : prefix_(prefix) {}
+  explicit FileUploader(const std::string &prefix);
 
   // This type is neither copyable nor movable.
   FileUploader(const FileUploader &) = delete;
   FileUploader &operator=(const FileUploader &) = delete;
 
   bool Upload(const std::string &profile_type,
-              const std::string &profile) override {
-    std::string filename = ProfilePath(prefix_, profile_type);
+              const std::string &profile) override;
+
+ private:
+  struct File {
+    std::string path;
+    int64_t size;
+  };
 
-    FILE *f = fopen(filename.c_str(), "w");
-    if (f == nullptr) {
-      LOG(INFO) << "Failed to create file " << filename;
-      return false;
-    }
+  // Lists the profiles already saved with the prefix, oldest first.
+  void ScanExisting();
 
-    LOG(INFO) << "Saving profile to " << filename;
+  // Returns a path for a new profile, distinct from the last one even when
+  // saved within the same second.
+  std::string NewPath(const std::string &profile_type,
+                      const std::string &profile);
 
-    int count = profile.size();
-    int wrote = fwrite(profile.c_str(), 1, count, f);
-    fclose(f);
+  // Removes the oldest profiles until the saved ones are within the
+  // limits, always keeping the newest one.
+  void Rotate();
 
-    if (wrote != count) {
-      LOG(INFO) << "Failure! Wrote " << wrote << " bytes, wanted " << count;
-      return false;
-    }
-    return true;
-  }
+  bool Write(const std::string &path, const std::string &profile);
 
- private:
-  std::string prefix_;
+  const std::string prefix_;
+  std::mutex mutex_;
+  // The saved profiles, oldest first.
+  std::deque<File> files_;
+  int64_t total_bytes_ = 0;
+  std::string last_path_;
+  int same_path_count_ = 0;
 };
 
 }  // namespace profiler
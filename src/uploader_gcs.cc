@@ -44,8 +44,8 @@ bool GcsUploader::Upload(const std::string &profile_type,
   uploadReq.AddHeader("Content-Length", std::to_string(profile.size()));
   uploadReq.SetTimeout(FLAGS_cprof_gcs_upload_timeout_sec);
 
-  std::string url =
-      std::string(kGcsHost) + "/" + ProfilePath(prefix_, profile_type);
+  std::string url = std::string(kGcsHost) + "/" +
+                    ProfilePath(prefix_, profile_type, profile);
   if (!uploadReq.DoPut(url, profile)) {
     LOG(ERROR) << "Error making profile upload HTTP request to GCS";
     return false;
@@ -0,0 +1,155 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/uploader_socket.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+DEFINE_int32(cprof_collector_timeout_sec, 30,
+             "timeout of the hand over of a profile to the host collector, "
+             "including its acknowledgement, in seconds");
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+const char kMagic[] = "CPRF";
+const uint32_t kFormatVersion = 1;
+const char kAck = 0x01;
+
+void AppendUint32(uint32_t value, std::string* out) {
+  for (int i = 0; i < 4; i++) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+void AppendUint64(uint64_t value, std::string* out) {
+  for (int i = 0; i < 8; i++) {
+    out->push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+  }
+}
+
+void AppendString(const std::string& value, std::string* out) {
+  AppendUint32(value.size(), out);
+  out->append(value);
+}
+
+bool SendAll(int fd, const char* data, size_t size) {
+  while (size > 0) {
+    // No SIGPIPE if the collector went away.
+    ssize_t sent = send(fd, data, size, MSG_NOSIGNAL);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+}  // namespace
+
+SocketUploader::SocketUploader(CloudEnv* env, const std::string& socket_path)
+    : socket_path_(socket_path),
+      service_(env->Service()),
+      service_version_(env->ServiceVersion()) {}
+
+SocketUploader::~SocketUploader() { Disconnect(); }
+
+bool SocketUploader::Upload(const std::string& profile_type,
+                            const std::string& profile) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!Connect()) {
+    return false;
+  }
+  LOG(INFO) << "Handing a " << profile.size() << " byte " << profile_type
+            << " profile over to the collector at " << socket_path_;
+
+  std::string header(kMagic, sizeof(kMagic) - 1);
+  AppendUint32(kFormatVersion, &header);
+  AppendString(profile_type, &header);
+  AppendString("java", &header);
+  AppendString(service_, &header);
+  AppendString(service_version_, &header);
+  AppendUint32(getpid(), &header);
+  AppendUint64(profile.size(), &header);
+
+  char ack = 0;
+  ssize_t received = -1;
+  if (SendAll(fd_, header.data(), header.size()) &&
+      SendAll(fd_, profile.data(), profile.size())) {
+    do {
+      received = recv(fd_, &ack, 1, 0);
+    } while (received < 0 && errno == EINTR);
+  }
+  if (received != 1 || ack != kAck) {
+    LOG(ERROR) << "Failed to hand the " << profile_type
+               << " profile over to the collector at " << socket_path_
+               << (received < 0 ? std::string(": ") + strerror(errno) : "");
+    // The connection may be left in the middle of a message.
+    Disconnect();
+    return false;
+  }
+  return true;
+}
+
+bool SocketUploader::Connect() {
+  if (fd_ >= 0) {
+    return true;
+  }
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path_.size() >= sizeof(addr.sun_path)) {
+    LOG(ERROR) << "Collector socket path too long: " << socket_path_;
+    return false;
+  }
+  memcpy(addr.sun_path, socket_path_.c_str(), socket_path_.size());
+
+  fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd_ < 0) {
+    LOG(ERROR) << "Failed to create a Unix socket: " << strerror(errno);
+    return false;
+  }
+  struct timeval timeout = {FLAGS_cprof_collector_timeout_sec, 0};
+  setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (connect(fd_, reinterpret_cast<struct sockaddr*>(&addr),
+              sizeof(addr)) != 0) {
+    LOG(ERROR) << "Failed to connect to the collector at " << socket_path_
+               << ": " << strerror(errno);
+    Disconnect();
+    return false;
+  }
+  return true;
+}
+
+void SocketUploader::Disconnect() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+}  // namespace profiler
+}  // namespace cloud
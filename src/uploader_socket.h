@@ -0,0 +1,75 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_UPLOADER_SOCKET_H_
+#define CLOUD_PROFILER_AGENT_JAVA_UPLOADER_SOCKET_H_
+
+#include <mutex>  // NOLINT
+#include <string>
+
+#include "src/cloud_env.h"
+#include "src/uploader.h"
+
+namespace cloud {
+namespace profiler {
+
+// Profile uploader handing the profiles over a Unix domain socket to a
+// collector process running on the same host, which uploads those of all
+// the JVMs of the host on their behalf. The agent then needs neither
+// network access nor credentials of its own.
+//
+// The connection is kept open across profiles. Each profile is sent as a
+// message made of:
+//   - the 4 bytes "CPRF" and a 32-bit format version, currently 1,
+//   - the length-prefixed profile type, language ("java"), service name
+//     and service version,
+//   - the 32-bit process id of the JVM,
+//   - the 64-bit length of the serialized profile, followed by its bytes,
+// with all integers little-endian, and the lengths of the strings 32-bit.
+// The collector acknowledges each profile it accepted with a single 0x01
+// byte, only after which the upload is reported successful.
+class SocketUploader : public cloud::profiler::ProfileUploader {
+ public:
+  // Constructs an uploader to the collector listening at socket_path,
+  // labeling the profiles with the service of the caller-owned env.
+  SocketUploader(CloudEnv* env, const std::string& socket_path);
+
+  ~SocketUploader() override;
+
+  // This type is neither copyable nor movable.
+  SocketUploader(const SocketUploader&) = delete;
+  SocketUploader& operator=(const SocketUploader&) = delete;
+
+  bool Upload(const std::string& profile_type,
+              const std::string& profile) override;
+
+ private:
+  // Connects to the collector unless connected. Returns false on error.
+  bool Connect();
+  void Disconnect();
+
+  const std::string socket_path_;
+  const std::string service_;
+  const std::string service_version_;
+  // Serializes the use of the connection.
+  std::mutex mutex_;
+  int fd_ = -1;
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_UPLOADER_SOCKET_H_
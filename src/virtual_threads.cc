@@ -0,0 +1,321 @@
+// Copyright 2018 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "src/virtual_threads.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+#include "src/clock.h"
+
+namespace cloud {
+namespace profiler {
+
+namespace {
+
+using google::javaprofiler::JVMPI_CallFrame;
+using google::javaprofiler::kMaxFramesToCapture;
+
+// Ids of the HotSpot extension events, posted on the carrier thread,
+// with the JNIEnv and the virtual thread as parameters.
+const char kMountEvent[] = "com.sun.hotspot.events.VirtualThreadMount";
+const char kUnmountEvent[] = "com.sun.hotspot.events.VirtualThreadUnmount";
+
+// Position of can_support_virtual_threads in jvmtiCapabilities, right
+// after can_generate_sampled_object_alloc_events. It is set by position,
+// as the JDK headers the agent is built with may predate it.
+const int kVirtualThreadsCapabilityByte = 5;
+const unsigned char kVirtualThreadsCapabilityBit = 1 << 4;
+
+// Values of Parked::virtual_thread other than the id of a virtual thread,
+// which are positive.
+const int64_t kFree = 0;
+const int64_t kBusy = -1;
+
+// Unmounts of the current carrier left to skip before the next sampled one.
+__thread int unmount_countdown = 0;
+
+// State of the generator rounding the weights of the samples.
+__thread uint64_t random_state = 0;
+
+int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return TimeSpecToNanos(ts);
+}
+
+// Returns a pseudo-random number, from a per-thread xorshift generator.
+uint64_t NextRandom() {
+  uint64_t x = random_state;
+  if (x == 0) {
+    x = reinterpret_cast<uintptr_t>(&random_state) | 1;
+  }
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  random_state = x;
+  return x;
+}
+
+}  // namespace
+
+// A sampled unmounted virtual thread.
+struct VirtualThreads::Parked {
+  // Id of the virtual thread, kFree, or kBusy while claimed by an event.
+  std::atomic<int64_t> virtual_thread;
+  int64_t start_nanos;
+  int num_frames;
+  JVMPI_CallFrame frames[kMaxFramesToCapture];
+};
+
+int VirtualThreads::sampling_rate_ = 1;
+jfieldID VirtualThreads::tid_field_ = nullptr;
+VirtualThreads::Parked *VirtualThreads::parked_ = nullptr;
+int VirtualThreads::max_parked_ = 0;
+std::atomic<int64_t> VirtualThreads::period_nanos_(1);
+std::atomic<VirtualThreads::ParkedRecorder> VirtualThreads::recorder_(
+    nullptr);
+__thread int64_t VirtualThreads::mounted_;
+
+bool VirtualThreads::AddCapability(jvmtiEnv *jvmti) {
+  jvmtiCapabilities potential;
+  memset(&potential, 0, sizeof(potential));
+  if (jvmti->GetPotentialCapabilities(&potential) != JVMTI_ERROR_NONE ||
+      (reinterpret_cast<unsigned char *>(&potential)
+           [kVirtualThreadsCapabilityByte] &
+       kVirtualThreadsCapabilityBit) == 0) {
+    LOG(WARNING) << "The JVM does not support virtual threads";
+    return false;
+  }
+  jvmtiCapabilities caps;
+  memset(&caps, 0, sizeof(caps));
+  reinterpret_cast<unsigned char *>(&caps)[kVirtualThreadsCapabilityByte] =
+      kVirtualThreadsCapabilityBit;
+  if (jvmti->AddCapabilities(&caps) != JVMTI_ERROR_NONE) {
+    LOG(WARNING) << "Failed to add the virtual threads capability";
+    return false;
+  }
+  return true;
+}
+
+bool VirtualThreads::Enable(jvmtiEnv *jvmti, JNIEnv *jni, int sampling_rate,
+                            int max_parked) {
+  jclass thread_class = jni->FindClass("java/lang/Thread");
+  if (thread_class == nullptr) {
+    jni->ExceptionClear();
+    LOG(WARNING) << "Failed to find java.lang.Thread";
+    return false;
+  }
+  tid_field_ = jni->GetFieldID(thread_class, "tid", "J");
+  jni->DeleteLocalRef(thread_class);
+  if (tid_field_ == nullptr) {
+    jni->ExceptionClear();
+    LOG(WARNING) << "Failed to find the java.lang.Thread.tid field";
+    return false;
+  }
+
+  jint count = 0;
+  jvmtiExtensionEventInfo *events = nullptr;
+  if (jvmti->GetExtensionEvents(&count, &events) != JVMTI_ERROR_NONE) {
+    LOG(WARNING) << "Failed to list the JVMTI extension events";
+    return false;
+  }
+  jint mount_index = -1, unmount_index = -1;
+  for (jint i = 0; i < count; i++) {
+    jvmtiExtensionEventInfo &event = events[i];
+    if (strcmp(event.id, kMountEvent) == 0) {
+      mount_index = event.extension_event_index;
+    } else if (strcmp(event.id, kUnmountEvent) == 0) {
+      unmount_index = event.extension_event_index;
+    }
+    for (jint j = 0; j < event.param_count; j++) {
+      jvmti->Deallocate(
+          reinterpret_cast<unsigned char *>(event.params[j].name));
+    }
+    jvmti->Deallocate(reinterpret_cast<unsigned char *>(event.params));
+    jvmti->Deallocate(reinterpret_cast<unsigned char *>(event.id));
+    jvmti->Deallocate(
+        reinterpret_cast<unsigned char *>(event.short_description));
+  }
+  jvmti->Deallocate(reinterpret_cast<unsigned char *>(events));
+  if (mount_index < 0 || unmount_index < 0) {
+    LOG(WARNING) << "The JVM has no virtual thread mount events";
+    return false;
+  }
+
+  sampling_rate_ = sampling_rate > 0 ? sampling_rate : 1;
+  max_parked_ = max_parked > 0 ? max_parked : 1;
+  parked_ = new Parked[max_parked_]();
+
+  // Setting the callback of an extension event enables it.
+  if (jvmti->SetExtensionEventCallback(
+          mount_index, reinterpret_cast<jvmtiExtensionEvent>(&Mount)) !=
+          JVMTI_ERROR_NONE ||
+      jvmti->SetExtensionEventCallback(
+          unmount_index, reinterpret_cast<jvmtiExtensionEvent>(&Unmount)) !=
+          JVMTI_ERROR_NONE) {
+    LOG(WARNING) << "Failed to enable the virtual thread mount events";
+    jvmti->SetExtensionEventCallback(mount_index, nullptr);
+    jvmti->SetExtensionEventCallback(unmount_index, nullptr);
+    return false;
+  }
+  return true;
+}
+
+void VirtualThreads::StartParkedSampling(int64_t period_nanos,
+                                         ParkedRecorder recorder) {
+  if (!Enabled()) {
+    return;
+  }
+  // Drop the entries left by events still running when the last sampling
+  // stopped.
+  for (int i = 0; i < max_parked_; i++) {
+    int64_t current = parked_[i].virtual_thread.load();
+    if (current != kBusy) {
+      parked_[i].virtual_thread.compare_exchange_strong(current, kFree);
+    }
+  }
+  period_nanos_.store(period_nanos > 0 ? period_nanos : 1,
+                      std::memory_order_relaxed);
+  recorder_.store(recorder, std::memory_order_release);
+}
+
+void VirtualThreads::StopParkedSampling() {
+  if (!Enabled()) {
+    return;
+  }
+  ParkedRecorder recorder = recorder_.exchange(nullptr);
+  if (recorder == nullptr) {
+    return;
+  }
+  int64_t now_nanos = NowNanos();
+  for (int i = 0; i < max_parked_; i++) {
+    Parked &parked = parked_[i];
+    int64_t current = parked.virtual_thread.load();
+    if (current != kFree && current != kBusy &&
+        parked.virtual_thread.compare_exchange_strong(current, kBusy)) {
+      RecordParked(recorder, &parked, current, now_nanos);
+      parked.virtual_thread.store(kFree, std::memory_order_release);
+    }
+  }
+}
+
+void JNICALL VirtualThreads::Mount(jvmtiEnv *jvmti, ...) {
+  va_list args;
+  va_start(args, jvmti);
+  JNIEnv *jni = va_arg(args, JNIEnv *);
+  jthread thread = va_arg(args, jthread);
+  va_end(args);
+
+  int64_t id = ThreadId(jni, thread);
+  mounted_ = id;
+  ParkedRecorder recorder = recorder_.load(std::memory_order_acquire);
+  if (recorder == nullptr || id <= 0) {
+    return;
+  }
+  Parked &parked = parked_[id % max_parked_];
+  int64_t current = parked.virtual_thread.load(std::memory_order_relaxed);
+  if (current == id && parked.virtual_thread.compare_exchange_strong(
+                           current, kBusy, std::memory_order_acquire)) {
+    RecordParked(recorder, &parked, id, NowNanos());
+    parked.virtual_thread.store(kFree, std::memory_order_release);
+  }
+}
+
+void JNICALL VirtualThreads::Unmount(jvmtiEnv *jvmti, ...) {
+  va_list args;
+  va_start(args, jvmti);
+  JNIEnv *jni = va_arg(args, JNIEnv *);
+  jthread thread = va_arg(args, jthread);
+  va_end(args);
+
+  // From here on, the samples of the carrier are its own.
+  mounted_ = 0;
+  ParkedRecorder recorder = recorder_.load(std::memory_order_acquire);
+  if (recorder == nullptr) {
+    return;
+  }
+  if (unmount_countdown <= 0) {
+    // Spread the first sample of each carrier over the sampling period.
+    unmount_countdown =
+        1 + (reinterpret_cast<uintptr_t>(&unmount_countdown) >> 6) %
+                sampling_rate_;
+  }
+  if (--unmount_countdown > 0) {
+    return;
+  }
+  unmount_countdown = sampling_rate_;
+
+  int64_t id = ThreadId(jni, thread);
+  if (id <= 0) {
+    return;
+  }
+  Parked &parked = parked_[id % max_parked_];
+  int64_t current = parked.virtual_thread.load(std::memory_order_relaxed);
+  if (current == kBusy || !parked.virtual_thread.compare_exchange_strong(
+                              current, kBusy, std::memory_order_acquire)) {
+    // Claimed by another event, drop the sample.
+    return;
+  }
+  int64_t now_nanos = NowNanos();
+  if (current != kFree) {
+    // Displaced, the other virtual thread gets its time so far.
+    RecordParked(recorder, &parked, current, now_nanos);
+  }
+  // The virtual thread is still mounted, its frames are those walked.
+  parked.num_frames = google::javaprofiler::Asgct::GetCurrentThreadTrace(
+      jni, kMaxFramesToCapture, parked.frames);
+  if (parked.num_frames <= 0) {
+    parked.frames[0] =
+        JVMPI_CallFrame{kCallTraceErrorLineNum,
+                        reinterpret_cast<jmethodID>(parked.num_frames)};
+    parked.num_frames = 1;
+  }
+  parked.start_nanos = now_nanos;
+  parked.virtual_thread.store(id, std::memory_order_release);
+}
+
+int64_t VirtualThreads::ThreadId(JNIEnv *jni, jthread thread) {
+  if (jni == nullptr || thread == nullptr) {
+    return 0;
+  }
+  return jni->GetLongField(thread, tid_field_);
+}
+
+void VirtualThreads::RecordParked(ParkedRecorder recorder, Parked *parked,
+                                  int64_t virtual_thread, int64_t now_nanos) {
+  int64_t period_nanos = period_nanos_.load(std::memory_order_relaxed);
+  int64_t weighted_nanos = (now_nanos - parked->start_nanos) * sampling_rate_;
+  if (weighted_nanos <= 0) {
+    return;
+  }
+  // Round randomly, so that short parks still add up to their time.
+  int64_t weight = weighted_nanos / period_nanos;
+  if (static_cast<int64_t>(NextRandom() % period_nanos) <
+      weighted_nanos % period_nanos) {
+    weight++;
+  }
+  if (weight == 0) {
+    return;
+  }
+  JVMPI_CallTrace trace;
+  trace.env_id = nullptr;
+  trace.num_frames = parked->num_frames;
+  trace.frames = parked->frames;
+  recorder(&trace, virtual_thread, weight);
+}
+
+}  // namespace profiler
+}  // namespace cloud
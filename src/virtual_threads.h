@@ -0,0 +1,119 @@
+/*
+ * Copyright 2018 Google LLC
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef CLOUD_PROFILER_AGENT_JAVA_VIRTUAL_THREADS_H_
+#define CLOUD_PROFILER_AGENT_JAVA_VIRTUAL_THREADS_H_
+
+#include <stdint.h>
+
+#include <atomic>
+
+#include "src/globals.h"
+#include "third_party/javaprofiler/stacktraces.h"
+
+namespace cloud {
+namespace profiler {
+
+// Tracks the virtual threads of JDK 21 and later as they get mounted on and
+// unmounted from their carrier threads, from the VirtualThreadMount and
+// VirtualThreadUnmount extension events of HotSpot, without registering
+// the virtual threads themselves.
+//
+// The id of the virtual thread mounted on a carrier is kept in thread
+// local storage, for the signal handler to label the samples of the
+// carrier with it.
+//
+// Unmounted virtual threads have no native thread to signal, so while a
+// wall profile is collected, one in sampling_rate unmounts of each carrier
+// is sampled: the stack of the virtual thread is captured before it
+// leaves the carrier, into a fixed table keyed by the virtual thread. On
+// its next mount, the time it spent unmounted is recorded under that
+// stack, weighted by sampling_rate. A sampled virtual thread displaced
+// from the table by another one, or still unmounted when the profile
+// ends, gets the time it spent unmounted until then.
+class VirtualThreads {
+ public:
+  // Receives the stack of an unmounted virtual thread, standing for weight
+  // periods of the wall profile. This must be async-safe.
+  typedef void (*ParkedRecorder)(JVMPI_CallTrace *trace,
+                                 int64_t virtual_thread, int64_t weight);
+
+  // This type is neither copyable nor movable.
+  VirtualThreads(const VirtualThreads &) = delete;
+  VirtualThreads &operator=(const VirtualThreads &) = delete;
+
+  // Adds the JVMTI capability of the virtual threads, which only JDK 21
+  // and later have, in the OnLoad phase. Returns whether it was added.
+  static bool AddCapability(jvmtiEnv *jvmti);
+
+  // Subscribes to the mount and unmount events, and allocates the table
+  // of up to max_parked sampled unmounted virtual threads. Returns whether
+  // the virtual threads are tracked.
+  static bool Enable(jvmtiEnv *jvmti, JNIEnv *jni, int sampling_rate,
+                     int max_parked);
+
+  static bool Enabled() { return parked_ != nullptr; }
+
+  // Returns the id of the virtual thread mounted on the current thread, or
+  // 0. This is async-safe.
+  static int64_t Mounted() { return mounted_; }
+
+  // Starts sampling the unmounted virtual threads into recorder, as
+  // samples of period_nanos.
+  static void StartParkedSampling(int64_t period_nanos,
+                                  ParkedRecorder recorder);
+
+  // Stops sampling, recording the sampled virtual threads still unmounted.
+  static void StopParkedSampling();
+
+ private:
+  struct Parked;
+
+  static void JNICALL Mount(jvmtiEnv *jvmti, ...);
+  static void JNICALL Unmount(jvmtiEnv *jvmti, ...);
+
+  // Returns the id of virtual thread thread, from its Thread.tid field.
+  static int64_t ThreadId(JNIEnv *jni, jthread thread);
+
+  // Records into recorder the time virtual_thread, sampled into parked,
+  // spent unmounted until now_nanos. Requires parked to be claimed.
+  static void RecordParked(ParkedRecorder recorder, Parked *parked,
+                           int64_t virtual_thread, int64_t now_nanos);
+
+  static int sampling_rate_;
+  static jfieldID tid_field_;
+  // Table of the sampled unmounted virtual threads. Allocated by Enable()
+  // and never freed, as events may still be handled when sampling stops.
+  static Parked *parked_;
+  static int max_parked_;
+  static std::atomic<int64_t> period_nanos_;
+  static std::atomic<ParkedRecorder> recorder_;
+
+  // Accessed from the signal handler, see the comments of Accessors on the
+  // TLS model.
+#if defined(JAVAPROFILER_GLOBAL_DYNAMIC_TLS) || defined(ALPINE)
+  static __thread int64_t mounted_
+      __attribute__((tls_model("global-dynamic")));
+#else
+  static __thread int64_t mounted_
+      __attribute__((tls_model("initial-exec")));
+#endif
+};
+
+}  // namespace profiler
+}  // namespace cloud
+
+#endif  // CLOUD_PROFILER_AGENT_JAVA_VIRTUAL_THREADS_H_
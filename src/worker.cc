@@ -22,7 +22,11 @@
 #include <vector>
 
 #include "src/clock.h"
+#include "src/contention.h"
+#include "src/method_ids.h"
+#include "src/overhead.h"
 #include "src/profiler.h"
+#include "src/proto.h"
 #include "src/throttler_api.h"
 #include "src/throttler_timed.h"
 #include "third_party/javaprofiler/heap_sampler.h"
@@ -36,6 +40,51 @@ DEFINE_int32(cprof_cpu_sampling_period_msec, 10,
              "sampling period for CPU time profiling, in milliseconds");
 DEFINE_int32(cprof_wall_sampling_period_msec, 100,
              "sampling period for wall time profiling, in milliseconds");
+DEFINE_int32(cprof_method_cache_max_entries, 65536,
+             "maximum number of Java methods whose symbolization is kept "
+             "across profiles, 0 for no limit");
+DEFINE_int32(cprof_native_symbols_max_mb, 64,
+             "maximum memory used to cache the symbols of native code, in "
+             "megabytes, 0 for no limit");
+DEFINE_int32(cprof_profile_dictionary_max_entries, 1 << 20,
+             "maximum number of strings, functions and locations kept "
+             "across CPU and wall profiles, 0 for no limit");
+DEFINE_int32(cprof_cpu_profiles_per_upload, 1,
+             "with --cprof_profile_filename, number of successive CPU "
+             "profiles merged locally into each one saved or uploaded");
+DEFINE_bool(cprof_enable_heap_alloc_profiling, false,
+            "when set along with heap sampling, also collect profiles of "
+            "the heap allocations over the profiling duration");
+DEFINE_bool(cprof_enable_threads_profiling, false,
+            "when set, also collect profiles of the state and stack of the "
+            "threads");
+DEFINE_int32(cprof_threads_sampling_period_msec, 1000,
+             "period of the thread snapshots for threads profiling, in "
+             "milliseconds");
+DEFINE_int32(cprof_overhead_log_interval_sec, 600,
+             "interval between the log lines summarizing the work done by "
+             "the agent itself, in seconds, 0 to disable them");
+DEFINE_bool(cprof_continuous_cpu, false,
+            "when set, collect CPU profiles continuously at a low sampling "
+            "rate, uploading one per window, instead of the profiles "
+            "requested by the profiler service or the local throttler");
+DEFINE_int32(cprof_continuous_cpu_sampling_period_msec, 100,
+             "sampling period for the continuous CPU profiling, in "
+             "milliseconds");
+DEFINE_int32(cprof_continuous_window_sec, 60,
+             "duration of the windows of the continuous CPU profiling, in "
+             "seconds");
+DEFINE_int32(cprof_upload_queue_depth, 1,
+             "number of collected profiles that may wait for their upload "
+             "while the next one is collected, 0 to upload each profile "
+             "before collecting the next");
+DEFINE_string(cprof_upload_spool_dir, "",
+              "when set, directory where the profiles which do not fit in "
+              "the upload queue, or fail to upload, are kept to be uploaded "
+              "later on, including by a later process");
+DEFINE_int32(cprof_upload_spool_max_mb, 64,
+             "max size of the profiles kept in --cprof_upload_spool_dir, "
+             "in megabytes, beyond which the oldest ones are dropped");
 
 namespace cloud {
 namespace profiler {
@@ -71,7 +120,7 @@ std::string JavaVersion(JNIEnv *jni) {
 
 std::atomic<bool> Worker::enabled_;
 
-void Worker::Start(JNIEnv *jni) {
+void Worker::Start(JNIEnv *jni, Activation activation) {
   jclass cls = jni->FindClass("java/lang/Thread");
   jmethodID constructor = jni->GetMethodID(cls, "<init>", "()V");
   jobject thread = jni->NewGlobalRef(jni->NewObject(cls, constructor));
@@ -87,6 +136,15 @@ void Worker::Start(JNIEnv *jni) {
   if (google::javaprofiler::HeapMonitor::Enabled()) {
     LOG(INFO) << "Heap allocation sampling supported for this JDK";
     types.push_back(api::HEAP);
+    if (FLAGS_cprof_enable_heap_alloc_profiling) {
+      types.push_back(api::HEAP_ALLOC);
+    }
+  }
+  if (ContentionProfiler::Enabled()) {
+    types.push_back(api::CONTENTION);
+  }
+  if (FLAGS_cprof_enable_threads_profiling) {
+    types.push_back(api::THREADS);
   }
 
   // Initialize the throttler here rather in the constructor, since the
@@ -96,6 +154,32 @@ void Worker::Start(JNIEnv *jni) {
                          new APIThrottler(types, "java", java_version))
                    : std::unique_ptr<Throttler>(
                          new TimedThrottler(FLAGS_cprof_profile_filename));
+  methods_.reset(
+      new MethodCache(jvmti_, FLAGS_cprof_method_cache_max_entries));
+  compression_ = CompressionFromFlags(!FLAGS_cprof_profile_filename.empty());
+  LOG(INFO) << "Profile compression: " << CompressionName(compression_);
+  if (FLAGS_cprof_upload_queue_depth > 0) {
+    std::unique_ptr<UploadSpool> spool;
+    if (!FLAGS_cprof_upload_spool_dir.empty()) {
+      spool.reset(new UploadSpool(
+          FLAGS_cprof_upload_spool_dir,
+          int64_t{FLAGS_cprof_upload_spool_max_mb} * 1024 * 1024));
+      if (!spool->Open()) {
+        spool.reset();
+      }
+    }
+    Throttler *throttler = throttler_.get();
+    uploads_.reset(new UploadQueue(
+        FLAGS_cprof_upload_queue_depth, std::move(spool),
+        [throttler](const std::string &profile_type, int64_t duration_nanos) {
+          return throttler->OfflineUpload(profile_type, duration_nanos);
+        }));
+  }
+
+  activation_ = activation;
+  if (uploads_ && activation_ != kLazy) {
+    uploads_->Start();
+  }
 
   // Pass 'this' as the arg to access members from the worker thread.
   jvmtiError err = jvmti_->RunAgentThread(thread, ProfileThread, this,
@@ -112,6 +196,11 @@ void Worker::Stop() {
   stopping_.store(true, std::memory_order_release);
   // Close the throttler which will initiate cancellation of WaitNext / Upload.
   throttler_->Close();
+  // Release the worker thread if it waits on the uploads, and wait till
+  // the upload thread is done.
+  if (uploads_) {
+    uploads_->Stop();
+  }
   // Wait till the worker thread is done.
   std::lock_guard<std::mutex> lock(mutex_);
 }
@@ -119,14 +208,46 @@ void Worker::Stop() {
 namespace {
 
 std::string Collect(Profiler *p, JNIEnv *env,
-                    google::javaprofiler::NativeProcessInfo *native_info) {
+                    google::javaprofiler::NativeProcessInfo *native_info,
+                    ProfileProtoBuilder *builder,
+                    const CompressionOptions &compression) {
   const char *profile_type = p->ProfileType();
   if (!p->Collect()) {
     LOG(ERROR) << "Failure: Could not collect " << profile_type << " profile";
     return "";
   }
-  native_info->Refresh();
-  return p->SerializeProfile(env, *native_info);
+  {
+    ScopedOverheadTimer timer(Overhead::kNativeInfoRefresh);
+    native_info->Refresh();
+  }
+  return p->SerializeProfile(env, builder, compression);
+}
+
+// Same as above, for a profile merged with the next ones until there are
+// per_upload of them, returning an empty profile until then.
+std::string CollectMerged(Profiler *p, JNIEnv *env,
+                          google::javaprofiler::NativeProcessInfo *native_info,
+                          ProfileProtoBuilder *builder,
+                          const CompressionOptions &compression,
+                          MergedTraces *merged, int per_upload) {
+  if (!p->Collect()) {
+    LOG(ERROR) << "Failure: Could not collect " << p->ProfileType()
+               << " profile";
+    return "";
+  }
+  bool is_merged = p->MergeInto(merged);
+  if (is_merged && merged->collections < per_upload) {
+    return "";
+  }
+  {
+    ScopedOverheadTimer timer(Overhead::kNativeInfoRefresh);
+    native_info->Refresh();
+  }
+  if (!is_merged) {
+    // The calling context tree is not merged.
+    return p->SerializeProfile(env, builder, compression);
+  }
+  return p->SerializeMerged(env, builder, compression, merged);
 }
 
 class JNILocalFrame {
@@ -156,9 +277,54 @@ void Worker::ProfileThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg) {
   Worker *w = static_cast<Worker *>(arg);
   std::lock_guard<std::mutex> lock(w->mutex_);
 
+  // Whether the throttler was already waited for the next profile. The
+  // continuous profiling instead starts right away.
+  bool due = false;
+  if (w->activation_ == kLazy && !FLAGS_cprof_continuous_cpu) {
+    LOG(INFO) << "Waiting for the first profile to activate the agent";
+    while (!due && w->throttler_->WaitNext() && !w->stopping_) {
+      due = enabled_;
+    }
+    if (!due) {
+      LOG(INFO) << "Exiting the profiling loop, the agent was not activated";
+      return;
+    }
+  }
+  if (!w->Activate(jvmti_env, jni_env)) {
+    return;
+  }
+
   google::javaprofiler::NativeProcessInfo n("/proc/self/maps");
+  NativeSymbolCache native_symbols(
+      &n, int64_t{FLAGS_cprof_native_symbols_max_mb} * 1024 * 1024);
+  ProfileProtoBuilder builder(&n, &native_symbols, w->methods_.get(),
+                              FLAGS_cprof_profile_dictionary_max_entries);
+  // Only the profiles saved by the local throttler may wait for the next
+  // ones, those created by the profiler service are due right away.
+  int cpu_per_upload = 1;
+  if (FLAGS_cprof_cpu_profiles_per_upload > 1) {
+    if (FLAGS_cprof_profile_filename.empty()) {
+      LOG(WARNING) << "Ignoring --cprof_cpu_profiles_per_upload without "
+                   << "--cprof_profile_filename";
+    } else {
+      cpu_per_upload = FLAGS_cprof_cpu_profiles_per_upload;
+    }
+  }
+  MergedTraces merged_cpu;
+  struct timespec next_overhead_log =
+      TimeAdd(DefaultClock()->Now(),
+              NanosToTimeSpec(FLAGS_cprof_overhead_log_interval_sec *
+                              kNanosPerSecond));
 
-  while (w->throttler_->WaitNext()) {
+  if (FLAGS_cprof_continuous_cpu) {
+    w->ProfileContinuously(jni_env, &n, &builder);
+    w->methods_->Clear(jni_env);
+    LOG(INFO) << "Exiting the continuous profiling loop";
+    return;
+  }
+
+  while (due || w->throttler_->WaitNext()) {
+    due = false;
     if (w->stopping_) {
       // The worker is exiting.
       break;
@@ -180,18 +346,42 @@ void Worker::ProfileThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg) {
     // so that, if ever JNI handle leaks do happen again, this will release the
     // handles automatically.
     JNILocalFrame local_frame(jni_env);
-    std::string profile;
+    if (FLAGS_cprof_overhead_log_interval_sec > 0 &&
+        TimeLessThan(next_overhead_log, DefaultClock()->Now())) {
+      LOG(INFO) << "Agent overhead: "
+                << Overhead::Summary(Overhead::Snapshot());
+      next_overhead_log =
+          TimeAdd(DefaultClock()->Now(),
+                  NanosToTimeSpec(FLAGS_cprof_overhead_log_interval_sec *
+                                  kNanosPerSecond));
+    }
+    std::unique_ptr<PendingUpload> upload(new PendingUpload);
     std::string pt = w->throttler_->ProfileType();
     if (pt == kTypeCPU) {
       CPUProfiler p(w->jvmti_, w->threads_, w->throttler_->DurationNanos(),
                     FLAGS_cprof_cpu_sampling_period_msec * kNanosPerMilli);
-      profile = Collect(&p, jni_env, &n);
+      if (cpu_per_upload > 1) {
+        upload->data = CollectMerged(&p, jni_env, &n, &builder,
+                                     w->compression_, &merged_cpu,
+                                     cpu_per_upload);
+        if (upload->data.empty() && merged_cpu.collections > 0) {
+          // Waits for the next profiles to be merged with.
+          continue;
+        }
+      } else {
+        upload->data = Collect(&p, jni_env, &n, &builder, w->compression_);
+      }
     } else if (pt == kTypeWall) {
       // Note that the requested sampling period for the wall profiling may be
       // increased if the number of live threads is too large.
       WallProfiler p(w->jvmti_, w->threads_, w->throttler_->DurationNanos(),
                      FLAGS_cprof_wall_sampling_period_msec * kNanosPerMilli);
-      profile = Collect(&p, jni_env, &n);
+      upload->data = Collect(&p, jni_env, &n, &builder, w->compression_);
+    } else if (pt == kTypeThreads) {
+      ThreadsProfiler p(
+          w->jvmti_, w->threads_, w->throttler_->DurationNanos(),
+          FLAGS_cprof_threads_sampling_period_msec * kNanosPerMilli);
+      upload->data = Collect(&p, jni_env, &n, &builder, w->compression_);
     } else if (pt == kTypeHeap) {
       if (!google::javaprofiler::HeapMonitor::Enabled()) {
         LOG(WARNING) << "Asked for a heap sampler but it is disabled";
@@ -204,24 +394,166 @@ void Worker::ProfileThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg) {
       //   - Some other objects might be sampled but not show up yet.
       // On the flip side, this allows the profile collection to not provoke a
       // GC.
-      perftools::profiles::Builder::Marshal(
-          *google::javaprofiler::HeapMonitor::GetHeapProfiles(
-              jni_env, false /* force_gc */),
-          &profile);
+      // The compression is left to the upload thread.
+      upload->proto = google::javaprofiler::HeapMonitor::GetHeapProfiles(
+          jni_env, false /* force_gc */);
+      upload->compression = w->compression_;
+    } else if (pt == kTypeHeapAlloc) {
+      if (!google::javaprofiler::HeapMonitor::Enabled()) {
+        LOG(WARNING) << "Asked for a heap allocation profile but the heap "
+                     << "sampler is disabled";
+        continue;
+      }
+
+      // The allocations are counted by the heap sampler as they happen, so
+      // collecting only takes starting and ending the counting window.
+      google::javaprofiler::HeapMonitor::ResetAllocations();
+      DefaultClock()->SleepFor(
+          NanosToTimeSpec(w->throttler_->DurationNanos()));
+      upload->proto =
+          google::javaprofiler::HeapMonitor::GetAllocationProfiles(jni_env);
+      upload->compression = w->compression_;
+    } else if (pt == kTypeContention) {
+      if (!ContentionProfiler::Enabled()) {
+        LOG(WARNING) << "Asked for a contention profile but the contention "
+                     << "profiling is disabled";
+        continue;
+      }
+
+      // The contended monitor entries are only counted over the profiling
+      // duration, keeping the monitor events disabled between profiles.
+      if (!ContentionProfiler::Start()) {
+        LOG(ERROR) << "Failure: Could not collect contention profile";
+        continue;
+      }
+      DefaultClock()->SleepFor(
+          NanosToTimeSpec(w->throttler_->DurationNanos()));
+      {
+        ScopedOverheadTimer timer(Overhead::kNativeInfoRefresh);
+        n.Refresh();
+      }
+      upload->proto = ContentionProfiler::Stop(
+          jni_env, w->throttler_->DurationNanos(), &native_symbols);
+      upload->compression = w->compression_;
     } else {
       LOG(ERROR) << "Unknown profile type '" << pt << "', skipping the upload";
       continue;
     }
-    if (profile.empty()) {
+    if (upload->data.empty() && upload->proto == nullptr) {
       LOG(ERROR) << "No profile bytes collected, skipping the upload";
       continue;
     }
-    if (!w->throttler_->Upload(std::move(profile))) {
-      LOG(ERROR) << "Error on profile upload, discarding the profile";
-    }
+    upload->profile_type = pt;
+    upload->duration_nanos = w->throttler_->DurationNanos();
+    upload->upload = w->throttler_->DetachUpload();
+    w->Upload(std::move(upload));
+  }
+  if (merged_cpu.collections > 0) {
+    // Fewer than cpu_per_upload profiles were merged, eg the last ones
+    // before --cprof_max_count.
+    JNILocalFrame local_frame(jni_env);
+    CPUProfiler p(w->jvmti_, w->threads_, 0,
+                  FLAGS_cprof_cpu_sampling_period_msec * kNanosPerMilli);
+    n.Refresh();
+    std::unique_ptr<PendingUpload> upload(new PendingUpload);
+    // Read before SerializeMerged() resets it.
+    upload->duration_nanos = merged_cpu.duration_nanos;
+    upload->data =
+        p.SerializeMerged(jni_env, &builder, w->compression_, &merged_cpu);
+    upload->profile_type = kTypeCPU;
+    upload->upload =
+        w->throttler_->OfflineUpload(kTypeCPU, upload->duration_nanos);
+    w->Upload(std::move(upload));
   }
+  w->methods_->Clear(jni_env);
   LOG(INFO) << "Exiting the profiling loop";
 }
 
+bool Worker::Activate(jvmtiEnv *jvmti_env, JNIEnv *jni_env) {
+  if (activation_ == kActive) {
+    return true;
+  }
+  int64_t start_nanos = Overhead::NowNanos();
+  // Before listing the loaded classes, so that no class is missed.
+  if (activation_ == kLazy && !EnableClassEvents(jvmti_env)) {
+    LOG(ERROR) << "Failed to activate the agent";
+    return false;
+  }
+  int primed =
+      CreateJMethodIDsForLoadedClasses(jvmti_env, jni_env, &stopping_);
+  LOG(INFO) << "Created the jmethodIDs of " << primed << " loaded classes in "
+            << (Overhead::NowNanos() - start_nanos) / kNanosPerMilli << "ms";
+  if (activation_ == kLazy && uploads_) {
+    uploads_->Start();
+  }
+  return true;
+}
+
+void Worker::ProfileContinuously(
+    JNIEnv *jni_env, google::javaprofiler::NativeProcessInfo *native_info,
+    ProfileProtoBuilder *builder) {
+  int64_t window_nanos =
+      int64_t{FLAGS_cprof_continuous_window_sec} * kNanosPerSecond;
+  LOG(INFO) << "Collecting CPU profiles continuously, over windows of "
+            << FLAGS_cprof_continuous_window_sec << "s";
+  // Sampling goes on across windows: the signal handler and the timers
+  // are only set up again after profiling was disabled.
+  CPUProfiler p(jvmti_, threads_, window_nanos,
+                FLAGS_cprof_continuous_cpu_sampling_period_msec *
+                    kNanosPerMilli);
+  bool sampling = false;
+  while (!stopping_) {
+    if (!enabled_) {
+      if (sampling) {
+        p.StopContinuous();
+        sampling = false;
+      }
+      DefaultClock()->SleepFor(NanosToTimeSpec(kNanosPerSecond));
+      continue;
+    }
+    if (!sampling) {
+      if (!p.StartContinuous()) {
+        LOG(ERROR) << "Failure: Could not start continuous CPU profiling";
+        return;
+      }
+      sampling = true;
+    }
+
+    JNILocalFrame local_frame(jni_env);
+    if (!p.CollectWindow(window_nanos, &stopping_)) {
+      break;
+    }
+    {
+      ScopedOverheadTimer timer(Overhead::kNativeInfoRefresh);
+      native_info->Refresh();
+    }
+    std::unique_ptr<PendingUpload> upload(new PendingUpload);
+    upload->data = p.SerializeProfile(jni_env, builder, compression_);
+    if (upload->data.empty()) {
+      LOG(ERROR) << "No profile bytes collected, skipping the upload";
+      continue;
+    }
+    upload->profile_type = kTypeCPU;
+    // The window ends early when stopping, and flushes may stretch it.
+    upload->duration_nanos = p.DurationNanos();
+    upload->upload =
+        throttler_->OfflineUpload(kTypeCPU, upload->duration_nanos);
+    Upload(std::move(upload));
+  }
+  if (sampling) {
+    p.StopContinuous();
+  }
+}
+
+void Worker::Upload(std::unique_ptr<PendingUpload> upload) {
+  if (uploads_) {
+    if (!uploads_->Add(std::move(upload))) {
+      LOG(INFO) << "The worker is stopping, discarding the profile";
+    }
+  } else if (!UploadQueue::Upload(upload.get())) {
+    LOG(ERROR) << "Error on profile upload, discarding the profile";
+  }
+}
+
 }  // namespace profiler
 }  // namespace cloud
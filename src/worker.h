@@ -21,13 +21,24 @@
 #include <memory>
 #include <mutex>  // NOLINT
 
+#include "src/compression.h"
 #include "src/globals.h"
+#include "src/method_cache.h"
 #include "src/threads.h"
 #include "src/throttler.h"
+#include "src/upload_queue.h"
+
+namespace google {
+namespace javaprofiler {
+class NativeProcessInfo;
+}  // namespace javaprofiler
+}  // namespace google
 
 namespace cloud {
 namespace profiler {
 
+class ProfileProtoBuilder;
+
 class Worker {
  public:
   Worker(jvmtiEnv *jvmti, ThreadTable *threads)
@@ -37,7 +48,21 @@ class Worker {
   Worker(const Worker &) = delete;
   Worker &operator=(const Worker &) = delete;
 
-  void Start(JNIEnv *jni);
+  // What the worker thread sets up before it collects its first profile.
+  enum Activation {
+    // Nothing, everything was set up during VM init.
+    kActive,
+    // Creates the jmethodIDs of the classes loaded before VM init, as soon
+    // as the thread starts.
+    kPrimeLoadedClasses,
+    // Waits for the first profile to be due before it enables the class
+    // events, creates the jmethodIDs of the classes loaded so far and
+    // starts the upload thread, so that a process which never gets
+    // profiled pays for none of it.
+    kLazy,
+  };
+
+  void Start(JNIEnv *jni, Activation activation);
   void Stop();
 
   static void EnableProfiling();
@@ -46,9 +71,29 @@ class Worker {
  private:
   static void ProfileThread(jvmtiEnv *jvmti_env, JNIEnv *jni_env, void *arg);
 
+  // Collects CPU profiles over back to back windows until stopping, see
+  // --cprof_continuous_cpu, instead of those requested by the throttler.
+  void ProfileContinuously(
+      JNIEnv *jni_env, google::javaprofiler::NativeProcessInfo *native_info,
+      ProfileProtoBuilder *builder);
+
+  // Sets up what activation_ left for the worker thread to do. Returns
+  // false if the class events could not be enabled.
+  bool Activate(jvmtiEnv *jvmti_env, JNIEnv *jni_env);
+
+  // Uploads a collected profile, or queues it for upload.
+  void Upload(std::unique_ptr<PendingUpload> upload);
+
   jvmtiEnv *jvmti_;
   ThreadTable *threads_;
   std::unique_ptr<Throttler> throttler_;
+  // Symbolization data shared by the successive profiles.
+  std::unique_ptr<MethodCache> methods_;
+  CompressionOptions compression_;
+  // Uploads the profiles while the next ones are collected; null when
+  // each profile is uploaded by the worker thread before the next one.
+  std::unique_ptr<UploadQueue> uploads_;
+  Activation activation_ = kActive;
   std::mutex mutex_;  // Held by the worker thread while it's running.
   std::atomic<bool> stopping_;
   static std::atomic<bool> enabled_;
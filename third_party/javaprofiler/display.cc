@@ -15,6 +15,7 @@
 #include "third_party/javaprofiler/display.h"
 
 #include <inttypes.h>
+#include <algorithm>
 #include <cstring>
 
 #include "third_party/javaprofiler/stacktrace_fixer.h"
@@ -145,15 +146,22 @@ void FillMethodSignatureAndLine(jvmtiEnv *jvmti, const JVMPI_CallFrame &frame,
 }  // end namespace
 
 jint GetLineNumber(jvmtiEnv *jvmti, jmethodID method, jlocation location) {
-  jint entry_count;
-  JvmtiScopedPtr<jvmtiLineNumberEntry> table_ptr_ctr(jvmti);
-  jint line_number = -1;
-
   // Shortcut for native methods.
   if (location < 0) {
     return -1;
   }
 
+  LineNumberTable table;
+  table.Load(jvmti, method);
+  return table.LineNumber(location);
+}
+
+bool LineNumberTable::Load(jvmtiEnv *jvmti, jmethodID method) {
+  loaded_ = true;
+  entries_.clear();
+
+  jint entry_count;
+  JvmtiScopedPtr<jvmtiLineNumberEntry> table_ptr_ctr(jvmti);
   int jvmti_error =
       jvmti->GetLineNumberTable(method, &entry_count, table_ptr_ctr.GetRef());
 
@@ -167,35 +175,41 @@ jint GetLineNumber(jvmtiEnv *jvmti, jmethodID method, jlocation location) {
         no_debug_info = true;
       }
     }
-    return -1;
+    return false;
   }
 
   jvmtiLineNumberEntry *table_ptr = table_ptr_ctr.Get();
-  if (entry_count == 1) {
-    return table_ptr[0].line_number;
+  entries_.assign(table_ptr, table_ptr + entry_count);
+  // The JVMTI does not promise any order. The sort is stable so that, among
+  // entries sharing a start location, the last one wins as in a walk.
+  std::stable_sort(entries_.begin(), entries_.end(),
+                   [](const jvmtiLineNumberEntry &a,
+                      const jvmtiLineNumberEntry &b) {
+                     return a.start_location < b.start_location;
+                   });
+  return true;
+}
+
+jint LineNumberTable::LineNumber(jlocation location) const {
+  // Natives have a negative location and no table.
+  if (location < 0 || entries_.empty()) {
+    return -1;
   }
-  if (location == 0) {
+  if (entries_.size() == 1 || location == 0) {
     // Return method first line.
-    return table_ptr[0].line_number;
+    return entries_[0].line_number;
   }
 
-  jlocation last_location = table_ptr[0].start_location;
-  for (int l = 1; l < entry_count; l++) {
-    // ... and if you see one that is in the right place for your
-    // location, you've found the line number!
-    if ((location < table_ptr[l].start_location) &&
-        (location >= last_location)) {
-      line_number = table_ptr[l - 1].line_number;
-      return line_number;
-    }
-    last_location = table_ptr[l].start_location;
-  }
-
-  if (location >= last_location) {
-    return table_ptr[entry_count - 1].line_number;
+  // The entry covering location is the last one starting at or before it.
+  auto it = std::upper_bound(
+      entries_.begin(), entries_.end(), location,
+      [](jlocation l, const jvmtiLineNumberEntry &e) {
+        return l < e.start_location;
+      });
+  if (it == entries_.begin()) {
+    return -1;
   }
-
-  return -1;
+  return (it - 1)->line_number;
 }
 
 bool GetStackFrameElements(JNIEnv *jni, jvmtiEnv *jvmti,
@@ -17,6 +17,7 @@
 #include <jvmti.h>
 
 #include <string>
+#include <vector>
 
 #include "third_party/javaprofiler/globals.h"
 #include "third_party/javaprofiler/native.h"
@@ -31,8 +32,33 @@ namespace javaprofiler {
 // Walks the line number table and return the associated Java line number from a
 // given method and location.
 // Returns -1 on error or for native methods.
+// Callers resolving several locations of a method should use a
+// LineNumberTable instead, which fetches the table only once.
 jint GetLineNumber(jvmtiEnv *jvmti, jmethodID method, jlocation location);
 
+// The line number table of a method, sorted by start location so that
+// locations are resolved with a binary search.
+class LineNumberTable {
+ public:
+  LineNumberTable() {}
+
+  // Fetches the table of method from the JVMTI. When the table is not
+  // available, e.g. for native methods or classes compiled without debug
+  // information, the table is left empty and false is returned.
+  bool Load(jvmtiEnv *jvmti, jmethodID method);
+
+  // Whether Load() was called, successful or not.
+  bool Loaded() const { return loaded_; }
+
+  // Returns the line number of location, with the same semantics as
+  // GetLineNumber().
+  jint LineNumber(jlocation location) const;
+
+ private:
+  bool loaded_ = false;
+  std::vector<jvmtiLineNumberEntry> entries_;
+};
+
 // Fill the file_name, class_name, method_name, and line_number parameters using
 // the information provided by the frame and using the JVMTI environment.
 // When unknown, it fills the parameters with: UnknownFile, UnknownClass,
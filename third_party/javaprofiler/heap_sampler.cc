@@ -17,23 +17,71 @@
 #include <jni.h>
 #include <jvmti.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>              // NOLINT
+#include <cmath>
 #include <condition_variable>  // NOLINT
+#include <cstdlib>
 #include <list>
 #include <memory>
 #include <mutex>  // NOLINT
+#include <utility>
 #include <vector>
 
 #include "third_party/javaprofiler/accessors.h"
 #include "third_party/javaprofiler/heap_sampler.h"
 #include "third_party/javaprofiler/profile_proto_builder.h"
 #include "third_party/javaprofiler/stacktrace_decls.h"
+#include "third_party/javaprofiler/stacktrace_fixer.h"
 #include "third_party/javaprofiler/stacktraces.h"
 
 namespace {
 
 using google::javaprofiler::JVMPI_CallFrame;
 
+// Upper bounds of the age buckets of the freed objects, and their labels.
+const int64_t kAgeBucketLimitsNanos[] = {
+    google::javaprofiler::kNanosPerSecond,
+    10 * google::javaprofiler::kNanosPerSecond,
+    60 * google::javaprofiler::kNanosPerSecond,
+    600 * google::javaprofiler::kNanosPerSecond,
+};
+const char *const kAgeBucketLabels[] = {"<1s", "1s-10s", "10s-1m", "1m-10m",
+                                        ">10m"};
+
+// Period of the adjustments of an adaptive sampling interval.
+const int64_t kAdjustmentPeriodNanos = google::javaprofiler::kNanosPerSecond;
+
+// Staging buffer of the allocating thread, as an index assigned on its first
+// sample, plus one.
+__thread int staging_buffer_index = 0;
+std::atomic<int> next_staging_buffer_index(0);
+
+// State of the per-thread generator deciding which samples get tracked
+// once the heap storage is over its memory budget.
+__thread uint64_t admission_random = 0;
+
+// Returns true with a probability of 1/2^shift.
+bool Admit(int shift) {
+  if (shift == 0) {
+    return true;
+  }
+  uint64_t x = admission_random;
+  if (x == 0) {
+    x = (reinterpret_cast<uintptr_t>(&admission_random) ^
+         google::javaprofiler::TimeSpecToNanos(
+             google::javaprofiler::DefaultClock()->Now())) |
+        1;
+  }
+  // xorshift64.
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  admission_random = x;
+  return (x & ((uint64_t{1} << shift) - 1)) == 0;
+}
+
 std::vector<JVMPI_CallFrame> TransformFrames(jvmtiFrameInfo *stack_frames,
                                              jint count) {
   std::vector<JVMPI_CallFrame> frames(count);
@@ -49,13 +97,18 @@ std::vector<JVMPI_CallFrame> TransformFrames(jvmtiFrameInfo *stack_frames,
   return frames;
 }
 
+// Captures the stack with AsyncGetCallTrace, which walks the frames of the
+// thread directly instead of going through a JVMTI stack walk.
 std::unique_ptr<std::vector<JVMPI_CallFrame>> GetTrace(JNIEnv *jni) {
-  std::unique_ptr<std::vector<JVMPI_CallFrame>> trace_result = nullptr;
-
-// Cannot use the fast stacktrace for standalone builds as their standard
-// libraries do not support getcontext.
+  JVMPI_CallFrame frames[google::javaprofiler::kMaxFramesToCapture];
+  int num_frames = google::javaprofiler::Asgct::GetCurrentThreadTrace(
+      jni, google::javaprofiler::kMaxFramesToCapture, frames);
+  if (num_frames <= 0) {
+    return nullptr;
+  }
 
-  return trace_result;
+  return std::unique_ptr<std::vector<JVMPI_CallFrame>>(
+      new std::vector<JVMPI_CallFrame>(frames, frames + num_frames));
 }
 
 std::unique_ptr<std::vector<JVMPI_CallFrame>> GetTraceUsingJvmti(
@@ -75,16 +128,6 @@ std::unique_ptr<std::vector<JVMPI_CallFrame>> GetTraceUsingJvmti(
       new std::vector<JVMPI_CallFrame>(TransformFrames(stack_frames, count)));
 }
 
-static jstring GetClassName(JNIEnv *jni_env, jobject object,
-                            jclass object_klass) {
-  jclass cls = jni_env->FindClass("java/lang/Class");
-  jmethodID get_name_id =
-      jni_env->GetMethodID(cls, "getName", "()Ljava/lang/String;");
-  jstring name_obj = static_cast<jstring>(
-      jni_env->CallObjectMethod(object_klass, get_name_id));
-  return name_obj;
-}
-
 static jlong GetThreadId(JNIEnv *jni_env, jthread thread) {
   jclass thread_class = jni_env->FindClass("java/lang/Thread");
   jmethodID get_id_method_id =
@@ -101,33 +144,18 @@ extern "C" JNIEXPORT void SampledObjectAlloc(jvmtiEnv *jvmti_env,
     return;
   }
 
-  if (!google::javaprofiler::HeapMonitor::HasAllocationInstrumentation() &&
-      !google::javaprofiler::HeapMonitor::HasGarbageInstrumentation()) {
-    google::javaprofiler::HeapMonitor::AddSample(
-        jni_env, thread, object, object_klass, size, nullptr, 0, 0);
-    return;
-  }
-  jstring class_name = GetClassName(jni_env, object, object_klass);
-  const char *name_str = jni_env->GetStringUTFChars(class_name, NULL);
-  int name_len = strlen(name_str);
-  jbyte *name_bytes =
-      const_cast<jbyte *>(reinterpret_cast<const jbyte *>(name_str));
-
-  jlong thread_id = GetThreadId(jni_env, thread);
-
   google::javaprofiler::HeapMonitor::AddSample(jni_env, thread, object,
-                                               object_klass, size, name_bytes,
-                                               name_len, thread_id);
-  // Invoke all functions in HeapMonitor::alloc_inst_functions_
-  google::javaprofiler::HeapMonitor::InvokeAllocationInstrumentationFunctions(
-      thread_id, name_bytes, name_len, size, 0);
-  jni_env->ReleaseStringUTFChars(class_name, name_str);
+                                               object_klass, size);
 }
 
 extern "C" JNIEXPORT void GarbageCollectionFinish(jvmtiEnv *jvmti_env) {
   google::javaprofiler::HeapMonitor::NotifyGCWaitingThread();
 }
 
+extern "C" JNIEXPORT void ObjectFree(jvmtiEnv *jvmti_env, jlong tag) {
+  google::javaprofiler::HeapMonitor::ObjectFreed(tag);
+}
+
 }  // namespace
 
 namespace google {
@@ -143,95 +171,382 @@ std::atomic<HeapMonitor *> HeapMonitor::heap_monitor_;
 
 std::atomic<jvmtiEnv *> HeapMonitor::jvmti_;
 std::atomic<int> HeapMonitor::sampling_interval_;
+std::atomic<int64_t> HeapMonitor::target_samples_per_sec_;
+std::atomic<int> HeapMonitor::min_sampling_interval_;
+std::atomic<int> HeapMonitor::max_sampling_interval_;
 std::atomic<bool> HeapMonitor::use_jvm_trace_;
 std::vector<AllocationInstrumentationFunction>
     HeapMonitor::alloc_inst_functions_;
 std::vector<GarbageInstrumentationFunction> HeapMonitor::gc_inst_functions_;
 
+int ClassTable::Intern(jvmtiEnv *jvmti, jclass klass) {
+  jlong tag = 0;
+  if (jvmti->GetTag(klass, &tag) == JVMTI_ERROR_NONE && IsClassTag(tag)) {
+    return -tag - 1;
+  }
+
+  std::string name = "<unknown>";
+  JvmtiScopedPtr<char> signature(jvmti);
+  if (jvmti->GetClassSignature(klass, signature.GetRef(), nullptr) ==
+      JVMTI_ERROR_NONE) {
+    name = signature.Get();
+    PrettyPrintSignature(&name);
+  }
+  int id = InternName(name);
+  // A positive tag means that the Class object was itself sampled; keep
+  // that tag, so that its freeing is noticed.
+  if (tag == 0) {
+    jvmti->SetTag(klass, -static_cast<jlong>(id) - 1);
+  }
+  return id;
+}
+
+int ClassTable::InternName(const std::string &name) {
+  std::lock_guard<std::mutex> lock(lock_);
+  auto it = ids_.find(name);
+  if (it != ids_.end()) {
+    return it->second;
+  }
+  int id = names_.size();
+  names_.push_back(name);
+  ids_.emplace(name, id);
+  return id;
+}
+
+const std::string &ClassTable::Name(int id) {
+  std::lock_guard<std::mutex> lock(lock_);
+  return names_[id];
+}
+
+int StackTable::Intern(std::vector<JVMPI_CallFrame> *frames) {
+  uint64_t hash = CalculateHash(0, frames->size(), frames->data());
+  auto range = ids_.equal_range(hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    Entry &entry = entries_[it->second];
+    if (entry.frames.size() == frames->size() &&
+        Equal(frames->size(), entry.frames.data(), frames->data())) {
+      entry.refs++;
+      return it->second;
+    }
+  }
+
+  int id;
+  if (free_ids_.empty()) {
+    id = entries_.size();
+    entries_.emplace_back();
+  } else {
+    id = free_ids_.back();
+    free_ids_.pop_back();
+  }
+  Entry &entry = entries_[id];
+  entry.frames = std::move(*frames);
+  entry.hash = hash;
+  entry.refs = 1;
+  ids_.emplace(hash, id);
+  bytes_ += EntryBytes(entry.frames.size());
+  return id;
+}
+
+void StackTable::Unref(int id) {
+  Entry &entry = entries_[id];
+  if (--entry.refs > 0) {
+    return;
+  }
+  auto range = ids_.equal_range(entry.hash);
+  for (auto it = range.first; it != range.second; ++it) {
+    if (it->second == id) {
+      ids_.erase(it);
+      break;
+    }
+  }
+  bytes_ -= EntryBytes(entry.frames.size());
+  std::vector<JVMPI_CallFrame>().swap(entry.frames);
+  free_ids_.push_back(id);
+}
+
+int64_t StackTable::EntryBytes(size_t num_frames) {
+  // The entry, its frames, and the hash table node of its id.
+  return sizeof(Entry) + num_frames * sizeof(JVMPI_CallFrame) +
+         sizeof(std::pair<const uint64_t, int>) + 2 * sizeof(void *);
+}
+
 HeapEventStorage::HeapEventStorage(jvmtiEnv *jvmti, ProfileFrameCache *cache,
-                                   int max_garbage_size, GcCallback gc_callback)
-    : peak_profile_size_(0),
+                                   int max_garbage_size, GcCallback gc_callback,
+                                   int64_t max_allocation_stacks,
+                                   int64_t max_memory_bytes)
+    : next_tag_(1),
+      peak_profile_size_(0),
       max_garbage_size_(max_garbage_size),
-      cur_garbage_pos_(0),
       jvmti_(jvmti),
       cache_(cache),
-      gc_callback_(gc_callback) {}
+      gc_callback_(gc_callback),
+      max_memory_bytes_(max_memory_bytes),
+      admission_shift_(0),
+      admission_closed_(false),
+      dropped_live_samples_(0),
+      thinning_gen_(DefaultClock()->Now().tv_nsec / 1000),
+      allocations_(max_allocation_stacks),
+      dropped_allocations_(0),
+      allocations_start_(DefaultClock()->Now()) {}
 
 void HeapEventStorage::Add(JNIEnv *jni, jthread thread, jobject object,
-                           jclass klass, jlong size,
-                           std::vector<JVMPI_CallFrame> frames, jbyte *name,
-                           jint name_len, jlong thread_id) {
-  jweak weak_ref = jni->NewWeakGlobalRef(object);
-  if (jni->ExceptionCheck()) {
-    LOG(WARNING) << "Failed to create NewWeakGlobalRef, skipping heap sample";
-    return;
+                           jclass klass, jlong size, int sampling_interval,
+                           std::vector<JVMPI_CallFrame> frames, int class_id,
+                           jlong thread_id) {
+  // Only tracked objects are tagged, so that the others cost no ObjectFree
+  // event.
+  int shift = admission_shift_.load(std::memory_order_relaxed);
+  bool track =
+      !admission_closed_.load(std::memory_order_relaxed) && Admit(shift);
+  jlong tag = 0;
+  if (track) {
+    tag = next_tag_.fetch_add(1, std::memory_order_relaxed);
+    if (jvmti_->SetTag(object, tag) != JVMTI_ERROR_NONE) {
+      LOG(WARNING) << "Failed to tag the object, skipping heap sample";
+      return;
+    }
   }
 
-  HeapObjectTrace live_object(weak_ref, size, std::move(frames), name, name_len,
-                              thread_id);
+  JVMPI_CallTrace trace = {nullptr, static_cast<jint>(frames.size()),
+                           frames.data()};
+  // The interval is part of the key, for the unsampling of each trace.
+  if (!allocations_.Add(sampling_interval, &trace, 1, size)) {
+    dropped_allocations_.fetch_add(1, std::memory_order_relaxed);
+  }
 
+  if (!track) {
+    if (admission_closed_.load(std::memory_order_relaxed)) {
+      dropped_live_samples_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return;
+  }
+
+  HeapObjectTrace live_object(tag, size, sampling_interval,
+                              TimeSpecToNanos(DefaultClock()->Now()),
+                              std::move(frames), class_id,
+                              &classes_.Name(class_id), thread_id);
+  live_object.Reweight(1 << shift);
+
+  if (staging_buffer_index == 0) {
+    staging_buffer_index =
+        next_staging_buffer_index.fetch_add(1, std::memory_order_relaxed) %
+            kStagingBuffers +
+        1;
+  }
   // Only now lock and get things done quickly.
-  std::lock_guard<std::mutex> lock(storage_lock_);
-  newly_allocated_objects_.push_back(std::move(live_object));
+  StagingBuffer &buffer = staging_[staging_buffer_index - 1];
+  std::lock_guard<std::mutex> lock(buffer.lock);
+  buffer.objects.push_back(std::move(live_object));
 }
 
-void HeapEventStorage::AddToGarbage(HeapObjectTrace &&obj) {
-  if (garbage_objects_.size() >= max_garbage_size_) {
-    garbage_objects_[cur_garbage_pos_] = std::move(obj);
-    cur_garbage_pos_ = (cur_garbage_pos_ + 1) % max_garbage_size_;
+void HeapEventStorage::AddToGarbage(const HeapObjectTrace &obj,
+                                    int64_t now_ns) {
+  SampleKey key = KeyOf(obj);
+  auto it = garbage_.find(key);
+  if (it == garbage_.end()) {
+    if (garbage_.size() >= max_garbage_size_) {
+      dropped_garbage_++;
+      stacks_.Unref(obj.StackId());
+      return;
+    }
+    // The entry takes over the reference of the object.
+    it = garbage_.emplace(key, GarbageCounts()).first;
   } else {
-    garbage_objects_.push_back(std::move(obj));
+    stacks_.Unref(obj.StackId());
+  }
+
+  int64_t age_ns = now_ns - obj.AllocationTimeNanos();
+  int bucket = 0;
+  while (bucket < kAgeBuckets - 1 && age_ns >= kAgeBucketLimitsNanos[bucket]) {
+    bucket++;
   }
+  it->second.by_age[bucket] += obj.Weight();
 }
 
-void HeapEventStorage::MoveLiveObjects(
-    JNIEnv *env, std::vector<HeapObjectTrace> *objects,
-    std::vector<HeapObjectTrace> *still_live_objects) {
-  for (auto &elem : *objects) {
-    if (elem.IsLive(env)) {
-      still_live_objects->push_back(std::move(elem));
-    } else {
-      gc_callback_(elem);
-      elem.DeleteWeakReference(env);
-      AddToGarbage(std::move(elem));
-    }
+void HeapEventStorage::ObjectFreed(jlong tag) {
+  // Unloaded classes are kept in the class table.
+  if (ClassTable::IsClassTag(tag)) {
+    return;
   }
+  std::lock_guard<std::mutex> lock(freed_lock_);
+  freed_tags_.push_back(tag);
 }
 
-int64_t HeapEventStorage::ProfileSize(
-    const std::vector<HeapObjectTrace> &live_objects) const {
-  int64_t total = 0;
-  for (auto &trace : live_objects) {
-    total += trace.Size();
+void HeapEventStorage::MoveFreedObjects() {
+  {
+    std::lock_guard<std::mutex> lock(freed_lock_);
+    dead_tags_.insert(dead_tags_.end(), freed_tags_.begin(),
+                      freed_tags_.end());
+    freed_tags_.clear();
   }
-  return total;
+
+  int64_t now_ns = TimeSpecToNanos(DefaultClock()->Now());
+  size_t unmatched = 0;
+  for (jlong tag : dead_tags_) {
+    auto it = live_objects_.find(tag);
+    if (it == live_objects_.end()) {
+      // The object was freed after its staging buffer was drained, or was
+      // dropped by the memory budget.
+      if (tag >= compacted_tag_limit_) {
+        dead_tags_[unmatched++] = tag;
+      }
+      continue;
+    }
+    HeapObjectTrace &elem = it->second;
+    auto count = live_counts_.find(KeyOf(elem));
+    if ((count->second -= elem.Weight()) == 0) {
+      live_counts_.erase(count);
+    }
+    live_size_ -= elem.Size() * elem.Weight();
+    CountClass(elem, -elem.Weight());
+    gc_callback_(elem);
+    AddToGarbage(elem, now_ns);
+    live_objects_.erase(it);
+  }
+  dead_tags_.resize(unmatched);
 }
 
-void HeapEventStorage::CompactSamples(JNIEnv *env) {
-  std::lock_guard<std::mutex> lock(storage_lock_);
+int64_t HeapEventStorage::TrackedBytes() const {
+  // Hash table nodes also hold a next pointer and a bucket pointer.
+  const int64_t kNodeBytes = 2 * sizeof(void *);
+  return live_objects_.size() *
+             (sizeof(std::pair<const jlong, HeapObjectTrace>) + kNodeBytes) +
+         (live_counts_.size() + peak_counts_.size()) *
+             (sizeof(SampleCounts::value_type) + kNodeBytes) +
+         stacks_.Bytes();
+}
 
-  std::vector<HeapObjectTrace> still_live;
+void HeapEventStorage::EnforceMemoryBudget() {
+  if (max_memory_bytes_ <= 0) {
+    return;
+  }
 
-  MoveLiveObjects(env, &newly_allocated_objects_, &still_live);
-  MoveLiveObjects(env, &live_objects_, &still_live);
+  int initial_shift = admission_shift_.load(std::memory_order_relaxed);
+  int shift = initial_shift;
+  std::bernoulli_distribution drop(0.5);
+  while (TrackedBytes() > max_memory_bytes_ && shift < kMaxAdmissionShift &&
+         !live_objects_.empty()) {
+    shift++;
+    for (auto it = live_objects_.begin(); it != live_objects_.end();) {
+      HeapObjectTrace &object = it->second;
+      int64_t weight = object.Weight();
+      auto count = live_counts_.find(KeyOf(object));
+      if (drop(thinning_gen_)) {
+        if ((count->second -= weight) == 0) {
+          live_counts_.erase(count);
+        }
+        live_size_ -= object.Size() * weight;
+        CountClass(object, -weight);
+        stacks_.Unref(object.StackId());
+        it = live_objects_.erase(it);
+      } else {
+        count->second += weight;
+        live_size_ += object.Size() * weight;
+        CountClass(object, weight);
+        object.Reweight(2);
+        ++it;
+      }
+    }
+    LOG(INFO) << "Heap samples over the memory budget of "
+              << max_memory_bytes_ << " bytes, tracking 1 in "
+              << (1 << shift) << " samples";
+  }
+  // Track more samples again once the objects use well under the budget.
+  if (shift == initial_shift && shift > 0 &&
+      TrackedBytes() < max_memory_bytes_ / 4) {
+    shift--;
+  }
+  admission_shift_.store(shift, std::memory_order_relaxed);
 
-  // Live objects are the objects still alive.
-  live_objects_ = std::move(still_live);
-  // Newly allocated objects is now reset, those still alive are now in
-  // live_objects.
-  newly_allocated_objects_.clear();
+  bool closed = TrackedBytes() > max_memory_bytes_;
+  if (closed && !admission_closed_.load(std::memory_order_relaxed)) {
+    LOG(WARNING) << "Heap samples over the memory budget of "
+                 << max_memory_bytes_ << " bytes, not tracking new samples";
+  }
+  admission_closed_.store(closed, std::memory_order_relaxed);
+}
 
-  // Update peak profile if needed.
+void HeapEventStorage::CountClass(const HeapObjectTrace &object,
+                                  int64_t weight) {
+  if (object.ClassId() >= class_counts_.size()) {
+    class_counts_.resize(object.ClassId() + 1);
+  }
+  // Unsampled like the samples of the heap profiles.
+  double objects = weight * CalculateSamplingRatio(object.SamplingInterval(),
+                                                   1, object.Size());
+  ClassCounts &counts = class_counts_[object.ClassId()];
+  counts.objects += objects;
+  counts.bytes += objects * object.Size();
+}
 
-  int64_t curr_profile_size = ProfileSize(live_objects_);
+std::vector<HeapEventStorage::ClassHistogramEntry>
+HeapEventStorage::GetClassHistogram(size_t max_classes) {
+  std::lock_guard<std::mutex> lock(storage_lock_);
+  std::vector<int> ids;
+  for (int id = 0; id < class_counts_.size(); ++id) {
+    // Counts fall back to about zero, not exactly, once all are freed.
+    if (class_counts_[id].objects >= 0.5) {
+      ids.push_back(id);
+    }
+  }
+  auto more_bytes = [this](int a, int b) {
+    return class_counts_[a].bytes > class_counts_[b].bytes;
+  };
+  if (ids.size() > max_classes) {
+    std::partial_sort(ids.begin(), ids.begin() + max_classes, ids.end(),
+                      more_bytes);
+    ids.resize(max_classes);
+  } else {
+    std::sort(ids.begin(), ids.end(), more_bytes);
+  }
 
-  if (curr_profile_size > peak_profile_size_) {
-    peak_profile_size_ = curr_profile_size;
+  std::vector<ClassHistogramEntry> histogram;
+  for (int id : ids) {
+    histogram.push_back({classes_.Name(id),
+                         std::llround(class_counts_[id].objects),
+                         std::llround(class_counts_[id].bytes)});
+  }
+  return histogram;
+}
 
-    peak_objects_.clear();
-    for (auto &object : live_objects_) {
-      peak_objects_.push_back(object.Copy());
+void HeapEventStorage::CompactSamples(JNIEnv *env) {
+  std::lock_guard<std::mutex> lock(storage_lock_);
+  // Any tag below this is staged by the end of the next compaction.
+  jlong tag_limit = next_tag_.load(std::memory_order_relaxed);
+
+  for (StagingBuffer &buffer : staging_) {
+    {
+      // Hand the buffer the emptied storage of the previous one, so that it
+      // keeps its capacity.
+      std::lock_guard<std::mutex> staging_lock(buffer.lock);
+      buffer.objects.swap(drained_);
+    }
+    for (auto &object : drained_) {
+      object.SetStackId(stacks_.Intern(&object.Frames()));
+      live_counts_[KeyOf(object)] += object.Weight();
+      live_size_ += object.Size() * object.Weight();
+      CountClass(object, object.Weight());
+      jlong tag = object.Tag();
+      live_objects_.emplace(tag, std::move(object));
     }
+    drained_.clear();
+  }
+  MoveFreedObjects();
+  compacted_tag_limit_ = tag_limit;
+  EnforceMemoryBudget();
+
+  // Update peak profile if needed. This only copies the distinct stacks and
+  // sizes of the live objects, not the objects.
+  if (live_size_ > peak_profile_size_) {
+    peak_profile_size_ = live_size_;
+
+    for (const auto &entry : live_counts_) {
+      stacks_.Ref(entry.first.stack_id);
+    }
+    for (const auto &entry : peak_counts_) {
+      stacks_.Unref(entry.first.stack_id);
+    }
+    peak_counts_ = live_counts_;
   }
 }
 
@@ -240,33 +555,84 @@ HeapEventStorage::StackTraceArrayBuilder::StackTraceArrayBuilder(
     : objects_size_(objects_size),
       stack_trace_data_(
           new google::javaprofiler::ProfileStackTrace[objects_size_]),
-      call_trace_data_(new JVMPI_CallTrace[objects_size_]) {}
+      call_trace_data_(new JVMPI_CallTrace[objects_size_]),
+      counts_(new int32_t[objects_size_]) {}
 
 void HeapEventStorage::StackTraceArrayBuilder::AddTrace(
-    HeapObjectTrace &object) {
-  std::vector<JVMPI_CallFrame> &frames = object.Frames();
-
-  call_trace_data_[curr_trace_] = {nullptr, static_cast<int>(frames.size()),
-                                   frames.data()};
+    const std::vector<JVMPI_CallFrame> &frames, jlong size,
+    int sampling_interval, int32_t count) {
+  // The builder only reads the frames.
+  call_trace_data_[curr_trace_] = {
+      nullptr, static_cast<int>(frames.size()),
+      const_cast<JVMPI_CallFrame *>(frames.data())};
 
   stack_trace_data_[curr_trace_] = {&call_trace_data_[curr_trace_],
-                                    object.Size()};
+                                    size * count};
+  stack_trace_data_[curr_trace_].trace_and_labels.sampling_rate =
+      sampling_interval;
 
   // Add the size as a label to help post-processing filtering.
-  stack_trace_data_[curr_trace_].trace_and_labels.AddLabel(
-      "bytes", object.Size(), "bytes");
+  stack_trace_data_[curr_trace_].trace_and_labels.AddLabel("bytes", size,
+                                                           "bytes");
+  counts_[curr_trace_] = count;
 
   curr_trace_++;
 }
 
+void HeapEventStorage::StackTraceArrayBuilder::AddLabel(
+    const std::string &key, const std::string &value) {
+  stack_trace_data_[curr_trace_ - 1].trace_and_labels.AddLabel(key, value);
+}
+
+std::unique_ptr<perftools::profiles::Profile>
+HeapEventStorage::ConvertGarbageToProto(ProfileProtoBuilder *builder) {
+  if (dropped_garbage_ > 0) {
+    LOG(WARNING) << "Dropped " << dropped_garbage_ << " freed objects, the "
+                 << "garbage table is full";
+    dropped_garbage_ = 0;
+  }
+
+  StackTraceArrayBuilder stack_trace_builder(garbage_.size() * kAgeBuckets);
+  for (const auto &entry : garbage_) {
+    const SampleKey &key = entry.first;
+    for (int bucket = 0; bucket < kAgeBuckets; ++bucket) {
+      int64_t count = entry.second.by_age[bucket];
+      if (count == 0) {
+        continue;
+      }
+      stack_trace_builder.AddTrace(stacks_.Frames(key.stack_id), key.size,
+                                   key.sampling_interval, count);
+      stack_trace_builder.AddLabel("age", kAgeBucketLabels[bucket]);
+    }
+  }
+
+  builder->AddTraces(stack_trace_builder.GetStackTraceData(),
+                     stack_trace_builder.GetCounts(),
+                     stack_trace_builder.Size());
+  std::unique_ptr<perftools::profiles::Profile> profile =
+      builder->CreateProto();
+
+  for (const auto &entry : garbage_) {
+    stacks_.Unref(entry.first.stack_id);
+  }
+  garbage_.clear();
+  return profile;
+}
+
 std::unique_ptr<perftools::profiles::Profile> HeapEventStorage::ConvertToProto(
-    ProfileProtoBuilder *builder, std::vector<HeapObjectTrace> &objects) {
-  StackTraceArrayBuilder stack_trace_builder(objects.size());
-  for (int i = 0; i < objects.size(); ++i) {
-    stack_trace_builder.AddTrace(objects[i]);
+    ProfileProtoBuilder *builder, const SampleCounts &counts) const {
+  // One trace per distinct stack and size, rather than have the builder look
+  // up the stack of each object.
+  StackTraceArrayBuilder stack_trace_builder(counts.size());
+  for (const auto &entry : counts) {
+    const SampleKey &key = entry.first;
+    stack_trace_builder.AddTrace(stacks_.Frames(key.stack_id), key.size,
+                                 key.sampling_interval, entry.second);
   }
 
-  builder->AddTraces(stack_trace_builder.GetStackTraceData(), objects.size());
+  builder->AddTraces(stack_trace_builder.GetStackTraceData(),
+                     stack_trace_builder.GetCounts(),
+                     stack_trace_builder.Size());
   return builder->CreateProto();
 }
 
@@ -276,7 +642,63 @@ HeapEventStorage::GetPeakHeapProfiles(JNIEnv *env, int sampling_interval) {
       ProfileProtoBuilder::ForHeap(env, jvmti_, sampling_interval, cache_);
 
   std::lock_guard<std::mutex> lock(storage_lock_);
-  return ConvertToProto(builder.get(), peak_objects_);
+  return ConvertToProto(builder.get(), peak_counts_);
+}
+
+void HeapEventStorage::ResetAllocations() {
+  std::lock_guard<std::mutex> lock(allocations_lock_);
+  for (int i = 0; i < allocations_.MaxEntries(); ++i) {
+    int64_t attr, count;
+    JVMPI_CallFrame frame;
+    allocations_.Extract(i, &attr, 1, &frame, &count);
+  }
+  dropped_allocations_.store(0, std::memory_order_relaxed);
+  allocations_start_ = DefaultClock()->Now();
+}
+
+std::unique_ptr<perftools::profiles::Profile>
+HeapEventStorage::GetAllocationProfiles(JNIEnv *env, int sampling_interval) {
+  std::lock_guard<std::mutex> lock(allocations_lock_);
+  struct timespec now = DefaultClock()->Now();
+  auto builder = ProfileProtoBuilder::ForAllocation(
+      env, jvmti_,
+      TimeSpecToNanos(now) - TimeSpecToNanos(allocations_start_),
+      sampling_interval, cache_);
+  allocations_start_ = now;
+
+  std::vector<std::vector<JVMPI_CallFrame>> stacks;
+  std::vector<int64_t> bytes;
+  std::vector<int64_t> intervals;
+  std::vector<int32_t> counts;
+  JVMPI_CallFrame frames[kMaxFramesToCapture];
+  for (int i = 0; i < allocations_.MaxEntries(); ++i) {
+    int64_t attr, count, metric;
+    int num_frames = allocations_.Extract(i, &attr, kMaxFramesToCapture,
+                                          frames, &count, &metric);
+    if (num_frames > 0) {
+      stacks.emplace_back(frames, frames + num_frames);
+      bytes.push_back(metric);
+      intervals.push_back(attr);
+      counts.push_back(count);
+    }
+  }
+  int64_t dropped = dropped_allocations_.exchange(0, std::memory_order_relaxed);
+  if (dropped > 0) {
+    LOG(WARNING) << "Dropped " << dropped << " allocation samples, the "
+                 << "allocation table is full";
+  }
+
+  std::unique_ptr<JVMPI_CallTrace[]> traces(new JVMPI_CallTrace[stacks.size()]);
+  std::unique_ptr<ProfileStackTrace[]> stack_traces(
+      new ProfileStackTrace[stacks.size()]);
+  for (size_t i = 0; i < stacks.size(); ++i) {
+    traces[i] = {nullptr, static_cast<int>(stacks[i].size()),
+                 stacks[i].data()};
+    stack_traces[i] = {&traces[i], bytes[i]};
+    stack_traces[i].trace_and_labels.sampling_rate = intervals[i];
+  }
+  builder->AddTraces(stack_traces.get(), counts.data(), stacks.size());
+  return builder->CreateProto();
 }
 
 std::unique_ptr<perftools::profiles::Profile> HeapEventStorage::GetProfiles(
@@ -293,14 +715,34 @@ std::unique_ptr<perftools::profiles::Profile> HeapEventStorage::GetProfiles(
     CompactSamples(env);
   }
 
+  int64_t dropped =
+      dropped_live_samples_.exchange(0, std::memory_order_relaxed);
+  if (dropped > 0) {
+    LOG(WARNING) << "Dropped " << dropped << " heap samples over the memory "
+                 << "budget";
+  }
+
+  std::unique_ptr<perftools::profiles::Profile> profile;
   {
     std::lock_guard<std::mutex> lock(storage_lock_);
 
-    if (get_live) {
-      return ConvertToProto(builder.get(), live_objects_);
+    if (!get_live) {
+      return ConvertGarbageToProto(builder.get());
     }
+    profile = ConvertToProto(builder.get(), live_counts_);
+  }
+  AddClassHistogramComments(profile.get());
+  return profile;
+}
 
-    return ConvertToProto(builder.get(), garbage_objects_);
+void HeapEventStorage::AddClassHistogramComments(
+    perftools::profiles::Profile *profile) {
+  for (const ClassHistogramEntry &entry :
+       GetClassHistogram(kClassHistogramComments)) {
+    profile->add_string_table("class " + entry.name + ": " +
+                              std::to_string(entry.objects) + " objects, " +
+                              std::to_string(entry.bytes) + " bytes");
+    profile->add_comment(profile->string_table_size() - 1);
   }
 }
 
@@ -335,7 +777,8 @@ bool HeapMonitor::Supported(jvmtiEnv *jvmti) {
   // it was added at the end of the structure. Therefore this is a cheap way to
   // check for a runtime "are we running with JDK11+".
   if (!caps.can_generate_sampled_object_alloc_events ||
-      !caps.can_generate_garbage_collection_events) {
+      !caps.can_generate_garbage_collection_events ||
+      !caps.can_tag_objects || !caps.can_generate_object_free_events) {
     // Provide more debug information that this will fail: JVMTI_VERSION and
     // sizeof is really lower level but helps figure out compilation
     // environments.
@@ -343,6 +786,8 @@ bool HeapMonitor::Supported(jvmtiEnv *jvmti) {
                  << caps.can_generate_sampled_object_alloc_events
                  << "; GC Collection: "
                  << caps.can_generate_garbage_collection_events
+                 << "; Tagging: " << caps.can_tag_objects
+                 << "; Object free: " << caps.can_generate_object_free_events
                  << "; Size of capabilities: " << sizeof(jvmtiCapabilities)
                  << "; JVMTI_VERSION: " << JVMTI_VERSION;
     return false;
@@ -351,14 +796,7 @@ bool HeapMonitor::Supported(jvmtiEnv *jvmti) {
 }
 
 void HeapMonitor::AddSample(JNIEnv *jni_env, jthread thread, jobject object,
-                            jclass object_klass, jlong size, jbyte *name,
-                            jint name_len, jlong thread_id) {
-  auto trace = use_jvm_trace_.load()
-                   ? GetTrace(jni_env)
-                   : GetTraceUsingJvmti(jni_env, jvmti_.load(), thread);
-  if (trace == nullptr) {
-    return;
-  }
+                            jclass object_klass, jlong size) {
   // HeapMonitor is never deleted, but the pointer is cleared during
   // disablement. Ensure we are not racing with disablement and check if the
   // HeapMonitor is nullptr.
@@ -366,8 +804,43 @@ void HeapMonitor::AddSample(JNIEnv *jni_env, jthread thread, jobject object,
   if (instance == nullptr) {
     return;
   }
-  instance->storage_.Add(jni_env, thread, object, object_klass, size,
-                         std::move(*trace), name, name_len, thread_id);
+  int class_id = instance->storage_.InternClass(object_klass);
+  jlong thread_id = 0;
+  if (HasAllocationInstrumentation() || HasGarbageInstrumentation()) {
+    thread_id = GetThreadId(jni_env, thread);
+  }
+
+  std::unique_ptr<std::vector<JVMPI_CallFrame>> trace;
+  if (use_jvm_trace_.load()) {
+    trace = GetTrace(jni_env);
+  }
+  if (trace == nullptr) {
+    trace = GetTraceUsingJvmti(jni_env, jvmti_.load(), thread);
+  }
+  if (trace != nullptr) {
+    if (target_samples_per_sec_.load(std::memory_order_relaxed) > 0) {
+      instance->samples_since_adjustment_.fetch_add(
+          1, std::memory_order_relaxed);
+    }
+    instance->storage_.Add(jni_env, thread, object, object_klass, size,
+                           sampling_interval_.load(std::memory_order_relaxed),
+                           std::move(*trace), class_id, thread_id);
+  }
+
+  if (HasAllocationInstrumentation()) {
+    const std::string &name = instance->storage_.ClassName(class_id);
+    InvokeAllocationInstrumentationFunctions(
+        thread_id, reinterpret_cast<jbyte *>(const_cast<char *>(name.data())),
+        name.size(), size, 0);
+  }
+}
+
+void HeapMonitor::ObjectFreed(jlong tag) {
+  HeapMonitor *instance = TryGetInstance();
+  if (instance == nullptr) {
+    return;
+  }
+  instance->storage_.ObjectFreed(tag);
 }
 
 void HeapMonitor::InvokeAllocationInstrumentationFunctions(
@@ -444,11 +917,21 @@ void HeapMonitor::WaitForShutdown() {
 void HeapMonitor::AddCallback(jvmtiEventCallbacks *callbacks) {
   callbacks->SampledObjectAlloc = &SampledObjectAlloc;
   callbacks->GarbageCollectionFinish = &GarbageCollectionFinish;
+  callbacks->ObjectFree = &ObjectFree;
 }
 
 // Currently, we enable once and forget about it.
+void HeapMonitor::SetAdaptiveSampling(int64_t target_samples_per_sec,
+                                      int min_interval, int max_interval) {
+  target_samples_per_sec_.store(target_samples_per_sec);
+  min_sampling_interval_.store(min_interval);
+  max_sampling_interval_.store(max_interval);
+}
+
 bool HeapMonitor::Enable(jvmtiEnv *jvmti, JNIEnv *jni, int sampling_interval,
-                         int max_garbage_size, bool use_jvm_trace) {
+                         int max_garbage_size, bool use_jvm_trace,
+                         int64_t max_allocation_stacks,
+                         int64_t max_memory_bytes) {
   if (!Supported(jvmti)) {
     LOG(WARNING) << "Heap sampling is not supported by the JVM, disabling the "
                  << " heap sampling monitor";
@@ -462,6 +945,8 @@ bool HeapMonitor::Enable(jvmtiEnv *jvmti, JNIEnv *jni, int sampling_interval,
   caps.can_get_source_file_name = 1;
   caps.can_generate_sampled_object_alloc_events = 1;
   caps.can_generate_garbage_collection_events = 1;
+  caps.can_tag_objects = 1;
+  caps.can_generate_object_free_events = 1;
 
   if (jvmti->AddCapabilities(&caps) != JVMTI_ERROR_NONE) {
     LOG(WARNING) << "Failed to add capabilities, disabling the heap "
@@ -475,9 +960,19 @@ bool HeapMonitor::Enable(jvmtiEnv *jvmti, JNIEnv *jni, int sampling_interval,
     return false;
   }
 
+  // Enabled first so that no sampled object can be freed unnoticed.
+  if (jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_OBJECT_FREE,
+                                      nullptr) != JVMTI_ERROR_NONE) {
+    LOG(WARNING) << "Failed to enable object free event, disabling the heap "
+                 << "sampling monitor";
+    return false;
+  }
+
   if (jvmti->SetEventNotificationMode(JVMTI_ENABLE,
                                       JVMTI_EVENT_SAMPLED_OBJECT_ALLOC,
                                       nullptr) != JVMTI_ERROR_NONE) {
+    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_OBJECT_FREE,
+                                    nullptr);
     LOG(WARNING) << "Failed to enable sampled object alloc event, disabling the"
                  << " heap sampling monitor";
     return false;
@@ -488,12 +983,14 @@ bool HeapMonitor::Enable(jvmtiEnv *jvmti, JNIEnv *jni, int sampling_interval,
                                       nullptr) != JVMTI_ERROR_NONE) {
     jvmti->SetEventNotificationMode(JVMTI_DISABLE,
                                     JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, nullptr);
+    jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_OBJECT_FREE,
+                                    nullptr);
     LOG(WARNING) << "Failed to enable garbage collection finish event, "
                  << "disabling the heap sampling monitor";
     return false;
   }
 
-  if (use_jvm_trace) {
+  if (use_jvm_trace && Asgct::GetAsgct() == nullptr) {
     Asgct::SetAsgct(Accessors::GetJvmFunction<ASGCTType>("AsyncGetCallTrace"));
   }
 
@@ -504,7 +1001,9 @@ bool HeapMonitor::Enable(jvmtiEnv *jvmti, JNIEnv *jni, int sampling_interval,
   // Ensure this is really a singleton i.e. don't recreate it if sampling is
   // re-enabled.
   if (heap_monitor_ == nullptr) {
-    static HeapMonitor *monitor = new HeapMonitor(max_garbage_size);
+    static HeapMonitor *monitor =
+        new HeapMonitor(max_garbage_size, max_allocation_stacks,
+                        max_memory_bytes);
     if (!monitor->CreateGCWaitingThread(jvmti, jni)) {
       return false;
     }
@@ -526,6 +1025,8 @@ void HeapMonitor::Disable() {
                                   JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, nullptr);
   jvmti->SetEventNotificationMode(
       JVMTI_DISABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, nullptr);
+  jvmti->SetEventNotificationMode(JVMTI_DISABLE, JVMTI_EVENT_OBJECT_FREE,
+                                  nullptr);
   // Notify the agent thread that we are done.
   monitor->ShutdownGCWaitingThread();
   heap_monitor_.store(nullptr);
@@ -553,6 +1054,22 @@ std::unique_ptr<perftools::profiles::Profile> HeapMonitor::GetPeakHeapProfiles(
   return EmptyHeapProfile(env);
 }
 
+void HeapMonitor::ResetAllocations() {
+  HeapMonitor *monitor = TryGetInstance();
+  if (monitor != nullptr) {
+    monitor->storage_.ResetAllocations();
+  }
+}
+
+std::unique_ptr<perftools::profiles::Profile>
+HeapMonitor::GetAllocationProfiles(JNIEnv *env) {
+  HeapMonitor *monitor = TryGetInstance();
+  if (monitor != nullptr) {
+    return monitor->storage_.GetAllocationProfiles(env, sampling_interval_);
+  }
+  return EmptyHeapProfile(env);
+}
+
 std::unique_ptr<perftools::profiles::Profile>
 HeapMonitor::GetGarbageHeapProfiles(JNIEnv *env, bool force_gc) {
   // Note: technically this means that you cannot disable the sampler and then
@@ -580,8 +1097,18 @@ void HeapMonitor::NotifyGCWaitingThreadInternal(GcEvent event) {
 HeapMonitor::GcEvent HeapMonitor::WaitForGC() {
   std::unique_lock<std::mutex> lock(gc_waiting_mutex_);
 
-  // If we are woken up without having been notified, just go back to sleep.
-  gc_waiting_cv_.wait(lock, [this] { return !gc_notify_events_.empty(); });
+  if (target_samples_per_sec_.load() > 0) {
+    // Wake up for the adjustments of the sampling interval as well.
+    if (!gc_waiting_cv_.wait_for(
+            lock, std::chrono::nanoseconds(kAdjustmentPeriodNanos),
+            [this] { return !gc_notify_events_.empty(); })) {
+      return GcEvent::NO_EVENT;
+    }
+  } else {
+    // If we are woken up without having been notified, just go back to
+    // sleep.
+    gc_waiting_cv_.wait(lock, [this] { return !gc_notify_events_.empty(); });
+  }
 
   GcEvent result = gc_notify_events_.front();
   gc_notify_events_.pop_front();
@@ -608,7 +1135,10 @@ void HeapMonitor::GCWaitingThreadRun(JNIEnv *jni_env) {
       break;
     }
 
-    CompactData(jni_env);
+    AdjustSamplingInterval();
+    if (event == GcEvent::GC_FINISHED) {
+      CompactData(jni_env);
+    }
   }
 
   LOG(INFO) << "Heap sampling GC waiting thread finished";
@@ -618,5 +1148,42 @@ void HeapMonitor::CompactData(JNIEnv *jni_env) {
   storage_.CompactSamples(jni_env);
 }
 
+void HeapMonitor::AdjustSamplingInterval() {
+  int64_t target = target_samples_per_sec_.load();
+  if (target <= 0) {
+    return;
+  }
+  struct timespec now = DefaultClock()->Now();
+  int64_t elapsed_ns =
+      TimeSpecToNanos(now) - TimeSpecToNanos(last_adjustment_);
+  if (elapsed_ns < kAdjustmentPeriodNanos) {
+    return;
+  }
+  last_adjustment_ = now;
+  int64_t samples = samples_since_adjustment_.exchange(0);
+
+  // The number of samples is inversely proportional to the interval. Move
+  // by at most a factor of 2 per adjustment to ride out allocation bursts.
+  double factor = samples * static_cast<double>(kNanosPerSecond) /
+                  elapsed_ns / target;
+  factor = std::min(2.0, std::max(0.5, factor));
+  int64_t interval = sampling_interval_.load();
+  int64_t next = static_cast<int64_t>(interval * factor);
+  next = std::min<int64_t>(max_sampling_interval_.load(),
+                           std::max<int64_t>(min_sampling_interval_.load(),
+                                             next));
+  if (std::abs(next - interval) * 10 < interval) {
+    return;
+  }
+
+  // Samples taken around the change may be attributed to the wrong
+  // interval; that error is bounded by the 2x step.
+  if (jvmti_.load()->SetHeapSamplingInterval(next) != JVMTI_ERROR_NONE) {
+    LOG(WARNING) << "Failed to set the heap sampling interval to " << next;
+    return;
+  }
+  sampling_interval_.store(next);
+}
+
 }  // namespace javaprofiler
 }  // namespace google
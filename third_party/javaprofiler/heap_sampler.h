@@ -22,13 +22,19 @@
 
 #include <atomic>
 #include <condition_variable>  // NOLINT
+#include <deque>
 #include <functional>
 #include <list>
 #include <memory>
 #include <mutex>  // NOLINT
+#include <random>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "third_party/javaprofiler/clock.h"
 #include "third_party/javaprofiler/profile_proto_builder.h"
+#include "third_party/javaprofiler/stacktraces.h"
 
 typedef void (*AllocationInstrumentationFunction)(jlong thread_id, jbyte *name,
                                                   int name_length, jlong size,
@@ -41,25 +47,110 @@ typedef void (*GarbageInstrumentationFunction)(jlong thread_id, jbyte *name,
 namespace google {
 namespace javaprofiler {
 
+// Deduplicated storage for the stack traces of the sampled heap objects:
+// objects sampled at the same allocation site share a single copy of the
+// frames. Stacks are reference counted, and the ids of released stacks are
+// reused.
+//
+// Not thread-safe; HeapEventStorage only uses it with its storage lock held.
+class StackTable {
+ public:
+  StackTable() {}
+
+  // This type is neither copyable nor movable.
+  StackTable(const StackTable &) = delete;
+  StackTable &operator=(const StackTable &) = delete;
+
+  // Returns the id of the stack made of *frames, with a reference taken for
+  // the caller. The frames are moved out of *frames if the stack is new.
+  int Intern(std::vector<JVMPI_CallFrame> *frames);
+
+  void Ref(int id) { entries_[id].refs++; }
+
+  // Releases a reference to the stack, dropping it with the last one.
+  void Unref(int id);
+
+  const std::vector<JVMPI_CallFrame> &Frames(int id) const {
+    return entries_[id].frames;
+  }
+
+  // Returns the number of distinct stacks stored.
+  int Size() const { return entries_.size() - free_ids_.size(); }
+
+  // Returns an estimate of the memory held by the stored stacks, in bytes.
+  int64_t Bytes() const { return bytes_; }
+
+ private:
+  static int64_t EntryBytes(size_t num_frames);
+
+  struct Entry {
+    std::vector<JVMPI_CallFrame> frames;
+    uint64_t hash = 0;
+    int64_t refs = 0;
+  };
+
+  std::vector<Entry> entries_;
+  std::vector<int> free_ids_;
+  // Ids of the stored stacks by the hash of their frames.
+  std::unordered_multimap<uint64_t, int> ids_;
+  int64_t bytes_ = 0;
+};
+
+// Names of the classes of the sampled heap objects. A class is named on its
+// first sample and tagged with its id, so that its later samples only read
+// its JVMTI tag. Classes of the same name share an id.
+//
+// Thread-safe.
+class ClassTable {
+ public:
+  ClassTable() {}
+
+  // This type is neither copyable nor movable.
+  ClassTable(const ClassTable &) = delete;
+  ClassTable &operator=(const ClassTable &) = delete;
+
+  // Returns the id of the class.
+  int Intern(jvmtiEnv *jvmti, jclass klass);
+
+  // Returns the name of the class, e.g. "java.lang.String[]". The reference
+  // stays valid as long as the table.
+  const std::string &Name(int id);
+
+  // Returns whether the JVMTI tag is the one of a class.
+  static bool IsClassTag(jlong tag) { return tag < 0; }
+
+ private:
+  int InternName(const std::string &name);
+
+  std::mutex lock_;
+  std::unordered_map<std::string, int> ids_;
+  // Names by id; a deque keeps their addresses stable as it grows.
+  std::deque<std::string> names_;
+};
+
 // A sampled heap object, defined by the object, its size, and the stack
 // frame.
+//
+// The frames of a new sample are held by the object itself until the next
+// compaction of the HeapEventStorage, which moves them into its StackTable
+// and leaves the object with the id of the stack.
 class HeapObjectTrace {
  public:
-  // This object owns the jweak object parameter. It is freed when the object
-  // is sent to the garbage list, and the object is set to nullptr.
-  HeapObjectTrace(jweak object, jlong size, std::vector<JVMPI_CallFrame> frames,
-                  jbyte *name, int name_length, jlong thread_id)
-      : object_(object),
+  // The object is identified by the JVMTI tag set on it when sampled, and
+  // was sampled with the given heap sampling interval at the given time.
+  HeapObjectTrace(jlong tag, jlong size, int sampling_interval,
+                  int64_t allocation_time_ns,
+                  std::vector<JVMPI_CallFrame> frames, int class_id,
+                  const std::string *class_name, jlong thread_id)
+      : tag_(tag),
         size_(size),
+        sampling_interval_(sampling_interval),
+        allocation_time_ns_(allocation_time_ns),
         frames_(std::move(frames)),
-        name_(name),
-        name_length_(name_length),
+        class_id_(class_id),
+        class_name_(class_name),
         thread_id_(thread_id) {}
 
-  HeapObjectTrace(jweak object, jlong size,
-                  const std::vector<JVMPI_CallFrame> &frames)
-      : object_(object), size_(size), frames_(frames) {}
-
   // Allow moving.
   HeapObjectTrace(HeapObjectTrace &&o) = default;
   HeapObjectTrace &operator=(HeapObjectTrace &&o) = default;
@@ -68,38 +159,55 @@ class HeapObjectTrace {
   HeapObjectTrace(const HeapObjectTrace &o) = delete;
   HeapObjectTrace &operator=(const HeapObjectTrace &o) = delete;
 
+  // Frames of the sample, until it is given a stack id.
   std::vector<JVMPI_CallFrame> &Frames() { return frames_; }
 
+  // Id of the stack of the sample in the StackTable, or -1 until the
+  // sample is compacted.
+  int StackId() const { return stack_id_; }
+
+  void SetStackId(int stack_id) {
+    stack_id_ = stack_id;
+    std::vector<JVMPI_CallFrame>().swap(frames_);
+  }
+
   jlong Size() const { return size_; }
 
-  jbyte *Name() const { return name_; }
+  int SamplingInterval() const { return sampling_interval_; }
 
-  int NameLength() const { return name_length_; }
+  // Number of samples the object stands for, once the storage dropped
+  // others to stay within its memory budget.
+  int Weight() const { return weight_; }
 
-  jlong ThreadId() const { return thread_id_; }
+  void Reweight(int factor) { weight_ *= factor; }
 
-  void DeleteWeakReference(JNIEnv *env) {
-    env->DeleteWeakGlobalRef(object_);
-    object_ = nullptr;
-  }
+  // Monotonic time of the allocation, in nanoseconds.
+  int64_t AllocationTimeNanos() const { return allocation_time_ns_; }
 
-  bool IsLive(JNIEnv *env) {
-    // When GC collects the object, the object represented by the weak
-    // reference will be considered as the same object as NULL.
-    return !env->IsSameObject(object_, NULL);
+  // Id of the class of the object in the ClassTable of the storage.
+  int ClassId() const { return class_id_; }
+
+  jbyte *Name() const {
+    return reinterpret_cast<jbyte *>(const_cast<char *>(class_name_->data()));
   }
 
-  // Make copying an explicit operation for the one case we need it (adding
-  // to the peak heapz storage)
-  HeapObjectTrace Copy() { return HeapObjectTrace(object_, size_, frames_); }
+  int NameLength() const { return class_name_->size(); }
+
+  jlong ThreadId() const { return thread_id_; }
+
+  jlong Tag() const { return tag_; }
 
  private:
-  jweak object_;
+  jlong tag_;
   jlong size_;
+  int sampling_interval_;
+  int weight_ = 1;
+  int64_t allocation_time_ns_;
   std::vector<JVMPI_CallFrame> frames_;
-  jbyte *name_;
-  int name_length_;
-  jlong thread_id_;
+  int stack_id_ = -1;
+  int class_id_;
+  const std::string *class_name_;
+  jlong thread_id_ = 0;
 };
 
 // Storage for the sampled heap objects recorded from the heap sampling JVMTI
@@ -108,19 +216,46 @@ class HeapEventStorage {
  public:
   typedef std::function<void(const HeapObjectTrace &)> GcCallback;
 
+  // Freed objects are counted for up to max_garbage_size distinct stacks
+  // and sizes. Allocations are counted by stack in a table of
+  // max_allocation_stacks entries, or the AsyncSafeTraceMultiset default if
+  // not positive. The live objects and their stacks are kept within about
+  // max_memory_bytes, or without limit if not positive.
   HeapEventStorage(
       jvmtiEnv *jvmti, ProfileFrameCache *cache = nullptr,
-      int max_garbage_size = 200,
-      GcCallback gc_callback = [](const HeapObjectTrace &t) {});
+      int max_garbage_size = 4096,
+      GcCallback gc_callback = [](const HeapObjectTrace &t) {},
+      int64_t max_allocation_stacks = 0, int64_t max_memory_bytes = 0);
 
   // TODO: establish correct shutdown sequence: how do we ensure that
   // things are not going to go awfully wrong at shutdown, is it this class' job
   // or should it be the owner of this class' instance's job?
 
-  // Adds an object to the storage system.
+  // Adds an object of the class of the given id to the storage system,
+  // sampled with the given heap sampling interval. The object gets tagged,
+  // and ObjectFreed() must be called when the JVM reports it freed.
   void Add(JNIEnv *jni, jthread thread, jobject object, jclass klass,
-           jlong size, std::vector<JVMPI_CallFrame> frames, jbyte *name,
-           jint name_len, jlong thread_id);
+           jlong size, int sampling_interval,
+           std::vector<JVMPI_CallFrame> frames, int class_id,
+           jlong thread_id);
+
+  // Returns the id of the class in the class table, for Add().
+  int InternClass(jclass klass) { return classes_.Intern(jvmti_, klass); }
+
+  const std::string &ClassName(int class_id) {
+    return classes_.Name(class_id);
+  }
+
+  // Estimated number and size of the live objects of a class.
+  struct ClassHistogramEntry {
+    std::string name;
+    int64_t objects;
+    int64_t bytes;
+  };
+
+  // Returns the max_classes classes with the most live bytes, as estimated
+  // from the tracked samples, in decreasing order.
+  std::vector<ClassHistogramEntry> GetClassHistogram(size_t max_classes);
 
   // Returns a perftools::profiles::Profile with the objects stored via
   // calls to the Add method.
@@ -136,8 +271,18 @@ class HeapEventStorage {
   std::unique_ptr<perftools::profiles::Profile> GetPeakHeapProfiles(
       JNIEnv *env, int sampling_interval);
 
+  // Discards the allocations counted so far, starting a new allocation
+  // profile.
+  void ResetAllocations();
+
+  // Returns a perftools::profiles::Profile with the objects allocated since
+  // the last call to this or ResetAllocations(), whether they are still live
+  // or not.
+  std::unique_ptr<perftools::profiles::Profile> GetAllocationProfiles(
+      JNIEnv *env, int sampling_interval);
+
   // Returns a perftools::profiles::Profile with the objects that have been
-  // GC'd.
+  // GC'd since the last call, with an "age" label bucketing their lifetime.
   // force_gc provides a means to force GC before returning the sampled heap
   // profiles;
   // setting force_gc to true has a performance impact and is discouraged.
@@ -146,6 +291,11 @@ class HeapEventStorage {
     return GetProfiles(env, sampling_interval, force_gc, false);
   }
 
+  // Records that the object with the given tag was freed, to be moved to
+  // the garbage on the next compaction. Called from the JVMTI ObjectFree
+  // event, so it neither waits for a compaction nor uses JNI.
+  void ObjectFreed(jlong tag);
+
   void CompactSamples(JNIEnv *env);
 
   // Not copyable or movable.
@@ -159,68 +309,209 @@ class HeapEventStorage {
    public:
     StackTraceArrayBuilder(std::size_t objects_size);
 
-    void AddTrace(HeapObjectTrace &object);
+    // Adds count objects of the given size sampled with the given frames,
+    // which must outlive the builder, and sampling interval.
+    void AddTrace(const std::vector<JVMPI_CallFrame> &frames, jlong size,
+                  int sampling_interval, int32_t count);
+
+    // Adds a string label to the last added trace.
+    void AddLabel(const std::string &key, const std::string &value);
 
     google::javaprofiler::ProfileStackTrace *GetStackTraceData() const {
       return stack_trace_data_.get();
     }
 
+    const int32_t *GetCounts() const { return counts_.get(); }
+
+    int Size() const { return curr_trace_; }
+
    private:
     int curr_trace_ = 0;
     std::size_t objects_size_;
     std::unique_ptr<google::javaprofiler::ProfileStackTrace[]>
         stack_trace_data_;
     std::unique_ptr<JVMPI_CallTrace[]> call_trace_data_;
+    std::unique_ptr<int32_t[]> counts_;
   };
 
-  static std::unique_ptr<perftools::profiles::Profile> ConvertToProto(
-      ProfileProtoBuilder *builder, std::vector<HeapObjectTrace> &objects);
-
-  std::unique_ptr<perftools::profiles::Profile> GetProfiles(
-      JNIEnv *env, int sampling_interval, bool force_gc, bool get_live);
-
-  // Add object to the garbage list: it uses a queue with a max size of
-  // max_garbage_size, provided via the constructor.
-  // obj will be std::move'd to the garbage_list.
-  void AddToGarbage(HeapObjectTrace &&obj);
+  // Numbers of sampled objects by stack id, object size and sampling
+  // interval. Objects of the same key end up in the same sample, as the size
+  // is one of its labels and samples are unsampled at their interval.
+  struct SampleKey {
+    int stack_id;
+    jlong size;
+    int sampling_interval;
+
+    bool operator==(const SampleKey &other) const {
+      return stack_id == other.stack_id && size == other.size &&
+             sampling_interval == other.sampling_interval;
+    }
+  };
+  struct SampleKeyHash {
+    size_t operator()(const SampleKey &key) const {
+      return (static_cast<uint64_t>(key.size) * 0x9e3779b97f4a7c15ULL) ^
+             (static_cast<uint64_t>(key.sampling_interval) << 32) ^
+             key.stack_id;
+    }
+  };
+  typedef std::unordered_map<SampleKey, int32_t, SampleKeyHash> SampleCounts;
 
-  // Moves live objects from objects to still_live_objects; live elements from
-  // the objects vector are replaced with nullptr via std::move.
-  void MoveLiveObjects(JNIEnv *env, std::vector<HeapObjectTrace> *objects,
-                       std::vector<HeapObjectTrace> *still_live_objects);
+  static SampleKey KeyOf(const HeapObjectTrace &object) {
+    return {object.StackId(), object.Size(), object.SamplingInterval()};
+  }
 
-  int64_t ProfileSize(const std::vector<HeapObjectTrace> &objects) const;
+  // Builds the profile of the counted objects. Must be called with
+  // storage_lock_ held.
+  std::unique_ptr<perftools::profiles::Profile> ConvertToProto(
+      ProfileProtoBuilder *builder, const SampleCounts &counts) const;
 
-  std::vector<HeapObjectTrace> newly_allocated_objects_;
-  std::vector<HeapObjectTrace> live_objects_;
+  std::unique_ptr<perftools::profiles::Profile> GetProfiles(
+      JNIEnv *env, int sampling_interval, bool force_gc, bool get_live);
 
+  // Counts a freed object in the garbage table, as of now_ns.
+  void AddToGarbage(const HeapObjectTrace &obj, int64_t now_ns);
+
+  // Builds the profile of the garbage table and clears it. Must be called
+  // with storage_lock_ held.
+  std::unique_ptr<perftools::profiles::Profile> ConvertGarbageToProto(
+      ProfileProtoBuilder *builder);
+
+  // Moves the objects of the freed tags from the live objects to the
+  // garbage. Tags of objects still staged are kept for the next compaction.
+  void MoveFreedObjects();
+
+  // Returns an estimate of the memory used to track the live objects.
+  int64_t TrackedBytes() const;
+
+  // Adds weight objects like object to the class histogram, or removes them
+  // if negative. Must be called with storage_lock_ held.
+  void CountClass(const HeapObjectTrace &object, int64_t weight);
+
+  // Appends the top of the class histogram to the comments of a live heap
+  // profile, for pprof -comments.
+  static const int kClassHistogramComments = 20;
+  void AddClassHistogramComments(perftools::profiles::Profile *profile);
+
+  // Drops live objects until they fit in max_memory_bytes_, and adjusts the
+  // admission of the new samples. Must be called with storage_lock_ held.
+  void EnforceMemoryBudget();
+
+  // Newly allocated objects are staged in one of several buffers, picked
+  // per allocating thread, until the next compaction. Compaction only
+  // holds a buffer's lock to swap its contents out, so the allocation path
+  // never waits for a compaction, and threads rarely share a buffer.
+  static const int kStagingBuffers = 16;
+  struct StagingBuffer {
+    std::mutex lock;
+    std::vector<HeapObjectTrace> objects;
+    // Keeps the locks of the buffers on separate cache lines; alignas would
+    // not be honored by the C++11 operator new of the HeapMonitor.
+    char padding[64];
+  };
+  StagingBuffer staging_[kStagingBuffers];
+  // Objects drained from a staging buffer; only used by CompactSamples.
+  std::vector<HeapObjectTrace> drained_;
+
+  // Tag of the next sampled object; 0 means untagged to JVMTI.
+  std::atomic<jlong> next_tag_;
+
+  // Tags reported by ObjectFreed(), until the next compaction.
+  std::mutex freed_lock_;
+  std::vector<jlong> freed_tags_;
+  // Tags of freed objects to move to the garbage; only used by
+  // CompactSamples.
+  std::vector<jlong> dead_tags_;
+  // Tags below this limit were all staged before the previous compaction,
+  // so those not found live belong to objects dropped by the memory budget.
+  jlong compacted_tag_limit_ = 0;
+
+  // Live objects by tag. Liveness is tracked through the JVMTI ObjectFree
+  // events, so compactions only touch the objects that were freed.
+  std::unordered_map<jlong, HeapObjectTrace> live_objects_;
+  // Aggregate of live_objects_, kept up to date by each compaction.
+  SampleCounts live_counts_;
+  int64_t live_size_ = 0;
+
+  // Copy of the live counts of the largest live size seen; each of its
+  // entries holds a reference to its stack.
   int64_t peak_profile_size_;
-  std::vector<HeapObjectTrace> peak_objects_;
-
-  // Though a queue really would be nice, we need a way to iterate when
-  // requested.
+  SampleCounts peak_counts_;
+
+  // Numbers of the objects freed since the last garbage profile by key and
+  // age; each entry holds a reference to its stack. Objects of new keys
+  // are only counted as dropped once there are max_garbage_size_ keys.
+  static const int kAgeBuckets = 5;
+  struct GarbageCounts {
+    int64_t by_age[kAgeBuckets] = {};
+  };
   int max_garbage_size_;
-  int cur_garbage_pos_;
-  std::vector<HeapObjectTrace> garbage_objects_;
+  std::unordered_map<SampleKey, GarbageCounts, SampleKeyHash> garbage_;
+  int64_t dropped_garbage_ = 0;
+
+  // Stacks of the live, peak and garbage objects.
+  StackTable stacks_;
+
+  // Classes of the sampled objects, and the unsampled numbers and sizes of
+  // the live objects by class id.
+  ClassTable classes_;
+  struct ClassCounts {
+    double objects = 0;
+    double bytes = 0;
+  };
+  std::vector<ClassCounts> class_counts_;
 
+  // Guards the live, peak and garbage objects and their stacks.
   std::mutex storage_lock_;
   jvmtiEnv *jvmti_;
   ProfileFrameCache *cache_;
   const GcCallback gc_callback_;
+
+  // Memory budget of the live objects. Over budget, a compaction drops
+  // each live object with a probability of 1/2 and doubles the weight of
+  // the others, counted as that many objects in the profiles, and new
+  // samples are only tracked with a probability of 1/2^admission_shift_,
+  // with a matching weight. This keeps the live and peak profiles
+  // unbiased, only less precise. Past kMaxAdmissionShift halvings, new
+  // samples are dropped until the objects fit again.
+  static const int kMaxAdmissionShift = 16;
+  int64_t max_memory_bytes_;
+  std::atomic<int> admission_shift_;
+  std::atomic<bool> admission_closed_;
+  std::atomic<int64_t> dropped_live_samples_;
+  std::default_random_engine thinning_gen_;
+
+  // Counts of the objects allocated by stack, and their size, since the
+  // last allocation profile. Samples whose stack does not fit are only
+  // counted in dropped_allocations_.
+  google::javaprofiler::AsyncSafeTraceMultiset allocations_;
+  std::atomic<int64_t> dropped_allocations_;
+  // Serializes the extractions from allocations_.
+  std::mutex allocations_lock_;
+  struct timespec allocations_start_;
 };
 
 // Due to the JVMTI callback, everything here is static.
 class HeapMonitor {
  public:
   static bool Enable(jvmtiEnv *jvmti, JNIEnv *jni, int sampling_interval,
-                     int max_garbage_size = 200,
-                     // TODO: Remove 'use_jvm_trace' and associated
-                     // code after Q2 2024.
-                     bool use_jvm_trace = false);
+                     int max_garbage_size = 4096,
+                     // Captures the stacks with AsyncGetCallTrace, falling
+                     // back to JVMTI GetStackTrace when it fails.
+                     bool use_jvm_trace = false,
+                     int64_t max_allocation_stacks = 0,
+                     int64_t max_memory_bytes = 0);
   static void Disable();
 
   static bool Enabled() { return heap_monitor_ != nullptr; }
 
+  // Makes the sampling interval adapt to the allocation rate, so that about
+  // target_samples_per_sec objects get sampled per second, within
+  // [min_interval, max_interval]. The interval passed to Enable() is the
+  // starting point. A target of 0 keeps the interval fixed. Must be called
+  // before Enable().
+  static void SetAdaptiveSampling(int64_t target_samples_per_sec,
+                                  int min_interval, int max_interval);
+
   // Returns a perftools::profiles::Profile with the objects provided by the
   // HeapEventStorage.
   static std::unique_ptr<perftools::profiles::Profile> GetHeapProfiles(
@@ -235,9 +526,19 @@ class HeapMonitor {
   static std::unique_ptr<perftools::profiles::Profile> GetPeakHeapProfiles(
       JNIEnv *env, bool force_gc);
 
+  // Starts a new allocation profile.
+  static void ResetAllocations();
+
+  // Returns a perftools::profiles::Profile with the objects allocated since
+  // the last call to this or ResetAllocations().
+  static std::unique_ptr<perftools::profiles::Profile> GetAllocationProfiles(
+      JNIEnv *env);
+
   static void AddSample(JNIEnv *jni_env, jthread thread, jobject object,
-                        jclass object_klass, jlong size, jbyte *name,
-                        jint name_len, jlong thread_id);
+                        jclass object_klass, jlong size);
+
+  // Forwards the JVMTI ObjectFree event of a sampled object.
+  static void ObjectFreed(jlong tag);
 
   static void InvokeAllocationInstrumentationFunctions(jlong thread_id,
                                                        jbyte *name,
@@ -276,9 +577,12 @@ class HeapMonitor {
  private:
   static const HeapEventStorage::GcCallback gc_callback_;
 
-  HeapMonitor(int max_garbage_size)
-      : storage_(jvmti_.load(), GetFrameCache(), max_garbage_size,
-                 gc_callback_) {}
+  HeapMonitor(int max_garbage_size, int64_t max_allocation_stacks,
+              int64_t max_memory_bytes)
+      : samples_since_adjustment_(0),
+        last_adjustment_(DefaultClock()->Now()),
+        storage_(jvmti_.load(), GetFrameCache(), max_garbage_size,
+                 gc_callback_, max_allocation_stacks, max_memory_bytes) {}
 
   static std::atomic<HeapMonitor *> heap_monitor_;
 
@@ -305,15 +609,27 @@ class HeapMonitor {
 
   void CompactData(JNIEnv *jni_env);
 
+  // Updates the sampling interval from the number of samples since the last
+  // adjustment, at most once per kAdjustmentPeriodNanos. Only called from
+  // the GC waiting thread.
+  void AdjustSamplingInterval();
+
   static std::vector<AllocationInstrumentationFunction> alloc_inst_functions_;
   static std::vector<GarbageInstrumentationFunction> gc_inst_functions_;
   static std::unique_ptr<perftools::profiles::Profile> EmptyHeapProfile(
       JNIEnv *jni_env);
 
   static std::atomic<jvmtiEnv *> jvmti_;
+  // Current sampling interval, which samples are recorded with.
   static std::atomic<int> sampling_interval_;
+  static std::atomic<int64_t> target_samples_per_sec_;
+  static std::atomic<int> min_sampling_interval_;
+  static std::atomic<int> max_sampling_interval_;
   static std::atomic<bool> use_jvm_trace_;
 
+  std::atomic<int64_t> samples_since_adjustment_;
+  struct timespec last_adjustment_;
+
   std::list<GcEvent> gc_notify_events_;
   bool gc_thread_shutdown = false;
   std::condition_variable gc_waiting_cv_;
@@ -18,7 +18,6 @@
 
 #include <cstdint>
 
-#include "third_party/javaprofiler/display.h"
 #include "third_party/javaprofiler/stacktrace_decls.h"
 
 namespace google {
@@ -28,15 +27,14 @@ int64_t MethodInfo::LineNumber(const JVMPI_CallFrame &frame) {
   // lineno is actually the BCI of the frame.
   int bci = frame.lineno;
 
-  auto it = line_numbers_.find(bci);
-  if (it != line_numbers_.end()) {
-    return it->second;
+  // Natives have no line table, don't bother fetching it.
+  if (bci < 0) {
+    return -1;
   }
-
-  int line_number = GetLineNumber(jvmti_env_, frame.method_id, bci);
-
-  line_numbers_[bci] = line_number;
-  return line_number;
+  if (!line_table_.Loaded()) {
+    line_table_.Load(jvmti_env_, frame.method_id);
+  }
+  return line_table_.LineNumber(bci);
 }
 
 }  // namespace javaprofiler
@@ -20,8 +20,8 @@
 #include <cstdint>
 #include <jvmti.h>
 #include <string>
-#include <unordered_map>
 
+#include "third_party/javaprofiler/display.h"
 #include "third_party/javaprofiler/stacktrace_decls.h"
 
 namespace google {
@@ -63,8 +63,8 @@ class MethodInfo {
   std::string file_name_;
   int start_line_;
 
-  // Cache of jlocation results.
-  std::unordered_map<int, int64_t> line_numbers_;
+  // Fetched on the first line number lookup.
+  LineNumberTable line_table_;
 };
 
 }  // namespace javaprofiler
@@ -12,74 +12,166 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
-// Force definition of SNCx64 macro used below for all variations of
-// inttypes.h.
-#ifndef __STDC_FORMAT_MACROS
-#define __STDC_FORMAT_MACROS
-#endif
-
 #include "third_party/javaprofiler/native.h"
 
-#include <libgen.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#include <cinttypes>
-#include <cstdio>
+#include <algorithm>
 #include <cstring>
-#include <memory>
 
 namespace google {
 namespace javaprofiler {
 
+namespace {
+
+// Parses a hexadecimal number at *p, advancing *p past it. Returns false
+// if there is no digit.
+bool ParseHex(const char **p, const char *end, uint64_t *value) {
+  const char *start = *p;
+  uint64_t v = 0;
+  for (; *p < end; ++*p) {
+    char c = **p;
+    if (c >= '0' && c <= '9') {
+      v = (v << 4) | (c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      v = (v << 4) | (c - 'a' + 10);
+    } else {
+      break;
+    }
+  }
+  *value = v;
+  return *p != start;
+}
+
+// Skips a field followed by spaces.
+void SkipField(const char **p, const char *end) {
+  while (*p < end && **p != ' ') {
+    ++*p;
+  }
+  while (*p < end && **p == ' ') {
+    ++*p;
+  }
+}
+
+}  // namespace
+
 NativeProcessInfo::NativeProcessInfo(const std::string &procmaps_filename)
     : procmaps_filename_(procmaps_filename) {
   Refresh();
 }
 
 void NativeProcessInfo::Refresh() {
-  FILE *f = fopen(procmaps_filename_.c_str(), "r");
+  if (!Read(&buffer_) || (parsed_ && buffer_ == contents_)) {
+    return;
+  }
+  contents_.swap(buffer_);
+  parsed_ = true;
+  generation_++;
+  Parse();
+}
+
+int NativeProcessInfo::Find(uint64_t address) const {
+  auto it = std::upper_bound(
+      mappings_.begin(), mappings_.end(), address,
+      [](uint64_t a, const Mapping &m) { return a < m.start; });
+  if (it == mappings_.begin()) {
+    return -1;
+  }
+  --it;
+  return address < it->limit ? it - mappings_.begin() : -1;
+}
 
-  if (f == nullptr) {
+bool NativeProcessInfo::Read(std::string *contents) {
+  int fd = open(procmaps_filename_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
     LOG(ERROR) << "Could not open maps file: " << procmaps_filename_;
-    return;
+    return false;
+  }
+
+  // The file reports its size as 0, so read it until the end, keeping the
+  // capacity of the buffer from the previous reads.
+  const size_t kReadSize = 64 * 1024;
+  size_t size = 0;
+  contents->resize(std::max(contents->capacity(), kReadSize));
+  while (true) {
+    if (contents->size() - size < kReadSize) {
+      contents->resize(contents->size() * 2);
+    }
+    ssize_t n = read(fd, &(*contents)[size], contents->size() - size);
+    if (n == -1 && errno == EINTR) {
+      continue;
+    }
+    if (n == -1) {
+      LOG(ERROR) << "Could not read maps file: " << procmaps_filename_;
+      close(fd);
+      return false;
+    }
+    if (n == 0) {
+      break;
+    }
+    size += n;
   }
+  close(fd);
+  contents->resize(size);
+  return true;
+}
 
+void NativeProcessInfo::Parse() {
   mappings_.clear();
 
-  const size_t kBufferLineSize = 2048;
-  std::unique_ptr<char[]> line(new char[kBufferLineSize]);
-  while (fgets(&line[0], kBufferLineSize, f)) {
-    uint64_t start = 0, limit = 0, offset = 0;
-    char permissions[5];
-    int filename_index = 0;
+  // Lines are "start-limit perms offset dev inode name".
+  const char *p = contents_.data();
+  const char *end = p + contents_.size();
+  while (p < end) {
+    const char *eol =
+        static_cast<const char *>(memchr(p, '\n', end - p));
+    if (eol == nullptr) {
+      eol = end;
+    }
+    const char *line = p;
+    p = eol + 1;
 
-    if (sscanf(&line[0], "%" SCNx64 "-%" SCNx64 " %4s %" SCNx64 " %*s %*s %n",
-               &start, &limit, &permissions[0], &offset,
-               &filename_index) != 4) {
+    uint64_t start, limit, offset;
+    if (!ParseHex(&line, eol, &start) || line == eol || *line++ != '-' ||
+        !ParseHex(&line, eol, &limit) || line == eol || *line++ != ' ') {
       // Partial match, ignore.
       continue;
     }
-    if (strlen(permissions) != 4 || permissions[2] != 'x') {
+    if (eol - line < 4 || line[2] != 'x') {
       // Only examine executable mappings.
       continue;
     }
-
-    if (filename_index == 0 || filename_index > strlen(&line[0])) {
-      // No valid filename found.
+    SkipField(&line, eol);
+    if (!ParseHex(&line, eol, &offset)) {
       continue;
     }
-
-    if (!line[filename_index]) {
-      // Skip mappings with an empty name. Likely generated code that
-      // cannot be symbolized anyway.
+    // Skip the device and inode.
+    for (int i = 0; i < 3; ++i) {
+      SkipField(&line, eol);
+    }
+    if (line == eol || *line != '/') {
+      // Only keep mappings of files: anonymous mappings are likely
+      // generated code that cannot be symbolized anyway, and the
+      // [vdso]-like pseudo files cannot be opened.
       continue;
     }
-
-    const char *filename = &line[filename_index];
-    size_t filename_len = strcspn(filename, " \t\n");
+    const char *name_end = line;
+    while (name_end < eol && *name_end != ' ' && *name_end != '\t') {
+      ++name_end;
+    }
     mappings_.emplace_back(
-        Mapping{start, limit, std::string(filename, filename_len)});
+        Mapping{start, limit, offset, std::string(line, name_end - line)});
   }
-  fclose(f);
+
+  // The kernel lists the mappings by address, but make sure lookups can
+  // rely on it.
+  std::sort(mappings_.begin(), mappings_.end(),
+            [](const Mapping &a, const Mapping &b) {
+              return a.start < b.start;
+            });
+  mappings_.shrink_to_fit();
 }
 
 }  // namespace javaprofiler
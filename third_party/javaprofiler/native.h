@@ -19,6 +19,7 @@
 
 #include <stdint.h>
 
+#include <string>
 #include <vector>
 
 #include "third_party/javaprofiler/globals.h"
@@ -26,7 +27,8 @@
 namespace google {
 namespace javaprofiler {
 
-// NativeProcessInfo maintains information about native libraries.
+// NativeProcessInfo maintains information about native libraries: the
+// executable mappings of files in the process, sorted by address.
 class NativeProcessInfo {
  public:
   // procmaps_filename contains the path of a file describing the memory
@@ -35,15 +37,36 @@ class NativeProcessInfo {
 
   struct Mapping {
     uint64_t start, limit;
+    uint64_t offset;  // Offset of start in the file.
     std::string name;
   };
 
+  // Reloads the mappings. The maps file is only parsed again when its
+  // contents changed since the last refresh.
   void Refresh();
   const std::vector<Mapping> &Mappings() const { return mappings_; }
 
+  // Returns the index in Mappings() of the mapping containing address, or
+  // -1 if there is none.
+  int Find(uint64_t address) const;
+
+  // Incremented each time the mappings change.
+  int64_t Generation() const { return generation_; }
+
  private:
+  // Reads the maps file into *contents. Returns false on error.
+  bool Read(std::string *contents);
+  // Loads the mappings from contents_.
+  void Parse();
+
   const std::string procmaps_filename_;
   std::vector<Mapping> mappings_;
+  // Contents of the maps file the mappings were parsed from, and of its
+  // last read. Both are kept to compare them without allocations.
+  std::string contents_;
+  std::string buffer_;
+  bool parsed_ = false;
+  int64_t generation_ = 0;
   DISALLOW_COPY_AND_ASSIGN(NativeProcessInfo);
 };
 
@@ -88,6 +88,7 @@ void ProfileProtoBuilder::AddArtificialTrace(const string &name, int count,
 
   auto profile = builder_.mutable_profile();
   auto sample = profile->add_sample();
+  sample_rates_.push_back(sampling_rate_);
   sample->add_location_id(location->id());
   // Move count * sampling rate to 64-bit.
   InitSampleValues(sample, count, static_cast<int64_t>(count) * sampling_rate);
@@ -101,7 +102,9 @@ void ProfileProtoBuilder::UnsampleMetrics() {
 
     auto count = sample->value(kCount);
     auto metric_value = sample->value(kMetric);
-    double ratio = CalculateSamplingRatio(sampling_rate_, count, metric_value);
+    double ratio = CalculateSamplingRatio(
+        i < sample_rates_.size() ? sample_rates_[i] : sampling_rate_, count,
+        metric_value);
 
     sample->set_value(kCount, static_cast<double>(count) * ratio);
     sample->set_value(kMetric, static_cast<double>(metric_value) * ratio);
@@ -204,6 +207,9 @@ void ProfileProtoBuilder::AddTrace(const ProfileStackTrace &profile_trace,
 
   auto profile = builder_.mutable_profile();
   sample = profile->add_sample();
+  sample_rates_.push_back(trace_and_labels.sampling_rate > 0
+                              ? trace_and_labels.sampling_rate
+                              : sampling_rate_);
   trace_samples_.Add(trace_and_labels, sample);
 
   AddLabels(trace_and_labels, sample);
@@ -385,8 +391,7 @@ perftools::profiles::Location *LocationBuilder::LocationFor(
   if (line_number != kNativeFrameLineNum) {
     auto line = location->add_line();
 
-    string simplified_name = function_name;
-    SimplifyFunctionName(&simplified_name);
+    const string &simplified_name = simplified_names_.Simplify(function_name);
     auto function_id =
         builder_->FunctionId(simplified_name.c_str(), function_name.c_str(),
                             file_name.c_str(), start_line);
@@ -462,7 +467,8 @@ size_t TraceSamples::TraceHash::operator()(
 bool TraceSamples::TraceEquals::operator()(
     const TraceAndLabels &trace_values1,
     const TraceAndLabels &trace_values2) const {
-  if (trace_values1.labels != trace_values2.labels) {
+  if (trace_values1.labels != trace_values2.labels ||
+      trace_values1.sampling_rate != trace_values2.sampling_rate) {
     return false;
   }
 
@@ -524,6 +530,13 @@ unique_ptr<ProfileProtoBuilder> ProfileProtoBuilder::ForHeap(
                                   true, {}));
 }
 
+unique_ptr<ProfileProtoBuilder> ProfileProtoBuilder::ForAllocation(
+    JNIEnv *jni_env, jvmtiEnv *jvmti_env, int64_t duration_ns,
+    int64_t sampling_rate, ProfileFrameCache *cache) {
+  return unique_ptr<ProfileProtoBuilder>(new AllocationProfileProtoBuilder(
+      jni_env, jvmti_env, duration_ns, sampling_rate, cache, true, {}));
+}
+
 unique_ptr<ProfileProtoBuilder> ProfileProtoBuilder::ForCpu(
     JNIEnv *jni_env, jvmtiEnv *jvmti_env, int64_t duration_ns,
     int64_t sampling_rate, ProfileFrameCache *cache) {
@@ -535,12 +548,12 @@ unique_ptr<ProfileProtoBuilder> ProfileProtoBuilder::ForCpu(
 }
 
 unique_ptr<ProfileProtoBuilder> ProfileProtoBuilder::ForContention(
-    JNIEnv *jni_env, jvmtiEnv *jvmti_env, int64_t sampling_rate,
-    int64_t duration_nanos, ProfileFrameCache *cache) {
+    JNIEnv *jni_env, jvmtiEnv *jvmti_env, int64_t duration_nanos,
+    int64_t sampling_rate, ProfileFrameCache *cache) {
   CHECK (cache != nullptr)
       << "Contention profiles may have native frames, cache must be provided";
   return unique_ptr<ProfileProtoBuilder>(new ContentionProfileProtoBuilder(
-      jni_env, jvmti_env, sampling_rate, duration_nanos, cache, false, {}));
+      jni_env, jvmti_env, duration_nanos, sampling_rate, cache, false, {}));
 }
 
 }  // namespace javaprofiler
@@ -30,6 +30,7 @@
 #include "perftools/profiles/proto/builder.h"
 #include "third_party/javaprofiler/method_info.h"
 #include "third_party/javaprofiler/stacktrace_decls.h"
+#include "third_party/javaprofiler/stacktrace_fixer.h"
 
 namespace google {
 namespace javaprofiler {
@@ -110,6 +111,10 @@ struct TraceAndLabels {
   const JVMPI_CallTrace *trace;
   // Labels associated with the trace.
   std::vector<SampleLabel> labels;
+  // Sampling rate the trace was collected at, when it differs from the
+  // rate of the profile, or 0. Traces of different rates are kept in
+  // different samples, each unsampled at its own rate.
+  int64_t sampling_rate = 0;
 };
 
 // A profile stack trace containing a stack trace, a metric value, and any
@@ -197,6 +202,7 @@ class LocationBuilder {
   };
 
   perftools::profiles::Builder *builder_;
+  SimplifiedNameCache simplified_names_;
 
   std::unordered_map<LocationInfo, perftools::profiles::Location *,
       LocationInfoHash, LocationInfoEquals> locations_;
@@ -276,6 +282,12 @@ class ProfileProtoBuilder {
       JNIEnv *jni_env, jvmtiEnv *jvmti_env, int64_t sampling_rate,
       ProfileFrameCache *cache = nullptr);
 
+  // Creates a heap allocation profile, of the objects allocated over
+  // duration_ns; the same remarks as for ForHeap apply.
+  static std::unique_ptr<ProfileProtoBuilder> ForAllocation(
+      JNIEnv *jni_env, jvmtiEnv *jvmti_env, int64_t duration_ns,
+      int64_t sampling_rate, ProfileFrameCache *cache = nullptr);
+
   static std::unique_ptr<ProfileProtoBuilder> ForCpu(JNIEnv *jni_env,
                                                      jvmtiEnv *jvmti_env,
                                                      int64_t duration_ns,
@@ -315,6 +327,8 @@ class ProfileProtoBuilder {
 
   perftools::profiles::Builder builder_;
   int64_t sampling_rate_ = 0;
+  // Sampling rate of each sample of the profile, by index.
+  std::vector<int64_t> sample_rates_;
 
  private:
   bool SkipFrame(const std::string &function_name) const;
@@ -401,6 +415,27 @@ class HeapProfileProtoBuilder : public ProfileProtoBuilder {
   }
 };
 
+class AllocationProfileProtoBuilder : public ProfileProtoBuilder {
+ public:
+  AllocationProfileProtoBuilder(JNIEnv *jni_env, jvmtiEnv *jvmti_env,
+                                int64_t duration_ns, int64_t sampling_rate,
+                                ProfileFrameCache *cache,
+                                bool skip_top_native_frames,
+                                std::vector<std::string> skip_frames)
+      : ProfileProtoBuilder(
+            jni_env, jvmti_env, cache, sampling_rate,
+            ProfileProtoBuilder::SampleType("alloc_objects", "count"),
+            ProfileProtoBuilder::SampleType("alloc_space", "bytes"),
+            skip_top_native_frames,
+            skip_frames) {
+    builder_.mutable_profile()->set_duration_nanos(duration_ns);
+  }
+
+  std::unique_ptr<perftools::profiles::Profile> CreateProto() override {
+    return CreateUnsampledProto();
+  }
+};
+
 class ContentionProfileProtoBuilder : public ProfileProtoBuilder {
  public:
   ContentionProfileProtoBuilder(JNIEnv *jni_env, jvmtiEnv *jvmti_env,
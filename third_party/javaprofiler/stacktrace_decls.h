@@ -118,6 +118,9 @@ enum CallTraceErrors {
   kNoAgentTracingFunction = -25,
   // The client passed in a nullptr trace or ucontext argument.
   kNullArgument = -26,
+  // Not returned by AsyncGetCallTrace: marks where the agent cut frames out
+  // of a stack deeper than it stores.
+  kTruncatedStack = -27,
 };
 
 // Maximum absolute value of the error code we expect
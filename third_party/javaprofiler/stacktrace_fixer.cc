@@ -17,6 +17,7 @@
 #include <algorithm>
 #include <cctype>
 #include <string>
+#include <utility>
 
 #include "third_party/javaprofiler/stacktrace_fixer.h"
 
@@ -25,133 +26,85 @@ namespace javaprofiler {
 
 namespace {
 
-// Simplifies a given string searching an occurrence of the trigger string
-// followed by specified suffix chars and removing those. For example,
-// calling the function with ("foo123bar", "foo", "321") returns "foobar".
-template <size_t M, size_t N>
-void SimplifySuffixedName(std::string *name, const char (&trigger)[M],
-                          const char (&suffix_chars)[N]) {
-  size_t first = 0;
-  while ((first = name->find(trigger, first)) != std::string::npos) {
-    first += M - 1;  // Exclude last zero char.
-    size_t last = name->find_first_not_of(suffix_chars, first, N);
-    if (last == std::string::npos) {
-      name->erase(first);
-      break;
-    }
-    name->erase(first, last - first);
-  }
-}
-
 constexpr char digits[] = "0123456789";
 constexpr char hexdigits[] = "0123456789abcdef";
 
-// Simplifies the name of a method in a dynamic class (with '$$FastClassBy*$$'
-// or '$$EnhancedBy*$$' in its name) to make it more human readable, and group
-// related functions under a single name. This could be done with a regexp
-// replacement, but including RE2 increases the size of the agent.
-void SimplifyDynamicClassName(std::string *name) {
-  // Replace $$[0-9a-f]+ by $$ to remove unique values, for example in
-  // $FastClassByCGLIB$$fd6bdf6d.invoke.
-  SimplifySuffixedName(name, "$$", hexdigits);
+// Names of the reflection stubs generated by the runtime, which are followed
+// by a unique number. See the test file for examples, or generateName() in
+// sun/reflect/MethodAccessorGenerator.java and
+// jdk/internal/reflect/MethodAccessorGenerator.java.
+constexpr const char *kReflectionAccessors[] = {
+    "sun.reflect.GeneratedConstructorAccessor",
+    "sun.reflect.GeneratedMethodAccessor",
+    "sun.reflect.GeneratedSerializationConstructorAccessor",
+    "jdk.internal.reflect.GeneratedConstructorAccessor",
+    "jdk.internal.reflect.GeneratedMethodAccessor",
+    "jdk.internal.reflect.GeneratedSerializationConstructorAccessor",
+};
+
+// Returns whether the first end chars of s end with suffix.
+bool EndsWith(const std::string &s, size_t end, const char *suffix,
+              size_t suffix_length) {
+  return end >= suffix_length &&
+         memcmp(s.data() + end - suffix_length, suffix, suffix_length) == 0;
 }
 
-// Simplifies the name of a lambda method to remove unique values.
-// For JDK 11 and older, replaces $$Lambda$[0-9]+\.[0-9]+ with $$Lambda$.
-//   For example: com.google.something.Something$$Lambda$197.1849072452.run.
-// For JDK 21 and newer, replaces $$Lambda\.0x[0-9a-f]+ with $$Lambda.
-//   For example: com.google.something.Something$$Lambda.0x00007ff38d3c11f8.run.
-void SimplifyLambdaName(std::string *name) {
-  constexpr char trigger[] = "$$Lambda";
-  const size_t trigger_length = strlen(trigger);
-
-  // Assume and handle just one instance of a $$Lambda$ pattern.
-  size_t first = name->find(trigger);
-  if (first == std::string::npos) {
-    return;
-  }
-  first += trigger_length;
-  if (first >= name->size()) {
-    return;
+// Returns the position of the first char at or after pos not in chars.
+size_t SkipChars(const std::string &s, size_t pos, const char *chars) {
+  while (pos < s.size() && s[pos] != '\0' && strchr(chars, s[pos]) != nullptr) {
+    pos++;
   }
-  bool is_pre_jdk21 = false;
-  if ((*name)[first] == '$') {
-    is_pre_jdk21 = true;
-    first++;
+  return pos;
+}
+
+size_t SkipDigits(const std::string &s, size_t pos) {
+  while (pos < s.size() && std::isdigit(s[pos])) {
+    pos++;
   }
+  return pos;
+}
 
-  size_t last;
-  if (is_pre_jdk21) {
-    if (first >= name->size() || !std::isdigit((*name)[first])) {
-      return;
+// Parses the unique value following "$$Lambda" at pos, and returns the
+// position of its end, or pos when there is none.
+//   - For JDK 11 and older, it is $[0-9]+\.[0-9]+, of which the leading
+//     '$' is kept, and *keep_dollar is set. For example:
+//     com.google.something.Something$$Lambda$197.1849072452.run.
+//   - For JDK 21 and newer, it is \.0x[0-9a-f]+ followed by a '.' or the end
+//     of the name. For example:
+//     com.google.something.Something$$Lambda.0x00007ff38d3c11f8.run.
+size_t SkipLambdaValue(const std::string &s, size_t pos, bool *keep_dollar) {
+  *keep_dollar = false;
+  if (pos >= s.size()) {
+    return pos;
+  }
+  if (s[pos] == '$') {
+    size_t last = pos + 1;
+    if (last >= s.size() || !std::isdigit(s[last])) {
+      return pos;
     }
-    last = name->find_first_not_of(digits, first);
-    if (last == std::string::npos || (*name)[last] != '.') {
-      return;
+    last = SkipDigits(s, last);
+    if (last >= s.size() || s[last] != '.') {
+      return pos;
     }
     last++;  // skip the dot
-    if (last >= name->size() || !std::isdigit((*name)[last])) {
-      return;
-    }
-    last = name->find_first_not_of(digits, last);
-  } else {
-    // Skip '0x'
-    if (first + 3 >= name->size() || (*name)[first] != '.' ||
-        (*name)[first + 1] != '0' || (*name)[first + 2] != 'x') {
-      return;
-    }
-    last = name->find_first_not_of(hexdigits, first + 3);
-    // check for '.' after the 0x... address
-    if (last != std::string::npos && (*name)[last] != '.') {
-      return;
+    if (last >= s.size() || !std::isdigit(s[last])) {
+      return pos;
     }
+    *keep_dollar = true;
+    return SkipDigits(s, last);
   }
 
-  if (last == std::string::npos) {
-    name->erase(first);
-    return;
+  // Skip '.0x'
+  if (pos + 3 >= s.size() || s[pos] != '.' || s[pos + 1] != '0' ||
+      s[pos + 2] != 'x') {
+    return pos;
   }
-  name->erase(first, last - first);
-}
-
-// Simplifies the name of a method generated by the runtime as a reflection
-// stub. See the test file for examples, or generateName() in
-// jdk/internal/reflect/MethodAccessorGenerator.java.
-void SimplifyInternalReflectionMethodName(std::string *name) {
-  SimplifySuffixedName(
-      name,
-      "jdk.internal.reflect.GeneratedConstructorAccessor",
-      digits);
-
-  SimplifySuffixedName(
-      name,
-      "jdk.internal.reflect.GeneratedMethodAccessor",
-      digits);
-
-  SimplifySuffixedName(
-      name,
-      "jdk.internal.reflect.GeneratedSerializationConstructorAccessor",
-      digits);
-}
-
-// Simplifies the name of a method generated by the runtime as a reflection
-// stub. See the test file for examples, or generateName() in
-// sun/reflect/MethodAccessorGenerator.java.
-void SimplifyReflectionMethodName(std::string *name) {
-  SimplifySuffixedName(
-      name,
-      "sun.reflect.GeneratedConstructorAccessor",
-      digits);
-
-  SimplifySuffixedName(
-      name,
-      "sun.reflect.GeneratedMethodAccessor",
-      digits);
-
-  SimplifySuffixedName(
-      name,
-      "sun.reflect.GeneratedSerializationConstructorAccessor",
-      digits);
+  size_t last = SkipChars(s, pos + 3, hexdigits);
+  // check for '.' after the 0x... address
+  if (last < s.size() && s[last] != '.') {
+    return pos;
+  }
+  return last;
 }
 
 std::string ParseMethodTypeSignatureWithReturn(const char *buffer,
@@ -283,11 +236,69 @@ std::string ParseMethodTypeSignatureWithReturn(const char *buffer,
 
 }  // namespace
 
+// The name is compacted in place in a single scan; every pattern is matched
+// against the already simplified prefix, and the unique values following it
+// are skipped in the input. The rules are:
+//   - $$[0-9a-f]+ is replaced by $$ in dynamic classes, for example in
+//     $FastClassByCGLIB$$fd6bdf6d.invoke.
+//   - The unique value of the first $$Lambda is removed, see
+//     SkipLambdaValue().
+//   - The number following a reflection stub class name is removed.
 void SimplifyFunctionName(std::string *name) {
-  SimplifyDynamicClassName(name);
-  SimplifyLambdaName(name);
-  SimplifyReflectionMethodName(name);
-  SimplifyInternalReflectionMethodName(name);
+  std::string &s = *name;
+  size_t read = 0;
+  size_t write = 0;
+  // A "$$" may not start before this position: matches do not overlap, and
+  // the '$' kept from a lambda value does not start one.
+  size_t dollars_start = 0;
+  bool lambda_seen = false;
+  while (read < s.size()) {
+    char c = s[read++];
+    s[write++] = c;
+    if (c == '$') {
+      if (write >= dollars_start + 2 && s[write - 2] == '$') {
+        read = SkipChars(s, read, hexdigits);
+        dollars_start = write;
+      }
+    } else if (c == 'a') {
+      if (!lambda_seen && EndsWith(s, write, "$$Lambda", 8)) {
+        lambda_seen = true;
+        bool keep_dollar;
+        size_t last = SkipLambdaValue(s, read, &keep_dollar);
+        if (last != read) {
+          if (keep_dollar) {
+            s[write++] = '$';
+            dollars_start = write;
+          }
+          read = last;
+        }
+      }
+    } else if (c == 'r') {
+      for (const char *accessor : kReflectionAccessors) {
+        if (EndsWith(s, write, accessor, strlen(accessor))) {
+          read = SkipDigits(s, read);
+          break;
+        }
+      }
+    }
+  }
+  s.resize(write);
+}
+
+SimplifiedNameCache::SimplifiedNameCache(size_t max_entries)
+    : max_entries_(max_entries) {}
+
+const std::string &SimplifiedNameCache::Simplify(const std::string &name) {
+  auto it = names_.find(name);
+  if (it != names_.end()) {
+    return it->second;
+  }
+  if (names_.size() >= max_entries_) {
+    names_.clear();
+  }
+  std::string simplified = name;
+  SimplifyFunctionName(&simplified);
+  return names_.emplace(name, std::move(simplified)).first->second;
 }
 
 void FixPath(std::string *s) { std::replace(s->begin(), s->end(), '/', '.'); }
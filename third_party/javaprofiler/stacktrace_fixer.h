@@ -20,6 +20,9 @@
 #ifndef THIRD_PARTY_JAVAPROFILER_STACKTRACE_FIXER_H_
 #define THIRD_PARTY_JAVAPROFILER_STACKTRACE_FIXER_H_
 
+#include <string>
+#include <unordered_map>
+
 #include "third_party/javaprofiler/globals.h"
 
 namespace google {
@@ -28,6 +31,21 @@ namespace javaprofiler {
   // related functions under a single name.
 void SimplifyFunctionName(std::string *name);
 
+// Memoizes SimplifyFunctionName() results keyed on the raw name, for callers
+// seeing the same names over and over. Starts over once max_entries names
+// are held. Not thread-safe.
+class SimplifiedNameCache {
+ public:
+  explicit SimplifiedNameCache(size_t max_entries = 16384);
+
+  // Returns the simplified name, valid until the next call.
+  const std::string &Simplify(const std::string &name);
+
+ private:
+  size_t max_entries_;
+  std::unordered_map<std::string, std::string> names_;
+};
+
 // Fix the parameter signature from a JVM type signature to a pretty-print
 // one.
 void FixMethodParameters(std::string *signature);
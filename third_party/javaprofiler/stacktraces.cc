@@ -14,16 +14,115 @@
 
 #include "third_party/javaprofiler/stacktraces.h"
 
+#include <stddef.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include <algorithm>
+
 namespace google {
 namespace javaprofiler {
 
 ASGCTType Asgct::asgct_;
 
+int Asgct::GetCurrentThreadTrace(JNIEnv *jni, int max_frames,
+                                 JVMPI_CallFrame *frames) {
+  ASGCTType asgct = asgct_;
+  if (asgct == nullptr) {
+    return kNoAgentTracingFunction;
+  }
+  JVMPI_CallTrace trace = {jni, 0, frames};
+  (*asgct)(&trace, max_frames, nullptr);
+  return trace.num_frames;
+}
+
 std::mutex *AttributeTable::mutex_;
-std::unordered_map<std::string, int> *AttributeTable::string_map_;
-std::vector<std::string> *AttributeTable::strings_;
+std::atomic<const std::string *> *AttributeTable::strings_;
+std::atomic<int> *AttributeTable::index_;
+std::atomic<int> AttributeTable::size_;
+std::atomic<int64_t> AttributeTable::dropped_;
+
+void AttributeTable::Init() {
+  strings_ = new std::atomic<const std::string *>[kMaxStrings];
+  index_ = new std::atomic<int>[kIndexSize];
+  for (int i = 0; i < kMaxStrings; i++) {
+    strings_[i].store(nullptr, std::memory_order_relaxed);
+  }
+  for (int i = 0; i < kIndexSize; i++) {
+    index_[i].store(0, std::memory_order_relaxed);
+  }
+  strings_[0].store(new std::string(), std::memory_order_relaxed);
+  size_.store(1, std::memory_order_release);
+  // Published last, as a non-null mutex_ marks the table as initialized.
+  mutex_ = new std::mutex;
+}
+
+uint64_t AttributeTable::Hash(const char *value) {
+  // FNV-1a, which does not need to copy value into a std::string.
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char *c = value; *c != 0; c++) {
+    hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+int AttributeTable::Lookup(const char *value, uint64_t hash) {
+  for (int i = 0; i < kIndexSize; i++) {
+    int id = index_[(hash + i) % kIndexSize].load(std::memory_order_acquire);
+    if (id == 0) {
+      return 0;
+    }
+    if (strcmp(GetString(id).c_str(), value) == 0) {
+      return id;
+    }
+  }
+  return 0;
+}
+
+int AttributeTable::RegisterString(const char *value) {
+  if (mutex_ == nullptr || value == nullptr || !*value) {
+    // Not initialized or empty string.
+    return 0;
+  }
+  uint64_t hash = Hash(value);
+  int id = Lookup(value, hash);
+  if (id != 0) {
+    return id;
+  }
+
+  std::lock_guard<std::mutex> lock(*mutex_);
+  // Registered concurrently, while the lock was taken.
+  id = Lookup(value, hash);
+  if (id != 0) {
+    return id;
+  }
+  id = size_.load(std::memory_order_relaxed);
+  if (id >= kMaxStrings) {
+    if (dropped_.fetch_add(1, std::memory_order_relaxed) == 0) {
+      LOG(WARNING) << "The table of " << kMaxStrings << " attribute strings "
+                   << "is full, further ones are dropped";
+    }
+    return 0;
+  }
+  strings_[id].store(new std::string(value), std::memory_order_release);
+  for (int i = 0; i < kIndexSize; i++) {
+    std::atomic<int> &slot = index_[(hash + i) % kIndexSize];
+    if (slot.load(std::memory_order_relaxed) == 0) {
+      slot.store(id, std::memory_order_release);
+      break;
+    }
+  }
+  size_.store(id + 1, std::memory_order_release);
+  return id;
+}
 
-bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace) {
+bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace,
+                                 int64_t weight, int64_t metric,
+                                 int time_bucket) {
   uint64_t hash_val = CalculateHash(attr, trace->num_frames, &trace->frames[0]);
 
   for (int64_t i = 0; i < MaxEntries(); i++) {
@@ -39,17 +138,32 @@ bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace) {
           // This entry is reserved, there is no danger of interacting
           // with Extract, so decrement active_updates early.
           entry.active_updates.fetch_sub(1, std::memory_order_release);
-          // memcpy is not async safe
-          JVMPI_CallFrame *fb = entry.frame_buffer;
           int num_frames = trace->num_frames;
+          if (num_frames > entry.capacity) {
+            // The region left by a previous trace, if any, is too small.
+            JVMPI_CallFrame *fb = AllocateFrames(num_frames);
+            if (fb == nullptr) {
+              // The arena is exhausted. Release the entry and keep
+              // probing for one that already owns a large enough region.
+              entry.count.store(0, std::memory_order_release);
+              continue;
+            }
+            entry.frames = fb;
+            entry.capacity = num_frames;
+          }
+          // memcpy is not async safe
+          JVMPI_CallFrame *fb = entry.frames;
           for (int frame_num = 0; frame_num < num_frames; ++frame_num) {
             fb[frame_num].lineno = trace->frames[frame_num].lineno;
             fb[frame_num].method_id = trace->frames[frame_num].method_id;
           }
-          entry.trace.frames = fb;
-          entry.trace.num_frames = num_frames;
+          entry.num_frames = num_frames;
           entry.attr = attr;
-          entry.count.store(static_cast<int64_t>(1), std::memory_order_release);
+          entry.hash = hash_val;
+          entry.metric.store(metric, std::memory_order_relaxed);
+          AddToTimeBucket(idx, time_bucket, weight);
+          num_entries_.fetch_add(1, std::memory_order_relaxed);
+          entry.count.store(weight, std::memory_order_release);
           return true;
         }
         break;
@@ -58,16 +172,22 @@ bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace) {
         // Worst case we may end with multiple entries with the same trace.
         break;
       default:
-        if (attr == entry.attr && trace->num_frames == entry.trace.num_frames &&
-            Equal(trace->num_frames, entry.trace.frames, trace->frames)) {
+        if (entry.hash == hash_val && attr == entry.attr &&
+            trace->num_frames == entry.num_frames &&
+            Equal(trace->num_frames, entry.frames, trace->frames)) {
           // Bump using a compare-swap instead of fetch_add to ensure
           // it hasn't been locked by a thread doing Extract().
           // Reload count in case it was updated while we were
           // examining the trace.
           count = entry.count.load(std::memory_order_relaxed);
           if (count != kTraceCountLocked &&
-              entry.count.compare_exchange_weak(count, count + 1,
+              entry.count.compare_exchange_weak(count, count + weight,
                                                 std::memory_order_relaxed)) {
+            // Extract() waits for this update before reading the metric.
+            if (metric != 0) {
+              entry.metric.fetch_add(metric, std::memory_order_relaxed);
+            }
+            AddToTimeBucket(idx, time_bucket, weight);
             entry.active_updates.fetch_sub(1, std::memory_order_release);
             return true;
           }
@@ -80,8 +200,28 @@ bool AsyncSafeTraceMultiset::Add(int attr, JVMPI_CallTrace *trace) {
   return false;
 }
 
+void AsyncSafeTraceMultiset::AddToTimeBucket(int64_t location,
+                                             int time_bucket,
+                                             int64_t weight) {
+  if (time_bucket < 0 || time_bucket >= num_time_buckets_) {
+    return;
+  }
+  time_buckets_[location * num_time_buckets_ + time_bucket].fetch_add(
+      weight, std::memory_order_relaxed);
+}
+
+JVMPI_CallFrame *AsyncSafeTraceMultiset::AllocateFrames(int num_frames) {
+  int64_t start =
+      arena_used_.fetch_add(num_frames, std::memory_order_relaxed);
+  if (start + num_frames > max_frames_) {
+    return nullptr;
+  }
+  return &frame_arena_[start];
+}
+
 int AsyncSafeTraceMultiset::Extract(int location, int64_t *attr, int max_frames,
-                                    JVMPI_CallFrame *frames, int64_t *count) {
+                                    JVMPI_CallFrame *frames, int64_t *count,
+                                    int64_t *metric, uint32_t *time_buckets) {
   if (location < 0 || location >= MaxEntries()) {
     return 0;
   }
@@ -91,7 +231,7 @@ int AsyncSafeTraceMultiset::Extract(int location, int64_t *attr, int max_frames,
     // Unused or in process of being updated, skip for now.
     return 0;
   }
-  int num_frames = entry.trace.num_frames;
+  int num_frames = entry.num_frames;
   if (num_frames > max_frames) {
     num_frames = max_frames;
   }
@@ -100,8 +240,8 @@ int AsyncSafeTraceMultiset::Extract(int location, int64_t *attr, int max_frames,
 
   *attr = entry.attr;
   for (int i = 0; i < num_frames; ++i) {
-    frames[i].lineno = entry.trace.frames[i].lineno;
-    frames[i].method_id = entry.trace.frames[i].method_id;
+    frames[i].lineno = entry.frames[i].lineno;
+    frames[i].method_id = entry.frames[i].method_id;
   }
 
   while (entry.active_updates.load(std::memory_order_acquire) != 0) {
@@ -110,65 +250,332 @@ int AsyncSafeTraceMultiset::Extract(int location, int64_t *attr, int max_frames,
     // deadlock
   }
 
+  if (metric != nullptr) {
+    *metric = entry.metric.load(std::memory_order_relaxed);
+  }
+  // The buckets are cleared for the next trace to take the entry.
+  std::atomic<uint32_t> *buckets =
+      time_buckets_ + static_cast<int64_t>(location) * num_time_buckets_;
+  for (int i = 0; i < num_time_buckets_; ++i) {
+    uint32_t bucket = buckets[i].exchange(0, std::memory_order_relaxed);
+    if (time_buckets != nullptr) {
+      time_buckets[i] = bucket;
+    }
+  }
   entry.count.store(0, std::memory_order_release);
+  num_entries_.fetch_sub(1, std::memory_order_relaxed);
   *count = c;
   return num_frames;
 }
 
+namespace {
+
+// Initial number of slots of a TraceMultiset, must be a power of two.
+const size_t kInitialTraceMultisetSlots = 1024;
+
+}  // namespace
+
+template <typename Count>
+void TraceMultiset::AddEntry(int64_t attr, int num_frames,
+                             JVMPI_CallFrame *frames, int64_t count,
+                             const Count *time_buckets) {
+  // Keep the load factor at or below 1/2.
+  if (2 * (entries_.size() + 1) > slots_.size()) {
+    Grow();
+  }
+
+  uint64_t hash = CalculateHash(attr, num_frames, frames);
+  size_t idx = hash & num_slots_mask_;
+  while (slots_[idx] != 0) {
+    Entry &entry = entries_[slots_[idx] - 1];
+    if (entry.hash == hash && entry.attr == attr &&
+        entry.num_frames == num_frames &&
+        Equal(num_frames, frames_.data() + entry.frame_offset, frames)) {
+      entry.count += count;
+      AddTimeBuckets(slots_[idx] - 1, time_buckets);
+      return;
+    }
+    idx = (idx + 1) & num_slots_mask_;
+  }
+
+  slots_[idx] = entries_.size() + 1;
+  entries_.push_back(Entry{hash, attr, static_cast<uint64_t>(count),
+                           frames_.size(), num_frames});
+  frames_.insert(frames_.end(), frames, frames + num_frames);
+  time_buckets_.resize(time_buckets_.size() + num_time_buckets_, 0);
+  AddTimeBuckets(entries_.size() - 1, time_buckets);
+}
+
+template <typename Count>
+void TraceMultiset::AddTimeBuckets(size_t index, const Count *time_buckets) {
+  if (time_buckets == nullptr) {
+    return;
+  }
+  uint64_t *buckets = time_buckets_.data() + index * num_time_buckets_;
+  for (int i = 0; i < num_time_buckets_; ++i) {
+    buckets[i] += time_buckets[i];
+  }
+}
+
 void TraceMultiset::Add(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
+                        int64_t count, const uint32_t *time_buckets) {
+  AddEntry(attr, num_frames, frames, count, time_buckets);
+}
+
+void TraceMultiset::Add(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
+                        int64_t count, const uint64_t *time_buckets) {
+  AddEntry(attr, num_frames, frames, count, time_buckets);
+}
+
+void TraceMultiset::Clear() {
+  entries_.clear();
+  frames_.clear();
+  time_buckets_.clear();
+  std::fill(slots_.begin(), slots_.end(), 0);
+}
+
+void TraceMultiset::Grow() {
+  size_t num_slots =
+      slots_.empty() ? kInitialTraceMultisetSlots : 2 * slots_.size();
+  slots_.assign(num_slots, 0);
+  num_slots_mask_ = num_slots - 1;
+  for (size_t i = 0; i < entries_.size(); ++i) {
+    size_t idx = entries_[i].hash & num_slots_mask_;
+    while (slots_[idx] != 0) {
+      idx = (idx + 1) & num_slots_mask_;
+    }
+    slots_[idx] = i + 1;
+  }
+}
+
+void CallTraceTree::Add(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
                         int64_t count) {
-  CallTrace t;
-  t.attr = attr;
-  t.frames = std::vector<JVMPI_CallFrame>(frames, frames + num_frames);
+  uint32_t node = kRootNode;
+  for (int i = num_frames - 1; i >= 0; --i) {
+    node = Child(node, frames[i]);
+  }
 
-  auto entry = traces_.find(t);
-  if (entry != traces_.end()) {
-    entry->second += count;
+  MaybeGrow(&sample_slots_, samples_.size() + 1, [this](uint32_t i) {
+    return SampleHash(samples_[i].node, samples_[i].attr);
+  });
+  size_t mask = sample_slots_.size() - 1;
+  size_t idx = SampleHash(node, attr) & mask;
+  while (sample_slots_[idx] != 0) {
+    Sample &sample = samples_[sample_slots_[idx] - 1];
+    if (sample.node == node && sample.attr == attr) {
+      sample.count += count;
+      return;
+    }
+    idx = (idx + 1) & mask;
+  }
+  sample_slots_[idx] = samples_.size() + 1;
+  samples_.push_back(Sample{node, attr, static_cast<uint64_t>(count)});
+}
+
+uint32_t CallTraceTree::Child(uint32_t parent, const JVMPI_CallFrame &frame) {
+  MaybeGrow(&node_slots_, nodes_.size() + 1, [this](uint32_t i) {
+    return NodeHash(nodes_[i].parent, nodes_[i].frame);
+  });
+  size_t mask = node_slots_.size() - 1;
+  size_t idx = NodeHash(parent, frame) & mask;
+  while (node_slots_[idx] != 0) {
+    uint32_t child = node_slots_[idx] - 1;
+    const Node &node = nodes_[child];
+    if (node.parent == parent && node.frame.method_id == frame.method_id &&
+        node.frame.lineno == frame.lineno) {
+      return child;
+    }
+    idx = (idx + 1) & mask;
+  }
+  uint32_t child = nodes_.size();
+  node_slots_[idx] = child + 1;
+  nodes_.push_back(Node{frame, parent});
+  return child;
+}
+
+void CallTraceTree::Clear() {
+  nodes_.clear();
+  samples_.clear();
+  std::fill(node_slots_.begin(), node_slots_.end(), 0);
+  std::fill(sample_slots_.begin(), sample_slots_.end(), 0);
+  // The root is not indexed, as it is nobody's child.
+  nodes_.push_back(Node{JVMPI_CallFrame{0, nullptr}, kRootNode});
+}
+
+uint64_t CallTraceTree::NodeHash(uint32_t parent,
+                                 const JVMPI_CallFrame &frame) {
+  return CalculateHash(parent, 1, &frame);
+}
+
+uint64_t CallTraceTree::SampleHash(uint32_t node, int64_t attr) {
+  return CalculateHash(attr, 0, nullptr) ^ (node * 0x9e3779b97f4a7c15ULL);
+}
+
+template <typename HashFn>
+void CallTraceTree::MaybeGrow(std::vector<uint32_t> *slots,
+                              size_t num_entries, HashFn hash) {
+  if (2 * num_entries <= slots->size()) {
     return;
   }
-  traces_.emplace(std::move(t), count);
+  size_t num_slots =
+      slots->empty() ? kInitialTraceMultisetSlots : 2 * slots->size();
+  slots->assign(num_slots, 0);
+  size_t mask = num_slots - 1;
+  // Only the first num_entries - 1 entries exist, the last one is about
+  // to be added by the caller.
+  for (uint32_t i = 0; i + 1 < num_entries; ++i) {
+    size_t idx = hash(i) & mask;
+    while ((*slots)[idx] != 0) {
+      idx = (idx + 1) & mask;
+    }
+    (*slots)[idx] = i + 1;
+  }
 }
 
-int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to) {
+namespace {
+
+void AddTrace(const AsyncSafeTraceMultiset &from, TraceMultiset *to,
+              int64_t attr, int num_frames, JVMPI_CallFrame *frames,
+              int64_t count, const uint32_t *time_buckets) {
+  bool same_buckets = from.NumTimeBuckets() > 0 &&
+                      from.NumTimeBuckets() == to->NumTimeBuckets();
+  to->Add(attr, num_frames, frames, count,
+          same_buckets ? time_buckets : nullptr);
+}
+
+void AddTrace(const AsyncSafeTraceMultiset &from, CallTraceTree *to,
+              int64_t attr, int num_frames, JVMPI_CallFrame *frames,
+              int64_t count, const uint32_t *time_buckets) {
+  to->Add(attr, num_frames, frames, count);
+}
+
+template <typename Traces>
+int HarvestSamplesInto(AsyncSafeTraceMultiset *from, Traces *to) {
   int trace_count = 0;
   int64_t num_traces = from->MaxEntries();
   for (int64_t i = 0; i < num_traces; i++) {
-    JVMPI_CallFrame frame[kMaxFramesToCapture];
+    JVMPI_CallFrame frame[kMaxStackDepth];
+    uint32_t time_buckets[AsyncSafeTraceMultiset::kMaxTimeBuckets];
     int64_t attr, count;
 
-    int num_frames =
-        from->Extract(i, &attr, kMaxFramesToCapture, &frame[0], &count);
+    int num_frames = from->Extract(i, &attr, kMaxStackDepth, &frame[0],
+                                   &count, nullptr, &time_buckets[0]);
     if (num_frames > 0 && count > 0) {
       ++trace_count;
-      to->Add(attr, num_frames, &frame[0], count);
+      AddTrace(*from, to, attr, num_frames, &frame[0], count,
+               &time_buckets[0]);
     }
   }
   return trace_count;
 }
 
+}  // namespace
+
+int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to) {
+  return HarvestSamplesInto(from, to);
+}
+
+int HarvestSamples(AsyncSafeTraceMultiset *from, CallTraceTree *to) {
+  return HarvestSamplesInto(from, to);
+}
+
+namespace {
+
+// Odd constants of the hash, from wyhash.
+const uint64_t kHashPrime0 = 0xa0761d6478bd642full;
+const uint64_t kHashPrime1 = 0xe7037ed1a0b428dbull;
+const uint64_t kHashPrime2 = 0x8ebc6af09c88c6e3ull;
+const uint64_t kHashPrime3 = 0x589965cc75374cc3ull;
+
+// Multiplies a and b and folds the two halves of the product, so that
+// every bit of the result depends on every bit of the inputs. This is a
+// single wide multiplication, and is async safe.
+inline uint64_t MulFold(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+  __uint128_t product = static_cast<__uint128_t>(a) * b;
+  return static_cast<uint64_t>(product) ^
+         static_cast<uint64_t>(product >> 64);
+#else
+  uint64_t product = a * b;
+  return product ^ (product >> 32) ^ ((a ^ b) >> 29);
+#endif
+}
+
+// Mixes a frame into the hash value h. The padding of the frame is not
+// read, as it is not initialized.
+inline uint64_t MixFrame(uint64_t h, const JVMPI_CallFrame &frame) {
+  return MulFold(reinterpret_cast<uintptr_t>(frame.method_id) ^ kHashPrime1,
+                 static_cast<uint32_t>(frame.lineno) ^ h);
+}
+
+}  // namespace
+
 uint64_t CalculateHash(int64_t attr, int num_frames,
                        const JVMPI_CallFrame *frame) {
-  // Make hash-value
-  uint64_t h = attr;
-  h += h << 10;
-  h ^= h >> 6;
-  for (int i = 0; i < num_frames; i++) {
-    h += reinterpret_cast<uintptr_t>(frame[i].method_id);
-    h += h << 10;
-    h ^= h >> 6;
-    h += static_cast<uintptr_t>(frame[i].lineno);
-    h += h << 10;
-    h ^= h >> 6;
-  }
-  h += h << 3;
-  h ^= h >> 11;
-  return h;
+  // The frames are mixed into two independent lanes, even and odd ones,
+  // so that the multiplications of consecutive frames overlap rather
+  // than wait for each other.
+  uint64_t h0 = static_cast<uint64_t>(attr) ^ kHashPrime0;
+  uint64_t h1 = static_cast<uint64_t>(num_frames) ^ kHashPrime2;
+  int i = 0;
+  for (; i + 1 < num_frames; i += 2) {
+    h0 = MixFrame(h0, frame[i]);
+    h1 = MixFrame(h1, frame[i + 1]);
+  }
+  if (i < num_frames) {
+    h0 = MixFrame(h0, frame[i]);
+  }
+  return MulFold(h0 ^ kHashPrime3, h1 ^ kHashPrime1);
 }
 
 bool Equal(int num_frames, const JVMPI_CallFrame *f1,
            const JVMPI_CallFrame *f2) {
+  int i = 0;
+#if defined(__SSE2__) || defined(__aarch64__)
+  // Compares blocks of frames a whole frame per vector, with the padding
+  // between lineno and method_id masked out, as it is not initialized.
+  // The differences of a block are ORed together so that there is a
+  // single branch per block.
+  static_assert(sizeof(JVMPI_CallFrame) == 16 &&
+                    offsetof(JVMPI_CallFrame, method_id) == 8,
+                "unexpected JVMPI_CallFrame layout");
+  const int kBlock = 4;
+#if defined(__SSE2__)
+  const __m128i mask = _mm_set_epi32(-1, -1, 0, -1);
+  for (; i + kBlock <= num_frames; i += kBlock) {
+    __m128i diff = _mm_setzero_si128();
+    for (int j = i; j < i + kBlock; j++) {
+      diff = _mm_or_si128(
+          diff, _mm_xor_si128(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i *>(f1 + j)),
+                    _mm_loadu_si128(
+                        reinterpret_cast<const __m128i *>(f2 + j))));
+    }
+    diff = _mm_and_si128(diff, mask);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) !=
+        0xffff) {
+      return false;
+    }
+  }
+#else
+  const uint32_t mask_words[4] = {~0u, 0, ~0u, ~0u};
+  const uint32x4_t mask = vld1q_u32(mask_words);
+  for (; i + kBlock <= num_frames; i += kBlock) {
+    uint32x4_t diff = vdupq_n_u32(0);
+    for (int j = i; j < i + kBlock; j++) {
+      diff = vorrq_u32(
+          diff, veorq_u32(
+                    vld1q_u32(reinterpret_cast<const uint32_t *>(f1 + j)),
+                    vld1q_u32(reinterpret_cast<const uint32_t *>(f2 + j))));
+    }
+    if (vmaxvq_u32(vandq_u32(diff, mask)) != 0) {
+      return false;
+    }
+  }
+#endif
+#endif
   // Compare individual members to avoid differences in padding.
-  for (int i = 0; i < num_frames; i++) {
+  for (; i < num_frames; i++) {
     if (f1[i].method_id != f2[i].method_id || f1[i].lineno != f2[i].lineno) {
       return false;
     }
@@ -21,8 +21,9 @@
 
 #include <atomic>
 #include <cstdint>
+#include <cstring>
 #include <mutex>  // NOLINT
-#include <unordered_map>
+#include <string>
 #include <vector>
 
 #include "third_party/javaprofiler/native.h"
@@ -34,6 +35,10 @@ namespace javaprofiler {
 // Maximum number of frames to store from the stack traces sampled.
 const int kMaxFramesToCapture = 128;
 
+// Upper bound on the number of frames of the stack traces sampled, when
+// their depth is configured at runtime rather than kMaxFramesToCapture.
+const int kMaxStackDepth = 2048;
+
 uint64_t CalculateHash(int64_t attr, int num_frames,
                        const JVMPI_CallFrame *frame);
 bool Equal(int num_frames, const JVMPI_CallFrame *f1,
@@ -54,56 +59,79 @@ class Asgct {
   // AsyncGetCallTrace function, to be dlsym'd.
   static ASGCTType GetAsgct() { return asgct_; }
 
+  // Stores up to max_frames frames of the Java stack of the current thread
+  // in frames, with AsyncGetCallTrace. Returns the number of frames, or 0 or
+  // one of the negative error codes of stacktrace_decls.h when the stack
+  // could not be walked. The thread must be in native code, as in a JVMTI
+  // event callback: the walk then starts from its last Java frame and does
+  // not need a signal context.
+  static int GetCurrentThreadTrace(JNIEnv *jni, int max_frames,
+                                   JVMPI_CallFrame *frames);
+
  private:
   static ASGCTType asgct_;
 };
 
+// Append-only table of the attribute strings, interned into dense ids.
+// Id 0 is the empty string, returned for unset attributes.
+//
+// Looking up a registered string is lock-free, only registering a new
+// one takes a lock. The strings are never released, so that the first
+// Size() of them can be read, without copying, as others are registered.
+// The table holds at most kMaxStrings strings, further ones are dropped
+// and counted, see DroppedCount().
 class AttributeTable {
  public:
+  static const int kMaxStrings = 1 << 14;
+
   // This type is neither copyable nor movable.
   AttributeTable(const AttributeTable&) = delete;
   AttributeTable& operator=(const AttributeTable&) = delete;
 
-  static void Init() {
-    mutex_ = new (std::mutex);
-    string_map_ = new (std::unordered_map<std::string, int>);
-    strings_ = new (std::vector<std::string>);
-    strings_->push_back("");
+  static void Init();
+
+  // Returns the id of value, registering it if needed. Returns 0 if value
+  // is empty, or if the table is not initialized or is full.
+  static int RegisterString(const char *value);
+
+  // Returns the number of strings registered, including the empty one.
+  static int Size() {
+    return size_.load(std::memory_order_acquire);
   }
 
-  static int RegisterString(const char *value) {
-    if (mutex_ == nullptr || value == nullptr || !*value) {
-      // Not initialized or empty string.
-      return 0;
-    }
-    std::lock_guard<std::mutex> lock(*mutex_);
-    int ret = strings_->size();
-    const auto inserted = string_map_->emplace(value, ret);
-    if (!inserted.second) {
-      // Insertion failed, use existing value.
-      return inserted.first->second;
-    }
-    strings_->push_back(value);
-    (*string_map_)[value] = ret;
-    return ret;
+  // Returns the number of strings not registered as the table was full.
+  static int64_t DroppedCount() {
+    return dropped_.load(std::memory_order_relaxed);
   }
 
-  static std::vector<std::string> GetStrings() {
-    if (mutex_ == nullptr) {
-      return std::vector<std::string>();
-    }
-    std::lock_guard<std::mutex> lock(*mutex_);
-    return *strings_;
+  // Returns the string of an id less than Size().
+  static const std::string &GetString(int id) {
+    return *strings_[id].load(std::memory_order_acquire);
   }
 
  private:
+  // The index has twice as many slots as there are strings, so that
+  // probes stay short.
+  static const int kIndexSize = 2 * kMaxStrings;
+
+  // Returns the id of value, or 0 if it is not registered.
+  static int Lookup(const char *value, uint64_t hash);
+  static uint64_t Hash(const char *value);
+
   static std::mutex *mutex_;
-  static std::unordered_map<std::string, int> *string_map_;
-  static std::vector<std::string> *strings_;
+  // Strings by id, and open-addressing index of their ids by hash, where
+  // 0 marks a free slot. Entries are published with release stores, once
+  // the strings they point to are complete.
+  static std::atomic<const std::string *> *strings_;
+  static std::atomic<int> *index_;
+  static std::atomic<int> size_;
+  static std::atomic<int64_t> dropped_;
 };
 
 // Multiset of stack traces. There is a maximum number of distinct
-// traces that can be held, return by MaxEntries();
+// traces that can be held, return by MaxEntries(), and a maximum
+// number of frames that can be held across all of them, returned by
+// MaxFrames().
 //
 // The Add() operation is async-safe, but will fail and return false
 // if there is no room to store the trace.
@@ -120,56 +148,156 @@ class AttributeTable {
 // by a subsequent call to Add(). It is important for Extract() to
 // wait until no additions are in progress to avoid releasing the
 // entry while another thread is inspecting it.
+//
+// Frames are not stored inline in the entries. Instead, the first
+// Add() that reserves an entry carves room for its frames out of a
+// shared arena, and the entry keeps that region across Extract() so
+// later traces that fit can reuse it. The arena is only rewound by
+// Reset(), which makes resetting proportional to the number of
+// entries rather than to the frame storage, and leaves the arena
+// pages that were never handed out untouched.
 class AsyncSafeTraceMultiset {
  public:
-  AsyncSafeTraceMultiset() { Reset(); }
+  // Default number of distinct traces that can be held.
+  static const int64_t kDefaultMaxStackTraces = 2048;
+
+  // Default arena size, in frames per entry.
+  static const int64_t kDefaultFramesPerTrace = 64;
+
+  // Upper bound on the number of time buckets of each entry.
+  static const int kMaxTimeBuckets = 64;
+
+  // Creates a multiset that can hold up to max_entries distinct
+  // traces, with room for max_frames frames across all of them. If
+  // max_frames is not positive, kDefaultFramesPerTrace frames per
+  // entry are reserved. Unless num_time_buckets is 0, each entry also
+  // counts its samples in that many buckets of time, up to
+  // kMaxTimeBuckets. The storage is allocated once, up front, as it
+  // cannot be grown from a signal handler.
+  explicit AsyncSafeTraceMultiset(
+      int64_t max_entries = kDefaultMaxStackTraces, int64_t max_frames = 0,
+      int num_time_buckets = 0)
+      : max_entries_(max_entries > 0 ? max_entries : kDefaultMaxStackTraces),
+        max_frames_(max_frames > 0 ? max_frames
+                                   : max_entries_ * kDefaultFramesPerTrace),
+        num_time_buckets_(num_time_buckets < 0 ? 0
+                          : num_time_buckets > kMaxTimeBuckets
+                              ? kMaxTimeBuckets
+                              : num_time_buckets),
+        traces_(new TraceData[max_entries_]),
+        frame_arena_(new JVMPI_CallFrame[max_frames_]),
+        time_buckets_(num_time_buckets_ > 0
+                          ? new std::atomic<uint32_t>[max_entries_ *
+                                                      num_time_buckets_]
+                          : nullptr) {
+    Reset();
+  }
+
+  ~AsyncSafeTraceMultiset() {
+    delete[] time_buckets_;
+    delete[] frame_arena_;
+    delete[] traces_;
+  }
 
+  // Clears all entries and rewinds the frame arena. This is not safe
+  // to run concurrently with Add() or Extract().
   void Reset() {
-    memset(traces_, 0, sizeof(traces_));
+    memset(traces_, 0, sizeof(TraceData) * max_entries_);
+    for (int64_t i = 0; i < max_entries_ * num_time_buckets_; i++) {
+      time_buckets_[i].store(0, std::memory_order_relaxed);
+    }
+    arena_used_.store(0, std::memory_order_relaxed);
+    num_entries_.store(0, std::memory_order_relaxed);
   }
 
-  // Add a trace to the set. If it is already present, increment its
-  // count. This operation is thread safe and async safe.
-  bool Add(int attr, JVMPI_CallTrace *trace);
+  // Add a trace to the set, weight times. If it is already present,
+  // increment its count by weight. The metric, e.g. a number of bytes, is
+  // summed per trace along with the count, and so is the weight in the
+  // given time bucket, if valid. This operation is thread safe and async
+  // safe.
+  bool Add(int attr, JVMPI_CallTrace *trace, int64_t weight = 1,
+           int64_t metric = 0, int time_bucket = -1);
 
   // Extract a trace from the array. frames must point to at least
   // max_frames contiguous frames. It will return the number of frames
   // written starting at frames[0], up to max_frames. returns 0 if
   // there is no valid trace at this location.  This operation is
   // thread safe with respect to Add() but only a single call to
-  // Extract can be done at a time.
+  // Extract can be done at a time. If metric is not null, it receives the
+  // sum of the metrics added for the trace. If time_buckets is not null,
+  // it receives the NumTimeBuckets() counts of the trace per time bucket.
   int Extract(int location, int64_t *attr, int max_frames,
-              JVMPI_CallFrame *frames, int64_t *count);
+              JVMPI_CallFrame *frames, int64_t *count,
+              int64_t *metric = nullptr, uint32_t *time_buckets = nullptr);
+
+  int64_t MaxEntries() const { return max_entries_; }
+
+  int64_t MaxFrames() const { return max_frames_; }
+
+  int NumTimeBuckets() const { return num_time_buckets_; }
 
-  int64_t MaxEntries() const { return kMaxStackTraces; }
+  // Number of entries currently holding a trace. This is async safe.
+  int64_t NumEntries() const {
+    return num_entries_.load(std::memory_order_relaxed);
+  }
+
+  // Fraction of the entries holding a trace, between 0 and 1. This is
+  // async safe. The frame arena is not accounted for, as entries keep
+  // their region once extracted.
+  double FillRatio() const {
+    return static_cast<double>(NumEntries()) / max_entries_;
+  }
 
  private:
   struct TraceData {
     // attr is an integer attribute for the stack trace. On encode
     // this will represent a sample label.
     int attr;
-    // trace is a triple containing the JNIEnv and the individual call frames.
-    // The frames are stored in frame_buffer.
-    JVMPI_CallTrace trace;
-    // frame_buffer is the storage for stack frames.
-    JVMPI_CallFrame frame_buffer[kMaxFramesToCapture];
+    // Number of frames of the trace currently held.
+    int num_frames;
+    // Number of frames that fit in the arena region owned by the entry.
+    int capacity;
+    // CalculateHash() of the trace, compared first so that most probe
+    // collisions are rejected without reading the frames.
+    uint64_t hash;
+    // Arena region owned by the entry, holding the call frames.
+    JVMPI_CallFrame *frames;
     // Number of times a trace has been encountered.
     // 0 indicates that the trace is unused
     // <0 values are reserved, used for concurrency control.
     std::atomic<int64_t> count;
+    // Sum of the metrics added along with count. Only updated while
+    // holding the entry, either locked or through active_updates.
+    std::atomic<int64_t> metric;
     // Number of active attempts to increase the counter on the trace.
     std::atomic<int> active_updates;
   };
 
-  // TODO: Re-evaluate MaxStackTraces, to minimize storage
-  // consumption while maintaining good performance and avoiding
-  // overflow.
-  static const int kMaxStackTraces = 2048;
+  // Reserves num_frames contiguous frames from the arena, or returns
+  // nullptr if it is exhausted. This is async safe.
+  JVMPI_CallFrame *AllocateFrames(int num_frames);
+
+  // Adds weight to a time bucket of the entry at location, which must be
+  // held. This is async safe.
+  void AddToTimeBucket(int64_t location, int time_bucket, int64_t weight);
 
   // Sentinel to use as trace count while the frames are being updated.
   static const int64_t kTraceCountLocked = -1;
 
-  TraceData traces_[kMaxStackTraces];
+  const int64_t max_entries_;
+  const int64_t max_frames_;
+  const int num_time_buckets_;
+  TraceData *traces_;
+  JVMPI_CallFrame *frame_arena_;
+  // num_time_buckets_ counts per entry, only updated while holding the
+  // entry like the metric.
+  std::atomic<uint32_t> *time_buckets_;
+  // Number of arena frames handed out since the last Reset(). May run
+  // past max_frames_ once the arena is exhausted.
+  std::atomic<int64_t> arena_used_;
+  // Number of entries holding a trace, updated when entries are taken
+  // by Add() and released by Extract().
+  std::atomic<int64_t> num_entries_;
   DISALLOW_COPY_AND_ASSIGN(AsyncSafeTraceMultiset);
 };
 
@@ -178,66 +306,192 @@ class AsyncSafeTraceMultiset {
 // collected atomically from AsyncSafeTraceMultiset, which implements
 // async and thread safe add/extract methods, but has fixed maximum
 // size.
+//
+// Traces are kept in a flat open-addressing hash table. The frames of
+// all traces are stored back to back in a single arena, and the traces
+// themselves in a vector in insertion order, which is also the
+// iteration order. Clear() keeps the allocated capacity, so a multiset
+// reused across profiles stops allocating once it has warmed up.
 class TraceMultiset {
- private:
-  typedef struct {
-    std::vector<JVMPI_CallFrame> frames;
+ public:
+  // View of a trace held in the multiset. The frames pointer is only
+  // valid until the next call to Add() or Clear().
+  struct Trace {
     int64_t attr;
-  } CallTrace;
+    int num_frames;
+    const JVMPI_CallFrame *frames;
+    uint64_t count;
+    // NumTimeBuckets() counts of the samples of the trace per time bucket,
+    // or null if the multiset has no time buckets.
+    const uint64_t *time_buckets;
+  };
 
-  struct CallTraceHash {
-    std::size_t operator()(const CallTrace &trace) const {
-      return CalculateHash(trace.attr, trace.frames.size(),
-                           trace.frames.data());
+  class const_iterator {
+   public:
+    const_iterator(const TraceMultiset *traces, size_t index)
+        : traces_(traces), index_(index) {}
+
+    Trace operator*() const { return traces_->TraceAt(index_); }
+
+    const_iterator &operator++() {
+      ++index_;
+      return *this;
     }
-  };
 
-  struct CallTraceEqual {
-    bool operator()(const CallTrace &t1, const CallTrace &t2) const {
-      if (t1.attr != t2.attr) {
-        return false;
-      }
-      if (t1.frames.size() != t2.frames.size()) {
-        return false;
-      }
-      return Equal(t1.frames.size(), t1.frames.data(), t2.frames.data());
+    bool operator==(const const_iterator &other) const {
+      return index_ == other.index_;
     }
-  };
 
-  typedef std::unordered_map<CallTrace, uint64_t, CallTraceHash, CallTraceEqual>
-      CountMap;
+    bool operator!=(const const_iterator &other) const {
+      return index_ != other.index_;
+    }
 
- public:
-  TraceMultiset() {}
+   private:
+    const TraceMultiset *traces_;
+    size_t index_;
+  };
+
+  // Unless num_time_buckets is 0, the traces also count their samples
+  // per time bucket.
+  explicit TraceMultiset(int num_time_buckets = 0)
+      : num_slots_mask_(0), num_time_buckets_(num_time_buckets) {}
 
   // Add a trace to the array. If it is already in the array,
-  // increment its count.
+  // increment its count, and its time buckets by those in time_buckets
+  // unless null.
   void Add(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
-           int64_t count);
-
-  typedef CountMap::iterator iterator;
-  typedef CountMap::const_iterator const_iterator;
+           int64_t count, const uint32_t *time_buckets = nullptr);
+  // Same as above, for the time buckets of a trace of another multiset.
+  void Add(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
+           int64_t count, const uint64_t *time_buckets);
 
-  iterator begin() { return traces_.begin(); }
-  iterator end() { return traces_.end(); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, entries_.size()); }
 
-  const_iterator begin() const { return const_iterator(traces_.begin()); }
-  const_iterator end() const { return const_iterator(traces_.end()); }
+  // Number of distinct traces held.
+  size_t Size() const { return entries_.size(); }
 
-  iterator erase(iterator it) { return traces_.erase(it); }
+  int NumTimeBuckets() const { return num_time_buckets_; }
 
-  void Clear() { traces_.clear(); }
+  // Removes all traces, retaining the allocated storage.
+  void Clear();
 
  private:
-  CountMap traces_;
+  struct Entry {
+    uint64_t hash;
+    int64_t attr;
+    uint64_t count;
+    // Offset of the first frame of the trace in frames_.
+    size_t frame_offset;
+    int num_frames;
+  };
+
+  Trace TraceAt(size_t index) const {
+    const Entry &entry = entries_[index];
+    return Trace{entry.attr, entry.num_frames,
+                 frames_.data() + entry.frame_offset, entry.count,
+                 num_time_buckets_ > 0
+                     ? time_buckets_.data() + index * num_time_buckets_
+                     : nullptr};
+  }
+
+  // Implements Add() for either width of time bucket counts.
+  template <typename Count>
+  void AddEntry(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
+                int64_t count, const Count *time_buckets);
+
+  // Adds time_buckets, unless null, to those of the entry at index.
+  template <typename Count>
+  void AddTimeBuckets(size_t index, const Count *time_buckets);
+
+  // Doubles the number of slots and reinserts all entries.
+  void Grow();
+
+  // Slots of the hash table, holding an index into entries_ plus one,
+  // or zero when empty. The number of slots is a power of two.
+  std::vector<uint32_t> slots_;
+  size_t num_slots_mask_;
+  std::vector<Entry> entries_;
+  std::vector<JVMPI_CallFrame> frames_;
+  const int num_time_buckets_;
+  // num_time_buckets_ counts per entry, in the order of entries_.
+  std::vector<uint64_t> time_buckets_;
   DISALLOW_COPY_AND_ASSIGN(TraceMultiset);
 };
 
+// CallTraceTree implements a growable calling context tree of traces.
+// Traces that share their outermost frames share the tree nodes for
+// them, so deep stacks with common prefixes (e.g. a servlet container
+// or framework layers) are stored once, and consumers can resolve each
+// distinct node a single time. Like TraceMultiset, it is not thread or
+// async safe, and is meant to aggregate traces harvested from an
+// AsyncSafeTraceMultiset.
+class CallTraceTree {
+ public:
+  // Index of the root node, which has no frame. Every other node is a
+  // frame called from the frame of its parent.
+  static const uint32_t kRootNode = 0;
+
+  struct Node {
+    JVMPI_CallFrame frame;
+    uint32_t parent;
+  };
+
+  // Number of samples recorded for the trace ending at node, from the
+  // root, with a given attribute.
+  struct Sample {
+    uint32_t node;
+    int64_t attr;
+    uint64_t count;
+  };
+
+  CallTraceTree() { Clear(); }
+
+  // Add a trace to the tree. frames[0] is the innermost frame, as
+  // returned by AsyncGetCallTrace.
+  void Add(int64_t attr, int num_frames, JVMPI_CallFrame *frames,
+           int64_t count);
+
+  // Nodes of the tree, indexed by node id. A node always has a lower id
+  // than its children.
+  const std::vector<Node> &Nodes() const { return nodes_; }
+
+  // Distinct samples in insertion order.
+  const std::vector<Sample> &Samples() const { return samples_; }
+
+  // Removes all traces, retaining the allocated storage.
+  void Clear();
+
+ private:
+  // Returns the id of the child of parent for frame, adding it if
+  // needed.
+  uint32_t Child(uint32_t parent, const JVMPI_CallFrame &frame);
+
+  static uint64_t NodeHash(uint32_t parent, const JVMPI_CallFrame &frame);
+  static uint64_t SampleHash(uint32_t node, int64_t attr);
+
+  // Rebuilds the slots for a table of num_entries entries, doubling
+  // them when the load factor would exceed 1/2.
+  template <typename HashFn>
+  static void MaybeGrow(std::vector<uint32_t> *slots, size_t num_entries,
+                        HashFn hash);
+
+  // Open-addressing indexes into nodes_ and samples_. Each slot holds an
+  // index plus one, or zero when empty. Sizes are powers of two.
+  std::vector<uint32_t> node_slots_;
+  std::vector<uint32_t> sample_slots_;
+  std::vector<Node> nodes_;
+  std::vector<Sample> samples_;
+  DISALLOW_COPY_AND_ASSIGN(CallTraceTree);
+};
+
 // HarvestSamples extracts traces from an asyncsafe trace multiset
 // and copies them into a trace multiset. It returns the number of samples
 // that were copied. This is thread-safe with respect to other threads adding
-// samples into the asyncsafe set.
+// samples into the asyncsafe set. The time buckets are copied when both
+// multisets have as many, the calling context tree does not keep them.
 int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to);
+int HarvestSamples(AsyncSafeTraceMultiset *from, CallTraceTree *to);
 
 }  // namespace javaprofiler
 }  // namespace google
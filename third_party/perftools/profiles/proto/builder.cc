@@ -29,9 +29,11 @@
 #include <unordered_set>
 
 #include "glog/logging.h"
+#include "google/protobuf/io/coded_stream.h"
 #include "google/protobuf/io/gzip_stream.h"
 #include "google/protobuf/io/zero_copy_stream_impl.h"
 
+using google::protobuf::io::CodedOutputStream;
 using google::protobuf::io::StringOutputStream;
 using google::protobuf::io::GzipOutputStream;
 using google::protobuf::io::FileOutputStream;
@@ -47,6 +49,54 @@ typedef std::unordered_set<uint64> IndexSet;
 namespace perftools {
 namespace profiles {
 
+const char *StringArena::Copy(const char *data, size_t size) {
+  if (size > kBlockSize) {
+    large_blocks_.emplace_back(new char[size]);
+    memcpy(large_blocks_.back().get(), data, size);
+    return large_blocks_.back().get();
+  }
+  if (blocks_.empty() || used_ + size > kBlockSize) {
+    if (!blocks_.empty()) {
+      block_++;
+    }
+    if (block_ == blocks_.size()) {
+      blocks_.emplace_back(new char[kBlockSize]);
+    }
+    used_ = 0;
+  }
+  char *copy = blocks_[block_].get() + used_;
+  memcpy(copy, data, size);
+  used_ += size;
+  return copy;
+}
+
+void StringArena::Clear() {
+  large_blocks_.clear();
+  block_ = 0;
+  used_ = 0;
+}
+
+size_t StringRefHasher::operator()(const StringRef &s) const {
+  // Mixes 8 bytes at a time, as the strings are mostly long Java or C++
+  // function names.
+  const uint64_t kMul = 0x9ddfea08eb382d69ULL;
+  uint64_t hash = s.size * kMul;
+  size_t i = 0;
+  for (; i + 8 <= s.size; i += 8) {
+    uint64_t word;
+    memcpy(&word, s.data + i, 8);
+    hash = (hash ^ word) * kMul;
+    hash ^= hash >> 29;
+  }
+  if (i < s.size) {
+    uint64_t word = 0;
+    memcpy(&word, s.data + i, s.size - i);
+    hash = (hash ^ word) * kMul;
+    hash ^= hash >> 29;
+  }
+  return static_cast<size_t>(hash);
+}
+
 void AddCallstackToSample(Sample *sample, const void *const *stack, int depth,
                           CallstackType type) {
   if (depth <= 0) return;
@@ -64,6 +114,7 @@ void AddCallstackToSample(Sample *sample, const void *const *stack, int depth,
 
 Builder::Builder() : profile_(new Profile()) {
   // string_table[0] must be ""
+  strings_.Insert("", 0);
   profile_->add_string_table("");
 }
 
@@ -75,14 +126,11 @@ int64_t Builder::StringId(const char *str) {
 }
 
 int64_t Builder::InternalStringId(const std::string &str) {
-  const int64_t index = profile_->string_table_size();
-  const auto inserted = strings_.emplace(str, index);
-  if (!inserted.second) {
-    // Failed to insert -- use existing id.
-    return inserted.first->second;
+  const auto inserted = strings_.Insert(str.data(), str.size());
+  if (inserted.second) {
+    profile_->add_string_table(str);
   }
-  profile_->add_string_table(inserted.first->first);
-  return index;
+  return inserted.first;
 }
 
 uint64_t Builder::FunctionId(const char *name, const char *system_name,
@@ -95,11 +143,10 @@ uint64_t Builder::FunctionId(const char *name, const char *system_name,
       std::make_tuple(name_index, system_name_index, file_index, start_line);
 
   int64_t index = profile_->function_size() + 1;
-  const auto inserted = functions_.insert(std::make_pair(fn, index));
+  const auto inserted = functions_.Insert(fn, index);
   const bool insert_successful = inserted.second;
   if (!insert_successful) {
-    const auto existing_function = inserted.first;
-    return existing_function->second;
+    return *inserted.first;
   }
 
   auto function = profile_->add_function();
@@ -338,5 +385,121 @@ bool Builder::Finalize() {
   return CheckValid(*profile_);
 }
 
+namespace {
+
+// Field numbers of the repeated fields of Profile.
+constexpr int kProfileSample = 2;
+constexpr int kProfileMapping = 3;
+constexpr int kProfileLocation = 4;
+constexpr int kProfileFunction = 5;
+constexpr int kProfileStringTable = 6;
+
+// Wire type of strings and embedded messages.
+constexpr uint32_t kLengthDelimited = 2;
+
+}  // namespace
+
+StreamingBuilder::StreamingBuilder(
+    google::protobuf::io::ZeroCopyOutputStream *output) {
+  Reset(output);
+}
+
+StreamingBuilder::~StreamingBuilder() {}
+
+void StreamingBuilder::Reset(
+    google::protobuf::io::ZeroCopyOutputStream *output) {
+  strings_.Clear();
+  functions_.Clear();
+  added_strings_ = 0;
+  coded_stream_.reset(new CodedOutputStream(output));
+  // string_table[0] must be ""
+  strings_.Insert("", 0);
+  coded_stream_->WriteTag((kProfileStringTable << 3) | kLengthDelimited);
+  coded_stream_->WriteVarint32(0);
+}
+
+int64_t StreamingBuilder::StringId(const char *str) {
+  if (str == nullptr || !str[0]) {
+    return 0;
+  }
+  const size_t size = strlen(str);
+  const auto inserted = strings_.Insert(str, size);
+  if (inserted.second) {
+    coded_stream_->WriteTag((kProfileStringTable << 3) | kLengthDelimited);
+    coded_stream_->WriteVarint32(size);
+    coded_stream_->WriteRaw(str, size);
+  }
+  return inserted.first;
+}
+
+uint64_t StreamingBuilder::FunctionId(const char *name,
+                                      const char *system_name,
+                                      const char *file, int64_t start_line) {
+  int64_t name_index = StringId(name);
+  int64_t system_name_index = StringId(system_name);
+  int64_t file_index = StringId(file);
+
+  auto fn =
+      std::make_tuple(name_index, system_name_index, file_index, start_line);
+
+  int64_t index = functions_.size() + 1;
+  const auto inserted = functions_.Insert(fn, index);
+  if (!inserted.second) {
+    return *inserted.first;
+  }
+
+  function_.set_id(index);
+  function_.set_name(name_index);
+  function_.set_system_name(system_name_index);
+  function_.set_filename(file_index);
+  function_.set_start_line(start_line);
+  WriteMessage(kProfileFunction, function_);
+  return index;
+}
+
+int64_t StreamingBuilder::AddString(const char *data, size_t size) {
+  coded_stream_->WriteTag((kProfileStringTable << 3) | kLengthDelimited);
+  coded_stream_->WriteVarint32(size);
+  coded_stream_->WriteRaw(data, size);
+  return ++added_strings_;
+}
+
+void StreamingBuilder::AddFunction(const Function &function) {
+  WriteMessage(kProfileFunction, function);
+}
+
+void StreamingBuilder::AddMapping(const Mapping &mapping) {
+  WriteMessage(kProfileMapping, mapping);
+}
+
+void StreamingBuilder::AddLocation(const Location &location) {
+  WriteMessage(kProfileLocation, location);
+}
+
+void StreamingBuilder::AddSample(const Sample &sample) {
+  WriteMessage(kProfileSample, sample);
+}
+
+void StreamingBuilder::AddFields(const Profile &profile) {
+  profile.SerializeToCodedStream(coded_stream_.get());
+}
+
+bool StreamingBuilder::Finish() {
+  // Destroying the coded stream hands its unused buffer back to the output.
+  bool ok = !coded_stream_->HadError();
+  coded_stream_.reset();
+  if (!ok) {
+    LOG(ERROR) << "Failed to serialize to the output stream";
+  }
+  return ok;
+}
+
+void StreamingBuilder::WriteMessage(
+    int field_number, const google::protobuf::MessageLite &message) {
+  coded_stream_->WriteTag((field_number << 3) | kLengthDelimited);
+  coded_stream_->WriteVarint32(message.ByteSizeLong());
+  message.SerializeWithCachedSizes(coded_stream_.get());
+}
+
 }  // namespace profiles
 }  // namespace perftools
@@ -16,6 +16,7 @@
 #define PERFTOOLS_PROFILES_PROTO_BUILDER_H_
 
 #include <stddef.h>
+#include <string.h>
 
 #include <algorithm>
 #include <cstdint>
@@ -23,8 +24,7 @@
 #include <string>
 #include <tuple>
 #include <utility>
-
-#include <unordered_map>
+#include <vector>
 
 namespace perftools {
 namespace profiles {
@@ -33,7 +33,143 @@ typedef int64_t int64;
 typedef uint64_t uint64;
 typedef std::string string;
 
-typedef std::unordered_map<string, int64> StringIndexMap;
+// Hash map for the tables of a profile: keys are mapped to values in an
+// open addressing index over a dense array of entries, so that insertions
+// do not allocate once the map has grown, and Clear() keeps the memory for
+// reuse. Entries cannot be erased.
+template <typename Key, typename Value, typename Hash>
+class FlatHashMap {
+ public:
+  FlatHashMap() {}
+
+  // Returns the value of key, inserting value for it if it is missing, and
+  // whether it was inserted. The pointer is valid until the next insertion.
+  std::pair<Value *, bool> Insert(const Key &key, const Value &value) {
+    if ((entries_.size() + 1) * 2 > slots_.size()) {
+      Grow();
+    }
+    const size_t hash = Mix(Hash()(key));
+    const size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      uint32_t slot = slots_[i];
+      if (slot == 0) {
+        entries_.push_back(Entry{key, value, hash});
+        slots_[i] = entries_.size();
+        return std::make_pair(&entries_.back().value, true);
+      }
+      Entry &entry = entries_[slot - 1];
+      if (entry.hash == hash && entry.key == key) {
+        return std::make_pair(&entry.value, false);
+      }
+    }
+  }
+
+  // Returns the value of key, or null if it is missing.
+  Value *Find(const Key &key) {
+    if (entries_.empty()) {
+      return nullptr;
+    }
+    const size_t hash = Mix(Hash()(key));
+    const size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+      uint32_t slot = slots_[i];
+      if (slot == 0) {
+        return nullptr;
+      }
+      Entry &entry = entries_[slot - 1];
+      if (entry.hash == hash && entry.key == key) {
+        return &entry.value;
+      }
+    }
+  }
+
+  size_t size() const { return entries_.size(); }
+
+  // Returns the key of the i-th inserted entry.
+  const Key &KeyAt(size_t i) const { return entries_[i].key; }
+
+  // Drops all the entries, keeping the memory.
+  void Clear() {
+    if (!entries_.empty()) {
+      entries_.clear();
+      std::fill(slots_.begin(), slots_.end(), 0);
+    }
+  }
+
+ private:
+  struct Entry {
+    Key key;
+    Value value;
+    size_t hash;
+  };
+
+  // Spreads the bits of the hash, which is masked to pick the slot.
+  static size_t Mix(uint64_t hash) {
+    hash ^= hash >> 32;
+    hash *= 0x9e3779b97f4a7c15ULL;
+    return static_cast<size_t>(hash ^ (hash >> 29));
+  }
+
+  void Grow() {
+    std::vector<uint32_t> slots(std::max<size_t>(16, slots_.size() * 2), 0);
+    const size_t mask = slots.size() - 1;
+    for (size_t e = 0; e < entries_.size(); ++e) {
+      size_t i = entries_[e].hash & mask;
+      while (slots[i] != 0) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = e + 1;
+    }
+    slots_.swap(slots);
+    entries_.reserve(slots_.size() / 2);
+  }
+
+  std::vector<Entry> entries_;
+  // Power of two number of slots, holding the entry index plus one, or 0
+  // for the empty ones.
+  std::vector<uint32_t> slots_;
+};
+
+// Copies strings into large blocks, for tables interning many small
+// strings. Clear() keeps the blocks for reuse.
+class StringArena {
+ public:
+  StringArena() {}
+
+  // This type is neither copyable nor movable.
+  StringArena(const StringArena &) = delete;
+  StringArena &operator=(const StringArena &) = delete;
+
+  // Returns a copy of size bytes of data, valid until Clear().
+  const char *Copy(const char *data, size_t size);
+
+  // Drops all the strings, keeping the memory.
+  void Clear();
+
+ private:
+  static constexpr size_t kBlockSize = 64 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  // Blocks of the strings larger than kBlockSize, released by Clear().
+  std::vector<std::unique_ptr<char[]>> large_blocks_;
+  size_t block_ = 0;  // Block being filled.
+  size_t used_ = 0;   // Bytes used in the block being filled.
+};
+
+// A string held elsewhere, e.g. in a StringArena.
+struct StringRef {
+  const char *data;
+  size_t size;
+
+  bool operator==(const StringRef &other) const {
+    return size == other.size && memcmp(data, other.data, size) == 0;
+  }
+};
+
+class StringRefHasher {
+ public:
+  size_t operator()(const StringRef &s) const;
+};
 
 class FunctionHasher {
  public:
@@ -46,8 +182,48 @@ class FunctionHasher {
   }
 };
 
-typedef std::unordered_map<std::tuple<int64, int64, int64, int64>, int64,
-                           FunctionHasher>
+// Deduplicates the strings of a profile, assigning them consecutive ids.
+class StringTable {
+ public:
+  StringTable() {}
+
+  // This type is neither copyable nor movable.
+  StringTable(const StringTable &) = delete;
+  StringTable &operator=(const StringTable &) = delete;
+
+  // Returns the id of the string, adding it if needed, and whether it was
+  // added.
+  std::pair<int64, bool> Insert(const char *data, size_t size) {
+    StringRef key = {data, size};
+    const int64 *id = index_.Find(key);
+    if (id != nullptr) {
+      return std::make_pair(*id, false);
+    }
+    // The index refers to a copy owned by the table.
+    key.data = arena_.Copy(data, size);
+    const int64 new_id = index_.size();
+    index_.Insert(key, new_id);
+    return std::make_pair(new_id, true);
+  }
+
+  size_t size() const { return index_.size(); }
+
+  // Returns the string of an id.
+  const StringRef &Get(int64 id) const { return index_.KeyAt(id); }
+
+  // Drops all the strings, keeping the memory.
+  void Clear() {
+    index_.Clear();
+    arena_.Clear();
+  }
+
+ private:
+  StringArena arena_;
+  FlatHashMap<StringRef, int64, StringRefHasher> index_;
+};
+
+typedef FlatHashMap<std::tuple<int64, int64, int64, int64>, int64,
+                    FunctionHasher>
     FunctionIndexMap;
 
 }  // namespace profiles
@@ -55,6 +231,15 @@ typedef std::unordered_map<std::tuple<int64, int64, int64, int64>, int64,
 
 #include "perftools/profiles/proto/profile.pb.h"
 
+namespace google {
+namespace protobuf {
+namespace io {
+class CodedOutputStream;
+class ZeroCopyOutputStream;
+}  // namespace io
+}  // namespace protobuf
+}  // namespace google
+
 namespace perftools {
 namespace profiles {
 
@@ -133,8 +318,8 @@ class Builder {
  private:
   int64_t InternalStringId(const std::string &str);
 
-  // Maps to deduplicate strings and functions.
-  StringIndexMap strings_;
+  // Tables to deduplicate strings and functions.
+  StringTable strings_;
   FunctionIndexMap functions_;
 
   // Actual profile being updated.
@@ -144,6 +329,68 @@ class Builder {
   std::string error_;
 };
 
+// Encodes a profile straight into an output stream, typically a compressing
+// one. Unlike Builder, the Profile message is never held in memory:
+// strings, functions, mappings, locations and samples are serialized as
+// they are added, and only the indexes used to deduplicate strings and
+// functions are kept.
+// This relies on serialized protobuf messages merging on concatenation.
+// The profile is not validated, nor are locations associated to mappings:
+// the caller is responsible for its consistency.
+class StreamingBuilder {
+ public:
+  // The serialized profile is written to output, which must outlive the
+  // builder.
+  explicit StreamingBuilder(
+      google::protobuf::io::ZeroCopyOutputStream *output);
+  ~StreamingBuilder();
+
+  // This type is neither copyable nor movable.
+  StreamingBuilder(const StreamingBuilder &) = delete;
+  StreamingBuilder &operator=(const StreamingBuilder &) = delete;
+
+  // Restarts the encoding of a new profile into output, reusing the
+  // memory of the tables of the previous one. Finish() must have been
+  // called for the previous profile.
+  void Reset(google::protobuf::io::ZeroCopyOutputStream *output);
+
+  // Same as Builder::StringId() and Builder::FunctionId().
+  int64_t StringId(const char *str);
+  uint64_t FunctionId(const char *name, const char *system_name,
+                      const char *file, int64_t start_line);
+
+  // Appends a string to the string table, without looking for an existing
+  // copy, and returns its id. For callers assigning the string and
+  // function ids themselves, which must not mix these with StringId() and
+  // FunctionId() in a profile.
+  int64_t AddString(const char *data, size_t size);
+  void AddFunction(const Function &function);
+
+  void AddMapping(const Mapping &mapping);
+  void AddLocation(const Location &location);
+  void AddSample(const Sample &sample);
+
+  // Adds the fields set in profile, e.g. sample types and period. Its
+  // string table must be empty; strings are added through StringId().
+  void AddFields(const Profile &profile);
+
+  // Flushes the serialized profile to the output stream. Returns false if
+  // there were errors on the serialization. No further calls should be
+  // made after this.
+  bool Finish();
+
+ private:
+  void WriteMessage(int field_number,
+                    const google::protobuf::MessageLite &message);
+
+  StringTable strings_;
+  FunctionIndexMap functions_;
+  Function function_;  // Reused to encode each new function.
+  int64_t added_strings_ = 0;  // Through AddString().
+
+  std::unique_ptr<google::protobuf::io::CodedOutputStream> coded_stream_;
+};
+
 }  // namespace profiles
 }  // namespace perftools
 